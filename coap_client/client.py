@@ -1,5 +1,7 @@
 # envia un GET a coap://<host>:<port>/<path>.
 # python client_get.py --host <DIRECCION IP> --path sensor
+# Con --observe se suscribe (Observe, RFC 7641) e imprime cada notificación
+# hasta Ctrl-C; al salir se da de baja.
 
 import argparse
 import os
@@ -10,6 +12,8 @@ import sys
 
 COAP_VER = 1
 TYPE_CON = 0
+TYPE_ACK = 2
+OPT_OBSERVE = 6
 OPT_URI_PATH = 11
 
 def _encode_uvar(n):
@@ -21,9 +25,10 @@ def _encode_uvar(n):
         n2 = n - 269
         return 14, struct.pack("!H", n2)
 
-def build_get(host, port, path, tkl=4):
+def build_get(host, port, path, tkl=4, observe=None, token=None):
     # header
-    token = os.urandom(tkl)
+    token = token if token is not None else os.urandom(tkl)
+    tkl = len(token)
     mid = random.randint(0, 0xFFFF)
     first = ((COAP_VER & 0x03) << 6) | ((TYPE_CON & 0x03) << 4) | (tkl & 0x0F)
     code = 0x01  # GET
@@ -32,6 +37,11 @@ def build_get(host, port, path, tkl=4):
     # options: Uri-Path segments
     opts = b""
     last_opt_num = 0
+    if observe is not None:
+        # Observe (6) va antes que Uri-Path (11); 0 = registrar (valor vacío), 1 = baja
+        val = bytes([observe]) if observe else b""
+        opts += bytes([(OPT_OBSERVE << 4) | len(val)]) + val
+        last_opt_num = OPT_OBSERVE
     segments = [seg for seg in path.split('/') if seg]
     for seg in segments:
         opt_num = OPT_URI_PATH
@@ -60,6 +70,7 @@ def parse_response(data):
     end = len(data)
 
     last_opt = 0
+    observe = None
     while p < end:
         if data[p] == 0xFF:
             p += 1
@@ -95,12 +106,14 @@ def parse_response(data):
         optnum = last_opt + d
         if p + l > end:
             return None
+        if optnum == OPT_OBSERVE:
+            observe = int.from_bytes(data[p:p+l], "big")
         p += l
         last_opt = optnum
 
     payload = data[p:end] if p <= end else b""
     return {"ver": ver, "type": typ, "tkl": tkl, "code": code, "mid": mid,
-            "token": token, "payload": payload}
+            "token": token, "observe": observe, "payload": payload}
 
 def code_to_str(code):
     cclass = code >> 5
@@ -113,8 +126,13 @@ def main():
     ap.add_argument("--port", type=int, default=5683, help="Puerto UDP (default 5683)")
     ap.add_argument("--path", default="sensor", help="Ruta (default: sensor)")
     ap.add_argument("--timeout", type=float, default=5.0, help="Timeout (s)")
+    ap.add_argument("--observe", action="store_true", help="Suscribirse y mostrar notificaciones")
     args = ap.parse_args()
 
+    if args.observe:
+        observe(args)
+        return
+
     pkt, token, mid = build_get(args.host, args.port, args.path)
     addr = (args.host, args.port)
 
@@ -141,5 +159,32 @@ def main():
     print(f"coap://{args.host}/{args.path}")
     print(f"[OK] GET -> {cstr} | {text}")
 
+def observe(args):
+    addr = (args.host, args.port)
+    pkt, token, mid = build_get(args.host, args.port, args.path, observe=0)
+    with socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as s:
+        s.settimeout(args.timeout)
+        try:
+            s.sendto(pkt, addr)
+            while True:
+                try:
+                    data, src = s.recvfrom(1500)
+                except socket.timeout:
+                    continue
+                resp = parse_response(data)
+                if not resp or resp["token"] != token:
+                    continue
+                if resp["type"] == TYPE_CON:
+                    # ACK vacío para las notificaciones confirmables
+                    s.sendto(struct.pack("!BBH", (COAP_VER << 6) | (TYPE_ACK << 4), 0, resp["mid"]), addr)
+                text = resp["payload"].decode("utf-8", errors="replace")
+                seq = resp["observe"]
+                if seq is None:
+                    print(f"[WARN] {code_to_str(resp['code'])} sin Observe (no suscrito) | {text}")
+                    return
+                print(f"[{seq}] {code_to_str(resp['code'])} | {text}", flush=True)
+        except KeyboardInterrupt:
+            s.sendto(build_get(args.host, args.port, args.path, observe=1, token=token)[0], addr)
+
 if __name__ == "__main__":
     main()
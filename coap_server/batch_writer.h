@@ -0,0 +1,110 @@
+// batch_writer.h — Escritor por lotes para el archivo de datos del servidor
+// Mantiene el descriptor abierto, acumula líneas en un buffer circular y las
+// escribe con un único writev() por lote. El lote se vacía al superar
+// flush_bytes o al cumplirse flush_ms desde la primera línea pendiente.
+// fsync_mode: 0 = nunca, 1 = fdatasync() tras cada lote.
+#pragma once
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BW_RING_SZ      (64u*1024u)
+#define BW_FLUSH_BYTES  (32u*1024u)
+
+typedef struct {
+    const char* path;
+    int      fd;
+    uint8_t  ring[BW_RING_SZ];
+    size_t   head, tail;          /* contadores monotónicos; índice = x % BW_RING_SZ */
+    uint64_t first_ms;            /* instante de la primera línea pendiente */
+    unsigned flush_ms;
+    int      fsync_mode;
+    unsigned long batches, lines;
+} bwriter_t;
+
+static inline uint64_t now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000u + (uint64_t)(ts.tv_nsec/1000000);
+}
+
+static inline size_t bw_pending(const bwriter_t* w){ return w->head - w->tail; }
+
+static inline void bw_init(bwriter_t* w, const char* path, unsigned flush_ms, int fsync_mode){
+    w->path = path;
+    w->fd = open(path, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0644);
+    w->head = w->tail = 0;
+    w->first_ms = 0;
+    w->flush_ms = flush_ms;
+    w->fsync_mode = fsync_mode;
+    w->batches = w->lines = 0;
+}
+
+/* Escribe todo lo pendiente (hasta dos iovec si el buffer dio la vuelta) */
+static inline int bw_flush(bwriter_t* w){
+    if (bw_pending(w) == 0) return 0;
+    if (w->fd < 0){
+        w->fd = open(w->path, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0644);
+        if (w->fd < 0) return -1;
+    }
+    while (bw_pending(w) > 0){
+        size_t off = w->tail % BW_RING_SZ, len = bw_pending(w);
+        struct iovec iov[2]; int cnt = 1;
+        iov[0].iov_base = w->ring + off;
+        if (off + len > BW_RING_SZ){
+            iov[0].iov_len = BW_RING_SZ - off;
+            iov[1].iov_base = w->ring;
+            iov[1].iov_len = len - iov[0].iov_len;
+            cnt = 2;
+        } else {
+            iov[0].iov_len = len;
+        }
+        ssize_t n = writev(w->fd, iov, cnt);
+        if (n < 0){
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        w->tail += (size_t)n;
+    }
+    if (w->fsync_mode) fdatasync(w->fd);
+    w->batches++;
+    return 0;
+}
+
+/* Encola una línea (se añade '\n'); si no cabe, vacía primero */
+static inline int bw_append(bwriter_t* w, const char* line, size_t len){
+    if (len + 1u > BW_RING_SZ) return -1;
+    if (bw_pending(w) + len + 1u > BW_RING_SZ && bw_flush(w) != 0) return -1;
+    if (bw_pending(w) == 0) w->first_ms = now_ms();
+    size_t off = w->head % BW_RING_SZ, first = BW_RING_SZ - off;
+    if (first > len) first = len;
+    memcpy(w->ring + off, line, first);
+    memcpy(w->ring, line + first, len - first);
+    w->ring[(w->head + len) % BW_RING_SZ] = '\n';
+    w->head += len + 1u;
+    w->lines++;
+    if (w->flush_ms == 0 || bw_pending(w) >= BW_FLUSH_BYTES) return bw_flush(w);
+    return 0;
+}
+
+/* Vacía si venció el intervalo; llamar en cada vuelta del bucle */
+static inline void bw_poll(bwriter_t* w, uint64_t now){
+    if (bw_pending(w) > 0 && now - w->first_ms >= w->flush_ms) bw_flush(w);
+}
+
+/* ms hasta que bw_poll() tenga que vaciar; -1 = nada pendiente */
+static inline int64_t bw_due_ms(const bwriter_t* w, uint64_t now){
+    if (bw_pending(w) == 0) return -1;
+    uint64_t at = w->first_ms + w->flush_ms;
+    return at > now ? (int64_t)(at - now) : 0;
+}
+
+static inline void bw_close(bwriter_t* w){
+    bw_flush(w);
+    if (w->fd >= 0) close(w->fd);
+    w->fd = -1;
+}
@@ -0,0 +1,312 @@
+// bench.c — Microbenchmarks del camino caliente del servidor
+// Mide ns/op de las piezas que toca cada datagrama, con el mismo código que
+// compila el servidor (headers compartidos): parseo con resolución de ruta
+// (y con Block2, índice de opciones y hash de sesión),
+// armado de respuesta con opciones, codificación de opciones, decodificación
+// del JSON de los sketches, append al almacenamiento de segmentos (con sus
+// write() amortizados, en un directorio temporal), caché de dedup y registro
+// en histograma, y OSCORE (descifrar la petición y cifrar la respuesta).
+// Cada caso corre REPS tandas de al menos MIN_MS y se queda
+// con la más rápida.
+// Con --baseline compara contra una salida anterior y termina con código 1 si
+// algún caso es más de --tolerance % más lento: sirve de chequeo de regresión.
+//
+// Compilar:  make bench   (gcc -std=c11 -O2 -Wall -Wextra -pthread -o coap_bench bench.c -lcrypto)
+// Ejecutar:  ./coap_bench [--filter texto] [--baseline base.txt] [--tolerance 20]
+//   ./coap_bench > base.txt          # referencia
+//   ./coap_bench --baseline base.txt # tras el cambio
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "coap_msg.h"
+#include "dedup.h"
+#include "metrics.h"
+#include "oscore.h"
+#include "reading.h"
+#include "router.h"
+#include "storage.h"
+
+#define REPS    5
+#define MIN_MS  200u
+#define BENCH_MAX 32
+#define BUF_MAX   1500
+
+typedef uint64_t (*bench_fn)(uint64_t iters);   /* devuelve un valor para que no se elimine */
+
+typedef struct { const char* name; bench_fn fn; } bench_t;
+
+static volatile uint64_t g_sink;
+static router_t g_rt;
+static uint8_t  g_post[128], g_get[128], g_blk[128];
+static size_t   g_post_len, g_get_len, g_blk_len;
+
+static uint8_t h_dummy(const struct coap_req* req, struct coap_out* o){ (void)req; (void)o; return 0; }
+
+/* Mismas rutas que register_routes() del servidor */
+static void bench_routes(void){
+    static const char* const paths[] = { "sensor", "sensor/temp", "sensor/dist", "device/{id}",
+                                         "sensor/{id}/stats", "device/{id}/stats", "metrics", ".well-known/core" };
+    rt_init(&g_rt);
+    for (size_t i = 0; i < sizeof(paths)/sizeof(paths[0]); i++) rt_add(&g_rt, paths[i], COAP_GET, h_dummy);
+    rt_build_core(&g_rt);
+    uint8_t tok[4] = { 1, 2, 3, 4 };
+    size_t h = build_req(g_post, sizeof(g_post), COAP_CON, COAP_POST, 0x1234, 4, tok, "device/1234", -1, CF_JSON, NULL);
+    g_post_len = finish_resp(g_post, h, put_bytes(g_post + h + 1u, sizeof(g_post) - h - 1u, "{\"t\":23.50,\"unit\":\"C\"}", 22));
+    g_get_len = build_req(g_get, sizeof(g_get), COAP_CON, COAP_GET, 0x1235, 4, tok, "sensor", 0, -1, "limit=10");
+    /* GET sensor/7/stats pidiendo el bloque 3 de 1024 (Block2 va tras Uri-Path) */
+    size_t b = build_req(g_blk, sizeof(g_blk), COAP_CON, COAP_GET, 0x1236, 4, tok, "sensor/7/stats", -1, -1, NULL);
+    int last = OPT_URI_PATH; uint8_t b2 = 0x36;
+    g_blk_len = b + (size_t)add_option(g_blk + b, sizeof(g_blk) - b, &last, OPT_BLOCK2, &b2, 1);
+}
+
+static uint64_t b_parse_post(uint64_t n){
+    coap_req_t r; uint64_t acc = 0;
+    for (uint64_t i = 0; i < n; i++){ coap_parse(g_post, g_post_len, &g_rt, &r); acc += (uint64_t)r.node + r.payload_len; }
+    return acc;
+}
+
+static uint64_t b_parse_get(uint64_t n){
+    coap_req_t r; uint64_t acc = 0;
+    for (uint64_t i = 0; i < n; i++){ coap_parse(g_get, g_get_len, &g_rt, &r); acc += (uint64_t)r.nquery + (uint64_t)r.observe; }
+    return acc;
+}
+
+/* Parseo + consultas al índice + hash de sesión por bloques */
+static uint64_t b_parse_block(uint64_t n){
+    coap_req_t r; uint64_t acc = 0; size_t l;
+    for (uint64_t i = 0; i < n; i++){
+        coap_parse(g_blk, g_blk_len, &g_rt, &r);
+        acc += (uint64_t)r.block2 + (coap_opt(&r, CO_ETAG, &l) != NULL) + coap_uri_hash(&r);
+    }
+    return acc;
+}
+
+static uint64_t b_build_resp(uint64_t n){
+    uint8_t out[256], tok[4] = { 1, 2, 3, 4 }; uint64_t acc = 0;
+    for (uint64_t i = 0; i < n; i++){
+        copt_t o[3] = { copt_uint(OPT_ETAG, (uint32_t)i), copt_uint(OPT_BLOCK2, 0x0E), copt_uint(OPT_SIZE2, 4096) };
+        size_t cf_at, h = build_resp(out, sizeof(out), COAP_CON, 4, tok, (uint16_t)i, COAP_205_CONTENT, CF_JSON, o, 3, &cf_at);
+        acc += finish_resp(out, h, 16);
+    }
+    return acc;
+}
+
+/* Los bytes de entrada salen de g_post (no se conocen al compilar) y un byte de
+ * la salida va al acumulador: sin eso -O2 reduce el lazo a n * 11 */
+static uint64_t b_add_option(uint64_t n){
+    uint8_t out[64]; uint64_t acc = 0;
+    const uint8_t* seg = g_post + 8;
+    for (uint64_t i = 0; i < n; i++){
+        int last = 0, p;
+        p  = add_option(out, sizeof(out), &last, OPT_URI_PATH, seg, 6);
+        p += add_option(out + p, sizeof(out) - (size_t)p, &last, OPT_SIZE1 + (int)(i & 7), seg + (i & 3), 2);
+        acc += (uint64_t)p + out[i % (uint64_t)p];
+    }
+    return acc;
+}
+
+static uint64_t b_json(uint64_t n){
+    static const char body[] = "{\"t\":23.50,\"unit\":\"C\"}";
+    srec_t r[4]; uint64_t acc = 0;
+    for (uint64_t i = 0; i < n; i++) acc += (uint64_t)reading_parse_json((const uint8_t*)body, sizeof(body) - 1u, 7, (int64_t)i, r, 4);
+    return acc;
+}
+
+static uint64_t b_json_batch(uint64_t n){
+    static const char body[] = "{\"id\":9,\"t\":[[0,21.5],[2000,21.6],[4000,21.7],[6000,21.8],[8000,21.9]],\"unit\":\"C\"}";
+    srec_t r[8]; uint64_t acc = 0;
+    for (uint64_t i = 0; i < n; i++) acc += (uint64_t)reading_parse_json((const uint8_t*)body, sizeof(body) - 1u, 0, (int64_t)i, r, 8);
+    return acc;
+}
+
+static char g_dir[64];
+
+static void rm_dir(const char* dir){
+    DIR* dp = opendir(dir);
+    struct dirent* de;
+    char p[320];
+    while (dp && (de = readdir(dp))){
+        if (de->d_name[0] == '.') continue;
+        snprintf(p, sizeof(p), "%s/%s", dir, de->d_name);
+        unlink(p);
+    }
+    if (dp) closedir(dp);
+    rmdir(dir);
+}
+
+/* 64 dispositivos, un registro por llamada: cada ST_BUF_RECS llega el write() */
+static uint64_t b_store_append(uint64_t n){
+    static store_t st;
+    snprintf(g_dir, sizeof(g_dir), "/tmp/coap_bench.XXXXXX");
+    if (!mkdtemp(g_dir) || st_open(&st, g_dir, 64u << 20, 1000, 0, NULL, 0) != 0){ perror("store"); exit(1); }
+    srec_t r = { 1700000000000, 0, 21.5f, RES_TEMP, 0, 0 };
+    for (uint64_t i = 0; i < n; i++){
+        r.device = (uint32_t)(i & 63u) + 1u; r.ts_ms++;
+        st_append(&st, &r, 1, i);
+    }
+    uint64_t acc = st.recs;
+    st_close(&st);
+    rm_dir(g_dir);
+    return acc;
+}
+
+static uint64_t b_dedup(uint64_t n){
+    static arena_t a; static dedup_t d;
+    if (!a.base && (arena_init(&a, dd_need(DEDUP_SLOTS)) != 0 || dd_init(&d, &a, DEDUP_SLOTS) != 0)){ perror("dedup"); exit(1); }
+    struct sockaddr_in cli; memset(&cli, 0, sizeof(cli));
+    uint8_t resp[16] = { 0x60, 0x44 }, out[128]; uint64_t acc = 0;
+    for (uint64_t i = 0; i < n; i++){
+        cli.sin_addr.s_addr = (uint32_t)(i & 1023u); cli.sin_port = 5683;
+        dd_store(&d, &cli, (uint16_t)i, 100, resp, sizeof(resp));
+        acc += dd_lookup(&d, &cli, (uint16_t)i, 100, out, sizeof(out));
+    }
+    return acc;
+}
+
+static uint64_t b_hist(uint64_t n){
+    static mx_t m; uint64_t x = 12345;
+    for (uint64_t i = 0; i < n; i++){ x = x * 6364136223846793005u + 1u; mx_rec(&m, H_HANDLE, (x >> 40) & 0xFFFFF); }
+    return mx_get(&m, M_RX) + atomic_load(&m.h[H_HANDLE].n);
+}
+
+/* POST de 22 bytes protegido (kid 07, PIV 1) como lo arma coap_min.h:
+ * unprotect + protect de la respuesta, con la ventana reiniciada en cada vuelta */
+static uint64_t b_oscore(uint64_t n){
+    static osc_ctx_t c; static uint32_t slot[2]; static uint8_t msg[160]; static size_t mlen;
+    static osc_table_t t = { .c = &c, .n = 1, .mask = 1, .slot = slot, .ssn_fd = -1 };
+    EVP_CIPHER_CTX* cx = EVP_CIPHER_CTX_new();
+    if (!t.aead){
+        static const uint8_t secret[16] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 };
+        c.rid[0] = 7; c.rid_len = 1;
+        t.aead = EVP_CIPHER_fetch(NULL, "AES-128-CCM", NULL);
+        if (!cx || !t.aead || osc_derive(&c, NULL, 0, secret, sizeof(secret), NULL, 0) != 0){ perror("oscore"); exit(1); }
+        slot[fnv1a(2166136261u, c.rid, 1) & 1u] = 1;
+        /* texto plano = código y opciones del POST de g_post; afuera OSCORE {09 01 07} */
+        uint8_t pt[128], piv = 1, ov[3] = { 0x09, 0x01, 0x07 }, nonce[OSC_NONCE_LEN], aad[32];
+        size_t h = 4u + (g_post[0] & 0x0Fu), ptl = g_post_len - h + 1u;
+        pt[0] = g_post[1]; memcpy(pt + 1, g_post + h, g_post_len - h);
+        memcpy(msg, g_post, h);
+        int last = 0;
+        mlen = h + (size_t)add_option(msg + h, sizeof(msg) - h, &last, OPT_OSCORE, ov, 3);
+        msg[mlen++] = 0xFF;
+        osc_nonce(c.civ, c.rid, 1, &piv, 1, nonce);
+        /* el cliente cifra con su Sender Key, que es la Recipient Key del servidor */
+        if (osc_aead(cx, t.aead, 1, c.rkey, nonce, aad, osc_aad(aad, c.rid, 1, &piv, 1), pt, ptl, msg + mlen) != 0){ perror("oscore"); exit(1); }
+        mlen += ptl + OSC_TAG_LEN;
+    }
+    uint8_t plain[BUF_MAX], out[BUF_MAX]; uint64_t acc = 0;
+    static const uint8_t resp[] = { 0x64, 0x44, 0x12, 0x34, 1, 2, 3, 4, 0xC1, 0x00, 0xFF, 'U', 'P', 'D', 'A', 'T', 'E', 'D' };
+    for (uint64_t i = 0; i < n; i++){
+        coap_req_t r; osc_req_t q; size_t pn = 0;
+        c.win_ok = 1; c.win_top = 0; c.win_bits = 0;
+        coap_parse(msg, mlen, NULL, &r);
+        if (osc_unprotect(&t, cx, msg, &r, plain, sizeof(plain), &pn, &q) != OSC_OK){ fprintf(stderr, "oscore: no verifica\n"); exit(1); }
+        acc += pn;
+        memcpy(out, resp, sizeof(resp));
+        acc += osc_protect(&t, cx, &q, out, sizeof(resp), sizeof(out));
+    }
+    EVP_CIPHER_CTX_free(cx);
+    return acc;
+}
+
+static uint64_t b_now(uint64_t n){
+    uint64_t acc = 0;
+    for (uint64_t i = 0; i < n; i++) acc += mx_now_ns();
+    return acc;
+}
+
+static const bench_t g_bench[] = {
+    { "parse_post",    b_parse_post },
+    { "parse_get",     b_parse_get },
+    { "parse_block2",  b_parse_block },
+    { "build_resp",    b_build_resp },
+    { "add_option",    b_add_option },
+    { "json_single",   b_json },
+    { "json_batch5",   b_json_batch },
+    { "store_append",  b_store_append },
+    { "dedup",         b_dedup },
+    { "hist_record",   b_hist },
+    { "oscore_rt",     b_oscore },
+    { "clock_ns",      b_now },
+};
+
+/* ns/op de la mejor de REPS tandas; el número de iteraciones crece hasta que
+ * una tanda dure al menos MIN_MS, o hasta N_MAX: un caso que el compilador
+ * dejó sin trabajo no cuelga la corrida (sale con ~0 ns/op y un aviso) */
+#define N_MAX   (1ull << 36)
+
+static double run(const bench_t* b){
+    uint64_t n = 1000;
+    for (;;){
+        uint64_t t0 = mx_now_ns();
+        g_sink += b->fn(n);
+        uint64_t dt = mx_now_ns() - t0;
+        if (dt >= (uint64_t)MIN_MS * 1000000u) break;
+        uint64_t k = dt ? (uint64_t)MIN_MS * 1000000u / dt + 1u : 100u;
+        if (n >= N_MAX / k){
+            fprintf(stderr, "%s: %llu iteraciones en %llu ns, ¿trabajo eliminado por el compilador?\n",
+                    b->name, (unsigned long long)n, (unsigned long long)dt);
+            break;
+        }
+        n *= k;
+    }
+    double best = 0;
+    for (int r = 0; r < REPS; r++){
+        uint64_t t0 = mx_now_ns();
+        g_sink += b->fn(n);
+        double ns = (double)(mx_now_ns() - t0) / (double)n;
+        if (r == 0 || ns < best) best = ns;
+    }
+    return best;
+}
+
+/* Lee "nombre ns/op" de una salida anterior; devuelve cuántos */
+static int load_baseline(const char* path, char names[][32], double* ns){
+    FILE* f = fopen(path, "r");
+    if (!f){ perror(path); return -1; }
+    char line[256]; int n = 0;
+    while (n < BENCH_MAX && fgets(line, sizeof(line), f))
+        if (line[0] != '#' && sscanf(line, "%31s %lf", names[n], &ns[n]) == 2) n++;
+    fclose(f);
+    return n;
+}
+
+int main(int argc, char** argv){
+    const char* filter = NULL, *base = NULL;
+    double tol = 20.0;
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) filter = argv[++i];
+        else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) base = argv[++i];
+        else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) tol = atof(argv[++i]);
+        else { fprintf(stderr, "uso: %s [--filter texto] [--baseline base.txt] [--tolerance PCT]\n", argv[0]); return 2; }
+    }
+    char bnames[BENCH_MAX][32]; double bns[BENCH_MAX];
+    int nb = base ? load_baseline(base, bnames, bns) : 0;
+    if (nb < 0) return 2;
+    bench_routes();
+
+    int slower = 0;
+    printf("# caso ns/op%s\n", base ? " base cambio%" : "");
+    for (size_t i = 0; i < sizeof(g_bench)/sizeof(g_bench[0]); i++){
+        const bench_t* b = &g_bench[i];
+        if (filter && !strstr(b->name, filter)) continue;
+        double ns = run(b);
+        int k = 0;
+        while (k < nb && strcmp(bnames[k], b->name) != 0) k++;
+        if (k < nb){
+            double d = (ns - bns[k]) / bns[k] * 100.0;
+            int bad = d > tol;
+            slower += bad;
+            printf("%-14s %9.2f %9.2f %+7.1f%s\n", b->name, ns, bns[k], d, bad ? "  REGRESIÓN" : "");
+        } else printf("%-14s %9.2f\n", b->name, ns);
+        fflush(stdout);
+    }
+    if (slower) fprintf(stderr, "%d caso(s) más de %.0f%% más lentos que %s\n", slower, tol, base);
+    return slower ? 1 : 0;
+}
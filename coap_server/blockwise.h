@@ -0,0 +1,105 @@
+// blockwise.h — Transferencia por bloques (RFC 7959) del lado servidor
+// Valor de Block1/Block2: NUM<<4 | M<<3 | SZX, con tamaño = 16 << SZX.
+// Se aceptan SZX 0..6 (16..1024 bytes); COAP_BLOCK_MAX fija el máximo del
+// servidor y se negocia hacia abajo en la respuesta.
+// Sesiones por worker, preasignadas en su arena (pool.h) y con caducidad:
+//   BLK_IN  — cuerpo de un POST/PUT que llega en bloques (Block1)
+//   BLK_OUT — representación de un GET servida en bloques (Block2)
+// La clave es (IP, puerto, hash de Uri-Path + Uri-Query).
+#pragma once
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+#define BLK_SESSIONS    16          /* default; COAP_BLK_SESSIONS */
+#define BLK_REPR_MAX    (64u*1024u)
+#define BLK_SESSION_S   60u
+#define BLK_SZX_MAX     6u
+
+#define BLK_SIZE(szx)        (16u << (szx))
+#define BLK_NUM(v)           ((uint32_t)(v) >> 4)
+#define BLK_M(v)             (((uint32_t)(v) >> 3) & 1u)
+#define BLK_SZX(v)           ((uint32_t)(v) & 7u)
+#define BLK_VAL(num, m, szx) (((uint32_t)(num) << 4) | ((uint32_t)(m) << 3) | (uint32_t)(szx))
+
+enum { BLK_FREE = 0, BLK_IN = 1, BLK_OUT = 2 };
+
+typedef struct {
+    uint32_t addr; uint16_t port;
+    uint8_t  kind, cf, code;
+    uint32_t key, etag, expires_s;
+    size_t   len;
+    uint8_t* buf;               /* BLK_REPR_MAX bytes de la arena */
+} blk_sess_t;
+
+typedef struct {
+    blk_sess_t* s;
+    uint32_t    n;
+    uint32_t    next_etag;
+} blk_table_t;
+
+static inline size_t blk_need(uint32_t nsess){
+    return arena_need((size_t)nsess * sizeof(blk_sess_t)) + arena_need((size_t)nsess * BLK_REPR_MAX);
+}
+
+static inline int blk_init(blk_table_t* t, arena_t* a, uint32_t nsess, uint32_t etag_seed){
+    memset(t, 0, sizeof(*t));
+    t->s = (blk_sess_t*)arena_alloc(a, (size_t)nsess * sizeof(blk_sess_t));
+    uint8_t* bufs = (uint8_t*)arena_alloc(a, (size_t)nsess * BLK_REPR_MAX);
+    if (!t->s || !bufs) return -1;
+    for (uint32_t i = 0; i < nsess; i++) t->s[i].buf = bufs + (size_t)i * BLK_REPR_MAX;
+    t->n = nsess;
+    t->next_etag = etag_seed;
+    return 0;
+}
+
+/* SZX 7 (BERT) no aplica sobre UDP: se trata como 1024 */
+static inline uint32_t blk_szx(uint32_t v, uint32_t max_szx){
+    uint32_t z = BLK_SZX(v);
+    if (z > BLK_SZX_MAX) z = BLK_SZX_MAX;
+    return z > max_szx ? max_szx : z;
+}
+
+static inline blk_sess_t* blk_find(blk_table_t* t, const struct sockaddr_in* cli, uint8_t kind,
+                                   uint32_t key, uint32_t now_s){
+    for (uint32_t i = 0; i < t->n; i++){
+        blk_sess_t* s = &t->s[i];
+        if (s->kind == kind && s->key == key && s->addr == cli->sin_addr.s_addr &&
+            s->port == cli->sin_port && s->expires_s > now_s) return s;
+    }
+    return NULL;
+}
+
+/* Abre (o reinicia) la sesión; reutiliza una libre, caducada o la que caduca antes */
+static inline blk_sess_t* blk_open(blk_table_t* t, const struct sockaddr_in* cli, uint8_t kind,
+                                   uint32_t key, uint32_t now_s){
+    blk_sess_t* v = blk_find(t, cli, kind, key, now_s);
+    for (uint32_t i = 0; !v && i < t->n; i++){
+        blk_sess_t* s = &t->s[i];
+        if (s->kind == BLK_FREE || s->expires_s <= now_s){ v = s; break; }
+    }
+    if (!v){
+        v = &t->s[0];
+        for (uint32_t i = 1; i < t->n; i++)
+            if (t->s[i].expires_s < v->expires_s) v = &t->s[i];
+    }
+    v->addr = cli->sin_addr.s_addr; v->port = cli->sin_port;
+    v->kind = kind; v->key = key;
+    v->expires_s = now_s + BLK_SESSION_S;
+    v->etag = ++t->next_etag;
+    v->len = 0; v->cf = 0; v->code = 0;
+    return v;
+}
+
+static inline void blk_drop(blk_sess_t* s){ s->kind = BLK_FREE; s->len = 0; }
+
+/* Libera las sesiones vencidas (timer del worker); devuelve cuántas */
+static inline int blk_expire(blk_table_t* t, uint32_t now_s){
+    int n = 0;
+    for (uint32_t i = 0; i < t->n; i++)
+        if (t->s[i].kind != BLK_FREE && t->s[i].expires_s <= now_s){ blk_drop(&t->s[i]); n++; }
+    return n;
+}
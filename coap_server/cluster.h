@@ -0,0 +1,567 @@
+// cluster.h — Modo clúster: anillo de consistent hashing, enlaces entre nodos y proxy
+// Cada nodo es a la vez frontal de ingesta (atiende cualquier POST) y shard de
+// almacenamiento de los dispositivos que le tocan en el anillo. La lista de
+// nodos sale de un archivo (COAP_CLUSTER), una línea por nodo:
+//     nombre  host:puerto_coap  puerto_enlace  [peso]
+// Cada nodo pone CL_VNODES * peso puntos en un anillo de 32 bits (hash del
+// nombre y el índice) y un dispositivo pertenece al primer punto en o después
+// del hash de su id: al agregar un nodo sólo se le traspasa ~1/N de los
+// dispositivos, y cada uno desde un solo dueño anterior.
+//
+// Enlaces (hilo escritor, TCP persistente por nodo): el escritor hace la cola
+// como siempre y los registros de dispositivos ajenos van al búfer del enlace
+// de su dueño, que se vacía cada COAP_CLUSTER_FLUSH_MS o al llenarse un cuarto
+// del búfer; así el paso a otro nodo cuesta un send() por lote y no uno por POST.
+// Tramas de cabecera fija (cl_frame_t) seguidas de n srec_t:
+//   RECS    registros en vivo; best-effort (si el enlace cae se pierde lo que
+//           estaba en vuelo, como con un fsync diferido)
+//   IMPORT  un segmento cerrado en traspaso, en tramas con tag; la última lleva
+//           CL_F_LAST y el receptor contesta ACK con el tag tras el fsync. El
+//           origen borra el segmento sólo con el ACK: un traspaso cortado se
+//           repite entero (al reintentar puede quedar duplicado, nunca perdido).
+//   ACK     confirmación de un IMPORT
+// El anillo se publica como puntero atómico: workers y escritor lo leen sin
+// lock y un SIGHUP (ver serverMOD2.c) lo reemplaza por uno nuevo con gen + 1;
+// los anillos retirados se liberan al salir (un SIGHUP es raro y cada uno
+// ocupa unos KiB), así que nadie puede quedarse con un puntero colgado.
+//
+// Proxy (workers, UDP): un GET de un dispositivo ajeno se reenvía al puerto
+// CoAP de su dueño con un token propio del worker (cl_px_t, en su arena) y la
+// respuesta vuelve al cliente con su token y MID. Las suscripciones Observe se
+// agregan: una sola observación hacia el dueño por recurso y worker, con el
+// token derivado de la clave, y cada notificación se reparte a los suscriptores
+// locales de ese recurso.
+#pragma once
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include "coap_msg.h"
+#include "oscore.h"
+#include "pool.h"
+#include "reading.h"
+
+#define CL_NODES_MAX   64u
+#define CL_NAME_MAX    32u
+#define CL_VNODES      64u          /* puntos en el anillo por unidad de peso */
+#define CL_WEIGHT_MAX  16u
+
+/* --- anillo --- */
+typedef struct {
+    char     name[CL_NAME_MAX];
+    struct sockaddr_in coap, link;  /* puerto CoAP (proxy) y del enlace TCP, mismo host */
+    uint32_t weight;
+} cl_node_t;
+
+typedef struct { uint32_t h, node; } cl_point_t;
+
+typedef struct cl_ring {
+    uint32_t gen, nnodes, npoints;
+    int32_t  self;                  /* índice de este nodo; -1 = ya no está en el anillo */
+    cl_node_t   node[CL_NODES_MAX];
+    cl_point_t* pt;                 /* npoints, ordenados por h */
+    struct cl_ring* retired;        /* anillo al que reemplazó (se libera al salir) */
+} cl_ring_t;
+
+static inline uint32_t cl_mix(uint32_t h){
+    h ^= h >> 16; h *= 0x7feb352du;
+    h ^= h >> 15; h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return h;
+}
+
+static inline uint32_t cl_hash_point(const char* name, uint32_t i){
+    uint32_t h = fnv1a(2166136261u, (const uint8_t*)name, strlen(name));
+    return cl_mix(h ^ (i * 0x9e3779b9u));
+}
+
+static inline uint32_t cl_hash_dev(uint32_t dev){ return cl_mix(dev * 0x9e3779b9u + 0x85ebca6bu); }
+
+static inline int cl_point_cmp(const void* a, const void* b){
+    const cl_point_t* x = (const cl_point_t*)a; const cl_point_t* y = (const cl_point_t*)b;
+    if (x->h != y->h) return x->h < y->h ? -1 : 1;
+    return (x->node > y->node) - (x->node < y->node);
+}
+
+/* Nodo dueño de dev (binaria sobre el anillo) */
+static inline uint32_t cl_owner(const cl_ring_t* r, uint32_t dev){
+    uint32_t h = cl_hash_dev(dev), lo = 0, hi = r->npoints;
+    while (lo < hi){
+        uint32_t mid = (lo + hi) / 2u;
+        if (r->pt[mid].h < h) lo = mid + 1u; else hi = mid;
+    }
+    return r->pt[lo == r->npoints ? 0u : lo].node;
+}
+
+static inline int cl_is_self(const cl_ring_t* r, uint32_t dev){ return (int32_t)cl_owner(r, dev) == r->self; }
+
+/* Opción elective del rango experimental (RFC 7252 §12.2) que el proxy pone en
+ * lo que reenvía: marca la petición como de un par. Su valor es el segundo de
+ * reloj de pared del emisor (4 bytes) y un HMAC-SHA256 truncado con la clave
+ * del clúster (COAP_CLUSTER_KEY) sobre el datagrama entero con esos 8 bytes en
+ * cero: la IP de origen se falsifica con UDP, la clave no */
+#define CL_OPT_HOP     65000u
+#define CL_HOP_MAC     8u
+#define CL_HOP_LEN     (4u + CL_HOP_MAC)
+#define CL_HOP_SKEW_S  30u          /* antigüedad o adelanto máx. del sello */
+#define CL_HOP_BUF     2048u        /* datagrama más largo que se verifica */
+#define CL_SECRET_MIN  16u
+#define CL_SECRET_MAX  32u
+
+typedef struct { uint8_t k[CL_SECRET_MAX]; size_t len; } cl_key_t;
+
+/* MAC de m[0, n) con la zona del MAC (m + at) en cero; m no se toca */
+static inline int cl_hop_mac(const cl_key_t* k, const uint8_t* m, size_t n, size_t at, uint8_t* mac){
+    uint8_t tmp[CL_HOP_BUF], h[32]; unsigned hl = 0;
+    if (n > sizeof(tmp) || at + CL_HOP_MAC > n) return -1;
+    memcpy(tmp, m, n);
+    memset(tmp + at, 0, CL_HOP_MAC);
+    if (!HMAC(EVP_sha256(), k->k, (int)k->len, tmp, n, h, &hl)) return -1;
+    memcpy(mac, h, CL_HOP_MAC);
+    return 0;
+}
+
+/* ¿La reenvió el proxy de otro nodo? 1 = IP de un nodo del anillo y opción de
+ * salto con sello al día y MAC válido; 0 = sin opción de salto; -1 = la trae
+ * pero no verifica (el llamador la rechaza). Los pares no pasan por los límites
+ * de tasa ni por COAP_OSCORE_REQUIRE (ya los aplicó el frontal) y no se vuelven
+ * a reenviar */
+static inline int cl_from_peer(const cl_ring_t* r, const cl_key_t* k, const coap_req_t* req, const struct sockaddr_in* a){
+    const uint8_t* p = req->msg + req->opt_begin;
+    const uint8_t* end = req->msg + req->opt_end;
+    const uint8_t* v = NULL;
+    unsigned num = 0;
+    int vl = 0;
+    while (p < end && !v){
+        uint8_t b = *p++;
+        int d = read_ext((uint8_t)(b >> 4), &p, end), l = read_ext((uint8_t)(b & 0x0F), &p, end);
+        num += (unsigned)d;
+        if (num == CL_OPT_HOP){ v = p; vl = l; }
+        p += l;
+    }
+    if (!v) return 0;
+    uint32_t i = 0;
+    while (i < r->nnodes && ((int32_t)i == r->self || r->node[i].coap.sin_addr.s_addr != a->sin_addr.s_addr)) i++;
+    if (i == r->nnodes || vl != (int)CL_HOP_LEN || !k->len) return -1;
+    uint32_t ts = (uint32_t)v[0] << 24 | (uint32_t)v[1] << 16 | (uint32_t)v[2] << 8 | v[3];
+    uint32_t now = (uint32_t)time(NULL);
+    if ((uint32_t)(now - ts + CL_HOP_SKEW_S) > 2u * CL_HOP_SKEW_S) return -1;
+    size_t n = req->payload_len ? (size_t)(req->payload - req->msg) + req->payload_len : req->opt_end;
+    uint8_t mac[CL_HOP_MAC];
+    if (cl_hop_mac(k, req->msg, n, (size_t)(v + 4 - req->msg), mac) != 0) return -1;
+    return CRYPTO_memcmp(mac, v + 4, CL_HOP_MAC) == 0 ? 1 : -1;
+}
+
+static inline void cl_free(cl_ring_t* r){
+    while (r){
+        cl_ring_t* nx = r->retired;
+        free(r->pt); free(r);
+        r = nx;
+    }
+}
+
+/* Carga el anillo de path; self es el nombre de este nodo. NULL si el archivo
+ * no se puede leer o tiene una línea mal formada (se avisa por stderr) */
+static inline cl_ring_t* cl_load(const char* path, const char* self, uint32_t gen){
+    FILE* f = fopen(path, "r");
+    if (!f){ perror(path); return NULL; }
+    cl_ring_t* r = (cl_ring_t*)calloc(1, sizeof(*r));
+    char line[256];
+    int ln = 0, bad = !r;
+    while (!bad && fgets(line, sizeof(line), f)){
+        char name[CL_NAME_MAX], host[64];
+        unsigned cport, lport, w = 1;
+        ln++;
+        char* h = strchr(line, '#');
+        if (h) *h = '\0';
+        int k = sscanf(line, "%31s %63[^:]:%u %u %u", name, host, &cport, &lport, &w);
+        if (k <= 0) continue;
+        struct in_addr ip;
+        if (k < 4 || inet_pton(AF_INET, host, &ip) != 1 || !cport || cport > 65535u || !lport ||
+            lport > 65535u || !w || w > CL_WEIGHT_MAX || r->nnodes == CL_NODES_MAX){
+            fprintf(stderr, "%s:%d: esperado \"nombre ip:puerto puerto_enlace [peso 1..%u]\"\n", path, ln, CL_WEIGHT_MAX);
+            bad = 1; break;
+        }
+        cl_node_t* n = &r->node[r->nnodes++];
+        snprintf(n->name, sizeof(n->name), "%s", name);
+        n->coap.sin_family = n->link.sin_family = AF_INET;
+        n->coap.sin_addr = n->link.sin_addr = ip;
+        n->coap.sin_port = htons((uint16_t)cport);
+        n->link.sin_port = htons((uint16_t)lport);
+        n->weight = w;
+        r->npoints += w * CL_VNODES;
+    }
+    fclose(f);
+    if (!bad && r->nnodes == 0){ fprintf(stderr, "%s: sin nodos\n", path); bad = 1; }
+    if (!bad && !(r->pt = (cl_point_t*)malloc(r->npoints * sizeof(cl_point_t)))) bad = 1;
+    if (bad){ cl_free(r); return NULL; }
+    r->gen = gen; r->self = -1;
+    uint32_t k = 0;
+    for (uint32_t i = 0; i < r->nnodes; i++){
+        if (strcmp(r->node[i].name, self) == 0) r->self = (int32_t)i;
+        for (uint32_t v = 0; v < r->node[i].weight * CL_VNODES; v++){
+            r->pt[k].h = cl_hash_point(r->node[i].name, v); r->pt[k].node = i; k++;
+        }
+    }
+    qsort(r->pt, r->npoints, sizeof(cl_point_t), cl_point_cmp);
+    return r;
+}
+
+/* --- tramas del enlace --- */
+#define CL_MAGIC       0x31534C43u  /* "CLS1" */
+#define CL_FRAME_RECS  1024u        /* registros por trama */
+#define CL_LINK_BUF    (256u << 10) /* búfer de salida por enlace */
+#define CL_CONN_BUF    (32u << 10)  /* búfer de entrada: cabe una trama completa */
+#define CL_RETRY_MIN_MS 100u
+#define CL_RETRY_MAX_MS 5000u
+
+enum { CL_RECS = 1, CL_IMPORT = 2, CL_ACK = 3 };
+#define CL_F_LAST   0x01            /* IMPORT: última trama del segmento */
+
+typedef struct {
+    uint32_t magic;
+    uint8_t  kind, flags, hops, pad;
+    uint32_t n;                     /* registros que siguen */
+    uint32_t device;                /* IMPORT */
+    uint32_t tag;                   /* IMPORT/ACK: id del traspaso */
+    uint32_t gen;                   /* generación del anillo del emisor */
+} cl_frame_t;
+
+_Static_assert(sizeof(cl_frame_t) == 24, "cl_frame_t: 24 bytes en el cable");
+
+static inline size_t cl_frame_bytes(const cl_frame_t* f){ return sizeof(*f) + (size_t)f->n * sizeof(srec_t); }
+
+/* --- enlace saliente (sólo el escritor) --- */
+enum { CL_DOWN = 0, CL_CONNECTING = 1, CL_UP = 2 };
+
+typedef struct {
+    int      fd, state;
+    struct sockaddr_in to;
+    uint8_t* buf;                   /* tramas completas pendientes de [off, len) */
+    size_t   len, off, last;        /* last: trama RECS abierta al final (SIZE_MAX = ninguna) */
+    uint64_t retry_at, first_ms;    /* first_ms: desde cuándo hay algo sin enviar */
+    uint32_t retry_ms;
+    uint8_t  ack[sizeof(cl_frame_t)];   /* ACK a medio leer */
+    size_t   acklen;
+} cl_link_t;
+
+static inline int cl_link_init(cl_link_t* l, const struct sockaddr_in* to){
+    memset(l, 0, sizeof(*l));
+    l->fd = -1; l->to = *to; l->last = SIZE_MAX;
+    l->retry_ms = CL_RETRY_MIN_MS;
+    l->buf = (uint8_t*)malloc(CL_LINK_BUF);
+    return l->buf ? 0 : -1;
+}
+
+static inline void cl_link_close(cl_link_t* l, uint64_t now){
+    if (l->fd >= 0) close(l->fd);
+    l->fd = -1; l->state = CL_DOWN; l->acklen = 0;
+    l->retry_at = now + l->retry_ms;
+    l->retry_ms = l->retry_ms * 2u > CL_RETRY_MAX_MS ? CL_RETRY_MAX_MS : l->retry_ms * 2u;
+    /* la trama a medio enviar se pierde: la conexión nueva empieza en un borde */
+    size_t p = 0;
+    while (p < l->off) p += cl_frame_bytes((const cl_frame_t*)(const void*)(l->buf + p));
+    memmove(l->buf, l->buf + p, l->len - p);
+    l->len -= p; l->off = 0;
+    if (l->last != SIZE_MAX) l->last = l->last >= p ? l->last - p : SIZE_MAX;
+}
+
+static inline void cl_link_free(cl_link_t* l){
+    if (l->fd >= 0) close(l->fd);
+    free(l->buf);
+    memset(l, 0, sizeof(*l));
+    l->fd = -1;
+}
+
+/* Conexión no bloqueante; 0 = en curso o hecha (mirar state), -1 = falló */
+static inline int cl_link_connect(cl_link_t* l, uint64_t now){
+    if (l->state != CL_DOWN || now < l->retry_at) return 0;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0){ cl_link_close(l, now); return -1; }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    l->fd = fd;
+    if (connect(fd, (const struct sockaddr*)&l->to, sizeof(l->to)) == 0){ l->state = CL_UP; return 0; }
+    if (errno == EINPROGRESS){ l->state = CL_CONNECTING; return 0; }
+    cl_link_close(l, now);
+    return -1;
+}
+
+/* EPOLLOUT de una conexión en curso: ¿quedó establecida? */
+static inline int cl_link_connected(cl_link_t* l, uint64_t now){
+    int err = 0; socklen_t el = sizeof(err);
+    if (getsockopt(l->fd, SOL_SOCKET, SO_ERROR, &err, &el) != 0 || err){ cl_link_close(l, now); return -1; }
+    l->state = CL_UP; l->retry_ms = CL_RETRY_MIN_MS;
+    return 0;
+}
+
+static inline size_t cl_link_room(const cl_link_t* l){ return CL_LINK_BUF - l->len; }
+
+/* Agrega una trama (cabecera + n registros); -1 si no cabe */
+static inline int cl_link_put(cl_link_t* l, uint8_t kind, uint8_t flags, uint8_t hops, uint32_t device,
+                              uint32_t tag, uint32_t gen, const srec_t* recs, uint32_t n, uint64_t now){
+    size_t need = sizeof(cl_frame_t) + (size_t)n * sizeof(srec_t);
+    if (need > cl_link_room(l)) return -1;
+    cl_frame_t f = { CL_MAGIC, kind, flags, hops, 0, n, device, tag, gen };
+    memcpy(l->buf + l->len, &f, sizeof(f));
+    if (n) memcpy(l->buf + l->len + sizeof(f), recs, (size_t)n * sizeof(srec_t));
+    l->last = kind == CL_RECS ? l->len : SIZE_MAX;
+    if (l->len == l->off) l->first_ms = now;
+    l->len += need;
+    return 0;
+}
+
+/* Registros en vivo: se suman a la última trama RECS si aún no salió (ni a medias)
+ * y tiene lugar; devuelve cuántos entraron */
+static inline uint32_t cl_link_recs(cl_link_t* l, uint8_t hops, uint32_t gen, const srec_t* recs, uint32_t n, uint64_t now){
+    uint32_t done = 0;
+    while (done < n){
+        cl_frame_t* f = l->last != SIZE_MAX && l->last >= l->off ? (cl_frame_t*)(void*)(l->buf + l->last) : NULL;
+        if (f && f->hops == hops && f->n < CL_FRAME_RECS){
+            uint32_t k = n - done, fit = (uint32_t)(cl_link_room(l) / sizeof(srec_t));
+            if (k > CL_FRAME_RECS - f->n) k = CL_FRAME_RECS - f->n;
+            if (k > fit) k = fit;
+            if (k == 0) break;
+            memcpy(l->buf + l->len, recs + done, (size_t)k * sizeof(srec_t));
+            l->len += (size_t)k * sizeof(srec_t);
+            f->n += k; done += k;
+            continue;
+        }
+        if (cl_link_put(l, CL_RECS, 0, hops, 0, 0, gen, NULL, 0, now) != 0) break;
+    }
+    return done;
+}
+
+/* Envía lo pendiente sin bloquear: 1 = queda algo (esperar EPOLLOUT), 0 = vacío, -1 = se cayó */
+static inline int cl_link_flush(cl_link_t* l, uint64_t now){
+    if (l->state != CL_UP) return l->len > l->off;
+    while (l->off < l->len){
+        ssize_t w = send(l->fd, l->buf + l->off, l->len - l->off, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 1;
+        if (w <= 0){ cl_link_close(l, now); return -1; }
+        l->off += (size_t)w;
+    }
+    l->len = l->off = 0; l->last = SIZE_MAX;
+    return 0;
+}
+
+/* Lee los ACK que devuelve el par; llama a on_ack(tag) por cada uno. -1 = se cayó */
+static inline int cl_link_read(cl_link_t* l, void (*on_ack)(void*, uint32_t), void* arg, uint64_t now){
+    for (;;){
+        ssize_t r = recv(l->fd, l->ack + l->acklen, sizeof(l->ack) - l->acklen, MSG_DONTWAIT);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (r <= 0){ cl_link_close(l, now); return -1; }
+        l->acklen += (size_t)r;
+        if (l->acklen < sizeof(l->ack)) continue;
+        cl_frame_t f;
+        memcpy(&f, l->ack, sizeof(f));
+        l->acklen = 0;
+        if (f.magic != CL_MAGIC || f.kind != CL_ACK || f.n){ cl_link_close(l, now); return -1; }
+        on_ack(arg, f.tag);
+    }
+}
+
+/* --- conexión entrante (sólo el escritor) --- */
+typedef struct {
+    int      fd;
+    size_t   len;
+    uint8_t* buf;                   /* CL_CONN_BUF */
+} cl_conn_t;
+
+/* Lee y entrega cada trama completa a fn (que puede contestar por c->fd);
+ * 0 = sigue abierta, -1 = cerrada o protocolo roto (el llamador la cierra) */
+static inline int cl_conn_read(cl_conn_t* c, void (*fn)(void*, cl_conn_t*, const cl_frame_t*, srec_t*), void* arg){
+    for (;;){
+        ssize_t r = recv(c->fd, c->buf + c->len, CL_CONN_BUF - c->len, MSG_DONTWAIT);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (r <= 0) return -1;
+        c->len += (size_t)r;
+        size_t p = 0;
+        while (c->len - p >= sizeof(cl_frame_t)){
+            cl_frame_t f;
+            memcpy(&f, c->buf + p, sizeof(f));
+            if (f.magic != CL_MAGIC || f.n > CL_FRAME_RECS) return -1;
+            size_t fb = cl_frame_bytes(&f);
+            if (c->len - p < fb) break;
+            fn(arg, c, &f, (srec_t*)(void*)(c->buf + p + sizeof(f)));
+            p += fb;
+        }
+        memmove(c->buf, c->buf + p, c->len - p);
+        c->len -= p;
+    }
+}
+
+/* Contesta el ACK de un IMPORT (24 bytes: entra entero en el búfer del socket) */
+static inline void cl_conn_ack(const cl_conn_t* c, uint32_t tag, uint32_t gen){
+    cl_frame_t f = { CL_MAGIC, CL_ACK, 0, 0, 0, 0, 0, tag, gen };
+    if (send(c->fd, &f, sizeof(f), MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)sizeof(f)){ /* el origen reintenta */ }
+}
+
+/* --- buzón escritor -> worker 0 (SPSC): claves a notificar por Observe --- */
+#define CL_MBX      256u            /* potencia de 2 */
+#define CL_KEY_MAX  64u
+
+typedef struct {
+    char key[CL_MBX][CL_KEY_MAX];
+    _Alignas(64) atomic_uint head;  /* lo avanza el worker */
+    _Alignas(64) atomic_uint tail;  /* lo avanza el escritor */
+} cl_mbx_t;
+
+/* Escritor: 0 o -1 si está lleno (esa notificación se pierde) */
+static inline int cl_mbx_push(cl_mbx_t* m, const char* key){
+    unsigned t = atomic_load_explicit(&m->tail, memory_order_relaxed);
+    if (t - atomic_load_explicit(&m->head, memory_order_acquire) == CL_MBX) return -1;
+    snprintf(m->key[t & (CL_MBX - 1u)], CL_KEY_MAX, "%s", key);
+    atomic_store_explicit(&m->tail, t + 1u, memory_order_release);
+    return 0;
+}
+
+static inline int cl_mbx_pop(cl_mbx_t* m, char* key){
+    unsigned h = atomic_load_explicit(&m->head, memory_order_relaxed);
+    if (h == atomic_load_explicit(&m->tail, memory_order_acquire)) return 0;
+    memcpy(key, m->key[h & (CL_MBX - 1u)], CL_KEY_MAX);
+    atomic_store_explicit(&m->head, h + 1u, memory_order_release);
+    return 1;
+}
+
+/* --- proxy de peticiones (por worker, en su arena) --- */
+#define CL_PX_SLOTS    256u         /* default de COAP_PROXY_SLOTS (potencia de 2) */
+#define CL_PX_TTL_S    10u          /* una petición sin respuesta del dueño se olvida */
+#define CL_PX_OBS      0x80000000u  /* bit alto del token: observación agregada por clave */
+
+enum { PX_FREE = 0, PX_REQ = 1, PX_SUB = 2 };
+
+typedef struct {
+    uint32_t ptok;                  /* token hacia el dueño (PX_REQ) o de la clave (PX_SUB) */
+    uint32_t expires_s;             /* PX_REQ */
+    struct sockaddr_in cli;
+    uint8_t  state, ctype, tkl, answered, sec;
+    uint8_t  token[8];
+    uint16_t cmid;                  /* MID de la petición del cliente */
+    uint16_t rmid;                  /* PX_SUB: MID de la última notificación reenviada */
+    osc_req_t orq;                  /* sec: para proteger la respuesta */
+} cl_px_t;
+
+typedef struct {
+    cl_px_t* e;
+    uint32_t mask, next, gen;
+} cl_px_table_t;
+
+static inline size_t cl_px_need(uint32_t n){ return n ? arena_need((size_t)n * sizeof(cl_px_t)) : 0u; }
+
+static inline int cl_px_init(cl_px_table_t* t, arena_t* a, uint32_t n){
+    memset(t, 0, sizeof(*t));
+    if (n == 0) return 0;
+    t->e = (cl_px_t*)arena_alloc(a, (size_t)n * sizeof(cl_px_t));
+    t->mask = n - 1u;
+    return t->e ? 0 : -1;
+}
+
+/* Token de observación de una clave: mismo valor en todos los workers */
+static inline uint32_t cl_px_key_tok(const char* key){
+    return CL_PX_OBS | (cl_mix(fnv1a(2166136261u, (const uint8_t*)key, strlen(key))) & ~CL_PX_OBS);
+}
+
+/* Slot libre (o vencido) para una petición; su ptok lleva índice y generación */
+static inline cl_px_t* cl_px_new(cl_px_table_t* t, uint32_t now_s){
+    for (uint32_t k = 0; k <= t->mask; k++){
+        uint32_t i = (t->next + k) & t->mask;
+        cl_px_t* e = &t->e[i];
+        if (e->state == PX_SUB || (e->state == PX_REQ && (int32_t)(e->expires_s - now_s) > 0)) continue;
+        t->next = i + 1u;
+        memset(e, 0, sizeof(*e));
+        /* la generación va sobre los bits del índice: una respuesta tardía no
+         * encuentra el slot ya reutilizado */
+        do t->gen++; while (((t->gen * (t->mask + 1u) + i) & ~CL_PX_OBS) == 0u);
+        e->ptok = (t->gen * (t->mask + 1u) + i) & ~CL_PX_OBS;
+        e->state = PX_REQ;
+        e->expires_s = now_s + CL_PX_TTL_S;
+        return e;
+    }
+    return NULL;
+}
+
+static inline cl_px_t* cl_px_find(cl_px_table_t* t, uint32_t ptok){
+    if (!t->e || (ptok & CL_PX_OBS)) return NULL;
+    cl_px_t* e = &t->e[ptok & t->mask];
+    return e->state == PX_REQ && e->ptok == ptok ? e : NULL;
+}
+
+/* Suscriptor (cli, clave): el existente o uno nuevo; NULL si la tabla está llena */
+static inline cl_px_t* cl_px_sub(cl_px_table_t* t, const struct sockaddr_in* cli, uint32_t ktok, uint32_t now_s){
+    for (uint32_t i = 0; t->e && i <= t->mask; i++){
+        cl_px_t* e = &t->e[i];
+        if (e->state == PX_SUB && e->ptok == ktok && e->cli.sin_port == cli->sin_port &&
+            e->cli.sin_addr.s_addr == cli->sin_addr.s_addr) return e;
+    }
+    cl_px_t* e = cl_px_new(t, now_s);
+    if (e){ e->state = PX_SUB; e->ptok = ktok; }
+    return e;
+}
+
+/* Petición hacia el dueño: la de req con el token tok (4 bytes), el MID mid, la
+ * opción Observe forzada a observe (-1 = quitarla) y la de salto, firmada con k,
+ * al final; el resto se recodifica tal cual (una opción de salto que trajera el
+ * cliente se descarta). Devuelve el largo o 0 si no cupo. */
+static inline size_t cl_fwd_req(uint8_t* out, size_t cap, const coap_req_t* req, uint8_t type, uint16_t mid,
+                                uint32_t tok, int32_t observe, const cl_key_t* k){
+    const uint8_t* p = req->msg + req->opt_begin;
+    const uint8_t* end = req->msg + req->opt_end;
+    if (cap < 8u) return 0;
+    out[0] = (uint8_t)((COAP_VER<<6) | (type<<4) | 4u);
+    out[1] = req->code;
+    out[2] = (uint8_t)(mid>>8); out[3] = (uint8_t)(mid & 0xFF);
+    out[4] = (uint8_t)(tok>>24); out[5] = (uint8_t)(tok>>16); out[6] = (uint8_t)(tok>>8); out[7] = (uint8_t)tok;
+    size_t pos = 8u;
+    int last = 0, n;
+    unsigned num = 0;
+    int done_obs = observe < 0;
+    while (p < end){
+        uint8_t b = *p++;
+        int d = read_ext((uint8_t)(b >> 4), &p, end), l = read_ext((uint8_t)(b & 0x0F), &p, end);
+        num += (unsigned)d;
+        if (!done_obs && num >= OPT_OBSERVE){
+            copt_t o = copt_uint(OPT_OBSERVE, (uint32_t)observe);
+            if ((n = add_option(out+pos, cap-pos, &last, OPT_OBSERVE, o.val, o.len)) < 0) return 0;
+            pos += (size_t)n; done_obs = 1;
+        }
+        if (num != OPT_OBSERVE && num != OPT_OSCORE && num != CL_OPT_HOP){
+            if ((n = add_option(out+pos, cap-pos, &last, (int)num, p, (size_t)l)) < 0) return 0;
+            pos += (size_t)n;
+        }
+        p += l;
+    }
+    if (!done_obs){
+        copt_t o = copt_uint(OPT_OBSERVE, (uint32_t)observe);
+        if ((n = add_option(out+pos, cap-pos, &last, OPT_OBSERVE, o.val, o.len)) < 0) return 0;
+        pos += (size_t)n;
+    }
+    uint8_t hv[CL_HOP_LEN] = { 0 };
+    uint32_t now = (uint32_t)time(NULL);
+    hv[0] = (uint8_t)(now>>24); hv[1] = (uint8_t)(now>>16); hv[2] = (uint8_t)(now>>8); hv[3] = (uint8_t)now;
+    if ((n = add_option(out+pos, cap-pos, &last, CL_OPT_HOP, hv, sizeof(hv))) < 0) return 0;
+    pos += (size_t)n;
+    size_t at = pos - CL_HOP_MAC;
+    if (req->payload_len){
+        if (pos + 1u + req->payload_len > cap) return 0;
+        out[pos++] = 0xFF;
+        memcpy(out + pos, req->payload, req->payload_len);
+        pos += req->payload_len;
+    }
+    return cl_hop_mac(k, out, pos, at, out + at) == 0 ? pos : 0;
+}
@@ -0,0 +1,347 @@
+// coap_msg.h — Codificación y parseo de mensajes CoAP (RFC 7252)
+// Lo comparten el servidor, el generador de carga y los microbenchmarks:
+// coap_parse() deja vistas sobre el datagrama (sin copiar opciones ni payload):
+// en una sola pasada llena el índice de opciones conocidas (offset y largo de la
+// primera aparición de cada una, consultable en O(1) con coap_opt()) y, si
+// recibe la tabla de rutas, resuelve el nodo del trie con cada Uri-Path;
+// build_resp()/build_req() escriben cabecera y opciones en sitio y
+// finish_resp() cierra el mensaje tras el payload.
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "router.h"
+
+/* --- CoAP básicos --- */
+#define COAP_VER 1
+enum { COAP_CON=0, COAP_NON=1, COAP_ACK=2, COAP_RST=3 };
+#define COAP_GET    0x01
+#define COAP_POST   0x02
+#define COAP_PUT    0x03
+#define COAP_DELETE 0x04
+#define COAP_MK(cls,det)   (uint8_t)(((cls)<<5)|(det))
+#define COAP_202_DELETED   COAP_MK(2,2)
+#define COAP_204_CHANGED   COAP_MK(2,4)
+#define COAP_205_CONTENT   COAP_MK(2,5)
+#define COAP_231_CONTINUE  COAP_MK(2,31)
+#define COAP_400_BADREQ    COAP_MK(4,0)
+#define COAP_401_UNAUTH    COAP_MK(4,1)
+#define COAP_402_BADOPT    COAP_MK(4,2)
+#define COAP_404_NOTFOUND  COAP_MK(4,4)
+#define COAP_405_NOTALLOWED COAP_MK(4,5)
+#define COAP_408_INCOMPLETE COAP_MK(4,8)
+#define COAP_413_TOOLARGE  COAP_MK(4,13)
+#define COAP_415_BADFORMAT COAP_MK(4,15)
+#define COAP_500_INTERR    COAP_MK(5,0)
+#define COAP_503_UNAVAIL   COAP_MK(5,3)
+#define OPT_IF_MATCH         1
+#define OPT_URI_HOST         3
+#define OPT_ETAG             4
+#define OPT_IF_NONE_MATCH    5
+#define OPT_OBSERVE          6
+#define OPT_URI_PORT         7
+#define OPT_LOCATION_PATH    8
+#define OPT_OSCORE           9
+#define OPT_URI_PATH        11
+#define OPT_CONTENT_FORMAT  12
+#define OPT_MAX_AGE         14
+#define OPT_URI_QUERY       15
+#define OPT_ACCEPT          17
+#define OPT_LOCATION_QUERY  20
+#define OPT_BLOCK2          23
+#define OPT_BLOCK1          27
+#define OPT_SIZE2           28
+#define OPT_PROXY_URI       35
+#define OPT_PROXY_SCHEME    39
+#define OPT_SIZE1           60
+#define OPT_ECHO           252
+#define CF_TEXT_PLAIN        0
+#define CF_LINK_FORMAT      40
+#define CF_JSON             50
+#define CF_CBOR             60
+#define CF_SENML_CBOR      112
+#define QUERY_MAX            8
+
+/* --- CoAP parsing/build --- */
+/* Índice de opciones: una entrada por opción registrada (RFC 7252 §5.10,
+ * 7641, 7959, 8613); co_slot[num] da la entrada + 1 (0 = desconocida) */
+enum {
+    CO_IF_MATCH, CO_URI_HOST, CO_ETAG, CO_IF_NONE_MATCH, CO_OBSERVE, CO_URI_PORT,
+    CO_LOCATION_PATH, CO_OSCORE, CO_URI_PATH, CO_CONTENT_FORMAT, CO_MAX_AGE, CO_URI_QUERY, CO_ACCEPT,
+    CO_LOCATION_QUERY, CO_BLOCK2, CO_BLOCK1, CO_SIZE2, CO_PROXY_URI, CO_PROXY_SCHEME, CO_SIZE1,
+    CO_KNOWN
+};
+#define CO_MAX_NUM  OPT_SIZE1
+static const uint8_t co_slot[CO_MAX_NUM + 1] = {
+    [OPT_IF_MATCH] = CO_IF_MATCH + 1,           [OPT_URI_HOST] = CO_URI_HOST + 1,
+    [OPT_ETAG] = CO_ETAG + 1,                   [OPT_IF_NONE_MATCH] = CO_IF_NONE_MATCH + 1,
+    [OPT_OBSERVE] = CO_OBSERVE + 1,             [OPT_URI_PORT] = CO_URI_PORT + 1,
+    [OPT_LOCATION_PATH] = CO_LOCATION_PATH + 1, [OPT_OSCORE] = CO_OSCORE + 1,
+    [OPT_URI_PATH] = CO_URI_PATH + 1,
+    [OPT_CONTENT_FORMAT] = CO_CONTENT_FORMAT + 1, [OPT_MAX_AGE] = CO_MAX_AGE + 1,
+    [OPT_URI_QUERY] = CO_URI_QUERY + 1,         [OPT_ACCEPT] = CO_ACCEPT + 1,
+    [OPT_LOCATION_QUERY] = CO_LOCATION_QUERY + 1, [OPT_BLOCK2] = CO_BLOCK2 + 1,
+    [OPT_BLOCK1] = CO_BLOCK1 + 1,               [OPT_SIZE2] = CO_SIZE2 + 1,
+    [OPT_PROXY_URI] = CO_PROXY_URI + 1,         [OPT_PROXY_SCHEME] = CO_PROXY_SCHEME + 1,
+    [OPT_SIZE1] = CO_SIZE1 + 1,
+};
+
+/* Vista de una opción: off = 0 es ausente (el byte 0 siempre es cabecera) */
+typedef struct { uint16_t off, len; } coap_oref_t;
+
+typedef struct coap_req {
+    uint8_t type, tkl, code;
+    uint16_t mid;
+    uint8_t token[8];
+    int16_t node;                       /* nodo del trie tras los Uri-Path; -1 = sin ruta */
+    uint8_t nparams;
+    rt_param_t params[RT_MAX_PARAMS];   /* segmentos "{x}" */
+    uint8_t nquery;
+    rt_param_t query[QUERY_MAX];        /* opciones Uri-Query ("k=v") */
+    int32_t block1, block2;             /* valor de la opción; -1 = ausente */
+    int32_t observe;                    /* 0 = registrar, 1 = baja; -1 = ausente */
+    int32_t cf;                         /* Content-Format del cuerpo; -1 = ausente */
+    const uint8_t* payload; size_t payload_len;
+    const uint8_t* msg;                 /* datagrama: base de opt[].off */
+    uint16_t opt_begin, opt_end;        /* zona de opciones [begin, end) */
+    coap_oref_t opt[CO_KNOWN];          /* primera aparición de cada opción conocida */
+} coap_req_t;
+
+static inline int read_ext(uint8_t v, const uint8_t** p, const uint8_t* end){
+    if (v < 13) return v;
+    if (v == 13){ if (*p >= end) return -1; return 13 + *(*p)++; }
+    if (v == 14){ if (*p+1 >= end) return -1; int val = (((*p)[0]<<8)|(*p)[1]); *p+=2; return 269 + val; }
+    return -1;
+}
+static inline uint32_t opt_uint(const uint8_t* p, int l){
+    uint32_t v = 0;
+    for (int i = 0; i < l; i++) v = (v << 8) | p[i];
+    return v;
+}
+
+static inline uint32_t fnv1a(uint32_t h, const uint8_t* p, size_t n){
+    for (size_t i = 0; i < n; i++){ h ^= p[i]; h *= 16777619u; }
+    return h;
+}
+
+/* Valor de la opción del índice (NULL = ausente) */
+static inline const uint8_t* coap_opt(const coap_req_t* r, int slot, size_t* len){
+    const coap_oref_t* o = &r->opt[slot];
+    if (!o->off) return NULL;
+    *len = o->len;
+    return r->msg + o->off;
+}
+
+/* Opción uint de hasta 4 bytes; -1 = ausente o más larga */
+static inline int64_t coap_opt_uint(const coap_req_t* r, int slot){
+    const coap_oref_t* o = &r->opt[slot];
+    return (o->off && o->len <= 4u) ? (int64_t)opt_uint(r->msg + o->off, o->len) : -1;
+}
+
+/* Block, Observe y Content-Format caben en 3 bytes; -1 = ausente o más largo */
+static inline int32_t coap_opt_u24(const coap_req_t* r, int slot){
+    const coap_oref_t* o = &r->opt[slot];
+    return (o->off && o->len <= 3u) ? (int32_t)opt_uint(r->msg + o->off, o->len) : -1;
+}
+
+/* rt puede ser NULL: entonces no se resuelve la ruta (node = -1).
+ * Una pasada: el caso común (delta y largo < 13) no pasa por read_ext y cada
+ * opción cae en el índice con una consulta a co_slot; sólo Uri-Path (trie) y
+ * Uri-Query (vistas "k=v") tienen trato aparte porque se repiten. El marcador
+ * de payload es el byte donde termina la última opción: no se busca con
+ * memchr porque 0xFF puede aparecer dentro de un valor (ETag, Observe...). */
+static inline int coap_parse(const uint8_t* buf, size_t len, const router_t* rt, coap_req_t* r){
+    if (len < 4u || len > 0xFFFFu) return -1;
+    uint8_t ver = (buf[0]>>6) & 0x03;
+    if (ver != COAP_VER) return -1;
+    r->type = (buf[0]>>4) & 0x03;
+    r->tkl  =  buf[0]     & 0x0F;
+    r->code =  buf[1];
+    r->mid  = (uint16_t)((buf[2]<<8) | buf[3]);
+    if ((size_t)4 + (size_t)r->tkl > len || r->tkl > 8) return -1;
+    memcpy(r->token, buf+4, r->tkl);
+    const uint8_t* p = buf + 4 + r->tkl;
+    const uint8_t* end = buf + len;
+    r->msg = buf;
+    r->opt_begin = (uint16_t)(p - buf);
+    memset(r->opt, 0, sizeof(r->opt));
+    r->node = rt ? 0 : -1;
+    r->nparams = 0;
+    r->nquery = 0;
+    unsigned num = 0;
+    while (p < end && *p != 0xFF){
+        uint8_t b = *p++;
+        unsigned d = b >> 4, l = b & 0x0F;
+        if (__builtin_expect(d >= 13 || l >= 13, 0)){
+            int dd = read_ext((uint8_t)d, &p, end);
+            int ll = read_ext((uint8_t)l, &p, end);
+            if (dd < 0 || ll < 0) return -1;
+            d = (unsigned)dd; l = (unsigned)ll;
+        }
+        num += d;
+        if ((size_t)(end - p) < l) return -1;
+        unsigned s = num <= CO_MAX_NUM ? co_slot[num] : 0u;
+        if (s && !r->opt[s-1u].off){ r->opt[s-1u].off = (uint16_t)(p - buf); r->opt[s-1u].len = (uint16_t)l; }
+        if (num == OPT_URI_PATH && l > 0 && r->node >= 0){
+            r->node = (int16_t)rt_step(rt, r->node, p, l);
+            if (r->node >= 0 && rt->n[r->node].param){
+                if (r->nparams == RT_MAX_PARAMS || l > 255) r->node = -1;
+                else { r->params[r->nparams].p = p; r->params[r->nparams].len = (uint8_t)l; r->nparams++; }
+            }
+        } else if (num == OPT_URI_QUERY && r->nquery < QUERY_MAX && l <= 255){
+            r->query[r->nquery].p = p; r->query[r->nquery].len = (uint8_t)l; r->nquery++;
+        }
+        p += l;
+    }
+    r->opt_end = (uint16_t)(p - buf);
+    r->block1  = coap_opt_u24(r, CO_BLOCK1);
+    r->block2  = coap_opt_u24(r, CO_BLOCK2);
+    r->observe = coap_opt_u24(r, CO_OBSERVE);
+    r->cf      = coap_opt_u24(r, CO_CONTENT_FORMAT);
+    if (p < end){
+        p++;
+        r->payload = p;
+        r->payload_len = (size_t)(end - p);
+    } else { r->payload = NULL; r->payload_len = 0; }
+    return 0;
+}
+
+/* FNV-1a de Uri-Path + Uri-Query (clave de las sesiones por bloques). Sólo lo
+ * piden las peticiones Block1/Block2: se calcula recorriendo otra vez la zona
+ * de opciones, que coap_parse() ya validó. */
+static inline uint32_t coap_uri_hash(const coap_req_t* r){
+    uint32_t h = 2166136261u;
+    const uint8_t* p = r->msg + r->opt_begin;
+    const uint8_t* end = r->msg + r->opt_end;
+    unsigned num = 0;
+    while (p < end){
+        uint8_t b = *p++;
+        int d = read_ext((uint8_t)(b >> 4), &p, end), l = read_ext((uint8_t)(b & 0x0F), &p, end);
+        num += (unsigned)d;
+        if (num == OPT_URI_PATH || num == OPT_URI_QUERY){
+            uint8_t sep = (uint8_t)num;
+            h = fnv1a(fnv1a(h, &sep, 1u), p, (size_t)l);
+        }
+        p += l;
+    }
+    return h;
+}
+
+static inline int add_option(uint8_t* out, size_t cap, int* last, int number, const uint8_t* val, size_t vlen){
+    if (cap < 1u) return -1;
+    int delta = number - *last;
+    uint8_t dl, ll, dext[2] = {0}, lext[2] = {0}; size_t dextn=0, lextn=0;
+    if (delta < 13){ dl=(uint8_t)delta; }
+    else if (delta < 269){ dl=13; dext[dextn++]=(uint8_t)(delta-13); }
+    else { dl=14; int D=delta-269; dext[dextn++]=(uint8_t)((D>>8)&0xFF); dext[dextn++]=(uint8_t)(D&0xFF); }
+    if (vlen < 13u){ ll=(uint8_t)vlen; }
+    else if (vlen < 269u){ ll=13; lext[lextn++]=(uint8_t)(vlen-13u); }
+    else { ll=14; size_t K=vlen-269u; lext[lextn++]=(uint8_t)((K>>8)&0xFF); lext[lextn++]=(uint8_t)(K&0xFF); }
+    size_t need = 1u + dextn + lextn + vlen;
+    if (cap < need) return -1;
+    uint8_t* q = out;
+    *q++ = (uint8_t)((dl<<4)|ll);
+    for (size_t i=0;i<dextn;i++) *q++ = dext[i];
+    for (size_t i=0;i<lextn;i++) *q++ = lext[i];
+    if (vlen && val){ memcpy(q, val, vlen); q += vlen; }
+    *last = number;
+    return (int)need;
+}
+
+/* Opción ya codificada para build_resp (valores uint de hasta 4 bytes) */
+typedef struct { uint16_t num; uint8_t len; uint8_t val[4]; } copt_t;
+
+static inline copt_t copt_uint(uint16_t num, uint32_t v){
+    copt_t o = { num, 0, {0} };
+    uint8_t tmp[4]; int n = 0;
+    while (v){ tmp[n++] = (uint8_t)(v & 0xFF); v >>= 8; }
+    while (n) o.val[o.len++] = tmp[--n];
+    return o;
+}
+
+/* Cabecera + opciones de la respuesta. Devuelve la posición donde termina;
+ * el handler escribe el payload directamente en out+pos+1 (tras el marcador)
+ * y finish_resp() cierra el mensaje. El código se parchea luego en out[1] y
+ * Content-Format (siempre 1 byte) en out[*cf_at]. opts va ordenado por número. */
+static inline size_t build_resp(uint8_t* out, size_t cap,
+                                uint8_t req_type, uint8_t tkl, const uint8_t* tok,
+                                uint16_t mid, uint8_t code, uint8_t cf,
+                                const copt_t* opts, int nopts, size_t* cf_at){
+    if (cap < 4u + (size_t)tkl) return 0;
+    uint8_t type = (req_type == COAP_CON) ? COAP_ACK : COAP_NON;
+    out[0] = (uint8_t)((COAP_VER<<6) | (type<<4) | (tkl & 0x0F));
+    out[1] = code;
+    out[2] = (uint8_t)(mid>>8);
+    out[3] = (uint8_t)(mid & 0xFF);
+    memcpy(out+4, tok, tkl);
+    size_t pos = 4u + (size_t)tkl;
+
+    int last = 0, i = 0, n;
+    for (; i < nopts && opts[i].num < OPT_CONTENT_FORMAT; i++){
+        if ((n = add_option(out+pos, cap-pos, &last, opts[i].num, opts[i].val, opts[i].len)) < 0) return 0;
+        pos += (size_t)n;
+    }
+    if ((n = add_option(out+pos, cap-pos, &last, OPT_CONTENT_FORMAT, &cf, 1u)) < 0) return 0;
+    pos += (size_t)n;
+    if (cf_at) *cf_at = pos - 1u;
+    for (; i < nopts; i++){
+        if ((n = add_option(out+pos, cap-pos, &last, opts[i].num, opts[i].val, opts[i].len)) < 0) return 0;
+        pos += (size_t)n;
+    }
+    return pos;
+}
+
+/* Pone el marcador si hay payload (ya escrito en out+hdr+1) y devuelve el largo total */
+static inline size_t finish_resp(uint8_t* out, size_t hdr, size_t plen){
+    if (plen == 0) return hdr;
+    out[hdr] = 0xFF;
+    return hdr + 1u + plen;
+}
+
+/* Copia n bytes (truncando a cap) y devuelve los copiados */
+static inline size_t put_bytes(uint8_t* dst, size_t cap, const void* src, size_t n){
+    if (n > cap) n = cap;
+    memcpy(dst, src, n);
+    return n;
+}
+#define PUT_LIT(dst, cap, lit)  put_bytes((dst), (cap), (lit), sizeof(lit)-1u)
+
+/* Petición: Uri-Path sale de path ("device/42"), Observe y Content-Format son
+ * opcionales (-1 = sin opción) y query ("k=v", NULL = sin) va en una Uri-Query.
+ * Devuelve dónde termina la cabecera, como build_resp (0 = no cupo).
+ * inline: el servidor no arma peticiones, sólo loadgen.c y bench.c. */
+static inline size_t build_req(uint8_t* out, size_t cap, uint8_t type, uint8_t code, uint16_t mid,
+                               uint8_t tkl, const uint8_t* tok, const char* path,
+                               int32_t observe, int32_t cf, const char* query){
+    if (cap < 4u + (size_t)tkl || tkl > 8) return 0;
+    out[0] = (uint8_t)((COAP_VER<<6) | ((type & 0x03)<<4) | tkl);
+    out[1] = code;
+    out[2] = (uint8_t)(mid>>8);
+    out[3] = (uint8_t)(mid & 0xFF);
+    memcpy(out+4, tok, tkl);
+    size_t pos = 4u + (size_t)tkl;
+    int last = 0, n;
+    if (observe >= 0){
+        copt_t o = copt_uint(OPT_OBSERVE, (uint32_t)observe);
+        if ((n = add_option(out+pos, cap-pos, &last, OPT_OBSERVE, o.val, o.len)) < 0) return 0;
+        pos += (size_t)n;
+    }
+    for (const char* p = path; p && *p; ){
+        const char* e = strchr(p, '/');
+        size_t l = e ? (size_t)(e - p) : strlen(p);
+        if (l && (n = add_option(out+pos, cap-pos, &last, OPT_URI_PATH, (const uint8_t*)p, l)) < 0) return 0;
+        if (l) pos += (size_t)n;
+        p += l + (e ? 1u : 0u);
+    }
+    if (cf >= 0){
+        copt_t o = copt_uint(OPT_CONTENT_FORMAT, (uint32_t)cf);
+        if ((n = add_option(out+pos, cap-pos, &last, OPT_CONTENT_FORMAT, o.val, o.len)) < 0) return 0;
+        pos += (size_t)n;
+    }
+    if (query && *query){
+        if ((n = add_option(out+pos, cap-pos, &last, OPT_URI_QUERY, (const uint8_t*)query, strlen(query))) < 0) return 0;
+        pos += (size_t)n;
+    }
+    return pos;
+}
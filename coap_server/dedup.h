@@ -0,0 +1,127 @@
+// dedup.h — Caché de deduplicación de CON (RFC 7252 §4.5)
+// Tabla de direccionamiento abierto y tamaño fijo, clave (IP, puerto, MID).
+// Guarda los bytes de la respuesta ya enviada para reenviarla tal cual a una
+// retransmisión, sin volver a parsear ni tocar el almacenamiento. Las entradas
+// caducan a los EXCHANGE_LIFETIME segundos. Una tabla por worker: con
+// SO_REUSEPORT el kernel manda siempre el mismo endpoint al mismo socket.
+// Los slots salen de la arena del worker (pool.h); su número se fija al arrancar.
+// Al salir limpio las entradas vigentes van a la instantánea (snapshot.h) con
+// el tiempo que les queda: una retransmisión que cruza un reinicio sigue
+// recibiendo la respuesta original en vez de ingerirse dos veces.
+#pragma once
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+#include "snapshot.h"
+
+#define EXCHANGE_LIFETIME_S  247u
+#define DEDUP_SLOTS          4096u    /* default; potencia de 2 */
+#define DEDUP_PROBE          16u      /* sondeo lineal acotado */
+#define DEDUP_RESP_MAX       128u     /* respuestas más largas no se guardan */
+
+typedef struct {
+    uint32_t addr;          /* 0 = slot nunca usado */
+    uint16_t port, mid;
+    uint32_t expires_s;
+    uint16_t len;
+    uint8_t  resp[DEDUP_RESP_MAX];
+} dedup_entry_t;
+
+/* Entrada en la instantánea: e.expires_s lleva los segundos que le quedaban */
+typedef struct {
+    uint32_t      worker;
+    dedup_entry_t e;
+} dd_snap_t;
+
+#define SN_DEDUP  SN_TAG('D','D','U','P')
+
+typedef struct {
+    dedup_entry_t* slots;   /* mask+1 slots, de la arena del worker */
+    uint32_t       mask;
+} dedup_t;
+
+static inline size_t dd_need(uint32_t nslots){ return arena_need((size_t)nslots * sizeof(dedup_entry_t)); }
+
+/* nslots debe ser potencia de 2 (pool_cfg_load ya la redondea) */
+static inline int dd_init(dedup_t* d, arena_t* a, uint32_t nslots){
+    d->slots = (dedup_entry_t*)arena_alloc(a, (size_t)nslots * sizeof(dedup_entry_t));
+    d->mask = nslots - 1u;
+    return d->slots ? 0 : -1;
+}
+
+static inline uint32_t dd_hash(uint32_t addr, uint16_t port, uint16_t mid){
+    uint32_t h = addr ^ ((uint32_t)port << 16 | mid);
+    h ^= h >> 16; h *= 0x7feb352du;
+    h ^= h >> 15; h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return h;
+}
+
+/* Si (cli, mid) ya se respondió y no caducó, copia la respuesta y devuelve su largo */
+static inline size_t dd_lookup(const dedup_t* d, const struct sockaddr_in* cli, uint16_t mid,
+                               uint32_t now_s, uint8_t* out, size_t cap){
+    uint32_t addr = cli->sin_addr.s_addr; uint16_t port = cli->sin_port;
+    uint32_t h = dd_hash(addr, port, mid);
+    for (uint32_t i = 0; i < DEDUP_PROBE; i++){
+        const dedup_entry_t* e = &d->slots[(h + i) & d->mask];
+        if (e->addr == 0 && e->port == 0) return 0;
+        if (e->addr == addr && e->port == port && e->mid == mid){
+            if (e->expires_s <= now_s || e->len > cap) return 0;
+            memcpy(out, e->resp, e->len);
+            return e->len;
+        }
+    }
+    return 0;
+}
+
+/* Guarda la respuesta de (cli, mid) hasta expires_s; reutiliza slots caducados
+ * y, si la ventana de sondeo está llena, reemplaza la entrada que caduca antes. */
+static inline void dd_store_until(dedup_t* d, const struct sockaddr_in* cli, uint16_t mid,
+                                  uint32_t now_s, uint32_t expires_s, const uint8_t* resp, size_t len){
+    if (len > DEDUP_RESP_MAX) return;
+    uint32_t addr = cli->sin_addr.s_addr; uint16_t port = cli->sin_port;
+    uint32_t h = dd_hash(addr, port, mid);
+    dedup_entry_t* victim = NULL;
+    for (uint32_t i = 0; i < DEDUP_PROBE; i++){
+        dedup_entry_t* e = &d->slots[(h + i) & d->mask];
+        int same = e->addr == addr && e->port == port && e->mid == mid;
+        if (same || (e->addr == 0 && e->port == 0) || e->expires_s <= now_s){ victim = e; break; }
+        if (!victim || e->expires_s < victim->expires_s) victim = e;
+    }
+    victim->addr = addr; victim->port = port; victim->mid = mid;
+    victim->expires_s = expires_s;
+    victim->len = (uint16_t)len;
+    memcpy(victim->resp, resp, len);
+}
+
+static inline void dd_store(dedup_t* d, const struct sockaddr_in* cli, uint16_t mid,
+                            uint32_t now_s, const uint8_t* resp, size_t len){
+    dd_store_until(d, cli, mid, now_s, now_s + EXCHANGE_LIFETIME_S, resp, len);
+}
+
+/* Vigentes a la instantánea (con el worker ya parado); la sección la abre quien llama */
+static inline void dd_snap_save(const dedup_t* d, sn_buf_t* b, uint32_t worker, uint32_t now_s){
+    for (uint32_t i = 0; i <= d->mask; i++){
+        const dedup_entry_t* e = &d->slots[i];
+        if ((e->addr == 0 && e->port == 0) || e->expires_s <= now_s) continue;
+        dd_snap_t* x = (dd_snap_t*)sn_item(b);
+        if (!x) return;
+        x->worker = worker; x->e = *e;
+        x->e.expires_s = e->expires_s - now_s;
+    }
+}
+
+/* Las de worker (o todas si worker < 0: otro número de workers, el kernel
+ * reparte distinto) a las que, pasados elapsed_s, aún les queda tiempo */
+static inline void dd_snap_load(dedup_t* d, const dd_snap_t* x, uint64_t n, int worker, uint32_t elapsed_s, uint32_t now_s){
+    for (uint64_t i = 0; x && i < n; i++){
+        if ((worker >= 0 && x[i].worker != (uint32_t)worker) || x[i].e.expires_s <= elapsed_s) continue;
+        struct sockaddr_in cli;
+        memset(&cli, 0, sizeof(cli));
+        cli.sin_addr.s_addr = x[i].e.addr; cli.sin_port = x[i].e.port;
+        dd_store_until(d, &cli, x[i].e.mid, now_s, now_s + x[i].e.expires_s - elapsed_s, x[i].e.resp, x[i].e.len);
+    }
+}
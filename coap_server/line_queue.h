@@ -0,0 +1,106 @@
+// line_queue.h — Cola acotada sin locks (MPMC, esquema de Vyukov) hacia el escritor
+// Los workers encolan las lecturas aceptadas (líneas de texto para la exportación
+// o lotes de registros binarios, según kind) y el hilo escritor las desencola. Cada celda lleva un número de secuencia que indica
+// si está libre para el productor (seq == pos) o lista para el consumidor
+// (seq == pos+1); así productores y consumidor nunca se bloquean entre sí.
+#pragma once
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define LQ_CAP       4096u           /* potencia de 2 */
+#define LQ_LINE_MAX  1024u
+
+enum { LQ_TEXT = 0, LQ_RECS = 1 };
+
+typedef struct {
+    atomic_size_t seq;
+    uint8_t  kind;
+    uint16_t len;
+    char     data[LQ_LINE_MAX];
+} lq_cell_t;
+
+typedef struct {
+    lq_cell_t cells[LQ_CAP];
+    _Alignas(64) atomic_size_t enq;
+    _Alignas(64) atomic_size_t deq;
+} lqueue_t;
+
+static inline void lq_init(lqueue_t* q){
+    for (size_t i = 0; i < LQ_CAP; i++) atomic_init(&q->cells[i].seq, i);
+    atomic_init(&q->enq, 0);
+    atomic_init(&q->deq, 0);
+}
+
+/* Ocupación aproximada (para el control de admisión): dos loads relajados,
+ * puede quedarse corta o pasarse en lo que esté en vuelo */
+static inline size_t lq_depth(lqueue_t* q){
+    size_t e = atomic_load_explicit(&q->enq, memory_order_relaxed);
+    size_t d = atomic_load_explicit(&q->deq, memory_order_relaxed);
+    return e > d ? e - d : 0;
+}
+
+/* Reserva n celdas consecutivas (todas o ninguna): un lote que ocupa varias no
+ * queda encolado a medias. 0 = reservadas desde *pos, -1 = no hay n libres */
+static inline int lq_reserve(lqueue_t* q, size_t n, size_t* pos){
+    if (n == 0 || n > LQ_CAP) return -1;
+    size_t p = atomic_load_explicit(&q->enq, memory_order_relaxed);
+    for (;;){
+        size_t i = 0;
+        intptr_t dif = 0;
+        for (; i < n; i++){
+            size_t seq = atomic_load_explicit(&q->cells[(p + i) & (LQ_CAP-1)].seq, memory_order_acquire);
+            if ((dif = (intptr_t)seq - (intptr_t)(p + i)) != 0) break;
+        }
+        if (i == n){
+            if (atomic_compare_exchange_weak_explicit(&q->enq, &p, p + n,
+                    memory_order_relaxed, memory_order_relaxed)){ *pos = p; return 0; }
+        } else if (dif < 0){
+            return -1;
+        } else {
+            p = atomic_load_explicit(&q->enq, memory_order_relaxed);
+        }
+    }
+}
+
+/* Llena la celda reservada pos y se la pasa al consumidor (len <= LQ_LINE_MAX) */
+static inline void lq_commit(lqueue_t* q, size_t pos, uint8_t kind, const void* data, size_t len){
+    lq_cell_t* c = &q->cells[pos & (LQ_CAP-1)];
+    memcpy(c->data, data, len);
+    c->kind = kind;
+    c->len = (uint16_t)len;
+    atomic_store_explicit(&c->seq, pos+1, memory_order_release);
+}
+
+/* 0 = encolado, -1 = cola llena o elemento demasiado largo */
+static inline int lq_push(lqueue_t* q, uint8_t kind, const void* data, size_t len){
+    size_t pos;
+    if (len > LQ_LINE_MAX || lq_reserve(q, 1, &pos) != 0) return -1;
+    lq_commit(q, pos, kind, data, len);
+    return 0;
+}
+
+/* Copia el siguiente elemento en out (capacidad LQ_LINE_MAX); 1 = hay, 0 = vacía */
+static inline int lq_pop(lqueue_t* q, uint8_t* kind, void* out, size_t* len){
+    size_t pos = atomic_load_explicit(&q->deq, memory_order_relaxed);
+    lq_cell_t* c;
+    for (;;){
+        c = &q->cells[pos & (LQ_CAP-1)];
+        size_t seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos+1);
+        if (dif == 0){
+            if (atomic_compare_exchange_weak_explicit(&q->deq, &pos, pos+1,
+                    memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (dif < 0){
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&q->deq, memory_order_relaxed);
+        }
+    }
+    *kind = c->kind;
+    *len = c->len;
+    memcpy(out, c->data, c->len);
+    atomic_store_explicit(&c->seq, pos + LQ_CAP, memory_order_release);
+    return 1;
+}
@@ -0,0 +1,358 @@
+// loadgen.c — Generador de carga para el servidor CoAP
+// Simula N sensores virtuales que publican {"t":..} (ids pares) o {"d":..}
+// (impares) en POST /device/{id}, a una tasa total fija, mezclando CON y NON
+// y una fracción de GET /device/{id}. Opcionalmente K observadores se suscriben
+// (Observe) a /device/0../device/K-1 y cuentan las notificaciones (las CON se
+// confirman con ACK). Reutiliza build_req()/coap_parse() de coap_msg.h y los
+// histogramas de metrics.h.
+// Cada hilo tiene sus sockets (el kernel reparte por 4-upla entre los workers
+// con SO_REUSEPORT), su ritmo y su tabla de peticiones en vuelo indexada por el
+// token (4 bytes = secuencia del hilo). Latencia = envío -> ACK/respuesta; una
+// petición sin respuesta en --timeout-ms cuenta como timeout (no se reenvía).
+// Al final imprime el throughput y p50/p99/p999 por tipo de petición.
+//
+// Compilar:  make loadgen (gcc -std=c11 -O2 -Wall -Wextra -pthread -o coap_loadgen loadgen.c)
+// Ejecutar:  ./coap_loadgen [--host 127.0.0.1] [--port 5683] [--sensors 20000] [--rate 20000]
+//                           [--duration 10] [--con 50] [--get 10] [--observers 8]
+//                           [--threads 2] [--sockets 8] [--timeout-ms 2000]
+//   --rate      peticiones por segundo en total (se reparten entre los hilos)
+//   --con       % de peticiones CON (el resto NON)
+//   --get       % de GET sobre el total (el resto POST)
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "coap_msg.h"
+#include "metrics.h"
+
+#define LG_BATCH     32
+#define LG_INFLIGHT  65536u      /* potencia de 2 */
+#define LG_PKT       256
+#define LG_MAX_FDS   256
+
+enum { K_CON, K_NON, K_GET, K_KINDS };
+static const char* const lg_kind_name[K_KINDS] = { "POST CON (ACK)", "POST NON", "GET" };
+
+enum {
+    C_SENT, C_RESP, C_2XX, C_4XX, C_5XX, C_TIMEOUT, C_STRAY, C_SEND_ERR, C_LAG,
+    C_NOTIFY, C_OBS_OK, C_OBS_REJ,
+    C_COUNTERS
+};
+
+typedef struct { uint64_t t; uint32_t seq; uint8_t kind, used; } lg_flight_t;
+
+typedef struct {
+    const char* host;
+    uint16_t port;
+    uint32_t sensors, observers;
+    double   rate, duration_s;
+    unsigned con_pct, get_pct, threads, sockets, timeout_ms;
+} lg_cfg_t;
+
+typedef struct {
+    int id;
+    pthread_t th;
+    const lg_cfg_t* cfg;
+    int fds[LG_MAX_FDS], nfd;           /* sockets de carga */
+    int ofds[LG_MAX_FDS], nobs;         /* un socket por observador */
+    uint32_t obs_first;
+    uint16_t mid[LG_MAX_FDS];
+    uint32_t seq, next_sensor, rng;
+    lg_flight_t* fl;
+    atomic_ulong sent[K_KINDS];
+    atomic_ulong c[C_COUNTERS];
+    mx_hist_t lat[K_KINDS];
+} lg_thread_t;
+
+static volatile sig_atomic_t g_stop = 0;
+static void on_sig(int s){ (void)s; g_stop = 1; }
+
+static uint32_t lg_rand(lg_thread_t* T){       /* xorshift32 */
+    uint32_t x = T->rng;
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    return T->rng = x;
+}
+
+static int lg_socket(const lg_cfg_t* c){
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0){ perror("socket"); return -1; }
+    int sz = 4 << 20;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz));
+    struct sockaddr_in a; memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET; a.sin_port = htons(c->port);
+    if (inet_pton(AF_INET, c->host, &a.sin_addr) != 1 || connect(fd, (struct sockaddr*)&a, sizeof(a)) != 0){
+        perror("connect"); close(fd); return -1;
+    }
+    return fd;
+}
+
+/* Arma la próxima petición del hilo en out; devuelve su largo */
+static size_t lg_build(lg_thread_t* T, int fi, uint8_t* out, uint64_t now){
+    const lg_cfg_t* c = T->cfg;
+    uint32_t share = (c->sensors + c->threads - 1u - (uint32_t)T->id) / c->threads;
+    uint32_t sensor = (uint32_t)T->id + c->threads * (T->next_sensor++ % (share ? share : 1u));
+    int get = lg_rand(T) % 100u < c->get_pct;
+    int con = lg_rand(T) % 100u < c->con_pct;
+    uint8_t kind = get ? K_GET : (con ? K_CON : K_NON);
+    uint32_t seq = T->seq++;
+    uint8_t tok[4] = { (uint8_t)(seq>>24), (uint8_t)(seq>>16), (uint8_t)(seq>>8), (uint8_t)seq };
+    char path[32];
+    snprintf(path, sizeof(path), "device/%u", sensor);
+    size_t hdr = build_req(out, LG_PKT, con ? COAP_CON : COAP_NON, get ? COAP_GET : COAP_POST,
+                           T->mid[fi]++, 4, tok, path, -1, get ? -1 : CF_JSON, NULL);
+    size_t plen = 0;
+    if (!get){
+        char* pl = (char*)out + hdr + 1u;
+        int w = (sensor & 1u) ? snprintf(pl, LG_PKT - hdr - 1u, "{\"d\":%u}", 20u + seq % 380u)
+                              : snprintf(pl, LG_PKT - hdr - 1u, "{\"t\":%.1f}", 18.0 + (double)(seq % 120u) / 10.0);
+        plen = w > 0 ? (size_t)w : 0;
+    }
+    lg_flight_t* f = &T->fl[seq & (LG_INFLIGHT - 1u)];
+    if (f->used) mx_bump(&T->c[C_TIMEOUT], 1);          /* pisada: vuelta de la tabla sin respuesta */
+    f->t = now; f->seq = seq; f->kind = kind; f->used = 1;
+    mx_bump(&T->sent[kind], 1);
+    return finish_resp(out, hdr, plen);
+}
+
+static void lg_response(lg_thread_t* T, const uint8_t* d, size_t n, uint64_t now){
+    coap_req_t r;
+    if (coap_parse(d, n, NULL, &r) != 0 || r.code == 0) return;
+    if (r.tkl != 4){ mx_bump(&T->c[C_STRAY], 1); return; }
+    uint32_t seq = (uint32_t)r.token[0]<<24 | (uint32_t)r.token[1]<<16 | (uint32_t)r.token[2]<<8 | r.token[3];
+    lg_flight_t* f = &T->fl[seq & (LG_INFLIGHT - 1u)];
+    if (!f->used || f->seq != seq){ mx_bump(&T->c[C_STRAY], 1); return; }   /* tardía o duplicada */
+    f->used = 0;
+    mx_hist_rec(&T->lat[f->kind], now - f->t);
+    mx_bump(&T->c[C_RESP], 1);
+    unsigned cls = r.code >> 5;
+    mx_bump(&T->c[cls == 2 ? C_2XX : (cls == 4 ? C_4XX : C_5XX)], 1);
+}
+
+/* Suscripción (obs = 0) o baja (obs = 1) del observador i */
+static void lg_observe(lg_thread_t* T, int i, int obs){
+    uint8_t out[LG_PKT], tok[2] = { 'o', (uint8_t)i };
+    char path[32];
+    snprintf(path, sizeof(path), "device/%u", T->obs_first + (uint32_t)i);
+    size_t len = build_req(out, sizeof(out), COAP_CON, COAP_GET, (uint16_t)(lg_rand(T)), 2, tok, path, obs, -1, NULL);
+    if (send(T->ofds[i], out, len, 0) < 0) mx_bump(&T->c[C_SEND_ERR], 1);
+}
+
+static void lg_notification(lg_thread_t* T, int i, const uint8_t* d, size_t n, int* registered){
+    coap_req_t r;
+    if (coap_parse(d, n, NULL, &r) != 0 || r.code == 0) return;
+    if (r.type == COAP_CON){                        /* confirmar con ACK vacío */
+        uint8_t ack[4] = { (uint8_t)((COAP_VER<<6) | (COAP_ACK<<4)), 0, d[2], d[3] };
+        if (send(T->ofds[i], ack, sizeof(ack), 0) < 0) mx_bump(&T->c[C_SEND_ERR], 1);
+    }
+    if (!registered[i]){
+        registered[i] = 1;
+        mx_bump(&T->c[r.observe >= 0 ? C_OBS_OK : C_OBS_REJ], 1);
+    } else if (r.observe >= 0) mx_bump(&T->c[C_NOTIFY], 1);
+}
+
+static void lg_sweep(lg_thread_t* T, uint64_t now){
+    uint64_t to = (uint64_t)T->cfg->timeout_ms * 1000000u;
+    for (uint32_t i = 0; i < LG_INFLIGHT; i++){
+        lg_flight_t* f = &T->fl[i];
+        if (f->used && now - f->t > to){ f->used = 0; mx_bump(&T->c[C_TIMEOUT], 1); }
+    }
+}
+
+static void lg_drain(lg_thread_t* T, int fd, int obs_i, int* registered){
+    uint8_t buf[LG_BATCH][1500];
+    struct iovec iov[LG_BATCH];
+    struct mmsghdr mm[LG_BATCH];
+    memset(mm, 0, sizeof(mm));
+    for (int i = 0; i < LG_BATCH; i++){
+        iov[i].iov_base = buf[i]; iov[i].iov_len = sizeof(buf[i]);
+        mm[i].msg_hdr.msg_iov = &iov[i]; mm[i].msg_hdr.msg_iovlen = 1;
+    }
+    int got;
+    while ((got = recvmmsg(fd, mm, LG_BATCH, MSG_DONTWAIT, NULL)) > 0){
+        uint64_t now = mx_now_ns();
+        for (int i = 0; i < got; i++){
+            if (obs_i >= 0) lg_notification(T, obs_i, buf[i], mm[i].msg_len, registered);
+            else            lg_response(T, buf[i], mm[i].msg_len, now);
+        }
+        if (got < LG_BATCH) break;
+    }
+}
+
+/* Bucle de un hilo: envía lo que toca según el ritmo (hasta LG_BATCH por
+ * sendmmsg, rotando sockets), recoge respuestas por epoll y, cada 100 ms,
+ * vence las peticiones sin respuesta. */
+static void* lg_main(void* arg){
+    lg_thread_t* T = (lg_thread_t*)arg;
+    const lg_cfg_t* c = T->cfg;
+    uint8_t pkt[LG_BATCH][LG_PKT];
+    struct iovec iov[LG_BATCH];
+    struct mmsghdr mm[LG_BATCH];
+    int registered[LG_MAX_FDS] = { 0 };
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    for (int i = 0; i < T->nfd + T->nobs; i++){
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = (uint32_t)i };
+        epoll_ctl(ep, EPOLL_CTL_ADD, i < T->nfd ? T->fds[i] : T->ofds[i - T->nfd], &ev);
+    }
+    for (int i = 0; i < T->nobs; i++) lg_observe(T, i, 0);
+
+    double ival = 1e9 / (c->rate / c->threads);
+    uint64_t start = mx_now_ns(), end = start + (uint64_t)(c->duration_s * 1e9);
+    uint64_t drain_end = end + (uint64_t)c->timeout_ms * 1000000u, next_sweep = start + 100000000u;
+    double next = (double)start;
+    int cur = 0;
+    for (;;){
+        uint64_t now = mx_now_ns();
+        if (g_stop || now >= drain_end) break;
+        if (now < end){
+            int k = 0;
+            while (k < LG_BATCH && next <= (double)now){
+                iov[k].iov_base = pkt[k];
+                iov[k].iov_len = lg_build(T, cur, pkt[k], now);
+                memset(&mm[k].msg_hdr, 0, sizeof(mm[k].msg_hdr));
+                mm[k].msg_hdr.msg_iov = &iov[k]; mm[k].msg_hdr.msg_iovlen = 1;
+                next += ival; k++;
+            }
+            if (next + 1e9 < (double)now){ mx_bump(&T->c[C_LAG], 1); next = (double)now; }   /* > 1 s atrasado */
+            for (int off = 0; off < k; ){
+                int s = sendmmsg(T->fds[cur], mm + off, (unsigned)(k - off), 0);
+                if (s <= 0){ mx_bump(&T->c[C_SEND_ERR], (unsigned long)(k - off)); break; }
+                off += s;
+            }
+            mx_bump(&T->c[C_SENT], (unsigned long)k);
+            if (k) cur = (cur + 1) % T->nfd;
+        }
+        if (now >= next_sweep){ lg_sweep(T, now); next_sweep = now + 100000000u; }
+        int to = 50;
+        if (now < end) to = next > (double)now ? (int)((next - (double)now) / 1e6) : 0;
+        struct epoll_event evs[64];
+        int ne = epoll_wait(ep, evs, 64, to > 50 ? 50 : to);
+        for (int i = 0; i < ne; i++){
+            int ix = (int)evs[i].data.u32;
+            if (ix < T->nfd) lg_drain(T, T->fds[ix], -1, registered);
+            else             lg_drain(T, T->ofds[ix - T->nfd], ix - T->nfd, registered);
+        }
+    }
+    for (int i = 0; i < T->nobs; i++) lg_observe(T, i, 1);
+    close(ep);
+    return NULL;
+}
+
+static unsigned long lg_sum(const lg_thread_t* ts, unsigned n, int c){
+    unsigned long v = 0;
+    for (unsigned i = 0; i < n; i++) v += atomic_load_explicit(&ts[i].c[c], memory_order_relaxed);
+    return v;
+}
+
+static unsigned long lg_sent(const lg_thread_t* ts, unsigned n, int k){
+    unsigned long v = 0;
+    for (unsigned i = 0; i < n; i++) v += atomic_load_explicit(&ts[i].sent[k], memory_order_relaxed);
+    return v;
+}
+
+static int lg_arg(int argc, char** argv, int* i, const char* name, double* v){
+    if (strcmp(argv[*i], name) != 0 || *i + 1 >= argc) return 0;
+    *v = atof(argv[++*i]);
+    return 1;
+}
+
+int main(int argc, char** argv){
+    lg_cfg_t c = { "127.0.0.1", 5683, 20000, 8, 20000.0, 10.0, 50, 10, 2, 8, 2000 };
+    for (int i = 1; i < argc; i++){
+        double v;
+        if (strcmp(argv[i], "--host") == 0 && i + 1 < argc) c.host = argv[++i];
+        else if (lg_arg(argc, argv, &i, "--port", &v))       c.port = (uint16_t)v;
+        else if (lg_arg(argc, argv, &i, "--sensors", &v))    c.sensors = (uint32_t)v;
+        else if (lg_arg(argc, argv, &i, "--observers", &v))  c.observers = (uint32_t)v;
+        else if (lg_arg(argc, argv, &i, "--rate", &v))       c.rate = v;
+        else if (lg_arg(argc, argv, &i, "--duration", &v))   c.duration_s = v;
+        else if (lg_arg(argc, argv, &i, "--con", &v))        c.con_pct = (unsigned)v;
+        else if (lg_arg(argc, argv, &i, "--get", &v))        c.get_pct = (unsigned)v;
+        else if (lg_arg(argc, argv, &i, "--threads", &v))    c.threads = (unsigned)v;
+        else if (lg_arg(argc, argv, &i, "--sockets", &v))    c.sockets = (unsigned)v;
+        else if (lg_arg(argc, argv, &i, "--timeout-ms", &v)) c.timeout_ms = (unsigned)v;
+        else { fprintf(stderr, "uso: %s [--host H] [--port P] [--sensors N] [--rate R] [--duration S] "
+                               "[--con PCT] [--get PCT] [--observers K] [--threads T] [--sockets S] "
+                               "[--timeout-ms MS]\n", argv[0]); return 2; }
+    }
+    if (c.threads < 1) c.threads = 1;
+    if (c.threads > 64) c.threads = 64;
+    if (c.sockets < 1) c.sockets = 1;
+    if (c.sockets > LG_MAX_FDS) c.sockets = LG_MAX_FDS;
+    if (c.sensors < c.threads) c.sensors = c.threads;
+    if (c.rate <= 0) c.rate = 1;
+    if (c.observers > c.threads * LG_MAX_FDS) c.observers = c.threads * LG_MAX_FDS;
+    signal(SIGINT, on_sig);
+    signal(SIGTERM, on_sig);
+
+    lg_thread_t* ts = (lg_thread_t*)calloc(c.threads, sizeof(lg_thread_t));
+    if (!ts){ perror("calloc"); return 1; }
+    for (unsigned t = 0, ob = 0; t < c.threads; t++){
+        lg_thread_t* T = &ts[t];
+        T->id = (int)t; T->cfg = &c;
+        T->rng = 0x9E3779B9u * (t + 1u);
+        T->fl = (lg_flight_t*)calloc(LG_INFLIGHT, sizeof(lg_flight_t));
+        if (!T->fl){ perror("calloc"); return 1; }
+        for (unsigned s = 0; s < c.sockets; s++){
+            if ((T->fds[T->nfd] = lg_socket(&c)) < 0) return 1;
+            T->mid[T->nfd++] = (uint16_t)lg_rand(T);
+        }
+        unsigned nobs = (c.observers - ob + (c.threads - t) - 1u) / (c.threads - t);
+        T->obs_first = ob;
+        for (unsigned k = 0; k < nobs; k++) if ((T->ofds[T->nobs++] = lg_socket(&c)) < 0) return 1;
+        ob += nobs;
+    }
+    printf("loadgen -> %s:%u  sensores=%u rate=%.0f/s duración=%.0fs CON=%u%% GET=%u%% observadores=%u hilos=%u sockets=%u\n",
+           c.host, c.port, c.sensors, c.rate, c.duration_s, c.con_pct, c.get_pct, c.observers, c.threads, c.sockets);
+    fflush(stdout);
+
+    uint64_t t0 = mx_now_ns();
+    for (unsigned t = 0; t < c.threads; t++) pthread_create(&ts[t].th, NULL, lg_main, &ts[t]);
+    unsigned long last_sent = 0, last_resp = 0;
+    for (unsigned s = 1; !g_stop && s <= (unsigned)c.duration_s; s++){
+        sleep(1);
+        unsigned long sent = lg_sum(ts, c.threads, C_SENT), resp = lg_sum(ts, c.threads, C_RESP);
+        printf("t=%us enviados=%lu/s respuestas=%lu/s timeouts=%lu\n", s, sent - last_sent, resp - last_resp,
+               lg_sum(ts, c.threads, C_TIMEOUT));
+        fflush(stdout);
+        last_sent = sent; last_resp = resp;
+    }
+    for (unsigned t = 0; t < c.threads; t++) pthread_join(ts[t].th, NULL);
+    double el = (double)(mx_now_ns() - t0) / 1e9, send_s = el < c.duration_s ? el : c.duration_s;
+
+    unsigned long sent = lg_sum(ts, c.threads, C_SENT), resp = lg_sum(ts, c.threads, C_RESP);
+    printf("enviados:   %lu (%.0f/s)  CON=%lu NON=%lu GET=%lu  errores de envío=%lu  atrasos=%lu\n",
+           sent, (double)sent / send_s, lg_sent(ts, c.threads, K_CON), lg_sent(ts, c.threads, K_NON),
+           lg_sent(ts, c.threads, K_GET), lg_sum(ts, c.threads, C_SEND_ERR), lg_sum(ts, c.threads, C_LAG));
+    printf("respuestas: %lu (%.0f/s)  2.xx=%lu 4.xx=%lu 5.xx=%lu  timeouts=%lu  sueltas=%lu\n",
+           resp, (double)resp / send_s, lg_sum(ts, c.threads, C_2XX), lg_sum(ts, c.threads, C_4XX),
+           lg_sum(ts, c.threads, C_5XX), lg_sum(ts, c.threads, C_TIMEOUT), lg_sum(ts, c.threads, C_STRAY));
+    for (int k = 0; k < K_KINDS; k++){
+        mx_acc_t a; mx_summary_t s;
+        memset(&a, 0, sizeof(a));
+        for (unsigned t = 0; t < c.threads; t++) mx_acc_add(&a, &ts[t].lat[k]);
+        mx_acc_summary(&a, &s);
+        if (s.n == 0) continue;
+        printf("latencia %-15s n=%-8lu p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n", lg_kind_name[k],
+               s.n, s.p50 / 1e3, s.p99 / 1e3, s.p999 / 1e3, s.max_ns / 1e3);
+    }
+    if (c.observers)
+        printf("observe:    %lu suscritos, %lu rechazados, %lu notificaciones\n",
+               lg_sum(ts, c.threads, C_OBS_OK), lg_sum(ts, c.threads, C_OBS_REJ), lg_sum(ts, c.threads, C_NOTIFY));
+    for (unsigned t = 0; t < c.threads; t++){
+        for (int i = 0; i < ts[t].nfd; i++) close(ts[t].fds[i]);
+        for (int i = 0; i < ts[t].nobs; i++) close(ts[t].ofds[i]);
+        free(ts[t].fl);
+    }
+    free(ts);
+    return 0;
+}
@@ -0,0 +1,178 @@
+// metrics.h — Contadores e histogramas de latencia por hilo
+// Cada hilo (worker o escritor) tiene su mx_t, alineado a línea de caché, y es
+// el único que lo escribe: los incrementos son load + store relajados (sin
+// lock en el bus) y quien lee (GET /metrics, Prometheus, estadísticas) suma
+// los de todos los hilos con loads relajados; puede ver un valor a medias de
+// actualizar, nunca uno roto.
+// Histogramas estilo HDR en ns: 2^MX_SUB_BITS sub-buckets lineales por
+// potencia de 2 (error relativo < 1/16), de 1 ns a ~18 min; lo que excede va
+// al último bucket. Los percentiles se calculan al leer, sobre la suma de los
+// buckets de todos los hilos.
+#pragma once
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define MX_SUB_BITS  4
+#define MX_SUB       (1u << MX_SUB_BITS)
+#define MX_MAX_EXP   40                                   /* 2^40 ns ≈ 18 min */
+#define MX_BUCKETS   ((MX_MAX_EXP - MX_SUB_BITS + 2) * MX_SUB)
+
+enum {
+    M_RX, M_TX, M_BATCHES, M_PARSE_ERR, M_4XX, M_5XX, M_DUPS, M_NOTIFY,
+    M_BYTES_IN, M_BYTES_OUT, M_BYTES_WR, M_RECS, M_OSCORE, M_OSC_REJ,
+    M_RATE_LIM, M_SHED, M_FWD, M_FWD_DROP, M_PROXY, M_HANDOFF, M_TEXT_DROP, M_REC_DROP, M_COUNTERS
+};
+static const char* const mx_counter_name[M_COUNTERS] = {
+    "rx", "tx", "batches", "parse_errors", "resp_4xx", "resp_5xx", "dups", "notifies",
+    "bytes_in", "bytes_out", "bytes_written", "records", "oscore", "oscore_rejects",
+    "rate_limited", "shed", "forwarded", "forward_drops", "proxied", "handoff_records",
+    "text_drops", "record_drops"
+};
+
+enum { H_PARSE, H_HANDLE, H_APPEND, H_SEND, H_COUNT };
+static const char* const mx_hist_name[H_COUNT] = { "parse", "handle", "append", "send" };
+
+typedef struct {
+    atomic_ulong n, sum_ns, max_ns;
+    atomic_ulong b[MX_BUCKETS];
+} mx_hist_t;
+
+typedef struct {
+    _Alignas(64) atomic_ulong c[M_COUNTERS];
+    mx_hist_t h[H_COUNT];
+} mx_t;
+
+static inline uint64_t mx_now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Sólo el hilo dueño escribe: sin read-modify-write atómico */
+static inline void mx_bump(atomic_ulong* a, unsigned long v){
+    atomic_store_explicit(a, atomic_load_explicit(a, memory_order_relaxed) + v, memory_order_relaxed);
+}
+
+static inline void mx_add(mx_t* m, int c, unsigned long v){ mx_bump(&m->c[c], v); }
+static inline void mx_set(mx_t* m, int c, unsigned long v){ atomic_store_explicit(&m->c[c], v, memory_order_relaxed); }
+static inline unsigned long mx_get(const mx_t* m, int c){ return atomic_load_explicit(&m->c[c], memory_order_relaxed); }
+
+static inline unsigned mx_bucket(uint64_t v){
+    if (v < MX_SUB) return (unsigned)v;
+    unsigned e = 63u - (unsigned)__builtin_clzll(v);
+    if (e > MX_MAX_EXP) return MX_BUCKETS - 1u;
+    return (e - MX_SUB_BITS + 1u) * MX_SUB + (unsigned)((v >> (e - MX_SUB_BITS)) & (MX_SUB - 1u));
+}
+
+/* Punto medio del bucket i (en ns) */
+static inline uint64_t mx_bucket_mid(unsigned i){
+    if (i < MX_SUB) return i;
+    unsigned e = i / MX_SUB + MX_SUB_BITS - 1u, s = i % MX_SUB;
+    uint64_t lo = ((uint64_t)(MX_SUB + s)) << (e - MX_SUB_BITS);
+    return lo + (((uint64_t)1 << (e - MX_SUB_BITS)) >> 1);
+}
+
+static inline void mx_hist_rec(mx_hist_t* x, uint64_t ns){
+    mx_bump(&x->b[mx_bucket(ns)], 1);
+    mx_bump(&x->n, 1);
+    mx_bump(&x->sum_ns, ns);
+    if (ns > atomic_load_explicit(&x->max_ns, memory_order_relaxed))
+        atomic_store_explicit(&x->max_ns, ns, memory_order_relaxed);
+}
+
+static inline void mx_rec(mx_t* m, int h, uint64_t ns){ mx_hist_rec(&m->h[h], ns); }
+
+/* Suma de histogramas de varios hilos y su resumen */
+typedef struct { unsigned long b[MX_BUCKETS], sum_ns, max_ns; } mx_acc_t;
+typedef struct { unsigned long n, sum_ns, max_ns; uint64_t p50, p90, p99, p999; } mx_summary_t;
+
+static inline void mx_acc_add(mx_acc_t* a, const mx_hist_t* x){
+    for (unsigned i = 0; i < MX_BUCKETS; i++) a->b[i] += atomic_load_explicit(&x->b[i], memory_order_relaxed);
+    a->sum_ns += atomic_load_explicit(&x->sum_ns, memory_order_relaxed);
+    unsigned long mx = atomic_load_explicit(&x->max_ns, memory_order_relaxed);
+    if (mx > a->max_ns) a->max_ns = mx;
+}
+
+static inline void mx_acc_summary(const mx_acc_t* a, mx_summary_t* out){
+    static const double q[4] = { 0.50, 0.90, 0.99, 0.999 };
+    uint64_t* dst[4] = { &out->p50, &out->p90, &out->p99, &out->p999 };
+    memset(out, 0, sizeof(*out));
+    out->sum_ns = a->sum_ns; out->max_ns = a->max_ns;
+    for (unsigned i = 0; i < MX_BUCKETS; i++) out->n += a->b[i];
+    unsigned long acc = 0; int j = 0;
+    for (unsigned i = 0; i < MX_BUCKETS && j < 4; i++){
+        acc += a->b[i];
+        while (j < 4 && a->b[i] && (double)acc >= q[j] * (double)out->n){
+            uint64_t v = mx_bucket_mid(i);
+            *dst[j++] = v > out->max_ns ? out->max_ns : v;
+        }
+    }
+}
+
+/* Resumen del histograma h sumado sobre nm hilos */
+static inline void mx_summarize(const mx_t* const* ms, int nm, int h, mx_summary_t* out){
+    mx_acc_t a;
+    memset(&a, 0, sizeof(a));
+    for (int k = 0; k < nm; k++) mx_acc_add(&a, &ms[k]->h[h]);
+    mx_acc_summary(&a, out);
+}
+
+static inline unsigned long mx_total(const mx_t* const* ms, int nm, int c){
+    unsigned long t = 0;
+    for (int k = 0; k < nm; k++) t += mx_get(ms[k], c);
+    return t;
+}
+
+/* Añade con snprintf al final de out; devuelve la nueva longitud (cap-1 si no cupo) */
+#define MX_PUT(out, cap, len, ...) do { \
+        int w_ = snprintf((out) + (len), (cap) - (len), __VA_ARGS__); \
+        (len) = (w_ < 0 || (size_t)w_ >= (cap) - (len)) ? (cap) - 1u : (len) + (size_t)w_; \
+    } while (0)
+
+/* JSON con totales y latencias en µs; devuelve el largo o cap si no cupo */
+static inline size_t mx_json(const mx_t* const* ms, int nm, double uptime_s, char* out, size_t cap){
+    size_t len = 0;
+    if (cap < 2u) return cap;
+    MX_PUT(out, cap, len, "{\"uptime_s\":%.0f,\"threads\":%d", uptime_s, nm);
+    for (int c = 0; c < M_COUNTERS; c++)
+        MX_PUT(out, cap, len, ",\"%s\":%lu", mx_counter_name[c], mx_total(ms, nm, c));
+    MX_PUT(out, cap, len, ",\"lat_us\":{");
+    for (int h = 0; h < H_COUNT; h++){
+        mx_summary_t s;
+        mx_summarize(ms, nm, h, &s);
+        MX_PUT(out, cap, len, "%s\"%s\":{\"n\":%lu,\"avg\":%.2f,\"p50\":%.2f,\"p90\":%.2f,\"p99\":%.2f,\"p999\":%.2f,\"max\":%.2f}",
+               h ? "," : "", mx_hist_name[h], s.n, s.n ? (double)s.sum_ns / (double)s.n / 1e3 : 0.0,
+               s.p50 / 1e3, s.p90 / 1e3, s.p99 / 1e3, s.p999 / 1e3, s.max_ns / 1e3);
+    }
+    MX_PUT(out, cap, len, "}}");
+    return len >= cap - 1u ? cap : len;
+}
+
+/* Formato de exposición de Prometheus (text 0.0.4): contadores por hilo con
+ * etiqueta thread y latencias como summary sobre todos los hilos */
+static inline size_t mx_prom(const mx_t* const* ms, const char* const* names, int nm, double uptime_s,
+                             char* out, size_t cap){
+    size_t len = 0;
+    if (cap < 2u) return cap;
+    MX_PUT(out, cap, len, "# TYPE coap_uptime_seconds gauge\ncoap_uptime_seconds %.0f\n", uptime_s);
+    for (int c = 0; c < M_COUNTERS; c++){
+        MX_PUT(out, cap, len, "# TYPE coap_%s_total counter\n", mx_counter_name[c]);
+        for (int k = 0; k < nm; k++)
+            MX_PUT(out, cap, len, "coap_%s_total{thread=\"%s\"} %lu\n", mx_counter_name[c], names[k], mx_get(ms[k], c));
+    }
+    MX_PUT(out, cap, len, "# TYPE coap_latency_seconds summary\n");
+    for (int h = 0; h < H_COUNT; h++){
+        mx_summary_t s;
+        mx_summarize(ms, nm, h, &s);
+        const uint64_t qv[4] = { s.p50, s.p90, s.p99, s.p999 };
+        static const char* const qn[4] = { "0.5", "0.9", "0.99", "0.999" };
+        for (int j = 0; j < 4; j++)
+            MX_PUT(out, cap, len, "coap_latency_seconds{stage=\"%s\",quantile=\"%s\"} %.9f\n", mx_hist_name[h], qn[j], qv[j] / 1e9);
+        MX_PUT(out, cap, len, "coap_latency_seconds_sum{stage=\"%s\"} %.9f\ncoap_latency_seconds_count{stage=\"%s\"} %lu\n",
+               mx_hist_name[h], s.sum_ns / 1e9, mx_hist_name[h], s.n);
+    }
+    return len >= cap - 1u ? cap : len;
+}
@@ -0,0 +1,185 @@
+// observe.h — Observe (RFC 7641): suscriptores y notificaciones
+// Un GET con Observe=0 sobre un recurso observable registra (endpoint, token,
+// clave del recurso) y Observe=1 lo da de baja. Cada POST/PUT que cambia la
+// clave genera una notificación por suscriptor con el número de secuencia en
+// la opción Observe. Tabla global preasignada y compartida por los workers
+// (con SO_REUSEPORT todos los sockets tienen el mismo puerto, así que cualquier
+// worker puede notificar); sus slots salen de una arena (pool.h) al arrancar. Las CON sin ACK se cuentan y tras OBS_MAX_FAILS
+// seguidas el suscriptor se da de baja; un RST lo da de baja al momento, tanto
+// a una CON como a la última NON (RFC 7641 §3.6: así cancela también un proxy).
+// Cada worker reenvía sus CON con backoff (timer) mientras obs_pending() diga
+// que siguen sin ACK; agotados los reenvíos el suscriptor se da de baja.
+// Los suscriptores y la secuencia pasan por la instantánea (snapshot.h): tras
+// reiniciar cada cliente sigue recibiendo notificaciones con números que no
+// retroceden (§3.4), sin volver a registrarse.
+#pragma once
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pool.h"
+#include "snapshot.h"
+
+#define OBS_SLOTS      64            /* default; COAP_OBS_SLOTS */
+#define OBS_KEY_MAX    64
+#define OBS_MAX_FAILS  3
+#define OBS_SEQ_MASK   0xFFFFFFu     /* la opción Observe lleva 24 bits */
+#define OBS_ACK_TIMEOUT_MS  2000u    /* reenvío de CON: RFC 7252 §4.8 */
+#define OBS_MAX_RETRANSMIT  4u
+
+typedef struct {
+    uint32_t addr; uint16_t port;    /* port = 0: slot libre */
+    uint8_t  tkl, token[8];
+    char     key[OBS_KEY_MAX];
+    uint16_t pending_mid;            /* MID de la última CON sin ACK */
+    uint16_t last_mid;               /* MID de la última notificación (CON o NON) */
+    uint8_t  pending, fails;
+    uint32_t sent;
+} obs_entry_t;
+
+typedef struct {
+    pthread_mutex_t mu;
+    obs_entry_t* e;
+    uint32_t    n;
+    uint32_t    seq;
+    uint16_t    next_mid;
+    unsigned    con_every;           /* 0 = siempre NON, N = una de cada N en CON */
+} obs_table_t;
+
+/* Cabecera de la tabla en la instantánea (los suscriptores van aparte, en crudo) */
+typedef struct { uint32_t seq; uint16_t next_mid, reserved; } obs_snap_t;
+
+#define SN_OBS_HDR  SN_TAG('O','B','S','H')
+#define SN_OBS      SN_TAG('O','B','S','E')
+
+/* Destino de una notificación, copiado fuera del lock */
+typedef struct {
+    struct sockaddr_in to;
+    uint8_t  tkl, token[8], con;
+    uint16_t mid;
+} obs_target_t;
+
+static inline size_t obs_need(uint32_t nslots){ return arena_need((size_t)nslots * sizeof(obs_entry_t)); }
+
+static inline int obs_init(obs_table_t* t, arena_t* a, uint32_t nslots, unsigned con_every, uint16_t mid_seed){
+    memset(t, 0, sizeof(*t));
+    pthread_mutex_init(&t->mu, NULL);
+    t->e = (obs_entry_t*)arena_alloc(a, (size_t)nslots * sizeof(obs_entry_t));
+    t->n = t->e ? nslots : 0;
+    t->con_every = con_every;
+    t->next_mid = mid_seed;
+    return t->e ? 0 : -1;
+}
+
+static inline int obs_same(const obs_entry_t* e, const struct sockaddr_in* cli){
+    return e->port == cli->sin_port && e->addr == cli->sin_addr.s_addr;
+}
+
+/* Registra (o renueva: mismo endpoint y recurso) un suscriptor; devuelve 0 y la
+ * secuencia actual, o -1 si la tabla está llena (se responde como GET normal) */
+static inline int obs_add(obs_table_t* t, const struct sockaddr_in* cli, const uint8_t* tok,
+                          uint8_t tkl, const char* key, uint32_t* seq){
+    obs_entry_t* v = NULL;
+    pthread_mutex_lock(&t->mu);
+    for (uint32_t i = 0; i < t->n; i++){
+        obs_entry_t* e = &t->e[i];
+        if (e->port && obs_same(e, cli) && strcmp(e->key, key) == 0){ v = e; break; }
+        if (!v && e->port == 0) v = e;
+    }
+    if (v){
+        memset(v, 0, sizeof(*v));
+        v->addr = cli->sin_addr.s_addr; v->port = cli->sin_port;
+        v->tkl = tkl > 8 ? 8 : tkl;
+        memcpy(v->token, tok, v->tkl);
+        snprintf(v->key, sizeof(v->key), "%s", key);
+    }
+    *seq = t->seq;
+    pthread_mutex_unlock(&t->mu);
+    return v ? 0 : -1;
+}
+
+static inline void obs_remove(obs_table_t* t, const struct sockaddr_in* cli, const char* key){
+    pthread_mutex_lock(&t->mu);
+    for (uint32_t i = 0; i < t->n; i++){
+        obs_entry_t* e = &t->e[i];
+        if (e->port && obs_same(e, cli) && strcmp(e->key, key) == 0) e->port = 0;
+    }
+    pthread_mutex_unlock(&t->mu);
+}
+
+/* ACK o RST vacío de un endpoint: confirma la CON pendiente o da de baja
+ * (el RST vale también contra la última NON) */
+static inline void obs_ack(obs_table_t* t, const struct sockaddr_in* cli, uint16_t mid, int rst){
+    pthread_mutex_lock(&t->mu);
+    for (uint32_t i = 0; i < t->n; i++){
+        obs_entry_t* e = &t->e[i];
+        if (!e->port || !obs_same(e, cli)) continue;
+        if (rst && e->sent && e->last_mid == mid){ e->port = 0; continue; }
+        if (!e->pending || e->pending_mid != mid) continue;
+        if (rst) e->port = 0;
+        else { e->pending = 0; e->fails = 0; }
+    }
+    pthread_mutex_unlock(&t->mu);
+}
+
+/* ¿Sigue sin ACK la CON mid enviada a cli? (el ACK puede entrar por otro worker) */
+static inline int obs_pending(obs_table_t* t, const struct sockaddr_in* cli, uint16_t mid){
+    int p = 0;
+    pthread_mutex_lock(&t->mu);
+    for (uint32_t i = 0; i < t->n && !p; i++){
+        const obs_entry_t* e = &t->e[i];
+        p = e->port && obs_same(e, cli) && e->pending && e->pending_mid == mid;
+    }
+    pthread_mutex_unlock(&t->mu);
+    return p;
+}
+
+/* Avanza la secuencia y copia en out los suscriptores de key (hasta max).
+ * Decide NON/CON por suscriptor y le asigna MID; devuelve cuántos. */
+static inline int obs_targets(obs_table_t* t, const char* key, obs_target_t* out, int max, uint32_t* seq){
+    int n = 0;
+    pthread_mutex_lock(&t->mu);
+    t->seq = (t->seq + 1u) & OBS_SEQ_MASK;
+    *seq = t->seq;
+    for (uint32_t i = 0; i < t->n && n < max; i++){
+        obs_entry_t* e = &t->e[i];
+        if (!e->port || strcmp(e->key, key) != 0) continue;
+        if (e->pending && ++e->fails >= OBS_MAX_FAILS){ e->port = 0; continue; }
+        obs_target_t* o = &out[n++];
+        memset(&o->to, 0, sizeof(o->to));
+        o->to.sin_family = AF_INET;
+        o->to.sin_addr.s_addr = e->addr; o->to.sin_port = e->port;
+        o->tkl = e->tkl; memcpy(o->token, e->token, e->tkl);
+        o->mid = e->last_mid = t->next_mid++;
+        o->con = t->con_every && (e->sent % t->con_every) == 0;
+        if (o->con){ e->pending = 1; e->pending_mid = o->mid; }
+        e->sent++;
+    }
+    pthread_mutex_unlock(&t->mu);
+    return n;
+}
+
+static inline void obs_snap_save(obs_table_t* t, sn_buf_t* b){
+    pthread_mutex_lock(&t->mu);
+    sn_section(b, SN_OBS_HDR, sizeof(obs_snap_t));
+    obs_snap_t* h = (obs_snap_t*)sn_item(b);
+    if (h){ h->seq = t->seq; h->next_mid = t->next_mid; }
+    sn_section(b, SN_OBS, sizeof(obs_entry_t));
+    for (uint32_t i = 0; i < t->n; i++){
+        obs_entry_t* e = t->e[i].port ? (obs_entry_t*)sn_item(b) : NULL;
+        if (e) *e = t->e[i];
+    }
+    pthread_mutex_unlock(&t->mu);
+}
+
+/* Al arrancar, antes de los workers. Las CON en reenvío eran del proceso
+ * anterior: se olvidan (la próxima notificación vuelve a pedir ACK). */
+static inline void obs_snap_load(obs_table_t* t, const obs_snap_t* h, const obs_entry_t* e, uint64_t n){
+    if (h){ t->seq = h->seq; t->next_mid = h->next_mid; }
+    for (uint64_t i = 0; e && i < n && i < t->n; i++){
+        t->e[i] = e[i];
+        t->e[i].pending = 0;
+    }
+}
@@ -0,0 +1,420 @@
+// oscore.h — OSCORE (RFC 8613) con clave precompartida por dispositivo
+// Seguridad extremo a extremo sobre el mismo UDP, sin handshake: cada petición
+// lleva la opción OSCORE (kid = Sender ID del dispositivo y Partial IV = su
+// número de secuencia) y el cuerpo cifrado con AES-CCM-16-64-128 (alg 10). Un
+// sensor que despierta del deep sleep sólo necesita su contexto (derivable de
+// la clave) y su número de secuencia: el primer datagrama ya va protegido.
+// El servidor carga los contextos al arrancar (osc_load) desde un archivo con
+// una línea por dispositivo:   <kid hex> <master secret hex> [<master salt hex>]
+// ('-' = vacío, '#' comenta). Las claves se derivan con HKDF-SHA256 (§3.2) y
+// quedan de sólo lectura; lo único que cambia por petición es la ventana
+// anti-replay de cada contexto, bajo su propio spinlock: los workers cifran y
+// descifran en paralelo (cada uno con su EVP_CIPHER_CTX) sin lock global.
+// Tras arrancar, la ventana de cada contexto es desconocida: la primera
+// petición recibe un 4.01 protegido con Echo (RFC 9175) y vale la que lo
+// repite (Apéndice B.1.2), así un mensaje grabado antes no se acepta nunca.
+// Sólo una instantánea de salida limpia (snapshot.h) trae las ventanas: eran
+// las finales, así que tras un reinicio planificado no hace falta el Echo.
+// La respuesta a una petición verificada como nueva reutiliza su nonce; si no
+// (el 4.01 con Echo, que puede contestar a una petición grabada y ya respondida
+// en otro arranque) lleva su propio Partial IV (§8.3, Apéndice B.1.2): un
+// número de secuencia del servidor, común a todos los contextos, cuya cota se
+// guarda en disco cada OSC_SSN_STEP usos antes de pasarla (como el SSN_STEP
+// de los sketches), así que nunca se repite aunque el proceso muera.
+// Limitaciones: las opciones externas (clase U) se descartan y no hay Observe
+// sobre OSCORE (la petición se atiende como GET simple).
+// Enlazar con -lcrypto (OpenSSL 3).
+#pragma once
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "coap_msg.h"
+#include "snapshot.h"
+
+#define OSC_ALG        10        /* AES-CCM-16-64-128 */
+#define OSC_KEY_LEN    16
+#define OSC_NONCE_LEN  13
+#define OSC_TAG_LEN    8
+#define OSC_ID_MAX     (OSC_NONCE_LEN - 6)
+#define OSC_PIV_MAX    5
+#define OSC_SECRET_MAX 64
+#define OSC_ECHO_LEN   8
+#define OSC_WINDOW     32        /* ventana anti-replay (bits) */
+#define OSC_SSN_STEP   64u       /* números de secuencia propios por escritura de la cota */
+#define OSC_SSN_MAX    ((1ull << 40) - 1u)   /* cabe en un Partial IV de 5 bytes */
+
+/* Resultado de osc_unprotect: 0 o el código de error a devolver sin proteger (§8.2) */
+#define OSC_OK         0
+#define OSC_ECHO       1         /* descifrada, pero hay que confirmar frescura con Echo */
+
+typedef struct {
+    uint8_t  rid[OSC_ID_MAX], rid_len;         /* Recipient ID = kid del dispositivo */
+    uint8_t  rkey[OSC_KEY_LEN], skey[OSC_KEY_LEN], civ[OSC_NONCE_LEN];
+    uint8_t  echo[OSC_ECHO_LEN];               /* reto de este arranque */
+    atomic_flag lock;                          /* protege lo de abajo */
+    uint8_t  win_ok;                           /* 0 = ventana desconocida (pedir Echo) */
+    uint32_t win_bits;                         /* bit d: se vio win_top - d */
+    uint64_t win_top;
+} osc_ctx_t;
+
+typedef struct {
+    osc_ctx_t* c;
+    uint32_t   n, mask;
+    uint32_t*  slot;                           /* hash de kid -> índice + 1 */
+    uint8_t    sid[OSC_ID_MAX], sid_len;       /* Sender ID del servidor (común) */
+    EVP_CIPHER* aead;                          /* obtenido una vez, compartido */
+    atomic_ullong ssn;                         /* próximo Partial IV propio */
+    atomic_ullong ssn_saved;                   /* cota guardada: ssn < ssn_saved sin tocar disco */
+    int        ssn_fd;                         /* archivo de la cota (osc_ssn_open) */
+    pthread_mutex_t ssn_mu;                    /* serializa la escritura de la cota */
+} osc_table_t;
+
+/* Ventana anti-replay de un contexto en la instantánea */
+typedef struct {
+    uint8_t  rid[OSC_ID_MAX], rid_len;
+    uint32_t win_bits;
+    uint64_t win_top;
+} osc_snap_t;
+
+#define SN_OSCORE  SN_TAG('O','S','C','W')
+
+/* Lo que necesita la respuesta de la petición que la originó */
+typedef struct {
+    const osc_ctx_t* c;
+    uint8_t piv[OSC_PIV_MAX], piv_len;
+    uint8_t nonce[OSC_NONCE_LEN];
+    uint8_t fresh;                             /* verificada nueva: la respuesta puede usar su nonce */
+} osc_req_t;
+
+/* --- primitivas --- */
+static inline int osc_hex(const char* s, uint8_t* out, size_t cap){
+    if (strcmp(s, "-") == 0) return 0;
+    size_t n = strlen(s);
+    if (n % 2u || n / 2u > cap) return -1;
+    for (size_t i = 0; i < n / 2u; i++){
+        unsigned v;
+        if (sscanf(s + 2u * i, "%2x", &v) != 1) return -1;
+        out[i] = (uint8_t)v;
+    }
+    return (int)(n / 2u);
+}
+
+/* HKDF-SHA256 (RFC 5869) con info = [id, nil, alg, "Key"/"IV", L] (§3.2.1);
+ * L <= 32 cabe en un solo bloque de expansión */
+static inline int osc_hkdf(const uint8_t* salt, size_t salt_len, const uint8_t* secret, size_t secret_len,
+                           const uint8_t* id, size_t id_len, int iv, uint8_t* out, size_t L){
+    static const uint8_t zero[32];
+    uint8_t prk[32], t[32], info[32];
+    unsigned pl = 0, tl = 0;
+    size_t k = 0;
+    if (!HMAC(EVP_sha256(), salt_len ? salt : zero, salt_len ? (int)salt_len : 32, secret, secret_len, prk, &pl)) return -1;
+    info[k++] = 0x85;
+    info[k++] = (uint8_t)(0x40 | id_len);
+    if (id_len){ memcpy(info + k, id, id_len); k += id_len; }
+    info[k++] = 0xF6;
+    info[k++] = OSC_ALG;
+    if (iv){ info[k++] = 0x62; info[k++] = 'I'; info[k++] = 'V'; }
+    else   { info[k++] = 0x63; info[k++] = 'K'; info[k++] = 'e'; info[k++] = 'y'; }
+    info[k++] = (uint8_t)L;
+    info[k++] = 0x01;
+    if (!HMAC(EVP_sha256(), prk, pl, info, k, t, &tl)) return -1;
+    memcpy(out, t, L);
+    return 0;
+}
+
+/* Nonce (§5.2): largo del ID | ID con ceros a la izquierda | PIV igual, XOR Common IV */
+static inline void osc_nonce(const uint8_t* civ, const uint8_t* id, size_t id_len,
+                             const uint8_t* piv, size_t piv_len, uint8_t* nonce){
+    memset(nonce, 0, OSC_NONCE_LEN);
+    nonce[0] = (uint8_t)id_len;
+    memcpy(nonce + 1 + OSC_ID_MAX - id_len, id, id_len);
+    memcpy(nonce + OSC_NONCE_LEN - piv_len, piv, piv_len);
+    for (int i = 0; i < OSC_NONCE_LEN; i++) nonce[i] ^= civ[i];
+}
+
+/* AAD = Enc_structure ["Encrypt0", h'', [1, [alg], kid, piv, h'']] (§5.4) */
+static inline size_t osc_aad(uint8_t* out, const uint8_t* kid, size_t kid_len, const uint8_t* piv, size_t piv_len){
+    uint8_t ea[5 + OSC_ID_MAX + 1 + OSC_PIV_MAX + 1];
+    size_t e = 0, a = 0;
+    ea[e++] = 0x85; ea[e++] = 0x01; ea[e++] = 0x81; ea[e++] = OSC_ALG;
+    ea[e++] = (uint8_t)(0x40 | kid_len); memcpy(ea + e, kid, kid_len); e += kid_len;
+    ea[e++] = (uint8_t)(0x40 | piv_len); memcpy(ea + e, piv, piv_len); e += piv_len;
+    ea[e++] = 0x40;
+    out[a++] = 0x83;
+    out[a++] = 0x68; memcpy(out + a, "Encrypt0", 8); a += 8;
+    out[a++] = 0x40;
+    out[a++] = (uint8_t)(0x40 | e); memcpy(out + a, ea, e);
+    return a + e;
+}
+
+/* AES-CCM: enc = 1 deja n bytes cifrados + tag en out; enc = 0 descifra n
+ * bytes (el tag va detrás de in) y devuelve -1 si no verifica */
+static inline int osc_aead(EVP_CIPHER_CTX* cx, const EVP_CIPHER* alg, int enc, const uint8_t* key, const uint8_t* nonce,
+                           const uint8_t* aad, size_t aad_len, const uint8_t* in, size_t n, uint8_t* out){
+    int l;
+    if (EVP_CipherInit_ex(cx, alg, NULL, NULL, NULL, enc) != 1 ||
+        EVP_CIPHER_CTX_ctrl(cx, EVP_CTRL_AEAD_SET_IVLEN, OSC_NONCE_LEN, NULL) != 1 ||
+        EVP_CIPHER_CTX_ctrl(cx, EVP_CTRL_AEAD_SET_TAG, OSC_TAG_LEN, enc ? NULL : (void*)(in + n)) != 1 ||
+        EVP_CipherInit_ex(cx, NULL, NULL, key, nonce, enc) != 1 ||
+        EVP_CipherUpdate(cx, NULL, &l, NULL, (int)n) != 1 ||
+        EVP_CipherUpdate(cx, NULL, &l, aad, (int)aad_len) != 1 ||
+        EVP_CipherUpdate(cx, out, &l, in, (int)n) != 1) return -1;
+    if (!enc) return 0;
+    if (EVP_CipherFinal_ex(cx, out + l, &l) != 1 ||
+        EVP_CIPHER_CTX_ctrl(cx, EVP_CTRL_AEAD_GET_TAG, OSC_TAG_LEN, out + n) != 1) return -1;
+    return 0;
+}
+
+/* --- contextos --- */
+static inline int osc_derive(osc_ctx_t* c, const uint8_t* sid, size_t sid_len, const uint8_t* secret, size_t secret_len,
+                             const uint8_t* salt, size_t salt_len){
+    if (osc_hkdf(salt, salt_len, secret, secret_len, sid, sid_len, 0, c->skey, OSC_KEY_LEN) != 0 ||
+        osc_hkdf(salt, salt_len, secret, secret_len, c->rid, c->rid_len, 0, c->rkey, OSC_KEY_LEN) != 0 ||
+        osc_hkdf(salt, salt_len, secret, secret_len, NULL, 0, 1, c->civ, OSC_NONCE_LEN) != 0) return -1;
+    return RAND_bytes(c->echo, OSC_ECHO_LEN) == 1 ? 0 : -1;
+}
+
+static inline osc_ctx_t* osc_find(const osc_table_t* t, const uint8_t* kid, size_t kid_len){
+    if (!t->n) return NULL;
+    for (uint32_t h = fnv1a(2166136261u, kid, kid_len) & t->mask; t->slot[h]; h = (h + 1u) & t->mask){
+        osc_ctx_t* c = &t->c[t->slot[h] - 1u];
+        if (c->rid_len == kid_len && memcmp(c->rid, kid, kid_len) == 0) return c;
+    }
+    return NULL;
+}
+
+static inline void osc_free(osc_table_t* t){
+    free(t->c); free(t->slot);
+    if (t->aead) EVP_CIPHER_free(t->aead);
+    if (t->ssn_fd >= 0) close(t->ssn_fd);
+    memset(t, 0, sizeof(*t));
+    t->ssn_fd = -1;
+}
+
+/* Carga los contextos de path con sid como Sender ID del servidor; devuelve
+ * cuántos o -1 (la línea con error se informa por stderr) */
+static inline int osc_load(osc_table_t* t, const char* path, const uint8_t* sid, size_t sid_len){
+    memset(t, 0, sizeof(*t));
+    t->ssn_fd = -1;
+    FILE* f = fopen(path, "r");
+    if (!f){ perror(path); return -1; }
+    char line[512];
+    uint32_t cap = 0, ln = 0;
+    while (fgets(line, sizeof(line), f)) cap++;
+    rewind(f);
+    uint32_t size = 2;
+    while (size < 2u * cap) size <<= 1;
+    t->c = (osc_ctx_t*)calloc(cap ? cap : 1u, sizeof(osc_ctx_t));
+    t->slot = (uint32_t*)calloc(size, sizeof(uint32_t));
+    t->mask = size - 1u;
+    memcpy(t->sid, sid, sid_len); t->sid_len = (uint8_t)sid_len;
+    t->aead = EVP_CIPHER_fetch(NULL, "AES-128-CCM", NULL);
+    if (!t->c || !t->slot || !t->aead){ fclose(f); osc_free(t); return -1; }
+    while (fgets(line, sizeof(line), f)){
+        char kid[64], sec[192], salt[64] = "-";
+        uint8_t secret[OSC_SECRET_MAX], sl[32];
+        ln++;
+        if (line[0] == '#' || sscanf(line, "%63s %191s %63s", kid, sec, salt) < 2) continue;
+        osc_ctx_t* c = &t->c[t->n];
+        int kl = osc_hex(kid, c->rid, OSC_ID_MAX), xl = osc_hex(sec, secret, sizeof(secret)), al = osc_hex(salt, sl, sizeof(sl));
+        if (kl < 0 || xl <= 0 || al < 0 || osc_find(t, c->rid, (size_t)kl)){
+            fprintf(stderr, "%s:%u: contexto inválido o repetido\n", path, ln);
+            fclose(f); osc_free(t); return -1;
+        }
+        c->rid_len = (uint8_t)kl;
+        if (osc_derive(c, sid, sid_len, secret, (size_t)xl, sl, (size_t)al) != 0){ fclose(f); osc_free(t); return -1; }
+        atomic_flag_clear(&c->lock);
+        uint32_t h = fnv1a(2166136261u, c->rid, c->rid_len) & t->mask;
+        while (t->slot[h]) h = (h + 1u) & t->mask;
+        t->slot[h] = ++t->n;
+    }
+    fclose(f);
+    return (int)t->n;
+}
+
+/* Abre (o crea) el archivo con la cota del número de secuencia propio y sigue
+ * desde ella: lo que el proceso anterior llegó a usar queda siempre debajo */
+static inline int osc_ssn_open(osc_table_t* t, const char* path){
+    uint64_t hi = 0;
+    t->ssn_fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+    if (t->ssn_fd < 0) return -1;
+    ssize_t r = pread(t->ssn_fd, &hi, sizeof(hi), 0);
+    if (r != 0 && r != (ssize_t)sizeof(hi)) return -1;
+    if (r == 0) hi = 0;
+    atomic_init(&t->ssn, hi);
+    atomic_init(&t->ssn_saved, hi);
+    return pthread_mutex_init(&t->ssn_mu, NULL) == 0 ? 0 : -1;
+}
+
+/* Próximo número de secuencia propio; antes de pasar la cota guardada escribe
+ * la siguiente (fdatasync). -1 si se agotó o no se pudo guardar: no se responde */
+static inline int osc_ssn_next(osc_table_t* t, uint64_t* out){
+    uint64_t s = atomic_fetch_add_explicit(&t->ssn, 1u, memory_order_relaxed);
+    if (s > OSC_SSN_MAX || t->ssn_fd < 0) return -1;
+    if (s >= atomic_load_explicit(&t->ssn_saved, memory_order_acquire)){
+        int ok = 1;
+        pthread_mutex_lock(&t->ssn_mu);
+        uint64_t hi = atomic_load_explicit(&t->ssn_saved, memory_order_relaxed);
+        if (s >= hi){
+            hi = s + OSC_SSN_STEP;
+            ok = pwrite(t->ssn_fd, &hi, sizeof(hi), 0) == (ssize_t)sizeof(hi) && fdatasync(t->ssn_fd) == 0;
+            if (ok) atomic_store_explicit(&t->ssn_saved, hi, memory_order_release);
+        }
+        pthread_mutex_unlock(&t->ssn_mu);
+        if (!ok) return -1;
+    }
+    *out = s;
+    return 0;
+}
+
+/* Ventana deslizante (§7.4); se llama con el lock tomado */
+static inline int osc_replay_ok(osc_ctx_t* c, uint64_t piv){
+    if (piv > c->win_top){
+        uint64_t s = piv - c->win_top;
+        c->win_bits = (s >= OSC_WINDOW ? 0u : c->win_bits << s) | 1u;
+        c->win_top = piv;
+        return 1;
+    }
+    uint64_t d = c->win_top - piv;
+    if (d >= OSC_WINDOW || (c->win_bits >> d) & 1u) return 0;
+    c->win_bits |= 1u << d;
+    return 1;
+}
+
+/* Valor de la opción Echo entre las opciones internas (p..end, deltas desde 0) */
+static inline const uint8_t* osc_inner_echo(const uint8_t* p, const uint8_t* end, size_t* len){
+    unsigned num = 0;
+    while (p < end && *p != 0xFF){
+        uint8_t b = *p++;
+        int d = read_ext((uint8_t)(b >> 4), &p, end), l = read_ext((uint8_t)(b & 0x0F), &p, end);
+        if (d < 0 || l < 0 || (size_t)(end - p) < (size_t)l) return NULL;
+        num += (unsigned)d;
+        if (num == OPT_ECHO){ *len = (size_t)l; return p; }
+        if (num > OPT_ECHO) return NULL;
+        p += l;
+    }
+    return NULL;
+}
+
+/* Verifica y descifra la petición (r = parseo del datagrama externo in) y deja
+ * en plain el mensaje CoAP interno: cabecera y token externos, código y
+ * opciones internas y payload. En rq queda lo necesario para responder. */
+static inline int osc_unprotect(osc_table_t* t, EVP_CIPHER_CTX* cx, const uint8_t* in, const coap_req_t* r,
+                                uint8_t* plain, size_t cap, size_t* plen, osc_req_t* rq){
+    size_t ol;
+    const uint8_t* ov = coap_opt(r, CO_OSCORE, &ol);
+    if (!ov || ol == 0) return COAP_402_BADOPT;
+    uint8_t fl = ov[0];
+    size_t pl = fl & 0x07u, pos = 1;
+    if ((fl & 0xE0u) || pl == 0 || pl > OSC_PIV_MAX || !(fl & 0x08u) || 1u + pl > ol) return COAP_402_BADOPT;
+    const uint8_t* piv = ov + pos; pos += pl;
+    if (fl & 0x10u){ if (pos >= ol || pos + 1u + ov[pos] > ol) return COAP_402_BADOPT; pos += 1u + ov[pos]; }  /* kid context: no se usa */
+    osc_ctx_t* c = osc_find(t, ov + pos, ol - pos);
+    if (!c) return COAP_401_UNAUTH;
+    if (r->payload_len <= OSC_TAG_LEN || 3u + r->tkl + r->payload_len - OSC_TAG_LEN > cap) return COAP_400_BADREQ;
+
+    uint8_t aad[32];
+    size_t al = osc_aad(aad, c->rid, c->rid_len, piv, pl), ctl = r->payload_len - OSC_TAG_LEN;
+    rq->c = c; rq->piv_len = (uint8_t)pl; memcpy(rq->piv, piv, pl); rq->fresh = 0;
+    osc_nonce(c->civ, c->rid, c->rid_len, piv, pl, rq->nonce);
+    uint8_t* dst = plain + 3u + r->tkl;          /* dst[0] = código interno, luego opciones */
+    if (osc_aead(cx, t->aead, 0, c->rkey, rq->nonce, aad, al, r->payload, ctl, dst) != 0) return COAP_400_BADREQ;
+    uint8_t code = dst[0];
+    memcpy(plain, in, 4u + r->tkl);
+    plain[1] = code;
+    *plen = 3u + r->tkl + ctl;
+
+    uint64_t seq = 0;
+    for (size_t i = 0; i < pl; i++) seq = (seq << 8) | piv[i];
+    size_t el = 0;
+    const uint8_t* ev = osc_inner_echo(plain + 4u + r->tkl, plain + *plen, &el);
+    int rc = OSC_OK;
+    while (atomic_flag_test_and_set_explicit(&c->lock, memory_order_acquire)) ;
+    if (!c->win_ok){
+        if (ev && el == OSC_ECHO_LEN && memcmp(ev, c->echo, OSC_ECHO_LEN) == 0){
+            c->win_ok = 1; c->win_top = seq; c->win_bits = 1u;
+        } else rc = OSC_ECHO;
+    } else if (!osc_replay_ok(c, seq)) rc = COAP_401_UNAUTH;
+    atomic_flag_clear_explicit(&c->lock, memory_order_release);
+    rq->fresh = rc == OSC_OK;
+    return rc;
+}
+
+/* Protege en sitio la respuesta msg (len bytes, hasta cap): código y opciones
+ * pasan al texto cifrado y afuera quedan 2.04, la opción OSCORE y el payload
+ * cifrado. La opción va vacía (nonce de la petición) si rq->fresh; si no, con
+ * un Partial IV propio y el nonce que sale de él y del Sender ID del servidor.
+ * La AAD es siempre la de la petición (§5.4). Devuelve el nuevo largo o 0 si
+ * no cabe (o no hubo número de secuencia). */
+static inline size_t osc_protect(osc_table_t* t, EVP_CIPHER_CTX* cx, const osc_req_t* rq,
+                                 uint8_t* msg, size_t len, size_t cap){
+    size_t h = 4u + (msg[0] & 0x0Fu), ptl = len - h + 1u;
+    uint8_t ov[1 + OSC_PIV_MAX], nonce[OSC_NONCE_LEN];
+    size_t ol = 0;
+    if (len < h) return 0;
+    if (!rq->fresh){
+        uint64_t s;
+        uint8_t piv[OSC_PIV_MAX];
+        size_t pl = 0;
+        if (osc_ssn_next(t, &s) != 0) return 0;
+        do { piv[OSC_PIV_MAX - 1u - pl++] = (uint8_t)s; s >>= 8; } while (s && pl < OSC_PIV_MAX);
+        ov[ol++] = (uint8_t)pl;                   /* flags: sólo el largo del PIV */
+        memcpy(ov + ol, piv + OSC_PIV_MAX - pl, pl); ol += pl;
+        osc_nonce(rq->c->civ, t->sid, t->sid_len, ov + 1, pl, nonce);
+    } else memcpy(nonce, rq->nonce, OSC_NONCE_LEN);
+    if (h + 2u + ol + ptl + OSC_TAG_LEN > cap || ptl + OSC_TAG_LEN > 1500u) return 0;
+    uint8_t aad[32], ct[1500 + OSC_TAG_LEN];
+    size_t al = osc_aad(aad, rq->c->rid, rq->c->rid_len, rq->piv, rq->piv_len);
+    uint8_t keep = msg[h - 1u];
+    msg[h - 1u] = msg[1];                         /* texto plano = código | opciones | 0xFF payload */
+    int bad = osc_aead(cx, t->aead, 1, rq->c->skey, nonce, aad, al, msg + h - 1u, ptl, ct);
+    msg[h - 1u] = keep;
+    if (bad) return 0;
+    msg[1] = COAP_204_CHANGED;
+    msg[h] = (uint8_t)(OPT_OSCORE << 4 | ol);     /* OSCORE: vacía o flags + PIV */
+    memcpy(msg + h + 1u, ov, ol);
+    msg[h + 1u + ol] = 0xFF;
+    memcpy(msg + h + 2u + ol, ct, ptl + OSC_TAG_LEN);
+    return h + 2u + ol + ptl + OSC_TAG_LEN;
+}
+
+/* 4.01 con Echo (sin proteger todavía) para la petición r */
+static inline size_t osc_challenge(const coap_req_t* r, const osc_req_t* rq, uint8_t* out, size_t cap){
+    size_t hdr = build_resp(out, cap, r->type, r->tkl, r->token, r->mid, COAP_401_UNAUTH, CF_TEXT_PLAIN, NULL, 0, NULL);
+    int last = OPT_CONTENT_FORMAT, k;
+    if (hdr == 0 || (k = add_option(out + hdr, cap - hdr, &last, OPT_ECHO, rq->c->echo, OSC_ECHO_LEN)) < 0) return 0;
+    return hdr + (size_t)k;
+}
+
+/* Ventanas conocidas a la instantánea (con los workers parados) */
+static inline void osc_snap_save(const osc_table_t* t, sn_buf_t* b){
+    sn_section(b, SN_OSCORE, sizeof(osc_snap_t));
+    for (uint32_t i = 0; i < t->n; i++){
+        const osc_ctx_t* c = &t->c[i];
+        osc_snap_t* x = c->win_ok ? (osc_snap_t*)sn_item(b) : NULL;
+        if (!x) continue;
+        memcpy(x->rid, c->rid, c->rid_len); x->rid_len = c->rid_len;
+        x->win_bits = c->win_bits; x->win_top = c->win_top;
+    }
+}
+
+/* Devuelve cuántas ventanas se recuperaron (contextos que siguen en el archivo de claves) */
+static inline uint32_t osc_snap_load(osc_table_t* t, const osc_snap_t* x, uint64_t n){
+    uint32_t got = 0;
+    for (uint64_t i = 0; x && i < n; i++){
+        osc_ctx_t* c = x[i].rid_len <= OSC_ID_MAX ? osc_find(t, x[i].rid, x[i].rid_len) : NULL;
+        if (!c) continue;
+        c->win_ok = 1; c->win_bits = x[i].win_bits; c->win_top = x[i].win_top;
+        got++;
+    }
+    return got;
+}
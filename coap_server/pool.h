@@ -0,0 +1,121 @@
+// pool.h — Arenas y slabs de objetos de tamaño fijo
+// Toda la memoria de estado (dedup, límites de tasa, sesiones Block, CON en
+// reenvío, peticiones en proxy, suscriptores) se reserva una sola vez al
+// arrancar, en una arena por dueño: una por worker (la toca sólo su hilo) y
+// una global para la tabla de Observe. El tamaño de cada slab sale de la
+// configuración (ver pool_cfg_load), así que el consumo total es conocido
+// antes de atender el primer datagrama:
+//   worker_arena_bytes() (serverMOD2.c) por worker + obs_need() (observe.h) global.
+// arena_alloc() es un puntero que avanza (no hay free); pool_get()/pool_put()
+// sacan y devuelven objetos de una lista libre intrusiva: O(1), sin locks y
+// sin malloc en el camino caliente. Un pool agotado devuelve NULL y lo cuenta.
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define POOL_ALIGN  64u      /* línea de caché: slabs de workers distintos no comparten líneas */
+
+typedef struct {
+    uint8_t* base;
+    size_t   cap, used;
+} arena_t;
+
+typedef struct pool_node { struct pool_node* next; } pool_node_t;
+
+typedef struct {
+    uint8_t*     base;
+    pool_node_t* free;
+    size_t       size;            /* tamaño de objeto, redondeado a puntero */
+    uint32_t     count, used, peak;
+    unsigned long fails;          /* pool_get sin objetos libres */
+} pool_t;
+
+static inline size_t pool_round(size_t n, size_t a){ return (n + a - 1u) / a * a; }
+
+static inline int arena_init(arena_t* a, size_t cap){
+    memset(a, 0, sizeof(*a));
+    a->cap = pool_round(cap ? cap : 1u, POOL_ALIGN);
+    if (posix_memalign((void**)&a->base, POOL_ALIGN, a->cap) != 0){ a->base = NULL; return -1; }
+    memset(a->base, 0, a->cap);    /* toca todas las páginas ya al arrancar */
+    return 0;
+}
+
+static inline void arena_free(arena_t* a){ free(a->base); memset(a, 0, sizeof(*a)); }
+
+/* Bloque de n bytes a cero, alineado a POOL_ALIGN; NULL si no cabe */
+static inline void* arena_alloc(arena_t* a, size_t n){
+    size_t sz = pool_round(n ? n : 1u, POOL_ALIGN);
+    if (!a->base || sz > a->cap - a->used) return NULL;
+    void* p = a->base + a->used;
+    a->used += sz;
+    return p;
+}
+
+/* Espacio que ocupa en la arena un bloque de n bytes (para dimensionarla) */
+static inline size_t arena_need(size_t n){ return pool_round(n ? n : 1u, POOL_ALIGN); }
+
+static inline size_t pool_obj_size(size_t size){ return pool_round(size < sizeof(pool_node_t) ? sizeof(pool_node_t) : size, sizeof(void*)); }
+
+static inline size_t pool_need(size_t size, uint32_t count){ return arena_need(pool_obj_size(size) * count); }
+
+static inline int pool_init(pool_t* p, arena_t* a, size_t size, uint32_t count){
+    memset(p, 0, sizeof(*p));
+    p->size = pool_obj_size(size);
+    p->count = count;
+    if (count == 0) return 0;
+    p->base = (uint8_t*)arena_alloc(a, p->size * count);
+    if (!p->base) return -1;
+    for (uint32_t i = count; i-- > 0; ){           /* el primero queda al frente */
+        pool_node_t* n = (pool_node_t*)(p->base + (size_t)i * p->size);
+        n->next = p->free; p->free = n;
+    }
+    return 0;
+}
+
+/* Objeto a cero o NULL si el pool está agotado */
+static inline void* pool_get(pool_t* p){
+    pool_node_t* n = p->free;
+    if (!n){ p->fails++; return NULL; }
+    p->free = n->next;
+    if (++p->used > p->peak) p->peak = p->used;
+    memset(n, 0, p->size);
+    return n;
+}
+
+static inline void pool_put(pool_t* p, void* obj){
+    pool_node_t* n = (pool_node_t*)obj;
+    n->next = p->free; p->free = n;
+    p->used--;
+}
+
+/* --- tamaños desde el entorno --- */
+typedef struct {
+    uint32_t dedup_slots;     /* COAP_DEDUP_SLOTS  (potencia de 2) */
+    uint32_t rate_slots;      /* COAP_RATE_SLOTS   cubos de ratelimit.h (potencia de 2) */
+    uint32_t blk_sessions;    /* COAP_BLK_SESSIONS (cada una con BLK_REPR_MAX de buffer) */
+    uint32_t obs_rtx;         /* COAP_OBS_RTX      CON de Observe en reenvío por worker */
+    uint32_t proxy_slots;     /* COAP_PROXY_SLOTS  peticiones en proxy por worker (clúster; potencia de 2) */
+    uint32_t obs_slots;       /* COAP_OBS_SLOTS    suscriptores (tabla global) */
+} pool_cfg_t;
+
+static inline uint32_t pool_env(const char* name, uint32_t def, uint32_t lo, uint32_t hi){
+    const char* s = getenv(name);
+    char* end;
+    unsigned long v = s && *s ? strtoul(s, &end, 10) : def;
+    if (s && *s && *end) v = def;
+    return v < lo ? lo : (v > hi ? hi : (uint32_t)v);
+}
+
+static inline uint32_t pool_pow2(uint32_t v){ uint32_t p = 1; while (p < v) p <<= 1; return p; }
+
+static inline void pool_cfg_load(pool_cfg_t* c, uint32_t dedup_def, uint32_t rate_def, uint32_t blk_def,
+                                 uint32_t rtx_def, uint32_t px_def, uint32_t obs_def){
+    c->dedup_slots  = pool_pow2(pool_env("COAP_DEDUP_SLOTS", dedup_def, 16u, 1u << 20));
+    c->rate_slots   = pool_pow2(pool_env("COAP_RATE_SLOTS", rate_def, 16u, 1u << 20));
+    c->blk_sessions = pool_env("COAP_BLK_SESSIONS", blk_def, 1u, 1024u);
+    c->obs_rtx      = pool_env("COAP_OBS_RTX", rtx_def, 0u, 65536u);
+    c->proxy_slots  = pool_pow2(pool_env("COAP_PROXY_SLOTS", px_def, 16u, 65536u));
+    c->obs_slots    = pool_env("COAP_OBS_SLOTS", obs_def, 1u, 65536u);
+}
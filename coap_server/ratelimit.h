@@ -0,0 +1,95 @@
+// ratelimit.h — Límite de tasa por endpoint y por dispositivo (token bucket)
+// Tabla de direccionamiento abierto y tamaño fijo, como la de dedup: cada slot
+// es un cubo con clave de 64 bits (tipo en el byte alto + IP:puerto,
+// dispositivo de la ruta o del cuerpo, o contexto OSCORE). Las fichas se
+// llevan en millonésimas y se reponen al consultar (rate fichas/s hasta
+// burst): sin timers ni barridos. Una tabla
+// por worker y sin locks; con SO_REUSEPORT un endpoint cae siempre en el mismo
+// worker, pero un dispositivo que cambia de puerto puede repartirse entre
+// varios, así que su límite es por worker. Con la ventana de sondeo llena se
+// recicla el cubo que lleva más tiempo sin uso: en el peor caso un cliente
+// recupera su ráfaga antes de tiempo, nunca se le niega de más.
+// Los slots salen de la arena del worker (pool.h); su número se fija al arrancar.
+#pragma once
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "pool.h"
+
+#define RL_SLOTS     4096u      /* default; potencia de 2 */
+#define RL_PROBE     8u         /* sondeo lineal acotado */
+#define RL_UNIT      1000000u   /* una ficha */
+#define RL_BURST_MAX 4000u      /* burst * RL_UNIT cabe en 32 bits */
+
+enum { RL_EP = 1, RL_DEV = 2, RL_KID = 3 };
+
+typedef struct {
+    uint64_t key;           /* 0 = slot libre */
+    uint32_t tok;           /* fichas * RL_UNIT */
+    uint32_t last_ms;       /* última reposición */
+} rl_bucket_t;
+
+/* rate en milésimas de ficha por segundo (= millonésimas por ms); 0 = sin límite */
+typedef struct { uint32_t rate, burst; } rl_limit_t;
+
+typedef struct {
+    rl_bucket_t* slots;     /* mask+1 slots, de la arena del worker */
+    uint32_t     mask;
+} rl_table_t;
+
+static inline size_t rl_need(uint32_t nslots){ return arena_need((size_t)nslots * sizeof(rl_bucket_t)); }
+
+/* nslots debe ser potencia de 2 (pool_cfg_load ya la redondea) */
+static inline int rl_init(rl_table_t* t, arena_t* a, uint32_t nslots){
+    t->slots = (rl_bucket_t*)arena_alloc(a, (size_t)nslots * sizeof(rl_bucket_t));
+    t->mask = nslots - 1u;
+    return t->slots ? 0 : -1;
+}
+
+/* Límite desde el entorno: rate en peticiones/s (admite decimales, "0.2" =
+ * una cada 5 s) y burst en peticiones (default: max(1, rate redondeado arriba)) */
+static inline void rl_limit_load(rl_limit_t* l, const char* rate_env, const char* burst_env){
+    const char* s = getenv(rate_env);
+    double r = s && *s ? strtod(s, NULL) : 0.0;
+    l->rate = r > 0.0 ? (r < 4e6 ? (uint32_t)(r * 1000.0 + 0.5) : 4000000000u) : 0u;
+    if (l->rate == 0u && r > 0.0) l->rate = 1u;
+    uint32_t def = (l->rate + 999u) / 1000u;
+    l->burst = pool_env(burst_env, def, 1u, RL_BURST_MAX);
+}
+
+static inline uint64_t rl_key_ep(const struct sockaddr_in* cli){
+    return (uint64_t)RL_EP << 56 | (uint64_t)cli->sin_addr.s_addr << 16 | cli->sin_port;
+}
+static inline uint64_t rl_key(uint8_t kind, uint32_t id){ return (uint64_t)kind << 56 | id; }
+
+static inline uint32_t rl_hash(uint64_t k){
+    k ^= k >> 33; k *= 0xff51afd7ed558ccdull;
+    k ^= k >> 33; k *= 0xc4ceb9fe1a85ec53ull;
+    k ^= k >> 33;
+    return (uint32_t)k;
+}
+
+/* Toma una ficha del cubo de key. 0 = admitida; -1 = sin fichas, con
+ * *retry_s = segundos hasta que haya una (>= 1, para Max-Age) */
+static inline int rl_take(rl_table_t* t, uint64_t key, const rl_limit_t* l, uint32_t now_ms, uint32_t* retry_s){
+    uint32_t h = rl_hash(key), full = l->burst * RL_UNIT;
+    rl_bucket_t *b = NULL, *victim = NULL;
+    for (uint32_t i = 0; i < RL_PROBE && !b; i++){
+        rl_bucket_t* e = &t->slots[(h + i) & t->mask];
+        if (e->key == key) b = e;
+        else if (!victim || (victim->key && (!e->key || (int32_t)(e->last_ms - victim->last_ms) < 0))) victim = e;
+    }
+    if (!b){
+        b = victim;
+        b->key = key; b->tok = full; b->last_ms = now_ms;
+    } else {
+        uint64_t tk = b->tok + (uint64_t)(uint32_t)(now_ms - b->last_ms) * l->rate;
+        b->tok = tk > full ? full : (uint32_t)tk;
+        b->last_ms = now_ms;
+    }
+    if (b->tok >= RL_UNIT){ b->tok -= RL_UNIT; return 0; }
+    uint64_t ms = (RL_UNIT - b->tok + l->rate - 1u) / l->rate;
+    *retry_s = ms < 1000u ? 1u : (uint32_t)((ms + 999u) / 1000u);
+    return -1;
+}
@@ -0,0 +1,175 @@
+// reading.h — Registro binario de telemetría y decodificador de los JSON de los sketches
+// Los cuerpos {"t":23.50,"unit":"C"} / {"d":12.30,"unit":"cm"} (opcionalmente con
+// "id" y "ts") se parsean una sola vez al ingerir y se guardan como srec_t de
+// tamaño fijo. El parser sólo entiende objetos planos con valores numéricos o
+// string; claves desconocidas se ignoran.
+// Lotes de los sketches: {"t":[[age,v],...],"unit":"C"}, un registro por par con
+// ts = ts - age (age en ms antes del envío); un elemento suelto v vale age 0.
+// Un id, ts, age o valor que no cabe en su campo (o no es finito) invalida el cuerpo.
+#pragma once
+#include <float.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+enum { RES_NONE = 0, RES_TEMP = 1, RES_DIST = 2 };
+
+/* 24 bytes; crc = FNV-1a de los 20 bytes anteriores (detecta registros cortados) */
+typedef struct {
+    int64_t  ts_ms;      /* epoch en ms */
+    uint32_t device;     /* 0 = sin id (POST /sensor sin "id") */
+    float    value;
+    uint16_t resource;   /* RES_* */
+    uint16_t flags;
+    uint32_t crc;
+} srec_t;
+
+#define READING_MAX_PER_MSG  64
+
+static inline uint32_t srec_crc(const srec_t* r){
+    const uint8_t* p = (const uint8_t*)r;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < offsetof(srec_t, crc); i++){ h ^= p[i]; h *= 16777619u; }
+    return h;
+}
+
+/* Números del cuerpo -> campos del registro. Convertir un double fuera de rango
+ * (o NaN/inf, que json_num da con exponentes grandes) es indefinido: -1 */
+#define READING_MS_MAX  1e15              /* |ts| y |age| en ms, ~31 000 años */
+
+static inline int reading_u32(double v, uint32_t* out){
+    if (!(v >= 0.0 && v <= (double)UINT32_MAX)) return -1;
+    *out = (uint32_t)v;
+    return 0;
+}
+static inline int reading_ms(double v, int64_t* out){
+    if (!(v >= -READING_MS_MAX && v <= READING_MS_MAX)) return -1;
+    *out = (int64_t)v;
+    return 0;
+}
+static inline int reading_val(double v, float* out){
+    if (!(v >= -(double)FLT_MAX && v <= (double)FLT_MAX)) return -1;
+    *out = (float)v;
+    return 0;
+}
+
+/* Número JSON sin copiar a un buffer con terminador (no hay strtod sobre inbuf) */
+static inline const uint8_t* json_num(const uint8_t* p, const uint8_t* end, double* out){
+    double sign = 1.0, v = 0.0;
+    int digits = 0;
+    if (p < end && (*p == '-' || *p == '+')){ if (*p == '-') sign = -1.0; p++; }
+    while (p < end && *p >= '0' && *p <= '9'){ v = v*10.0 + (*p - '0'); p++; digits++; }
+    if (p < end && *p == '.'){
+        double f = 0.1; p++;
+        while (p < end && *p >= '0' && *p <= '9'){ v += (*p - '0')*f; f *= 0.1; p++; digits++; }
+    }
+    if (!digits) return NULL;
+    if (p < end && (*p == 'e' || *p == 'E')){
+        int es = 1, e = 0; p++;
+        if (p < end && (*p == '-' || *p == '+')){ if (*p == '-') es = -1; p++; }
+        while (p < end && *p >= '0' && *p <= '9'){ if (e < 308) e = e*10 + (*p - '0'); p++; }
+        while (e--) v = es > 0 ? v*10.0 : v/10.0;
+    }
+    *out = sign * v;
+    return p;
+}
+
+static inline const uint8_t* json_ws(const uint8_t* p, const uint8_t* end){
+    while (p < end && (*p==' ' || *p=='\t' || *p=='\r' || *p=='\n')) p++;
+    return p;
+}
+
+/* Un elemento del lote: [age,v] o v; deja age en ts_ms (se resuelve al final) */
+static inline const uint8_t* json_batch_item(const uint8_t* p, const uint8_t* end, int64_t* age, double* v){
+    *age = 0;
+    if (p < end && *p == '['){
+        double a;
+        p = json_num(json_ws(p + 1, end), end, &a);
+        if (!p) return NULL;
+        p = json_ws(p, end);
+        if (p >= end || *p++ != ',') return NULL;
+        if (!(p = json_num(json_ws(p, end), end, v))) return NULL;
+        p = json_ws(p, end);
+        if (p >= end || *p++ != ']') return NULL;
+        return reading_ms(a, age) == 0 ? p : NULL;
+    }
+    return json_num(p, end, v);
+}
+
+/* Decodifica un objeto JSON plano en hasta max registros (uno por "t"/"d",
+ * o uno por elemento si el valor es un lote).
+ * device/ts_ms son los valores por defecto si el cuerpo no trae "id"/"ts".
+ * Devuelve el número de registros o -1 si el JSON no es válido. */
+static inline int reading_parse_json(const uint8_t* p, size_t n, uint32_t device, int64_t ts_ms,
+                                     srec_t* out, int max){
+    const uint8_t* end = p + n;
+    int cnt = 0;
+    p = json_ws(p, end);
+    if (p >= end || *p++ != '{') return -1;
+    for (;;){
+        p = json_ws(p, end);
+        if (p < end && *p == '}') break;
+        if (p >= end || *p++ != '"') return -1;
+        const uint8_t* k = p;
+        while (p < end && *p != '"') p++;
+        if (p >= end) return -1;
+        size_t klen = (size_t)(p - k); p++;
+        p = json_ws(p, end);
+        if (p >= end || *p++ != ':') return -1;
+        p = json_ws(p, end);
+        if (p < end && *p == '"'){                  /* valor string: se ignora */
+            p++;
+            while (p < end && *p != '"') p++;
+            if (p >= end) return -1;
+            p++;
+        } else if (p < end && *p == '['){           /* lote */
+            int is_rd = klen == 1 && (*k == 't' || *k == 'd');
+            p = json_ws(p + 1, end);
+            while (p < end && *p != ']'){
+                int64_t age; double v;
+                if (!(p = json_batch_item(p, end, &age, &v))) return -1;
+                if (is_rd && cnt < max){
+                    srec_t* r = &out[cnt++];
+                    memset(r, 0, sizeof(*r));
+                    r->resource = (*k == 't') ? RES_TEMP : RES_DIST;
+                    if (reading_val(v, &r->value) != 0) return -1;
+                    r->ts_ms = age;
+                }
+                p = json_ws(p, end);
+                if (p < end && *p == ','){ p = json_ws(p + 1, end); continue; }
+                if (p >= end || *p != ']') return -1;
+            }
+            if (p >= end) return -1;
+            p++;
+        } else {
+            double v;
+            if (!(p = json_num(p, end, &v))) return -1;
+            if (klen == 2 && memcmp(k, "id", 2) == 0){
+                if (reading_u32(v, &device) != 0) return -1;
+            } else if (klen == 2 && memcmp(k, "ts", 2) == 0){
+                if (reading_ms(v, &ts_ms) != 0) return -1;
+            } else if (klen == 1 && (*k == 't' || *k == 'd') && cnt < max){
+                srec_t* r = &out[cnt++];
+                memset(r, 0, sizeof(*r));
+                r->resource = (*k == 't') ? RES_TEMP : RES_DIST;
+                if (reading_val(v, &r->value) != 0) return -1;
+            }
+        }
+        p = json_ws(p, end);
+        if (p < end && *p == ','){ p++; continue; }
+        if (p < end && *p == '}') break;
+        return -1;
+    }
+    for (int i = 0; i < cnt; i++){ out[i].device = device; out[i].ts_ms = ts_ms - out[i].ts_ms; }
+    return cnt;
+}
+
+/* Vuelve a texto con la forma que envían los sketches */
+static inline size_t reading_format(const srec_t* r, char* out, size_t cap){
+    int w = (r->resource == RES_DIST)
+          ? snprintf(out, cap, "{\"d\":%.2f,\"unit\":\"cm\"}", (double)r->value)
+          : snprintf(out, cap, "{\"t\":%.2f,\"unit\":\"C\"}", (double)r->value);
+    if (w < 0) return 0;
+    return (size_t)w < cap ? (size_t)w : cap - 1u;
+}
@@ -0,0 +1,237 @@
+// rollup.h — Agregados incrementales por dispositivo (count/sum/min/max)
+// Cada registro ingerido suma en un bucket fijo de cada nivel:
+//   1 min x 60  (ventanas hasta 1 h),  1 h x 48  (hasta 2 días),  1 día x 90
+// Los buckets son anillos indexados por (inicio / ancho) % slots: al llegar un
+// bucket nuevo se pisa el más viejo, y un registro más viejo que su anillo se
+// ignora en ese nivel. Una ventana se responde con el nivel más fino que la
+// cubre, sumando los buckets que se solapan con [now - window, now]; la
+// resolución es la del bucket (p.ej. window=1m incluye el minuto anterior).
+// Sólo el hilo escritor actualiza (bajo ru->lock en escritura, breve) y cada
+// flush_ms guarda los dispositivos modificados junto a los segmentos:
+//   <dir>/d<device>.rollup   cabecera de 16 bytes + buckets (tmp + rename)
+// Al arrancar se cargan tal cual, sin recalcular desde los segmentos; si el
+// servidor muere se pierden a lo sumo los últimos flush_ms de agregados.
+// Tras una salida limpia vienen de la instantánea (snapshot.h: sólo los
+// buckets con datos, en una sección) y no hace falta abrir un archivo por
+// dispositivo; tras una caída se cargan los .rollup, que pueden ser más nuevos.
+#pragma once
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "reading.h"
+#include "snapshot.h"
+
+#define RU_MAGIC        0x50555243u   /* "CRUP" */
+#define RU_VERSION      1u
+#define RU_LEVELS       3
+#define RU_RES          2             /* RES_TEMP, RES_DIST */
+#define RU_SLOTS_TOTAL  (60 + 48 + 90)
+#define RU_MAX_DEVICES  4096u         /* potencia de 2 */
+
+static const int64_t  ru_width_ms[RU_LEVELS] = { 60000, 3600000, 86400000 };
+static const uint32_t ru_nslots[RU_LEVELS]   = { 60, 48, 90 };
+static const uint32_t ru_base[RU_LEVELS]     = { 0, 60, 60 + 48 };
+
+typedef struct {
+    int64_t  start;            /* inicio del bucket en ms epoch; 0 = vacío */
+    uint32_t n;
+    float    min, max;
+    double   sum;
+} ru_bucket_t;
+
+typedef struct {
+    uint32_t    device;
+    uint8_t     dirty;
+    ru_bucket_t b[RU_RES][RU_SLOTS_TOTAL];
+} ru_dev_t;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version, slots;
+    uint32_t device, bucket_size;
+} ru_hdr_t;
+
+typedef struct { uint32_t n; float min, max; double sum; int64_t res_ms; } ru_agg_t;
+
+/* Un bucket con datos en la instantánea */
+typedef struct {
+    uint32_t    device;
+    uint16_t    res, slot;
+    ru_bucket_t b;
+} ru_snap_t;
+
+#define SN_ROLLUP  SN_TAG('R','U','N','S')
+
+typedef struct {
+    char      dir[256];
+    pthread_rwlock_t lock;
+    ru_dev_t* devs[RU_MAX_DEVICES];   /* hash de direccionamiento abierto por device */
+    uint32_t  ndevs;
+    unsigned  flush_ms;
+    uint64_t  last_flush_ms;
+    unsigned long saves;
+} rollup_t;
+
+static inline ru_dev_t* ru_dev(rollup_t* ru, uint32_t device, int create){
+    uint32_t h = device * 2654435761u;
+    for (uint32_t i = 0; i < RU_MAX_DEVICES; i++){
+        ru_dev_t** slot = &ru->devs[(h + i) & (RU_MAX_DEVICES-1)];
+        if (*slot && (*slot)->device == device) return *slot;
+        if (!*slot){
+            if (!create || ru->ndevs + 1u >= RU_MAX_DEVICES) return NULL;
+            ru_dev_t* d = (ru_dev_t*)calloc(1, sizeof(ru_dev_t));
+            if (!d) return NULL;
+            d->device = device;
+            *slot = d;                 /* lo publica el escritor bajo ru->lock */
+            ru->ndevs++;
+            return d;
+        }
+    }
+    return NULL;
+}
+
+static inline void ru_path(const rollup_t* ru, uint32_t dev, const char* ext, char* out, size_t cap){
+    snprintf(out, cap, "%s/d%u.%s", ru->dir, dev, ext);
+}
+
+static inline int ru_load(rollup_t* ru, uint32_t dev){
+    char path[320];
+    ru_path(ru, dev, "rollup", path, sizeof(path));
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd < 0) return -1;
+    ru_hdr_t h;
+    ru_dev_t* d = NULL;
+    int ok = read(fd, &h, sizeof(h)) == (ssize_t)sizeof(h) && h.magic == RU_MAGIC &&
+             h.version == RU_VERSION && h.slots == RU_SLOTS_TOTAL && h.device == dev &&
+             h.bucket_size == sizeof(ru_bucket_t) && (d = ru_dev(ru, dev, 1)) != NULL &&
+             read(fd, d->b, sizeof(d->b)) == (ssize_t)sizeof(d->b);
+    close(fd);
+    if (!ok && d) memset(d->b, 0, sizeof(d->b));   /* de otra versión o cortado: empezar de cero */
+    return ok ? 0 : -1;
+}
+
+static inline int ru_save(rollup_t* ru, ru_dev_t* d){
+    char tmp[320], path[320];
+    ru_path(ru, d->device, "rollup.tmp", tmp, sizeof(tmp));
+    ru_path(ru, d->device, "rollup", path, sizeof(path));
+    int fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    ru_hdr_t h = { RU_MAGIC, RU_VERSION, RU_SLOTS_TOTAL, d->device, (uint32_t)sizeof(ru_bucket_t) };
+    int ok = write(fd, &h, sizeof(h)) == (ssize_t)sizeof(h) &&
+             write(fd, d->b, sizeof(d->b)) == (ssize_t)sizeof(d->b);
+    close(fd);
+    if (!ok || rename(tmp, path) != 0){ unlink(tmp); return -1; }
+    d->dirty = 0;
+    ru->saves++;
+    return 0;
+}
+
+/* snap != NULL: buckets de la instantánea (nsnap), en lugar de leer los .rollup */
+static inline int ru_open(rollup_t* ru, const char* dir, unsigned flush_ms, const ru_snap_t* snap, uint64_t nsnap){
+    memset(ru, 0, sizeof(*ru));
+    pthread_rwlock_init(&ru->lock, NULL);
+    snprintf(ru->dir, sizeof(ru->dir), "%s", dir);
+    ru->flush_ms = flush_ms;
+    if (snap){
+        ru_dev_t* d = NULL;
+        for (uint64_t i = 0; i < nsnap; i++){
+            const ru_snap_t* e = &snap[i];
+            if (e->res >= RU_RES || e->slot >= RU_SLOTS_TOTAL) continue;
+            if (!d || d->device != e->device) d = ru_dev(ru, e->device, 1);
+            if (d) d->b[e->res][e->slot] = e->b;
+        }
+        return 0;
+    }
+    DIR* dp = opendir(dir);
+    if (!dp) return -1;
+    struct dirent* de;
+    while ((de = readdir(dp))){
+        unsigned dev; char ext[8];
+        if (sscanf(de->d_name, "d%u.%7s", &dev, ext) == 2 && strcmp(ext, "rollup") == 0) ru_load(ru, dev);
+    }
+    closedir(dp);
+    return 0;
+}
+
+/* Suma registros recién ingeridos (hilo escritor) */
+static inline void ru_add(rollup_t* ru, const srec_t* recs, size_t n){
+    pthread_rwlock_wrlock(&ru->lock);
+    for (size_t i = 0; i < n; i++){
+        const srec_t* r = &recs[i];
+        if (r->resource != RES_TEMP && r->resource != RES_DIST) continue;
+        if (r->value != r->value || r->ts_ms <= 0) continue;        /* NaN */
+        ru_dev_t* d = ru_dev(ru, r->device, 1);
+        if (!d) continue;
+        for (int l = 0; l < RU_LEVELS; l++){
+            int64_t start = r->ts_ms - r->ts_ms % ru_width_ms[l];
+            ru_bucket_t* b = &d->b[r->resource - 1u][ru_base[l] + (uint32_t)((start / ru_width_ms[l]) % ru_nslots[l])];
+            if (b->start > start) continue;                          /* más viejo que el anillo */
+            if (b->start < start){ b->start = start; b->n = 0; b->sum = 0.0; }
+            if (b->n == 0 || r->value < b->min) b->min = r->value;
+            if (b->n == 0 || r->value > b->max) b->max = r->value;
+            b->n++; b->sum += r->value;
+        }
+        d->dirty = 1;
+    }
+    pthread_rwlock_unlock(&ru->lock);
+}
+
+/* Guarda los modificados cada flush_ms (o todos si force); sólo el escritor
+ * modifica, así que puede leer los buckets sin lock */
+static inline void ru_poll(rollup_t* ru, uint64_t now, int force){
+    if (!force && now - ru->last_flush_ms < ru->flush_ms) return;
+    ru->last_flush_ms = now;
+    for (uint32_t i = 0; i < RU_MAX_DEVICES; i++)
+        if (ru->devs[i] && ru->devs[i]->dirty && ru_save(ru, ru->devs[i]) != 0) perror("rollup save");
+}
+
+/* Agregado de device/resource sobre [now - window, now]; -1 si la ventana
+ * excede el nivel más grueso o el dispositivo no tiene agregados */
+static inline int ru_query(rollup_t* ru, uint32_t device, uint16_t resource, int64_t now, int64_t window,
+                           ru_agg_t* out){
+    int l = 0;
+    memset(out, 0, sizeof(*out));
+    while (l < RU_LEVELS && window > ru_width_ms[l] * (int64_t)ru_nslots[l]) l++;
+    if (l == RU_LEVELS || window <= 0 || (resource != RES_TEMP && resource != RES_DIST)) return -1;
+    out->res_ms = ru_width_ms[l];
+    pthread_rwlock_rdlock(&ru->lock);
+    const ru_dev_t* d = ru_dev(ru, device, 0);
+    for (uint32_t s = 0; d && s < ru_nslots[l]; s++){
+        const ru_bucket_t* b = &d->b[resource - 1u][ru_base[l] + s];
+        if (b->n == 0 || b->start + ru_width_ms[l] <= now - window || b->start > now) continue;
+        if (out->n == 0 || b->min < out->min) out->min = b->min;
+        if (out->n == 0 || b->max > out->max) out->max = b->max;
+        out->n += b->n; out->sum += b->sum;
+    }
+    pthread_rwlock_unlock(&ru->lock);
+    return d ? 0 : -1;
+}
+
+/* Buckets con datos a la instantánea */
+static inline void ru_snap_save(rollup_t* ru, sn_buf_t* b){
+    sn_section(b, SN_ROLLUP, sizeof(ru_snap_t));
+    pthread_rwlock_rdlock(&ru->lock);
+    for (uint32_t i = 0; i < RU_MAX_DEVICES && !b->err; i++){
+        const ru_dev_t* d = ru->devs[i];
+        for (uint32_t r = 0; d && r < RU_RES; r++)
+            for (uint32_t k = 0; k < RU_SLOTS_TOTAL; k++){
+                if (d->b[r][k].n == 0) continue;
+                ru_snap_t* e = (ru_snap_t*)sn_item(b);
+                if (!e) break;
+                e->device = d->device; e->res = (uint16_t)r; e->slot = (uint16_t)k; e->b = d->b[r][k];
+            }
+    }
+    pthread_rwlock_unlock(&ru->lock);
+}
+
+static inline void ru_close(rollup_t* ru){
+    ru_poll(ru, 0, 1);
+    for (uint32_t i = 0; i < RU_MAX_DEVICES; i++){ free(ru->devs[i]); ru->devs[i] = NULL; }
+    pthread_rwlock_destroy(&ru->lock);
+}
@@ -0,0 +1,140 @@
+// router.h — Tabla de rutas CoAP precompilada (trie de segmentos Uri-Path)
+// Las rutas se registran al arrancar con rt_add("sensor/temp", COAP_GET, fn).
+// coap_parse() avanza por el trie con cada opción Uri-Path (rt_step) y deja
+// el nodo final en la petición: no se arma ni se compara la ruta como string.
+// Un segmento "{x}" acepta cualquier valor y su vista queda como parámetro.
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define RT_MAX_NODES  64
+#define RT_METHODS    5      /* índice = código de petición (GET=1 .. DELETE=4) */
+#define RT_SEG_MAX    32
+#define RT_PATH_MAX   64
+#define RT_CORE_MAX   512
+#define RT_MAX_PARAMS 2
+
+struct coap_req;
+struct coap_out;
+typedef uint8_t (*route_fn)(const struct coap_req* req, struct coap_out* o);
+
+typedef struct { const uint8_t* p; uint8_t len; } rt_param_t;   /* vista sobre el datagrama */
+
+typedef struct {
+    char     seg[RT_SEG_MAX];
+    uint8_t  seglen, param;     /* param = segmento "{x}" */
+    uint8_t  obs;               /* GET admite Observe (RFC 7641) */
+    int16_t  child, next;       /* primer hijo / siguiente hermano; -1 = ninguno */
+    route_fn fn[RT_METHODS];
+    char     path[RT_PATH_MAX]; /* patrón registrado, p.ej. "device/{id}" */
+} rt_node_t;
+
+typedef struct {
+    rt_node_t n[RT_MAX_NODES];
+    int       count;
+    char      core[RT_CORE_MAX];   /* /.well-known/core en link-format (RFC 6690) */
+    size_t    core_len;
+} router_t;
+
+static inline void rt_init(router_t* rt){
+    memset(rt, 0, sizeof(*rt));
+    rt->n[0].child = rt->n[0].next = -1;
+    rt->count = 1;
+}
+
+static inline int rt_child(router_t* rt, int parent, const char* seg, size_t len){
+    for (int c = rt->n[parent].child; c >= 0; c = rt->n[c].next)
+        if (rt->n[c].seglen == len && memcmp(rt->n[c].seg, seg, len) == 0) return c;
+    if (rt->count == RT_MAX_NODES || len >= RT_SEG_MAX) return -1;
+    int c = rt->count++;
+    rt_node_t* nd = &rt->n[c];
+    memcpy(nd->seg, seg, len); nd->seg[len] = '\0';
+    nd->seglen = (uint8_t)len;
+    nd->param  = (len >= 2 && seg[0] == '{' && seg[len-1] == '}');
+    nd->child  = -1;
+    nd->next = rt->n[parent].child;
+    rt->n[parent].child = (int16_t)c;
+    return c;
+}
+
+/* Registra fn para (path, method); 0 = ok, -1 = tabla llena o argumentos inválidos */
+static inline int rt_add(router_t* rt, const char* path, uint8_t method, route_fn fn){
+    if (method == 0 || method >= RT_METHODS || strlen(path) >= RT_PATH_MAX) return -1;
+    int node = 0;
+    for (const char* p = path; *p; ){
+        const char* e = strchr(p, '/');
+        size_t len = e ? (size_t)(e - p) : strlen(p);
+        if (len){
+            node = rt_child(rt, node, p, len);
+            if (node < 0) return -1;
+        }
+        p += len + (e ? 1u : 0u);
+    }
+    rt->n[node].fn[method] = fn;
+    snprintf(rt->n[node].path, sizeof(rt->n[node].path), "%s", path);
+    return 0;
+}
+
+/* Avanza un segmento; devuelve el nodo hijo o -1 si ninguna ruta lo acepta.
+ * Un segmento exacto tiene prioridad sobre un "{x}" del mismo nivel. */
+static inline int rt_step(const router_t* rt, int node, const uint8_t* seg, size_t len){
+    int any = -1;
+    for (int c = rt->n[node].child; c >= 0; c = rt->n[c].next){
+        const rt_node_t* nd = &rt->n[c];
+        if (nd->param){ if (any < 0) any = c; continue; }
+        if (nd->seglen == len && memcmp(nd->seg, seg, len) == 0) return c;
+    }
+    return any;
+}
+
+/* Marca la ruta (ya registrada) como observable */
+static inline int rt_observable(router_t* rt, const char* path){
+    for (int i = 1; i < rt->count; i++)
+        if (strcmp(rt->n[i].path, path) == 0){ rt->n[i].obs = 1; return 0; }
+    return -1;
+}
+
+static inline int rt_has_any(const rt_node_t* nd){
+    for (int m = 1; m < RT_METHODS; m++) if (nd->fn[m]) return 1;
+    return 0;
+}
+
+/* Precalcula la respuesta de /.well-known/core con las rutas sin parámetros */
+static inline void rt_build_core(router_t* rt){
+    size_t pos = 0;
+    rt->core[0] = '\0';
+    for (int i = 1; i < rt->count; i++){
+        const rt_node_t* nd = &rt->n[i];
+        if (!rt_has_any(nd) || strchr(nd->path, '{')) continue;
+        int w = snprintf(rt->core + pos, sizeof(rt->core) - pos, "%s</%s>%s",
+                         pos ? "," : "", nd->path, nd->obs ? ";obs" : "");
+        if (w < 0 || (size_t)w >= sizeof(rt->core) - pos) break;
+        pos += (size_t)w;
+    }
+    rt->core_len = pos;
+}
+
+/* Expande el patrón del nodo sustituyendo cada "{x}" por su parámetro;
+ * sólo lo usan los handlers que necesitan una clave de texto */
+static inline size_t rt_expand(const rt_node_t* nd, const rt_param_t* prm, int nprm, char* out, size_t cap){
+    size_t pos = 0; int k = 0;
+    if (cap == 0) return 0;
+    for (const char* p = nd->path; *p && pos + 1u < cap; ){
+        if (*p == '{'){
+            const char* e = strchr(p, '}');
+            if (!e) break;
+            if (k < nprm){
+                size_t n = prm[k].len;
+                if (n > cap - 1u - pos) n = cap - 1u - pos;
+                memcpy(out + pos, prm[k].p, n); pos += n;
+            }
+            k++; p = e + 1;
+        } else {
+            out[pos++] = *p++;
+        }
+    }
+    out[pos] = '\0';
+    return pos;
+}
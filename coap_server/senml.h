@@ -0,0 +1,233 @@
+// senml.h — Decodificador CBOR (RFC 8949) de los cuerpos binarios
+// Content-Format 112 (application/senml+cbor, RFC 8428): arreglo de registros
+// SenML con claves enteras; cada registro con "v" da un srec_t. El recurso sale
+// del nombre (bn + n, último segmento: "t"/"temp" o "d"/"dist") o, si no, de la
+// unidad ("Cel" / "cm"). Un bn de la forma "<id>/" o "<id>:" fija el dispositivo.
+// t/bt en segundos; valores < 2^28 son relativos al momento de llegada. Un id,
+// tiempo o valor que no cabe en su campo (o no es finito) invalida el cuerpo.
+// Content-Format 60 (application/cbor): el mismo objeto que el JSON de los
+// sketches, como mapa con claves de texto ("t", "d", "id", "ts", lotes [[age,v]]).
+// Sólo longitudes definidas; se decodifica sobre el datagrama, sin copias.
+#pragma once
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "reading.h"
+
+#define CBOR_DEPTH_MAX  8
+#define SENML_BN_MAX    32
+
+enum { CB_UINT = 0, CB_NINT = 1, CB_BYTES = 2, CB_TEXT = 3, CB_ARRAY = 4, CB_MAP = 5,
+       CB_TAG = 6, CB_SIMPLE = 7 };
+
+/* SenML (RFC 8428 §6): etiquetas enteras */
+enum { SENML_BN = -2, SENML_BT = -3, SENML_BU = -4, SENML_BV = -5,
+       SENML_N = 0, SENML_U = 1, SENML_V = 2, SENML_T = 6 };
+
+typedef struct { const uint8_t* p; const uint8_t* end; } cbor_t;
+
+/* Lee la cabecera de un ítem: tipo mayor y argumento (largo/valor) */
+static inline int cb_head(cbor_t* c, uint8_t* major, uint64_t* arg){
+    if (c->p >= c->end) return -1;
+    uint8_t b = *c->p++, ai = b & 0x1F;
+    *major = b >> 5;
+    if (ai < 24){ *arg = ai; return 0; }
+    if (ai > 27) return -1;                       /* indefinidos / reservados */
+    size_t n = (size_t)1 << (ai - 24);
+    if ((size_t)(c->end - c->p) < n) return -1;
+    uint64_t v = 0;
+    for (size_t i = 0; i < n; i++) v = (v << 8) | *c->p++;
+    *arg = v;
+    return 0;
+}
+
+/* float16 sin libm: (m + 1024) * 2^(e-25), subnormales m * 2^-24 */
+static inline double cb_half(uint16_t h){
+    int e = (h >> 10) & 0x1F, m = h & 0x3FF, sh = (e ? e : 1) - 25;
+    double v = (double)(e ? m + 1024 : m);
+    if (e == 31) v = m ? NAN : INFINITY;
+    else { for (; sh > 0; sh--) v *= 2.0; for (; sh < 0; sh++) v *= 0.5; }
+    return (h & 0x8000) ? -v : v;
+}
+
+/* Número (entero o float 16/32/64); -1 si el ítem no es numérico */
+static inline int cb_num(cbor_t* c, double* out){
+    const uint8_t* at = c->p;
+    uint8_t mj; uint64_t a;
+    if (cb_head(c, &mj, &a) != 0) return -1;
+    if (mj == CB_UINT){ *out = (double)a; return 0; }
+    if (mj == CB_NINT){ *out = -1.0 - (double)a; return 0; }
+    if (mj == CB_SIMPLE){
+        uint8_t ai = *at & 0x1F;
+        if (ai == 25){ *out = cb_half((uint16_t)a); return 0; }
+        if (ai == 26){ uint32_t u = (uint32_t)a; float f; memcpy(&f, &u, 4); *out = f; return 0; }
+        if (ai == 27){ double d; memcpy(&d, &a, 8); *out = d; return 0; }
+    }
+    return -1;
+}
+
+/* Entero con signo (claves SenML) */
+static inline int cb_int(cbor_t* c, int64_t* out){
+    uint8_t mj; uint64_t a;
+    if (cb_head(c, &mj, &a) != 0 || (mj != CB_UINT && mj != CB_NINT) || a > INT64_MAX) return -1;
+    *out = mj == CB_UINT ? (int64_t)a : -1 - (int64_t)a;
+    return 0;
+}
+
+/* Texto como vista sobre el buffer */
+static inline int cb_text(cbor_t* c, const uint8_t** s, size_t* n){
+    uint8_t mj; uint64_t a;
+    if (cb_head(c, &mj, &a) != 0 || mj != CB_TEXT || a > (uint64_t)(c->end - c->p)) return -1;
+    *s = c->p; *n = (size_t)a; c->p += a;
+    return 0;
+}
+
+static inline int cb_skip(cbor_t* c, int depth){
+    uint8_t mj; uint64_t a;
+    if (depth > CBOR_DEPTH_MAX || cb_head(c, &mj, &a) != 0) return -1;
+    switch (mj){
+    case CB_BYTES: case CB_TEXT:
+        if (a > (uint64_t)(c->end - c->p)) return -1;
+        c->p += a; return 0;
+    case CB_ARRAY: case CB_MAP:
+        if (a > (uint64_t)(c->end - c->p)) return -1;   /* cada ítem ocupa >= 1 byte */
+        for (uint64_t i = 0; i < (mj == CB_MAP ? 2u*a : a); i++)
+            if (cb_skip(c, depth + 1) != 0) return -1;
+        return 0;
+    case CB_TAG:
+        return cb_skip(c, depth + 1);
+    default:
+        return 0;
+    }
+}
+
+/* Recurso según el último segmento del nombre o, si no dice, la unidad */
+static inline uint16_t senml_resource(const char* name, size_t nlen, const uint8_t* u, size_t ulen){
+    size_t i = nlen;
+    while (i > 0 && name[i-1] != '/' && name[i-1] != ':') i--;
+    const char* s = name + i; size_t n = nlen - i;
+    if ((n == 1 && *s == 't') || (n == 4 && memcmp(s, "temp", 4) == 0)) return RES_TEMP;
+    if ((n == 1 && *s == 'd') || (n == 4 && memcmp(s, "dist", 4) == 0)) return RES_DIST;
+    if (ulen == 3 && memcmp(u, "Cel", 3) == 0) return RES_TEMP;
+    if ((ulen == 2 && memcmp(u, "cm", 2) == 0) || (ulen == 1 && *u == 'm')) return RES_DIST;
+    return RES_NONE;
+}
+
+/* Tiempo SenML (s; < 2^28 = relativo a ahora) en ms; -1 si no cabe */
+static inline int senml_time_ms(double t, int64_t now_ms, int64_t* out){
+    int64_t ms;
+    if (reading_ms(t * 1000.0, &ms) != 0) return -1;
+    *out = (t < 0 ? -t : t) < 268435456.0 ? now_ms + ms : ms;
+    return 0;
+}
+
+/* SenML/CBOR -> hasta max registros; número de registros o -1 si no es válido */
+static inline int reading_parse_senml(const uint8_t* p, size_t n, uint32_t device, int64_t now_ms,
+                                      srec_t* out, int max){
+    cbor_t c = { p, p + n };
+    uint8_t mj; uint64_t cnt;
+    if (cb_head(&c, &mj, &cnt) != 0 || mj != CB_ARRAY) return -1;
+    char bn[SENML_BN_MAX]; size_t bnlen = 0;
+    const uint8_t* bu = NULL; size_t bulen = 0;
+    double bt = 0.0, bv = 0.0;
+    int nrec = 0;
+    for (uint64_t r = 0; r < cnt; r++){
+        uint64_t nk;
+        if (cb_head(&c, &mj, &nk) != 0 || mj != CB_MAP) return -1;
+        char name[SENML_BN_MAX * 2]; size_t nlen;
+        const uint8_t* nm = NULL; size_t nmlen = 0;
+        const uint8_t* u = bu; size_t ulen = bulen;
+        double t = 0.0, v = 0.0; int hasv = 0;
+        for (uint64_t k = 0; k < nk; k++){
+            int64_t key;
+            if (c.p < c.end && (*c.p >> 5) == CB_TEXT){        /* etiqueta de extensión */
+                const uint8_t* s; size_t sl;
+                if (cb_text(&c, &s, &sl) != 0 || cb_skip(&c, 1) != 0) return -1;
+                continue;
+            }
+            if (cb_int(&c, &key) != 0) return -1;
+            int bad = 0;
+            switch (key){
+            case SENML_BN: {
+                const uint8_t* s; size_t sl;
+                bad = cb_text(&c, &s, &sl);
+                if (!bad){ bnlen = sl < sizeof(bn) ? sl : sizeof(bn) - 1u; memcpy(bn, s, bnlen); }
+                break;
+            }
+            case SENML_BU: bad = cb_text(&c, &bu, &bulen); u = bu; ulen = bulen; break;
+            case SENML_BT: bad = cb_num(&c, &bt); break;
+            case SENML_BV: bad = cb_num(&c, &bv); break;
+            case SENML_N:  bad = cb_text(&c, &nm, &nmlen); break;
+            case SENML_U:  bad = cb_text(&c, &u, &ulen); break;
+            case SENML_V:  bad = cb_num(&c, &v); hasv = 1; break;
+            case SENML_T:  bad = cb_num(&c, &t); break;
+            default:       bad = cb_skip(&c, 1); break;       /* vs, vb, s, ut, ... */
+            }
+            if (bad) return -1;
+        }
+        if (!hasv || nrec == max) continue;
+        memcpy(name, bn, bnlen); nlen = bnlen;
+        if (nmlen > sizeof(name) - nlen) nmlen = sizeof(name) - nlen;
+        if (nm) memcpy(name + nlen, nm, nmlen);
+        nlen += nmlen;
+        uint16_t res = senml_resource(name, nlen, u, ulen);
+        if (res == RES_NONE) continue;
+        uint32_t dev = device, id = 0; size_t i = 0;
+        while (i < bnlen && bn[i] >= '0' && bn[i] <= '9' && id < 429496729u) id = id*10u + (uint32_t)(bn[i++] - '0');
+        if (i > 0 && i < bnlen && (bn[i] == '/' || bn[i] == ':')) dev = id;
+        srec_t* o = &out[nrec++];
+        memset(o, 0, sizeof(*o));
+        o->device = dev; o->resource = res;
+        if (reading_val(bv + v, &o->value) != 0 || senml_time_ms(bt + t, now_ms, &o->ts_ms) != 0) return -1;
+    }
+    return c.p == c.end ? nrec : -1;
+}
+
+/* Mapa CBOR con la forma del JSON de los sketches -> hasta max registros */
+static inline int reading_parse_cbor(const uint8_t* p, size_t n, uint32_t device, int64_t ts_ms,
+                                     srec_t* out, int max){
+    cbor_t c = { p, p + n };
+    uint8_t mj; uint64_t nk;
+    int cnt = 0;
+    if (cb_head(&c, &mj, &nk) != 0 || mj != CB_MAP) return -1;
+    for (uint64_t k = 0; k < nk; k++){
+        const uint8_t* key; size_t klen;
+        if (cb_text(&c, &key, &klen) != 0) return -1;
+        int is_rd = klen == 1 && (*key == 't' || *key == 'd');
+        double v;
+        if (klen == 2 && memcmp(key, "id", 2) == 0){
+            if (cb_num(&c, &v) != 0) return -1;
+            if (reading_u32(v, &device) != 0) return -1;
+        } else if (klen == 2 && memcmp(key, "ts", 2) == 0){
+            if (cb_num(&c, &v) != 0) return -1;
+            if (reading_ms(v, &ts_ms) != 0) return -1;
+        } else if (is_rd && c.p < c.end && (*c.p >> 5) == CB_ARRAY){   /* lote */
+            uint64_t na;
+            if (cb_head(&c, &mj, &na) != 0) return -1;
+            for (uint64_t i = 0; i < na; i++){
+                double age = 0.0;
+                if (c.p < c.end && (*c.p >> 5) == CB_ARRAY){
+                    uint64_t two;
+                    if (cb_head(&c, &mj, &two) != 0 || two != 2 || cb_num(&c, &age) != 0) return -1;
+                }
+                if (cb_num(&c, &v) != 0) return -1;
+                if (cnt == max) continue;
+                srec_t* r = &out[cnt++];
+                memset(r, 0, sizeof(*r));
+                r->resource = (*key == 't') ? RES_TEMP : RES_DIST;
+                if (reading_val(v, &r->value) != 0 || reading_ms(age, &r->ts_ms) != 0) return -1;
+            }
+        } else if (is_rd){
+            if (cb_num(&c, &v) != 0) return -1;
+            if (cnt == max) continue;
+            srec_t* r = &out[cnt++];
+            memset(r, 0, sizeof(*r));
+            r->resource = (*key == 't') ? RES_TEMP : RES_DIST;
+            if (reading_val(v, &r->value) != 0) return -1;
+        } else if (cb_skip(&c, 1) != 0) return -1;
+    }
+    if (c.p != c.end) return -1;
+    for (int i = 0; i < cnt; i++){ out[i].device = device; out[i].ts_ms = ts_ms - out[i].ts_ms; }
+    return cnt;
+}
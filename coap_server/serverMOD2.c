@@ -1,268 +1,2091 @@
-// coap_min_server.c — Servidor CoAP mínimo (UDP puro, sin librerías CoAP)
-// Endpoints:
-//   POST /sensor -> apendea el payload a un .txt
-//   GET  /sensor -> devuelve la última línea del .txt
-//
-// Compilar:  gcc -std=c99 -O2 -Wall -Wextra -o coap_min_server coap_min_server.c
-// Ejecutar:  ./coap_min_server
-// Archivo (opcional por env):  COAP_DATAFILE  (default: "/opt/coap/data.txt")
-
-#include <arpa/inet.h>
-#include <netinet/in.h>
-#include <signal.h>
-#include <stdint.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/socket.h>
-#include <unistd.h>
-
-#define COAP_PORT 5683
-#define BUF_SZ    1500
-
-/* --- CoAP básicos --- */
-#define COAP_VER 1
-enum { COAP_CON=0, COAP_NON=1, COAP_ACK=2, COAP_RST=3 };
-#define COAP_GET   0x01
-#define COAP_POST  0x02
-#define COAP_MK(cls,det)   (uint8_t)(((cls)<<5)|(det))
-#define COAP_204_CHANGED   COAP_MK(2,4)
-#define COAP_205_CONTENT   COAP_MK(2,5)
-#define COAP_404_NOTFOUND  COAP_MK(4,4)
-#define COAP_500_INTERR    COAP_MK(5,0)
-#define OPT_URI_PATH        11
-#define OPT_CONTENT_FORMAT  12
-#define CF_TEXT_PLAIN        0
-
-static volatile sig_atomic_t g_stop = 0;
-static void on_sig(int s){ (void)s; g_stop = 1; }
-
-static const char* datafile_path(void){
-    const char* p = getenv("COAP_DATAFILE");
-    return (p && *p) ? p : "/opt/coap/data.txt";
-}
-
-/* --- utilidades de texto/archivo --- */
-static void rstrip(char* s){
-    size_t n = strlen(s);
-    while (n && (s[n-1]=='\n' || s[n-1]=='\r')) s[--n] = '\0';
-}
-
-/* Copia segura con truncado explícito y devuelve bytes copiados */
-static size_t safe_cp(char *dst, size_t dstsz, const char *src) {
-    if (dstsz == 0) return 0;
-    size_t n = strlen(src);
-    if (n > dstsz - 1) n = dstsz - 1;
-    memcpy(dst, src, n);
-    dst[n] = '\0';
-    return n;
-}
-
-static int append_line(const char* path, const char* line){
-    FILE* f = fopen(path, "a");
-    if (!f) return -1;
-    if (fprintf(f, "%s\n", line) < 0){ fclose(f); return -1; }
-    if (fflush(f) != 0){ fclose(f); return -1; }
-    fclose(f);
-    return 0;
-}
-
-static int read_last_line(const char* path, char* out, size_t outsz){
-    FILE* f = fopen(path, "r");
-    if (!f) return 0;
-    char line[2048], last[2048] = {0};
-    while (fgets(line, sizeof(line), f)){
-        rstrip(line);
-        if (line[0]){
-            safe_cp(last, sizeof(last), line);
-        }
-    }
-    fclose(f);
-    if (!last[0]) return 0;
-    safe_cp(out, outsz, last);
-    return 1;
-}
-
-/* --- CoAP parsing/build --- */
-typedef struct {
-    uint8_t type, tkl, code;
-    uint16_t mid;
-    uint8_t token[8];
-    char uri_path[128];
-    const uint8_t* payload; size_t payload_len;
-} coap_req_t;
-
-static int read_ext(uint8_t v, const uint8_t** p, const uint8_t* end){
-    if (v < 13) return v;
-    if (v == 13){ if (*p >= end) return -1; return 13 + *(*p)++; }
-    if (v == 14){ if (*p+1 >= end) return -1; int val = (((*p)[0]<<8)|(*p)[1]); *p+=2; return 269 + val; }
-    return -1;
-}
-static void append_uri_seg(char* dst, size_t dstsz, const char* seg, size_t seglen){
-    size_t cur = strlen(dst);
-    if (seglen == 0 || dstsz == 0) return;
-    if (dst[0] && cur < dstsz-1) dst[cur++] = '/';
-    size_t copy = seglen;
-    if (cur + copy >= dstsz) copy = dstsz - 1 - cur;
-    memcpy(dst + cur, seg, copy);
-    dst[cur + copy] = '\0';
-}
-static int coap_parse(const uint8_t* buf, size_t len, coap_req_t* r){
-    if (len < 4u) return -1;
-    uint8_t ver = (buf[0]>>6) & 0x03;
-    if (ver != COAP_VER) return -1;
-    r->type = (buf[0]>>4) & 0x03;
-    r->tkl  =  buf[0]     & 0x0F;
-    r->code =  buf[1];
-    r->mid  = (uint16_t)((buf[2]<<8) | buf[3]);
-    if ((size_t)4 + (size_t)r->tkl > len || r->tkl > 8) return -1;
-    memcpy(r->token, buf+4, r->tkl);
-    const uint8_t* p = buf + 4 + r->tkl;
-    const uint8_t* end = buf + len;
-    r->uri_path[0] = '\0';
-    int last = 0;
-    while (p < end && *p != 0xFF){
-        uint8_t b = *p++;
-        int d = read_ext((b>>4)&0x0F, &p, end);
-        int l = read_ext( b     &0x0F, &p, end);
-        if (d < 0 || l < 0) return -1;
-        int num = last + d;
-        if ((size_t)(p + l) > (size_t)end) return -1;
-        if (num == OPT_URI_PATH){
-            append_uri_seg(r->uri_path, sizeof(r->uri_path), (const char*)p, (size_t)l);
-        }
-        p += l; last = num;
-    }
-    if (p < end && *p == 0xFF){
-        p++;
-        r->payload = p;
-        r->payload_len = (size_t)(end - p);
-    } else { r->payload = NULL; r->payload_len = 0; }
-    return 0;
-}
-
-static int add_option(uint8_t* out, size_t cap, int* last, int number, const uint8_t* val, size_t vlen){
-    if (cap < 1u) return -1;
-    int delta = number - *last;
-    uint8_t dl, ll, dext[2], lext[2]; size_t dextn=0, lextn=0;
-    if (delta < 13){ dl=(uint8_t)delta; }
-    else if (delta < 269){ dl=13; dext[dextn++]=(uint8_t)(delta-13); }
-    else { dl=14; int D=delta-269; dext[dextn++]=(uint8_t)((D>>8)&0xFF); dext[dextn++]=(uint8_t)(D&0xFF); }
-    if (vlen < 13u){ ll=(uint8_t)vlen; }
-    else if (vlen < 269u){ ll=13; lext[lextn++]=(uint8_t)(vlen-13u); }
-    else { ll=14; size_t K=vlen-269u; lext[lextn++]=(uint8_t)((K>>8)&0xFF); lext[lextn++]=(uint8_t)(K&0xFF); }
-    size_t need = 1u + dextn + lextn + vlen;
-    if (cap < need) return -1;
-    uint8_t* q = out;
-    *q++ = (uint8_t)((dl<<4)|ll);
-    for (size_t i=0;i<dextn;i++) *q++ = dext[i];
-    for (size_t i=0;i<lextn;i++) *q++ = lext[i];
-    if (vlen && val){ memcpy(q, val, vlen); q += vlen; }
-    *last = number;
-    return (int)need;
-}
-
-static size_t build_resp(uint8_t* out, size_t cap,
-                         uint8_t req_type, uint8_t tkl, const uint8_t* tok,
-                         uint16_t mid, uint8_t code,
-                         const uint8_t* payload, size_t plen){
-    if (cap < 4u + (size_t)tkl) return 0;
-    uint8_t type = (req_type == COAP_CON) ? COAP_ACK : COAP_NON;
-    out[0] = (uint8_t)((COAP_VER<<6) | (type<<4) | (tkl & 0x0F));
-    out[1] = code;
-    out[2] = (uint8_t)(mid>>8);
-    out[3] = (uint8_t)(mid & 0xFF);
-    memcpy(out+4, tok, tkl);
-    size_t pos = 4u + (size_t)tkl;
-
-    int last = 0;
-    uint8_t cf = CF_TEXT_PLAIN;
-    int n = add_option(out+pos, cap-pos, &last, OPT_CONTENT_FORMAT, &cf, 1u);
-    if (n < 0) return 0;
-    pos += (size_t)n;
-
-    if (payload && plen > 0){
-        if (pos + 1u + plen > cap) return 0;
-        out[pos++] = 0xFF;
-        memcpy(out+pos, payload, plen);
-        pos += plen;
-    }
-    return pos;
-}
-
-/* --- main --- */
-int main(void){
-    signal(SIGINT, on_sig);
-    signal(SIGTERM, on_sig);
-
-    const char* DATA = datafile_path();
-    printf("CoAP min server on 0.0.0.0:%d\n", COAP_PORT);
-    printf("datafile=%s\n", DATA);
-    fflush(stdout);
-
-    int fd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (fd < 0){ perror("socket"); return 1; }
-    struct sockaddr_in a; memset(&a,0,sizeof(a));
-    a.sin_family = AF_INET; a.sin_addr.s_addr = htonl(INADDR_ANY); a.sin_port = htons(COAP_PORT);
-    if (bind(fd, (struct sockaddr*)&a, sizeof(a)) != 0){ perror("bind"); close(fd); return 1; }
-
-    uint8_t inbuf[BUF_SZ], outbuf[BUF_SZ];
-
-    while (!g_stop){
-        struct sockaddr_in cli; socklen_t clen = sizeof(cli);
-        ssize_t n = recvfrom(fd, inbuf, sizeof(inbuf), 0, (struct sockaddr*)&cli, &clen);
-        if (n <= 0) continue;
-
-        coap_req_t req;
-        if (coap_parse(inbuf, (size_t)n, &req) != 0) continue;
-
-        char resp[1200] = {0};
-        size_t rlen = 0;
-        uint8_t rcode = COAP_404_NOTFOUND;
-
-        /* cuerpo textual (si viene) */
-        char body[1024] = {0};
-        if (req.payload_len > 0){
-            size_t L = req.payload_len < sizeof(body)-1 ? req.payload_len : sizeof(body)-1;
-            memcpy(body, req.payload, L); body[L] = '\0';
-        }
-
-        if (strcmp(req.uri_path, "sensor") == 0){
-            if (req.code == COAP_POST){ /* guardar */
-                if (append_line(DATA, body) == 0){
-                    rlen  = safe_cp(resp, sizeof(resp), "UPDATED");
-                    rcode = COAP_204_CHANGED;
-                } else {
-                    rlen  = safe_cp(resp, sizeof(resp), "WRITE_FAIL");
-                    rcode = COAP_500_INTERR;
-                }
-            } else if (req.code == COAP_GET){ /* devolver último */
-                char last[2048] = {0};
-                if (read_last_line(DATA, last, sizeof(last))){
-                    rlen  = safe_cp(resp, sizeof(resp), last);
-                } else {
-                    rlen  = safe_cp(resp, sizeof(resp), "NO_DATA");
-                }
-                rcode = COAP_205_CONTENT;
-            } else {
-                rlen  = safe_cp(resp, sizeof(resp), "NOT_FOUND");
-                rcode = COAP_404_NOTFOUND;
-            }
-        } else {
-            rlen  = safe_cp(resp, sizeof(resp), "NOT_FOUND");
-            rcode = COAP_404_NOTFOUND;
-        }
-
-        size_t outlen = build_resp(outbuf, sizeof(outbuf),
-                                   req.type, req.tkl, req.token, req.mid,
-                                   rcode, (const uint8_t*)resp, rlen);
-        if (outlen > 0){
-            sendto(fd, outbuf, outlen, 0, (struct sockaddr*)&cli, clen);
-        }
-    }
-
-    close(fd);
-    puts("bye");
-    return 0;
-}
-
+// coap_min_server.c — Servidor CoAP mínimo (UDP puro, sin librerías CoAP)
+// Endpoints (tabla de rutas en register_routes()):
+//   POST|PUT /sensor[/temp|/dist] -> decodifica el JSON y guarda registros binarios
+//                                    por dispositivo ("id" del cuerpo; 0 si no viene);
+//                                    {"t":[[age,v],...]} trae un lote (ver reading.h);
+//                                    Content-Format 60 (CBOR) y 112 (SenML+CBOR) en senml.h
+//                                    (un dispositivo nuevo con la tabla del almacén llena: 5.03)
+//   GET      /sensor[/temp|/dist] -> devuelve la última lectura (caché en memoria, sembrada del .txt)
+//   GET      /sensor?from=&to=&device=&limit=&skip=  -> historial (JSON) leído de los segmentos
+//            from/to en ms epoch (inclusive); device por defecto el de la ruta; si no cabe
+//            en BLK_REPR_MAX el arreglo termina en {"next":N}: seguir con skip=N
+// Respuestas grandes salen por Block2 y los cuerpos grandes pueden subir por Block1
+// (RFC 7959, bloques de 16 a 1024 bytes; ver blockwise.h).
+//   GET      /sensor/{id}/stats?window=1h  -> count/avg/min/max por recurso sobre la ventana
+//            (window en s, o con sufijo s/m/h/d; default 1h; ver rollup.h). También /device/{id}/stats
+//   DELETE   /sensor[/temp|/dist] -> olvida la última lectura en memoria (el .txt no se toca)
+//   GET|POST|PUT|DELETE /device/{id} -> igual, con el dispositivo tomado de la ruta
+//            (un "id" distinto en el cuerpo da 4.00); lo que llega a /sensor con "id"
+//            N se cachea y notifica como /device/N
+//   GET      /.well-known/core    -> recursos en link-format
+//   GET      /metrics[?fmt=prom]  -> contadores y latencias (JSON, o texto de Prometheus; ver metrics.h)
+// Con COAP_OSCORE_KEYS cada petición puede venir protegida con OSCORE (RFC 8613,
+// PSK por dispositivo; ver oscore.h): se descifra en el worker, se atiende como
+// el mensaje interno y la respuesta sale cifrada. Sin handshake: un sensor que
+// despierta del deep sleep manda su primera petición ya protegida.
+// Una CON que supera su límite (o llega con la cola del escritor saturada)
+// recibe 5.03 con Max-Age = segundos hasta poder reintentar; coap_min.h no manda
+// nada nuevo hasta entonces. Las NON en esa situación se descartan sin respuesta.
+// GET con Observe=0 sobre /sensor[...] y /device/{id} suscribe al cliente: cada
+// POST/PUT le llega como notificación (RFC 7641; ver observe.h). Observe=1 da de baja.
+// Con COAP_CLUSTER varios nodos se reparten los dispositivos por hashing
+// consistente (ver cluster.h): cada nodo acepta POST/PUT de cualquiera y el
+// escritor reenvía los registros ajenos por lotes al dueño (TCP, sin esperar);
+// GET y Observe sobre datos de un dispositivo ajeno se retransmiten al dueño
+// desde el worker y la respuesta vuelve al cliente con su token (firmado con
+// COAP_CLUSTER_KEY; una opción de salto que no verifica recibe 4.02). SIGHUP relee
+// el anillo: los segmentos que cambian de dueño se traspasan en segundo plano
+// y se borran sólo cuando el nuevo dueño los confirma.
+// Arranque en caliente (ver snapshot.h): cada COAP_SNAPSHOT_MS y al salir se
+// guarda <datadir>/state.snap con el catálogo de segmentos, las últimas
+// lecturas y los suscriptores; la de salida limpia lleva además agregados,
+// ventanas OSCORE y dedup. Al arrancar se mapea y sólo se releen los segmentos
+// que cambiaron desde entonces. Para actualizar sin cortar, se lanza el binario
+// nuevo con el mismo entorno: toma los sockets del proceso en marcha por
+// COAP_HANDOVER, éste sale guardando su instantánea y el nuevo la carga.
+//
+// Cada hilo (workers y escritor) es un bucle epoll con su rueda de timers
+// (timer_wheel.h): reenvío de notificaciones CON, caducidad de sesiones Block,
+// vaciado de segmentos/texto y guardado de agregados. El escritor sólo se
+// despierta con su eventfd cuando está dormido; la señal de parada es otro
+// eventfd que despierta a todos.
+//
+// Compilar:  make server  (gcc -std=c11 -O2 -Wall -Wextra -pthread -o coap_min_server serverMOD2.c -lcrypto)
+// Ejecutar:  ./coap_min_server [--workers N]
+//   --workers N  N hilos, cada uno con su socket SO_REUSEPORT en el mismo puerto
+//                (el kernel reparte los datagramas); default 1
+// Segmentos (env):             COAP_DATADIR      (default: "/opt/coap/seg"; ver storage.h)
+//                              COAP_SEG_MAX_KB   (default: 4096; rotación/compactación)
+//                              COAP_SEG_FLUSH_MS (default: 1000; vaciado por dispositivo)
+// Exportación de texto (env):  COAP_TEXT_EXPORT  (default: 0; 1 = además apendea cada payload)
+//                              COAP_DATAFILE     (default: "/opt/coap/data.txt")
+// Escritura por lotes (env):   COAP_FLUSH_MS  (default: 50; 0 = escribir en cada POST)
+//                              COAP_FSYNC     (default: 0; 1 = fdatasync tras cada lote)
+// Agregados (env):             COAP_ROLLUP_FLUSH_MS (default: 10000; cada cuánto se guardan)
+// Bloques (env):               COAP_BLOCK_MAX (default: 1024; 16..1024, tamaño máx. de bloque)
+// Observe (env):               COAP_OBS_CON   (default: 0 = notificar en NON; N = una de cada N en CON)
+// Memoria (env, ver pool.h):   COAP_DEDUP_SLOTS (4096), COAP_RATE_SLOTS (4096), COAP_BLK_SESSIONS (16),
+//                              COAP_OBS_RTX (32), COAP_PROXY_SLOTS (256; sólo en clúster)
+//                              por worker; COAP_OBS_SLOTS (64) suscriptores en total.
+//                              Todo se reserva al arrancar; el total se imprime.
+// Estadísticas (env):          COAP_STATS_S   (default: 0; cada N s imprime rx/tx y lote medio)
+//                              COAP_METRICS_PORT (default: 0; N = GET /metrics por HTTP en TCP N)
+// OSCORE (env):                COAP_OSCORE_KEYS    (default: ""; archivo "kid secret [salt]" en hex)
+//                              (la cota del Partial IV propio del servidor va en <datadir>/oscore.ssn)
+//                              COAP_OSCORE_SID     (default: vacío; Sender ID del servidor, hex)
+//                              COAP_OSCORE_REQUIRE (default: 0; 1 = 4.01 a toda petición sin proteger)
+// Límite de tasa (env):        COAP_RATE_PPS     (default: 0 = sin límite; peticiones/s por IP:puerto, admite "0.5")
+//                              COAP_RATE_BURST   (default: la tasa redondeada arriba, mínimo 1)
+//                              COAP_DEV_RATE_PPS / COAP_DEV_RATE_BURST: igual por dispositivo
+//                              (kid de OSCORE, o el {id} de POST/PUT a /device/{id} o el "id" del
+//                              cuerpo en /sensor); por worker, ver ratelimit.h
+// Descarte (env):              COAP_SHED_HWM     (default: 2048 de 4096 celdas; 0 = nunca)
+//                              con la cola del escritor en la marca se tiran las escrituras NON;
+//                              a 3/4 del resto, las CON reciben 5.03 con Max-Age
+// Clúster (env):               COAP_CLUSTER      (default: ""; archivo "nombre ip:puerto puerto_enlace [peso]")
+//                              COAP_CLUSTER_SELF (nombre del nodo propio; su puerto CoAP reemplaza 5683)
+//                              COAP_CLUSTER_FLUSH_MS (default: 5; demora máx. de un lote reenviado)
+//                              COAP_CLUSTER_KEY  (obligatoria con COAP_CLUSTER; 16-32 bytes en hex, la misma
+//                                                 en todos los nodos: firma lo que el proxy reenvía)
+// Arranque en caliente (env):  COAP_SNAPSHOT_MS  (default: 10000; 0 = sólo la instantánea de salida)
+//                              COAP_HANDOVER     (default: "<datadir>/handover.sock"; "" = sin traspaso)
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "batch_writer.h"
+#include "blockwise.h"
+#include "cluster.h"
+#include "coap_msg.h"
+#include "dedup.h"
+#include "line_queue.h"
+#include "metrics.h"
+#include "observe.h"
+#include "oscore.h"
+#include "pool.h"
+#include "ratelimit.h"
+#include "reading.h"
+#include "rollup.h"
+#include "router.h"
+#include "senml.h"
+#include "snapshot.h"
+#include "storage.h"
+#include "timer_wheel.h"
+
+#define COAP_PORT 5683     /* default; en clúster, el del nodo propio */
+#define BUF_SZ    1500
+#define MAX_WORKERS 64
+#define RX_BATCH    32    /* datagramas por recvmmsg/sendmmsg */
+#define SHED_RETRY_S 1    /* Max-Age del 5.03 por cola llena */
+#define RX_ROUNDS   8     /* lotes por despertar antes de atender timers */
+#define TW_TICK_MS  10
+#define BLK_SWEEP_MS 5000u
+#define OBS_RTX_SLOTS 32  /* default de CON de Observe en reenvío por worker (COAP_OBS_RTX) */
+#define SNAP_WAIT_MS 10000 /* espera máx. a que el proceso anterior termine en un traspaso */
+
+#define LQ_RECS_MAX          (int)(LQ_LINE_MAX / sizeof(srec_t))
+
+static volatile sig_atomic_t g_stop = 0;
+static uint16_t g_port = COAP_PORT;
+static int g_stop_fd = -1;   /* eventfd: queda legible al parar y despierta a todos los epoll */
+static void on_sig(int s){
+    (void)s; g_stop = 1;
+    uint64_t one = 1;
+    if (g_stop_fd >= 0 && write(g_stop_fd, &one, sizeof(one)) < 0){ /* nada que hacer en la señal */ }
+}
+
+static const char* datafile_path(void){
+    const char* p = getenv("COAP_DATAFILE");
+    return (p && *p) ? p : "/opt/coap/data.txt";
+}
+
+static const char* datadir_path(void){
+    const char* p = getenv("COAP_DATADIR");
+    return (p && *p) ? p : "/opt/coap/seg";
+}
+
+static unsigned env_uint(const char* name, unsigned def){
+    const char* p = getenv(name);
+    return (p && *p) ? (unsigned)strtoul(p, NULL, 10) : def;
+}
+
+static int64_t wall_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/* --- utilidades de texto/archivo --- */
+static void rstrip(char* s){
+    size_t n = strlen(s);
+    while (n && (s[n-1]=='\n' || s[n-1]=='\r')) s[--n] = '\0';
+}
+
+/* Copia segura con truncado explícito y devuelve bytes copiados */
+static size_t safe_cp(char *dst, size_t dstsz, const char *src) {
+    if (dstsz == 0) return 0;
+    size_t n = strlen(src);
+    if (n > dstsz - 1) n = dstsz - 1;
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+    return n;
+}
+
+/* Lee la última línea no vacía con un único seek hacia atrás desde el final
+ * (sin recorrer el archivo). Sólo se usa al arrancar para sembrar la caché. */
+static int read_tail_line(const char* path, char* out, size_t outsz){
+    FILE* f = fopen(path, "r");
+    if (!f) return 0;
+    char blk[2048];
+    long sz = (fseek(f, 0, SEEK_END) == 0) ? ftell(f) : -1;
+    long off = sz > (long)sizeof(blk)-1 ? sz - ((long)sizeof(blk)-1) : 0;
+    size_t n = 0;
+    if (sz > 0 && fseek(f, off, SEEK_SET) == 0) n = fread(blk, 1, sizeof(blk)-1, f);
+    fclose(f);
+    blk[n] = '\0';
+    rstrip(blk);
+    char* nl = strrchr(blk, '\n');
+    const char* line = nl ? nl + 1 : blk;
+    if (!line[0]) return 0;
+    safe_cp(out, outsz, line);
+    return 1;
+}
+
+/* --- caché en memoria de la última lectura --- */
+/* Una entrada por clave: el recurso ("sensor", "sensor/temp") o el dispositivo
+ * ("device/42"). POST la actualiza y GET responde desde RAM sin tocar el archivo.
+ * Hash de direccionamiento abierto con lugar para todos los dispositivos del
+ * almacén a media carga; si aun así falta, GET y Observe van a st_query_last().
+ * Compartida entre workers: las copias entran/salen bajo g_last_mu. */
+#define LAST_MAX    2048
+#define LAST_SLOTS  (2u * ST_MAX_DEVICES)   /* potencia de 2 */
+
+typedef struct {
+    char   key[64];                 /* "" = libre */
+    char   val[LAST_MAX];
+    size_t len;
+} last_entry_t;
+
+static last_entry_t g_last[LAST_SLOTS];
+static size_t       g_last_n = 0;
+static pthread_mutex_t g_last_mu = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t last_hash(const char* key){ return fnv1a(2166136261u, (const uint8_t*)key, strlen(key)) & (LAST_SLOTS - 1u); }
+
+/* Entrada de key, o el hueco libre donde iría (create); NULL si no está o no
+ * hay lugar. Siempre queda al menos un hueco: el sondeo termina */
+static last_entry_t* last_find(const char* key, int create){
+    for (uint32_t i = last_hash(key), k = 0; k < LAST_SLOTS; i = (i + 1u) & (LAST_SLOTS - 1u), k++){
+        last_entry_t* e = &g_last[i];
+        if (e->key[0] && strcmp(e->key, key) == 0) return e;
+        if (e->key[0]) continue;
+        if (!create || g_last_n + 1u >= LAST_SLOTS) return NULL;
+        safe_cp(e->key, sizeof(e->key), key);
+        g_last_n++;
+        return e;
+    }
+    return NULL;
+}
+
+static int last_put(const char* key, const char* val, size_t len){
+    pthread_mutex_lock(&g_last_mu);
+    last_entry_t* e = last_find(key, 1);
+    if (!e){ pthread_mutex_unlock(&g_last_mu); return -1; }
+    if (len > sizeof(e->val)-1) len = sizeof(e->val)-1;
+    memcpy(e->val, val, len);
+    e->val[len] = '\0';
+    e->len = len;
+    pthread_mutex_unlock(&g_last_mu);
+    return 0;
+}
+
+/* Copia la última lectura de key en out (sin terminador); bytes copiados o -1 si no hay */
+static long last_get(const char* key, uint8_t* out, size_t cap){
+    long n = -1;
+    pthread_mutex_lock(&g_last_mu);
+    const last_entry_t* e = last_find(key, 0);
+    if (e){ n = (long)(e->len < cap ? e->len : cap); memcpy(out, e->val, (size_t)n); }
+    pthread_mutex_unlock(&g_last_mu);
+    return n;
+}
+
+/* Borrado con corrimiento hacia atrás: las entradas que sondearon más allá del
+ * hueco vuelven a quedar alcanzables sin marcas de borrado */
+static void last_del(const char* key){
+    pthread_mutex_lock(&g_last_mu);
+    last_entry_t* e = last_find(key, 0);
+    if (e){
+        uint32_t i = (uint32_t)(e - g_last), j = i;
+        for (;;){
+            j = (j + 1u) & (LAST_SLOTS - 1u);
+            if (!g_last[j].key[0]) break;
+            uint32_t h = last_hash(g_last[j].key);
+            if (((j - h) & (LAST_SLOTS - 1u)) < ((j - i) & (LAST_SLOTS - 1u))) continue;   /* h en (i, j]: se queda */
+            g_last[i] = g_last[j];
+            i = j;
+        }
+        g_last[i].key[0] = '\0';
+        g_last_n--;
+    }
+    pthread_mutex_unlock(&g_last_mu);
+}
+
+/* La caché entera a la instantánea (las entradas tal cual) */
+#define SN_LAST  SN_TAG('L','A','S','T')
+
+static void last_snap_save(sn_buf_t* b){
+    pthread_mutex_lock(&g_last_mu);
+    sn_section(b, SN_LAST, sizeof(last_entry_t));
+    for (size_t i = 0; i < LAST_SLOTS; i++){
+        if (!g_last[i].key[0]) continue;
+        last_entry_t* e = (last_entry_t*)sn_item(b);
+        if (e) *e = g_last[i];
+    }
+    pthread_mutex_unlock(&g_last_mu);
+}
+
+static void last_snap_load(const sn_t* sn){
+    uint64_t n;
+    const last_entry_t* e = (const last_entry_t*)sn_find(sn, SN_LAST, sizeof(last_entry_t), &n);
+    for (uint64_t i = 0; e && i < n; i++)
+        if (e[i].key[0] && e[i].len < sizeof(e[i].val)) last_put(e[i].key, e[i].val, e[i].len);
+}
+
+static void last_seed(const char* path, const char* key){
+    char tail[LAST_MAX];
+    if (read_tail_line(path, tail, sizeof(tail))) last_put(key, tail, strlen(tail));
+}
+
+/* Clave de caché de la última lectura de un dispositivo */
+static void dev_key(uint32_t dev, char* key, size_t cap){
+    if (dev == 0) snprintf(key, cap, "sensor");
+    else          snprintf(key, cap, "device/%u", dev);
+}
+
+/* Siembra la caché con el último registro de cada dispositivo leído al abrir;
+ * los que vinieron intactos de la instantánea ya tienen el suyo */
+static void seed_from_store(store_t* st){
+    for (uint32_t i = 0; i < ST_MAX_DEVICES; i++){
+        const sdev_t* d = &st->devs[i];
+        srec_t r; char key[RT_PATH_MAX], val[64];
+        if (!d->used || !d->scanned || st_last(st, d, &r) != 0) continue;
+        dev_key(d->device, key, sizeof(key));
+        last_put(key, val, reading_format(&r, val, sizeof(val)));
+    }
+}
+
+/* --- persistencia: workers -> cola sin locks -> hilo escritor --- */
+typedef struct {
+    store_t*   st;
+    rollup_t*  ru;
+    bwriter_t* text;     /* NULL si COAP_TEXT_EXPORT=0 */
+} persist_t;
+
+static lqueue_t g_lq;
+static atomic_int g_wr_stop = 0;
+static int g_text_export = 0;
+
+/* El escritor duerme en epoll sobre g_wr_fd (eventfd) hasta el próximo timer.
+ * Para no pagar un write() por POST, sólo se lo despierta si anunció que se
+ * iba a dormir (g_wr_idle); antes de dormir vuelve a mirar la cola. */
+static int g_wr_fd = -1;
+static atomic_int g_wr_idle = 0;
+static mx_t g_wr_mx;               /* del hilo escritor: append y bytes escritos */
+
+static void wr_kick(void){
+    uint64_t one = 1;
+    if (atomic_exchange(&g_wr_idle, 0) && write(g_wr_fd, &one, sizeof(one)) < 0) perror("wr_kick");
+}
+
+/* --- clúster (ver cluster.h) --- */
+static _Atomic(cl_ring_t*) g_ring = NULL;   /* NULL = nodo único; lo reemplaza el SIGHUP */
+static cl_mbx_t g_cl_mbx;                   /* escritor -> worker 0: claves a notificar */
+static int g_cl_mbx_fd = -1;                /* eventfd del buzón */
+static int g_cl_lfd = -1;                   /* escucha de enlaces entrantes */
+static unsigned g_cl_flush_ms = 5;
+static cl_key_t g_cl_key;                   /* firma la opción de salto entre pares */
+
+static cl_ring_t* cl_ring(void){ return atomic_load_explicit(&g_ring, memory_order_acquire); }
+
+#define WR_EVENTS      16
+#define WR_CONNS       64           /* enlaces entrantes */
+#define HO_STEP_MS     10u          /* paso del traspaso: lo que quepa en el enlace */
+#define HO_ACK_MS      10000u       /* sin ACK en este tiempo se repite el segmento */
+
+/* Etiquetas de epoll del escritor: tipo en los 32 bits altos, índice en los bajos */
+enum { WR_EV_WAKE = 0, WR_EV_LISTEN = 1, WR_EV_LINK = 2, WR_EV_CONN = 3 };
+#define WR_TAG(kind, i)  ((uint64_t)(kind) << 32 | (uint32_t)(i))
+
+typedef struct {
+    cl_conn_t   c;                  /* primero: el handler de tramas recibe &c */
+    st_import_t im;
+    int         importing;
+} wr_conn_t;
+
+/* Traspaso en curso: un segmento cerrado de un dispositivo que ya no es nuestro */
+typedef struct {
+    int      node;                  /* destino; -1 = ninguno en curso */
+    int      wait;                  /* ya salió la trama LAST: esperando el ACK */
+    uint32_t dev, seq, off, tag;
+    uint32_t scan;                  /* próximo st->devs a mirar; ST_MAX_DEVICES = terminado */
+    uint64_t sent_ms;
+} wr_handoff_t;
+
+typedef struct {
+    persist_t* ps;
+    twheel_t   tw;
+    tw_timer_t flush, rollup, clflush, handoff;
+    int        ep;
+    cl_ring_t* ring;                /* el que usa el escritor (NULL = sin clúster) */
+    cl_link_t  link[CL_NODES_MAX];  /* por índice de nodo; buf NULL = propio o sin memoria */
+    wr_conn_t  conn[WR_CONNS];
+    wr_handoff_t ho;
+    srec_t     tmp[CL_FRAME_RECS];
+} wr_state_t;
+
+/* Vence el primer pendiente de segmentos o texto: vaciar y re-armar para el siguiente */
+static void wr_flush_due(tw_timer_t* t, void* arg, uint64_t now){
+    wr_state_t* w = (wr_state_t*)arg;
+    st_poll(w->ps->st, now, 0);
+    if (w->ps->text) bw_poll(w->ps->text, now);
+    mx_set(&g_wr_mx, M_BYTES_WR, w->ps->st->bytes + (w->ps->text ? (unsigned long)w->ps->text->tail : 0ul));
+    int64_t due = st_due_ms(w->ps->st, now), bd = w->ps->text ? bw_due_ms(w->ps->text, now) : -1;
+    if (due < 0 || (bd >= 0 && bd < due)) due = bd;
+    if (due >= 0) tw_add(&w->tw, t, now, (uint64_t)due, wr_flush_due, w);
+}
+
+static void wr_rollup_due(tw_timer_t* t, void* arg, uint64_t now){
+    wr_state_t* w = (wr_state_t*)arg;
+    ru_poll(w->ps->ru, now, 1);
+    tw_add(&w->tw, t, now, w->ps->ru->flush_ms ? w->ps->ru->flush_ms : 1000u, wr_rollup_due, w);
+}
+
+/* Registros de otro nodo ya guardados: caché de última lectura y aviso a
+ * worker 0 para que notifique a los observadores de cada dispositivo */
+static void wr_publish(const srec_t* recs, size_t n){
+    int any = 0;
+    for (size_t i = 0; i < n; ){
+        const srec_t* nw = &recs[i];
+        size_t j = i + 1u;
+        for (; j < n && recs[j].device == recs[i].device; j++) if (recs[j].ts_ms >= nw->ts_ms) nw = &recs[j];
+        char key[RT_PATH_MAX], val[64];
+        dev_key(nw->device, key, sizeof(key));
+        last_put(key, val, reading_format(nw, val, sizeof(val)));
+        any |= cl_mbx_push(&g_cl_mbx, key) == 0;
+        i = j;
+    }
+    uint64_t one = 1;
+    if (any && write(g_cl_mbx_fd, &one, sizeof(one)) < 0) perror("cluster mbx");
+}
+
+static void wr_store(wr_state_t* w, const srec_t* recs, size_t n, int remote, uint64_t now){
+    uint64_t t0 = mx_now_ns();
+    size_t ok = st_append(w->ps->st, recs, n, now);
+    mx_rec(&g_wr_mx, H_APPEND, mx_now_ns() - t0);
+    mx_add(&g_wr_mx, M_RECS, ok);
+    if (ok < n) mx_add(&g_wr_mx, M_REC_DROP, n - ok);
+    ru_add(w->ps->ru, recs, n);
+    if (remote) wr_publish(recs, n);
+    if (!tw_armed(&w->flush)) wr_flush_due(&w->flush, w, now);
+}
+
+/* Conecta si hace falta y vacía el enlace i; un fd nuevo entra al epoll del
+ * escritor (edge-triggered: EPOLLOUT avisa de la conexión y del lugar en el socket) */
+static void wr_link_io(wr_state_t* w, uint32_t i, uint64_t now){
+    cl_link_t* l = &w->link[i];
+    if (l->state == CL_DOWN && l->len > l->off && cl_link_connect(l, now) == 0 && l->fd >= 0){
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.u64 = WR_TAG(WR_EV_LINK, i) };
+        if (epoll_ctl(w->ep, EPOLL_CTL_ADD, l->fd, &ev) != 0) cl_link_close(l, now);
+    }
+    cl_link_flush(l, now);
+}
+
+/* Vacía los enlaces con algo pendiente y re-arma mientras quede algo */
+static void wr_clflush_due(tw_timer_t* t, void* arg, uint64_t now){
+    wr_state_t* w = (wr_state_t*)arg;
+    uint64_t next = 0;
+    for (uint32_t i = 0; w->ring && i < w->ring->nnodes; i++){
+        cl_link_t* l = &w->link[i];
+        if (!l->buf || l->len == l->off) continue;
+        wr_link_io(w, i, now);
+        if (l->len == l->off) continue;
+        uint64_t d = l->state == CL_UP ? g_cl_flush_ms : (l->retry_at > now ? l->retry_at - now : 1u);
+        if (!next || d < next) next = d;
+    }
+    if (next) tw_add(&w->tw, t, now, next, wr_clflush_due, w);
+}
+
+/* Registros al enlace del nodo o: se juntan con los anteriores en la misma
+ * trama y salen con el timer, o antes si ya hay un cuarto del búfer */
+static void wr_forward(wr_state_t* w, uint32_t o, uint8_t hops, const srec_t* recs, size_t n, uint64_t now){
+    cl_link_t* l = &w->link[o];
+    if (!l->buf){ wr_store(w, recs, n, hops > 0, now); return; }
+    uint32_t k = cl_link_recs(l, hops, w->ring->gen, recs, (uint32_t)n, now);
+    mx_add(&g_wr_mx, M_FWD, k);
+    if (k < n) mx_add(&g_wr_mx, M_FWD_DROP, n - k);
+    if (l->len - l->off >= CL_LINK_BUF / 4u) wr_link_io(w, o, now);
+    if (l->len > l->off && !tw_armed(&w->clflush)) tw_add(&w->tw, &w->clflush, now, g_cl_flush_ms, wr_clflush_due, w);
+}
+
+/* Reparte un lote por dueño (en tramos seguidos del mismo dueño, el caso común
+ * de un POST): lo propio se guarda, lo ajeno va a su enlace. hops = saltos que
+ * ya dio el lote: 0 si viene de un worker, 1 si llegó de otro nodo; uno que
+ * llegó reenviado por un nodo con el anillo viejo (hops 2) se guarda aquí. */
+static void wr_route(wr_state_t* w, const srec_t* recs, size_t n, uint8_t hops, uint64_t now){
+    const cl_ring_t* r = w->ring;
+    if (!r || hops >= 2u){ wr_store(w, recs, n, hops > 0, now); return; }
+    for (size_t i = 0; i < n; ){
+        uint32_t o = cl_owner(r, recs[i].device);
+        size_t j = i + 1u;
+        while (j < n && (recs[j].device == recs[i].device || cl_owner(r, recs[j].device) == o)) j++;
+        if ((int32_t)o == r->self) wr_store(w, recs + i, j - i, hops > 0, now);
+        else                       wr_forward(w, o, hops, recs + i, j - i, now);
+        i = j;
+    }
+}
+
+static int wr_drain(wr_state_t* w, uint8_t* item){
+    size_t n; uint8_t kind; int got = 0;
+    uint64_t now = now_ms();
+    while (lq_pop(&g_lq, &kind, item, &n)){
+        if (kind == LQ_RECS) wr_route(w, (const srec_t*)(const void*)item, n / sizeof(srec_t), 0, now);
+        else if (w->ps->text && bw_append(w->ps->text, (const char*)item, n) != 0)
+            mx_add(&g_wr_mx, M_TEXT_DROP, 1);   /* lo ya encolado en el anillo se reintenta en bw_poll */
+        got = 1;
+    }
+    return got;
+}
+
+/* --- traspaso de dispositivos al cambiar el anillo --- */
+static void wr_handoff_due(tw_timer_t* t, void* arg, uint64_t now);
+
+static void wr_handoff_arm(wr_state_t* w, uint64_t now, uint64_t ms){
+    tw_add(&w->tw, &w->handoff, now, ms, wr_handoff_due, w);
+}
+
+/* ACK del par: el segmento ya está en su disco y se borra del nuestro */
+static void wr_on_ack(void* arg, uint32_t tag){
+    wr_state_t* w = (wr_state_t*)arg;
+    wr_handoff_t* h = &w->ho;
+    if (h->node < 0 || !h->wait || tag != h->tag) return;
+    sdev_t* d = st_dev(w->ps->st, h->dev, 0);
+    if (d) st_drop_seg(w->ps->st, d, h->seq);
+    h->node = -1; h->wait = 0;
+    wr_handoff_arm(w, now_ms(), 1u);
+}
+
+/* Un paso del traspaso: elige el próximo segmento de un dispositivo ajeno y
+ * manda las tramas que quepan en el enlace de su dueño, sin frenar la cola: el
+ * resto en el próximo paso. Los segmentos van de a uno y del más viejo al más
+ * nuevo; lo que siga llegando para ese dispositivo ya se reenvía al dueño.
+ * Si un dispositivo recibe algo tarde (un nodo con el anillo viejo), queda en
+ * un segmento nuevo que se traspasa en la misma vuelta. */
+static void wr_handoff_due(tw_timer_t* t, void* arg, uint64_t now){
+    (void)t;
+    wr_state_t* w = (wr_state_t*)arg;
+    wr_handoff_t* h = &w->ho;
+    store_t* st = w->ps->st;
+    const cl_ring_t* r = w->ring;
+    if (!r) return;
+    if (h->wait && now - h->sent_ms < HO_ACK_MS){ wr_handoff_arm(w, now, 100u); return; }
+    if (h->wait){ h->wait = 0; h->node = -1; }                /* sin ACK: se repite */
+    sdev_t* d = NULL;
+    uint32_t i = 0;
+    if (h->node >= 0){
+        d = st_dev(st, h->dev, 0);
+        while (d && i < d->nsegs && d->segs[i].seq != h->seq) i++;
+        if (!d || i == d->nsegs) h->node = -1;                 /* se compactó o se borró: elegir de nuevo */
+    }
+    while (h->node < 0){
+        for (; h->scan < ST_MAX_DEVICES; h->scan++){
+            d = &st->devs[h->scan];
+            if (d->used && d->nsegs && !cl_is_self(r, d->device)) break;
+        }
+        if (h->scan == ST_MAX_DEVICES){
+            printf("cluster: traspaso terminado (anillo gen %u)\n", r->gen); fflush(stdout);
+            return;
+        }
+        if (st_seal(st, d, now) != 0){ wr_handoff_arm(w, now, 1000u); return; }
+        i = 0;
+        if (d->segs[0].nrec == 0){ st_drop_seg(st, d, d->segs[0].seq); continue; }
+        h->node = (int)cl_owner(r, d->device);
+        h->dev = d->device; h->seq = d->segs[0].seq; h->off = 0;
+        h->tag = (uint32_t)random() | 1u;
+    }
+    cl_link_t* l = &w->link[h->node];
+    if (!l->buf){ h->node = -1; h->scan++; wr_handoff_arm(w, now, HO_STEP_MS); return; }
+    const sseg_t* sg = &d->segs[i];
+    while (h->off < sg->nrec && cl_link_room(l) >= sizeof(cl_frame_t) + sizeof(w->tmp)){
+        uint32_t k = sg->nrec - h->off < CL_FRAME_RECS ? sg->nrec - h->off : CL_FRAME_RECS;
+        if (st_read_seg(st, d, i, h->off, w->tmp, k) != (long)k){ h->node = -1; break; }
+        uint8_t fl = h->off + k == sg->nrec ? CL_F_LAST : 0;
+        cl_link_put(l, CL_IMPORT, fl, 0, h->dev, h->tag, r->gen, w->tmp, k, now);
+        h->off += k;
+    }
+    if (h->node >= 0 && l->len > l->off) wr_link_io(w, (uint32_t)h->node, now);
+    if (h->node >= 0 && h->off == sg->nrec){ h->wait = 1; h->sent_ms = now; }
+    wr_handoff_arm(w, now, h->wait ? 100u : HO_STEP_MS);
+}
+
+/* El anillo cambió (o es el primero): los enlaces a nodos que siguen se
+ * conservan, con conexión y pendientes; el traspaso vuelve a recorrer todo */
+static void wr_ring_swap(wr_state_t* w, cl_ring_t* r, uint64_t now){
+    static cl_link_t old[CL_NODES_MAX];
+    uint32_t on = w->ring ? w->ring->nnodes : 0;
+    memcpy(old, w->link, sizeof(old));
+    memset(w->link, 0, sizeof(w->link));
+    for (uint32_t i = 0; i < CL_NODES_MAX; i++) w->link[i].fd = -1;
+    for (uint32_t i = 0; i < r->nnodes; i++){
+        if ((int32_t)i == r->self) continue;
+        cl_link_t* l = &w->link[i];
+        for (uint32_t j = 0; j < on && !l->buf; j++){
+            if (!old[j].buf || old[j].to.sin_addr.s_addr != r->node[i].link.sin_addr.s_addr ||
+                old[j].to.sin_port != r->node[i].link.sin_port) continue;
+            *l = old[j]; old[j].buf = NULL;
+            struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.u64 = WR_TAG(WR_EV_LINK, i) };
+            if (l->fd >= 0 && epoll_ctl(w->ep, EPOLL_CTL_MOD, l->fd, &ev) != 0) cl_link_close(l, now);
+        }
+        if (!l->buf && cl_link_init(l, &r->node[i].link) != 0) perror("cluster link");
+    }
+    for (uint32_t j = 0; j < on; j++){
+        if (!old[j].buf) continue;
+        if (old[j].len > old[j].off) mx_add(&g_wr_mx, M_FWD_DROP, 1);
+        cl_link_free(&old[j]);
+    }
+    w->ring = r;
+    w->ho.node = -1; w->ho.wait = 0; w->ho.scan = 0;
+    wr_handoff_arm(w, now, HO_STEP_MS);
+    printf("cluster: anillo gen %u, %u nodos, este es %s\n", r->gen, r->nnodes,
+           r->self >= 0 ? r->node[r->self].name : "(fuera del anillo)");
+    fflush(stdout);
+}
+
+/* Trama de un enlace entrante */
+static void wr_frame(void* arg, cl_conn_t* c, const cl_frame_t* f, srec_t* recs){
+    wr_state_t* w = (wr_state_t*)arg;
+    wr_conn_t* wc = (wr_conn_t*)(void*)c;
+    store_t* st = w->ps->st;
+    uint64_t now = now_ms();
+    if (f->kind == CL_RECS){ wr_route(w, recs, f->n, (uint8_t)(f->hops + 1u), now); return; }
+    if (f->kind != CL_IMPORT) return;
+    if (wc->importing && wc->im.tag != f->tag){ st_import_abort(&wc->im); wc->importing = 0; }
+    if (!wc->importing){
+        if (st_import_begin(st, &wc->im, f->device, f->tag) != 0) perror("cluster import");
+        wc->importing = 1;          /* aunque falle: sin fd, la importación termina sin ACK */
+    }
+    if (st_import_add(&wc->im, recs, f->n) == 0){
+        ru_add(w->ps->ru, recs, f->n);
+        mx_add(&g_wr_mx, M_HANDOFF, f->n);
+    } else st_import_abort(&wc->im);
+    if (!(f->flags & CL_F_LAST)) return;
+    wc->importing = 0;
+    if (wc->im.fd < 0 || st_import_commit(st, &wc->im) != 0){ st_import_abort(&wc->im); return; }
+    cl_conn_ack(c, f->tag, w->ring ? w->ring->gen : 0u);
+    sdev_t* d = st_dev(st, f->device, 0);
+    srec_t last;
+    if (d && st_last(st, d, &last) == 0){
+        char key[RT_PATH_MAX], val[64];
+        dev_key(f->device, key, sizeof(key));
+        last_put(key, val, reading_format(&last, val, sizeof(val)));
+    }
+}
+
+static void wr_conn_close(wr_conn_t* wc){
+    if (wc->importing) st_import_abort(&wc->im);
+    wc->importing = 0;
+    close(wc->c.fd);
+    wc->c.fd = -1; wc->c.len = 0;
+}
+
+static void wr_accept(wr_state_t* w){
+    for (;;){
+        int fd = accept4(g_cl_lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) return;
+        wr_conn_t* wc = NULL;
+        for (int j = 0; j < WR_CONNS && !wc; j++) if (w->conn[j].c.fd < 0) wc = &w->conn[j];
+        if (wc && !wc->c.buf) wc->c.buf = (uint8_t*)malloc(CL_CONN_BUF);
+        struct epoll_event ev = { .events = EPOLLIN, .data.u64 = WR_TAG(WR_EV_CONN, wc ? wc - w->conn : 0) };
+        if (!wc || !wc->c.buf || epoll_ctl(w->ep, EPOLL_CTL_ADD, fd, &ev) != 0){ close(fd); continue; }
+        wc->c.fd = fd; wc->c.len = 0;
+    }
+}
+
+static void wr_events(wr_state_t* w, const struct epoll_event* evs, int ne){
+    uint64_t now = now_ms();
+    for (int k = 0; k < ne; k++){
+        uint32_t kind = (uint32_t)(evs[k].data.u64 >> 32), i = (uint32_t)evs[k].data.u64;
+        if (kind == WR_EV_WAKE){
+            uint64_t v;
+            if (read(g_wr_fd, &v, sizeof(v)) < 0){ /* EAGAIN: otro despertar ya lo leyó */ }
+        } else if (kind == WR_EV_LISTEN) wr_accept(w);
+        else if (kind == WR_EV_CONN){
+            if (w->conn[i].c.fd >= 0 && cl_conn_read(&w->conn[i].c, wr_frame, w) != 0) wr_conn_close(&w->conn[i]);
+        } else if (kind == WR_EV_LINK && w->ring && i < w->ring->nnodes){
+            cl_link_t* l = &w->link[i];
+            if (l->fd < 0) continue;
+            if (evs[k].events & (EPOLLERR | EPOLLHUP)){ cl_link_close(l, now); continue; }
+            if (l->state == CL_CONNECTING && cl_link_connected(l, now) != 0) continue;
+            if ((evs[k].events & EPOLLIN) && cl_link_read(l, wr_on_ack, w, now) != 0) continue;
+            cl_link_flush(l, now);
+        }
+    }
+    /* un enlace que se cayó con pendientes: el timer reintenta la conexión */
+    for (uint32_t i = 0; w->ring && i < w->ring->nnodes && !tw_armed(&w->clflush); i++)
+        if (w->link[i].buf && w->link[i].len > w->link[i].off)
+            tw_add(&w->tw, &w->clflush, now, g_cl_flush_ms, wr_clflush_due, w);
+}
+
+static void* writer_main(void* arg){
+    persist_t* ps = (persist_t*)arg;
+    static uint8_t item[LQ_LINE_MAX];
+    static wr_state_t w;
+    struct epoll_event evs[WR_EVENTS];
+    uint64_t now = now_ms();
+    w.ps = ps;
+    for (int j = 0; j < WR_CONNS; j++) w.conn[j].c.fd = -1;
+    for (uint32_t i = 0; i < CL_NODES_MAX; i++) w.link[i].fd = -1;
+    tw_init(&w.tw, now, TW_TICK_MS);
+    wr_rollup_due(&w.rollup, &w, now);
+    w.ep = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = WR_TAG(WR_EV_WAKE, 0) };
+    if (w.ep < 0 || epoll_ctl(w.ep, EPOLL_CTL_ADD, g_wr_fd, &ev) != 0) perror("writer epoll");
+    ev.data.u64 = WR_TAG(WR_EV_LISTEN, 0);
+    if (g_cl_lfd >= 0 && epoll_ctl(w.ep, EPOLL_CTL_ADD, g_cl_lfd, &ev) != 0) perror("cluster epoll");
+    for (;;){
+        cl_ring_t* r = cl_ring();
+        if (r != w.ring) wr_ring_swap(&w, r, now_ms());
+        int got = wr_drain(&w, item);
+        now = now_ms();
+        if (got && !tw_armed(&w.flush)) wr_flush_due(&w.flush, &w, now);
+        tw_advance(&w.tw, now);
+        if (got){
+            if (w.ring) wr_events(&w, evs, epoll_wait(w.ep, evs, WR_EVENTS, 0));   /* enlaces también con la cola llena */
+            continue;
+        }
+        if (atomic_load(&g_wr_stop)) break;
+        atomic_store(&g_wr_idle, 1);
+        if (wr_drain(&w, item)){                     /* llegó algo justo antes de dormir */
+            atomic_store(&g_wr_idle, 0);
+            if (!tw_armed(&w.flush)) wr_flush_due(&w.flush, &w, now_ms());
+            continue;
+        }
+        int ne = epoll_wait(w.ep, evs, WR_EVENTS, tw_timeout_ms(&w.tw, now_ms()));
+        atomic_store(&g_wr_idle, 0);
+        wr_events(&w, evs, ne);
+    }
+    for (uint32_t i = 0; w.ring && i < w.ring->nnodes; i++){
+        if (w.link[i].buf) cl_link_flush(&w.link[i], now_ms());   /* último intento, sin esperar */
+        cl_link_free(&w.link[i]);
+    }
+    for (int j = 0; j < WR_CONNS; j++){
+        if (w.conn[j].c.fd >= 0) wr_conn_close(&w.conn[j]);
+        free(w.conn[j].c.buf);
+    }
+    if (w.ep >= 0) close(w.ep);
+    st_poll(ps->st, 0, 1);          /* main los cierra tras la instantánea final */
+    ru_poll(ps->ru, 0, 1);
+    if (ps->text) bw_close(ps->text);
+    return NULL;
+}
+
+/* --- workers --- */
+typedef struct {
+    mx_t mx;                        /* contadores/latencias: sólo los escribe este hilo */
+    int id, fd;
+    pthread_t th;
+    blk_table_t blk;                /* sesiones Block1/Block2 */
+    twheel_t    tw;                 /* timers del worker (sólo su hilo) */
+    tw_timer_t  sweep;
+    arena_t     arena;              /* toda la memoria de estado del worker */
+    pool_t      rtx;                /* obs_rtx_t: CON de Observe en reenvío */
+    obs_target_t* tg;               /* g_obs.n destinos para obs_fanout */
+    EVP_CIPHER_CTX* cx;             /* AES-CCM de OSCORE, propio del hilo */
+    rl_table_t  rl;                 /* cubos de tasa por endpoint y dispositivo */
+    dedup_t     dd;                 /* respuestas a CON ya enviadas (dedup.h) */
+    int         pfd;                /* clúster: socket hacia los dueños (proxy); -1 = sin clúster */
+    cl_px_table_t px;               /* peticiones en proxy y suscriptores agregados */
+    uint16_t    px_mid;
+} worker_t;
+
+/* Notificación CON a la espera de ACK: se reenvía igual (mismo MID) con
+ * timeout inicial en [ACK_TIMEOUT, 1.5 * ACK_TIMEOUT) que se duplica */
+typedef struct obs_rtx {
+    tw_timer_t t;
+    worker_t*  W;
+    struct sockaddr_in to;
+    uint32_t   timeout_ms;
+    uint16_t   mid, len;
+    uint8_t    tries;
+    uint8_t    pkt[BUF_SZ];
+} obs_rtx_t;
+
+static pool_cfg_t g_pool;
+static arena_t    g_obs_arena;
+static worker_t   g_workers[MAX_WORKERS];
+static int        g_nworkers = 1;
+static uint64_t   g_start_ms;
+static osc_table_t g_osc;           /* contextos OSCORE (claves de sólo lectura) */
+static int        g_osc_require = 0;
+static rl_limit_t g_rl_ep, g_rl_dev;  /* por endpoint IP:puerto y por dispositivo; rate 0 = sin límite */
+static size_t     g_shed_non, g_shed_con; /* marcas de la cola del escritor (0 = sin descarte) */
+
+/* Lo que reserva cada worker al arrancar (cota de su memoria de estado) */
+static size_t worker_arena_bytes(const pool_cfg_t* c){
+    return dd_need(c->dedup_slots) + rl_need(c->rate_slots) + blk_need(c->blk_sessions) +
+           pool_need(sizeof(obs_rtx_t), c->obs_rtx) + cl_px_need(c->proxy_slots) +
+           arena_need((size_t)c->obs_slots * sizeof(obs_target_t));
+}
+
+/* Sockets recibidos del proceso anterior (traspaso); -1 los ya tomados */
+static int g_ho_fds[SN_FDS_MAX];
+static int g_ho_n = 0;
+
+static int open_udp(uint16_t port, int reuseport){
+    int fd = port ? sn_take(g_ho_fds, g_ho_n, SOCK_DGRAM, port) : -1;
+    if (fd >= 0) return fd;
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0){ perror("socket"); return -1; }
+    int one = 1;
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0){
+        perror("SO_REUSEPORT"); close(fd); return -1;
+    }
+    struct sockaddr_in a; memset(&a,0,sizeof(a));
+    a.sin_family = AF_INET; a.sin_addr.s_addr = htonl(INADDR_ANY); a.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&a, sizeof(a)) != 0){ perror("bind"); close(fd); return -1; }
+    return fd;
+}
+
+/* --- recursos --- */
+static router_t g_rt;
+static store_t  g_st;
+static rollup_t g_ru;
+static obs_table_t g_obs;
+
+/* Salida de un handler: payload escrito en sitio sobre outbuf */
+typedef struct coap_out {
+    uint8_t* pl; size_t cap, len;
+    uint8_t  cf;                    /* Content-Format de la respuesta */
+    uint8_t  more;                  /* la representación no cupo en cap (GET: pasa a Block2) */
+    uint32_t dev;                   /* POST/PUT: dispositivo del cuerpo si no es el de la ruta (0 = el de la ruta) */
+} coap_out_t;
+
+/* Clave de caché de la ruta resuelta ("sensor", "device/42", ...) */
+static void req_key(const coap_req_t* req, char* out, size_t cap){
+    rt_expand(&g_rt.n[req->node], req->params, req->nparams, out, cap);
+}
+
+/* Dispositivo de la ruta: {id} numérico en /device/{id}, 0 en /sensor */
+static int req_device(const coap_req_t* req, uint32_t* dev){
+    *dev = 0;
+    if (req->nparams == 0) return 0;
+    const rt_param_t* pr = &req->params[0];
+    uint64_t v = 0;
+    if (pr->len == 0 || pr->len > 10) return -1;
+    for (uint8_t i = 0; i < pr->len; i++){
+        if (pr->p[i] < '0' || pr->p[i] > '9') return -1;
+        v = v*10u + (uint64_t)(pr->p[i] - '0');
+    }
+    if (v > UINT32_MAX) return -1;
+    *dev = (uint32_t)v;
+    return 0;
+}
+
+/* Registros del cuerpo según su Content-Format (dev = el de la ruta, por
+ * defecto); -1 si el formato no es de lecturas o el cuerpo no es válido */
+static int req_readings(const coap_req_t* req, uint32_t dev, srec_t* recs, int max){
+    if (req->cf < 0 || req->cf == CF_JSON) return reading_parse_json(req->payload, req->payload_len, dev, wall_ms(), recs, max);
+    if (req->cf == CF_CBOR)                return reading_parse_cbor(req->payload, req->payload_len, dev, wall_ms(), recs, max);
+    if (req->cf == CF_SENML_CBOR)          return reading_parse_senml(req->payload, req->payload_len, dev, wall_ms(), recs, max);
+    return -1;
+}
+
+static uint8_t h_reading_store(const coap_req_t* req, coap_out_t* o){   /* POST, PUT */
+    char key[RT_PATH_MAX];
+    srec_t recs[READING_MAX_PER_MSG];
+    uint32_t dev;
+    int json = req->cf < 0 || req->cf == CF_JSON;
+    if (!json && req->cf != CF_CBOR && req->cf != CF_SENML_CBOR){
+        o->len = PUT_LIT(o->pl, o->cap, "BAD_FORMAT");
+        return COAP_415_BADFORMAT;
+    }
+    if (g_text_export && json && req->payload_len > LQ_LINE_MAX){
+        o->len = PUT_LIT(o->pl, o->cap, "TOO_LARGE");
+        return COAP_413_TOOLARGE;
+    }
+    int nrec = -1;
+    if (req_device(req, &dev) == 0) nrec = req_readings(req, dev, recs, READING_MAX_PER_MSG);
+    if (nrec < 0 || (nrec == 0 && !(g_text_export && json))){
+        o->len = PUT_LIT(o->pl, o->cap, "BAD_PAYLOAD");
+        return COAP_400_BADREQ;
+    }
+    /* el "id" del cuerpo elige el dispositivo en /sensor; en /device/{id} tiene que coincidir */
+    uint32_t rdev = nrec > 0 ? recs[0].device : dev;
+    if (rdev != dev && req->nparams > 0){
+        o->len = PUT_LIT(o->pl, o->cap, "ID_MISMATCH");
+        return COAP_400_BADREQ;
+    }
+    /* con la tabla del almacén llena un dispositivo nuevo no se acepta: mejor
+     * 5.03 que un 2.04 por registros que st_append() va a descartar */
+    const cl_ring_t* ring = cl_ring();
+    for (int i = 0; i < nrec; i++){
+        if ((i > 0 && recs[i].device == recs[i-1].device) || (ring && !cl_is_self(ring, recs[i].device))) continue;
+        if (st_has_room(&g_st, recs[i].device)) continue;
+        o->len = PUT_LIT(o->pl, o->cap, "STORE_FULL");
+        return COAP_503_UNAVAIL;
+    }
+    /* un lote puede pasar de una celda de la cola: se parte en tandas, con todas
+     * las celdas reservadas de una vez (un 5.00 no deja nada encolado que el
+     * reintento del cliente duplique). El .txt recibe el JSON tal cual; los
+     * cuerpos binarios, una línea por registro */
+    size_t ncell = (size_t)((nrec + LQ_RECS_MAX - 1) / LQ_RECS_MAX), pos = 0;
+    if (g_text_export) ncell += json ? 1u : (size_t)nrec;
+    int fail = ncell > 0 && lq_reserve(&g_lq, ncell, &pos) != 0;
+    char val[64];
+    for (int i = 0; i < nrec && !fail; i += LQ_RECS_MAX){
+        int k = nrec - i < LQ_RECS_MAX ? nrec - i : LQ_RECS_MAX;
+        lq_commit(&g_lq, pos++, LQ_RECS, recs + i, (size_t)k * sizeof(srec_t));
+    }
+    if (g_text_export && json && !fail) lq_commit(&g_lq, pos++, LQ_TEXT, req->payload, req->payload_len);
+    for (int i = 0; g_text_export && !json && i < nrec && !fail; i++)
+        lq_commit(&g_lq, pos++, LQ_TEXT, val, reading_format(&recs[i], val, sizeof(val)));
+    wr_kick();
+    if (fail){
+        o->len = PUT_LIT(o->pl, o->cap, "WRITE_FAIL");
+        return COAP_500_INTERR;
+    }
+    if (rdev != dev){ dev_key(rdev, key, sizeof(key)); o->dev = rdev; }   /* la caché va por dispositivo */
+    else req_key(req, key, sizeof(key));
+    if (!json || memchr(req->payload, '[', req->payload_len)){
+        /* lote o binario: la caché guarda sólo la lectura más reciente, en JSON */
+        const srec_t* nw = &recs[0];
+        for (int i = 1; i < nrec; i++) if (recs[i].ts_ms >= nw->ts_ms) nw = &recs[i];
+        if (nrec > 0) last_put(key, val, reading_format(nw, val, sizeof(val)));
+    } else {
+        last_put(key, (const char*)req->payload, req->payload_len);
+    }
+    o->len = PUT_LIT(o->pl, o->cap, "UPDATED");
+    return COAP_204_CHANGED;
+}
+
+/* Valor entero de la opción Uri-Query "name=..."; 1 = presente, 0 = ausente, -1 = mal formado */
+static int req_query_i64(const coap_req_t* req, const char* name, int64_t* out){
+    size_t nl = strlen(name);
+    for (uint8_t i = 0; i < req->nquery; i++){
+        const rt_param_t* q = &req->query[i];
+        if (q->len <= nl + 1u || memcmp(q->p, name, nl) != 0 || q->p[nl] != '=') continue;
+        int64_t v = 0; int neg = 0; size_t k = nl + 1u;
+        if (q->p[k] == '-'){ neg = 1; k++; }
+        if (k == q->len) return -1;
+        for (; k < q->len; k++){
+            if (q->p[k] < '0' || q->p[k] > '9' || v > (INT64_MAX - 9) / 10) return -1;
+            v = v*10 + (q->p[k] - '0');
+        }
+        *out = neg ? -v : v;
+        return 1;
+    }
+    return 0;
+}
+
+/* Vista de la opción Uri-Query "name=..."; 1 = presente, 0 = ausente */
+static int req_query_str(const coap_req_t* req, const char* name, const uint8_t** v, size_t* len){
+    size_t nl = strlen(name);
+    for (uint8_t i = 0; i < req->nquery; i++){
+        const rt_param_t* q = &req->query[i];
+        if (q->len <= nl || memcmp(q->p, name, nl) != 0 || q->p[nl] != '=') continue;
+        *v = q->p + nl + 1u; *len = q->len - nl - 1u;
+        return 1;
+    }
+    return 0;
+}
+
+/* Emisor de la consulta: formatea cada registro mapeado directo al buffer de salida */
+typedef struct { coap_out_t* o; size_t cap; } hist_ctx_t;
+
+static int hist_emit(void* ctx, const srec_t* r){
+    hist_ctx_t* h = (hist_ctx_t*)ctx;
+    coap_out_t* o = h->o;
+    int w = snprintf((char*)o->pl + o->len, h->cap - o->len, "%s{\"ts\":%lld,\"id\":%u,\"%c\":%.2f}",
+                     o->len > 1u ? "," : "", (long long)r->ts_ms, r->device,
+                     r->resource == RES_DIST ? 'd' : 't', (double)r->value);
+    if (w < 0 || (size_t)w >= h->cap - o->len){ o->more = 1; return 1; }   /* no cabe: cortar */
+    o->len += (size_t)w;
+    return 0;
+}
+
+/* Lugar reservado al final del historial para el cursor ',{"next":N}' */
+#define HIST_NEXT_MAX  32u
+
+static uint8_t h_history(const coap_req_t* req, coap_out_t* o){
+    int64_t from = 0, to = INT64_MAX, dev, limit = INT64_MAX, skip = 0;
+    uint32_t rdev;
+    if (req_device(req, &rdev) != 0){
+        o->len = PUT_LIT(o->pl, o->cap, "BAD_DEVICE");
+        return COAP_400_BADREQ;
+    }
+    dev = rdev;
+    int bad = req_query_i64(req, "from", &from) < 0 || req_query_i64(req, "to", &to) < 0 ||
+              req_query_i64(req, "device", &dev) < 0 || req_query_i64(req, "limit", &limit) < 0 ||
+              req_query_i64(req, "skip", &skip) < 0;
+    if (bad || dev < 0 || dev > (int64_t)UINT32_MAX || limit < 0 || skip < 0 || o->cap < 2u){
+        o->len = PUT_LIT(o->pl, o->cap, "BAD_QUERY");
+        return COAP_400_BADREQ;
+    }
+    if (o->cap < HIST_NEXT_MAX + 2u){ o->more = 1; return COAP_205_CONTENT; }   /* bloque chico: pasa a Block2 */
+    hist_ctx_t h = { o, o->cap - HIST_NEXT_MAX - 1u };   /* reserva para el cursor y el ']' final */
+    o->pl[0] = '['; o->len = 1;
+    long n = st_query(&g_st, (uint32_t)dev, from, to, (uint64_t)skip, (uint64_t)limit, hist_emit, &h);
+    if (o->more){
+        /* cortado: el último elemento dice desde dónde seguir (?skip=N con la
+         * misma consulta). Ya en el búfer de Block2 no hay más lugar que pedir */
+        int w = snprintf((char*)o->pl + o->len, HIST_NEXT_MAX, "%s{\"next\":%llu}", o->len > 1u ? "," : "",
+                         (unsigned long long)skip + (unsigned long long)(n > 0 ? n : 0));
+        o->len += w > 0 ? (size_t)w : 0;
+        if (o->cap >= BLK_REPR_MAX) o->more = 0;
+    }
+    o->pl[o->len++] = ']';
+    o->cf = CF_JSON;
+    return COAP_205_CONTENT;
+}
+
+/* "90", "90s", "15m", "1h", "7d" -> ms; -1 si no se entiende */
+static int64_t parse_window_ms(const uint8_t* p, size_t n){
+    int64_t v = 0, unit = 1000;
+    size_t i = 0;
+    for (; i < n && p[i] >= '0' && p[i] <= '9' && v < 100000000; i++) v = v*10 + (p[i] - '0');
+    if (i == 0 || v == 0) return -1;
+    if (i + 1u == n){
+        switch (p[i]){
+        case 's': unit = 1000; break;
+        case 'm': unit = 60000; break;
+        case 'h': unit = 3600000; break;
+        case 'd': unit = 86400000; break;
+        default:  return -1;
+        }
+    } else if (i != n) return -1;
+    return v * unit;
+}
+
+static uint8_t h_stats_get(const coap_req_t* req, coap_out_t* o){
+    static const struct { uint16_t res; char key; } rs[] = { { RES_TEMP, 't' }, { RES_DIST, 'd' } };
+    const uint8_t* wv; size_t wl;
+    int64_t window = 3600000;
+    uint32_t dev;
+    if (req_device(req, &dev) != 0){
+        o->len = PUT_LIT(o->pl, o->cap, "BAD_DEVICE");
+        return COAP_400_BADREQ;
+    }
+    if (req_query_str(req, "window", &wv, &wl) && (window = parse_window_ms(wv, wl)) < 0){
+        o->len = PUT_LIT(o->pl, o->cap, "BAD_WINDOW");
+        return COAP_400_BADREQ;
+    }
+    int64_t now = wall_ms();
+    ru_agg_t a[2];
+    int found = 0;
+    for (int i = 0; i < 2; i++){
+        int rc = ru_query(&g_ru, dev, rs[i].res, now, window, &a[i]);
+        if (rc == 0) found = 1;
+        if (rc < 0 && a[i].res_ms == 0){
+            o->len = PUT_LIT(o->pl, o->cap, "WINDOW_TOO_LARGE");
+            return COAP_400_BADREQ;
+        }
+    }
+    if (!found || o->cap < 2u){
+        o->len = PUT_LIT(o->pl, o->cap, "NO_DATA");
+        return COAP_205_CONTENT;
+    }
+    int w = snprintf((char*)o->pl, o->cap, "{\"id\":%u,\"window_s\":%lld,\"res_s\":%lld",
+                     dev, (long long)(window / 1000), (long long)(a[0].res_ms / 1000));
+    size_t pos = w > 0 ? (size_t)w : 0;
+    for (int i = 0; i < 2 && pos < o->cap; i++){
+        if (a[i].n == 0) continue;
+        w = snprintf((char*)o->pl + pos, o->cap - pos,
+                     ",\"%c\":{\"n\":%u,\"avg\":%.2f,\"min\":%.2f,\"max\":%.2f}", rs[i].key,
+                     a[i].n, a[i].sum / a[i].n, (double)a[i].min, (double)a[i].max);
+        pos += w > 0 ? (size_t)w : 0;
+    }
+    if (pos + 1u >= o->cap){ o->more = 1; return COAP_205_CONTENT; }   /* no cabe: pasa a Block2 */
+    o->pl[pos++] = '}';
+    o->len = pos;
+    o->cf = CF_JSON;
+    return COAP_205_CONTENT;
+}
+
+/* Dispositivo de una clave de caché ("sensor...", "device/42"); -1 si no es de lecturas */
+static int key_device(const char* key, uint32_t* dev){
+    char* end;
+    if (strncmp(key, "sensor", 6) == 0){ *dev = 0; return 0; }
+    if (strncmp(key, "device/", 7) != 0 || key[7] < '0' || key[7] > '9') return -1;
+    unsigned long v = strtoul(key + 7, &end, 10);
+    if (*end || v > UINT32_MAX) return -1;
+    *dev = (uint32_t)v;
+    return 0;
+}
+
+/* last_get(), y si la clave no está en la caché, la última lectura del almacén
+ * (que vuelve a la caché si hay lugar) */
+static long last_or_store(const char* key, uint8_t* out, size_t cap){
+    long L = last_get(key, out, cap);
+    uint32_t dev; srec_t r; char val[64];
+    if (L >= 0 || key_device(key, &dev) != 0 || st_query_last(&g_st, dev, &r) != 0) return L;
+    size_t n = reading_format(&r, val, sizeof(val));
+    last_put(key, val, n);
+    if (n > cap) n = cap;
+    memcpy(out, val, n);
+    return (long)n;
+}
+
+static uint8_t h_reading_get(const coap_req_t* req, coap_out_t* o){
+    char key[RT_PATH_MAX];
+    if (req->nquery > 0) return h_history(req, o);
+    req_key(req, key, sizeof(key));
+    long L = last_or_store(key, o->pl, o->cap);
+    o->len = (L >= 0) ? (size_t)L : PUT_LIT(o->pl, o->cap, "NO_DATA");
+    return COAP_205_CONTENT;
+}
+
+static uint8_t h_reading_delete(const coap_req_t* req, coap_out_t* o){
+    char key[RT_PATH_MAX];
+    req_key(req, key, sizeof(key));
+    last_del(key);
+    o->len = PUT_LIT(o->pl, o->cap, "DELETED");
+    return COAP_202_DELETED;
+}
+
+static uint8_t h_core_get(const coap_req_t* req, coap_out_t* o){
+    (void)req;
+    o->len = put_bytes(o->pl, o->cap, g_rt.core, g_rt.core_len);
+    o->cf  = CF_LINK_FORMAT;
+    return COAP_205_CONTENT;
+}
+
+/* Métricas de todos los hilos (workers + escritor): JSON o texto de Prometheus;
+ * devuelve el largo, o cap si no cupo */
+static size_t metrics_render(int prom, char* out, size_t cap){
+    const mx_t* ms[MAX_WORKERS + 1];
+    const char* names[MAX_WORKERS + 1];
+    char nb[MAX_WORKERS][8];
+    int n = 0;
+    for (int i = 0; i < g_nworkers; i++){
+        snprintf(nb[i], sizeof(nb[i]), "w%d", i);
+        ms[n] = &g_workers[i].mx; names[n++] = nb[i];
+    }
+    ms[n] = &g_wr_mx; names[n++] = "writer";
+    double up = (double)(now_ms() - g_start_ms) / 1000.0;
+    return prom ? mx_prom(ms, names, n, up, out, cap) : mx_json(ms, n, up, out, cap);
+}
+
+static uint8_t h_metrics_get(const coap_req_t* req, coap_out_t* o){
+    const uint8_t* v; size_t vl;
+    int prom = req_query_str(req, "fmt", &v, &vl) && vl == 4u && memcmp(v, "prom", 4) == 0;
+    size_t n = metrics_render(prom, (char*)o->pl, o->cap);
+    o->cf = prom ? CF_TEXT_PLAIN : CF_JSON;
+    if (n >= o->cap){ o->more = 1; return COAP_205_CONTENT; }       /* no cabe: pasa a Block2 */
+    o->len = n;
+    return COAP_205_CONTENT;
+}
+
+static void register_routes(router_t* rt){
+    static const char* const readings[] = { "sensor", "sensor/temp", "sensor/dist", "device/{id}" };
+    rt_init(rt);
+    for (size_t i = 0; i < sizeof(readings)/sizeof(readings[0]); i++){
+        rt_add(rt, readings[i], COAP_GET,    h_reading_get);
+        rt_add(rt, readings[i], COAP_POST,   h_reading_store);
+        rt_add(rt, readings[i], COAP_PUT,    h_reading_store);
+        rt_add(rt, readings[i], COAP_DELETE, h_reading_delete);
+        rt_observable(rt, readings[i]);
+    }
+    rt_add(rt, "sensor/{id}/stats", COAP_GET, h_stats_get);
+    rt_add(rt, "device/{id}/stats", COAP_GET, h_stats_get);
+    rt_add(rt, "metrics", COAP_GET, h_metrics_get);
+    rt_add(rt, ".well-known/core", COAP_GET, h_core_get);
+    rt_build_core(rt);
+}
+
+/* Respuesta sin payload de handler (2.31, 4.08, 4.13, ...) */
+static size_t reply_plain(const coap_req_t* req, uint8_t* out, size_t cap, uint8_t code,
+                          const copt_t* opts, int nopts){
+    return build_resp(out, cap, req->type, req->tkl, req->token, req->mid, code,
+                      CF_TEXT_PLAIN, opts, nopts, NULL);
+}
+
+/* Sirve el bloque num de una representación guardada (ETag, Block2 y, en el
+ * primero, Size2 con el tamaño total) */
+static size_t reply_block2(const coap_req_t* req, const blk_sess_t* s, uint32_t num, uint32_t szx,
+                           uint8_t* out, size_t cap){
+    size_t bs = BLK_SIZE(szx), off = (size_t)num * bs;
+    if (off >= s->len && !(off == 0 && s->len == 0)) return reply_plain(req, out, cap, COAP_402_BADOPT, NULL, 0);
+    size_t n = s->len - off < bs ? s->len - off : bs;
+    copt_t opts[3]; int k = 0;
+    opts[k++] = copt_uint(OPT_ETAG, s->etag);
+    opts[k++] = copt_uint(OPT_BLOCK2, BLK_VAL(num, off + n < s->len, szx));
+    if (num == 0) opts[k++] = copt_uint(OPT_SIZE2, (uint32_t)s->len);
+    size_t hdr = build_resp(out, cap, req->type, req->tkl, req->token, req->mid, s->code, s->cf, opts, k, NULL);
+    if (hdr == 0 || hdr + 1u + n > cap) return 0;
+    memcpy(out + hdr + 1u, s->buf + off, n);
+    return finish_resp(out, hdr, n);
+}
+
+static unsigned g_blk_szx = BLK_SZX_MAX;   /* máximo del servidor (COAP_BLOCK_MAX) */
+
+/* Procesa un datagrama ya parseado en req (in es el datagrama crudo) y deja la
+ * respuesta en out; devuelve su largo (0 = no responder).
+ * El payload de la petición se usa como vista (puntero, largo) sobre in y el de la
+ * respuesta se escribe directamente en out tras la cabecera: sin copias intermedias.
+ * Sólo los cuerpos Block1 y las representaciones Block2 pasan por la sesión.
+ * Si la petición cambió un recurso observable deja su clave en changed ("" si no). */
+static size_t handle_packet(blk_table_t* bt, const struct sockaddr_in* cli, uint32_t now_s,
+                            coap_req_t* req, const uint8_t* in, uint8_t* out, size_t cap,
+                            char* changed){
+    changed[0] = '\0';
+
+    /* Mensaje vacío: ACK/RST de una notificación, o ping (CON) que se contesta con RST */
+    if (req->code == 0){
+        if (req->type == COAP_ACK || req->type == COAP_RST) obs_ack(&g_obs, cli, req->mid, req->type == COAP_RST);
+        if (req->type != COAP_CON || cap < 4u) return 0;
+        out[0] = (uint8_t)((COAP_VER<<6) | (COAP_RST<<4));
+        out[1] = 0; out[2] = in[2]; out[3] = in[3];
+        return 4;
+    }
+
+    const rt_node_t* nd = req->node >= 0 ? &g_rt.n[req->node] : NULL;
+    route_fn fn = (nd && req->code < RT_METHODS) ? nd->fn[req->code] : NULL;
+    copt_t opts[2]; int nopts = 0;
+    blk_sess_t* in_s = NULL;
+
+    /* Block1: acumular el cuerpo; los bloques intermedios se contestan 2.31 */
+    if (fn && req->block1 >= 0 && (req->code == COAP_POST || req->code == COAP_PUT)){
+        uint32_t num = BLK_NUM(req->block1), szx = blk_szx(req->block1, BLK_SZX_MAX);
+        uint32_t aszx = szx < g_blk_szx ? szx : g_blk_szx;
+        size_t off = (size_t)num * BLK_SIZE(szx);
+        in_s = num == 0 ? blk_open(bt, cli, BLK_IN, coap_uri_hash(req), now_s)
+                        : blk_find(bt, cli, BLK_IN, coap_uri_hash(req), now_s);
+        if (!in_s || off != in_s->len){
+            if (in_s) blk_drop(in_s);
+            return reply_plain(req, out, cap, COAP_408_INCOMPLETE, NULL, 0);
+        }
+        if (off + req->payload_len > BLK_REPR_MAX){
+            blk_drop(in_s);
+            opts[0] = copt_uint(OPT_SIZE1, BLK_REPR_MAX);
+            return reply_plain(req, out, cap, COAP_413_TOOLARGE, opts, 1);
+        }
+        memcpy(in_s->buf + in_s->len, req->payload, req->payload_len);
+        in_s->len += req->payload_len;
+        in_s->expires_s = now_s + BLK_SESSION_S;
+        if (BLK_M(req->block1)){
+            if (req->payload_len != BLK_SIZE(szx) || in_s->len < BLK_SIZE(aszx)){
+                blk_drop(in_s);
+                return reply_plain(req, out, cap, COAP_400_BADREQ, NULL, 0);
+            }
+            /* con un SZX menor el cliente sigue en el offset acumulado */
+            opts[0] = copt_uint(OPT_BLOCK1, BLK_VAL(in_s->len / BLK_SIZE(aszx) - 1u, 1u, aszx));
+            return reply_plain(req, out, cap, COAP_231_CONTINUE, opts, 1);
+        }
+        req->payload = in_s->buf; req->payload_len = in_s->len;
+        opts[nopts++] = copt_uint(OPT_BLOCK1, BLK_VAL(num, 0u, szx));
+    }
+
+    /* Block2 con NUM > 0: servir desde la representación guardada */
+    uint32_t b2num = 0, b2szx = g_blk_szx;
+    if (req->block2 >= 0){ b2num = BLK_NUM(req->block2); b2szx = blk_szx(req->block2, g_blk_szx); }
+    if (fn && req->code == COAP_GET && b2num > 0){
+        blk_sess_t* s = blk_find(bt, cli, BLK_OUT, coap_uri_hash(req), now_s);
+        if (s) return reply_block2(req, s, b2num, b2szx, out, cap);
+    }
+
+    /* Observe: registrar/dar de baja antes de armar la cabecera (la opción va delante) */
+    char okey[RT_PATH_MAX];
+    int observing = 0;
+    if (fn && req->code == COAP_GET && nd->obs && req->observe >= 0 && req->nquery == 0 && req->block2 < 0){
+        uint32_t seq;
+        req_key(req, okey, sizeof(okey));
+        if (req->observe == 0 && obs_add(&g_obs, cli, req->token, req->tkl, okey, &seq) == 0){
+            opts[nopts++] = copt_uint(OPT_OBSERVE, seq);
+            observing = 1;
+        } else if (req->observe == 1) obs_remove(&g_obs, cli, okey);
+    }
+
+    size_t cf_at = 0;
+    size_t hdr = build_resp(out, cap, req->type, req->tkl, req->token, req->mid, 0, CF_TEXT_PLAIN,
+                            opts, nopts, &cf_at);
+    if (hdr == 0 || hdr + 1u >= cap){
+        if (in_s) blk_drop(in_s);
+        if (observing) obs_remove(&g_obs, cli, okey);
+        return 0;
+    }
+    size_t room = cap - hdr - 1u;
+    coap_out_t o = { out + hdr + 1u, room < BLK_SIZE(b2szx) ? room : BLK_SIZE(b2szx), 0, CF_TEXT_PLAIN, 0, 0 };
+    uint8_t rcode;
+
+    if (fn){
+        rcode = (req->code == COAP_GET && b2num > 0) ? 0 : fn(req, &o);
+    } else if (nd && rt_has_any(nd)){
+        o.len = PUT_LIT(o.pl, o.cap, "METHOD_NOT_ALLOWED");
+        rcode = COAP_405_NOTALLOWED;
+    } else {
+        o.len = PUT_LIT(o.pl, o.cap, "NOT_FOUND");
+        rcode = COAP_404_NOTFOUND;
+    }
+    if (in_s) blk_drop(in_s);
+
+    /* No cupo en un bloque (o piden un bloque sin sesión): generar la
+     * representación completa en la sesión y servirla por partes */
+    if (fn && req->code == COAP_GET && (o.more || b2num > 0)){
+        if (observing) obs_remove(&g_obs, cli, okey);   /* sólo se observan representaciones de un bloque */
+        blk_sess_t* s = blk_open(bt, cli, BLK_OUT, coap_uri_hash(req), now_s);
+        coap_out_t big = { s->buf, BLK_REPR_MAX, 0, CF_TEXT_PLAIN, 0, 0 };
+        s->code = fn(req, &big);
+        s->cf = big.cf; s->len = big.len;
+        if (big.more){
+            /* ni en BLK_REPR_MAX: mejor un error que una representación cortada que parece entera */
+            s->code = COAP_500_INTERR; s->cf = CF_TEXT_PLAIN;
+            s->len = PUT_LIT(s->buf, BLK_REPR_MAX, "TOO_LARGE");
+        }
+        return reply_block2(req, s, b2num, b2szx, out, cap);
+    }
+
+    if (nd && nd->obs && rcode == COAP_204_CHANGED){
+        if (o.dev) dev_key(o.dev, changed, RT_PATH_MAX);
+        else       req_key(req, changed, RT_PATH_MAX);
+    }
+    out[1] = rcode;
+    out[cf_at] = o.cf;
+    return finish_resp(out, hdr, o.len);
+}
+
+static void obs_rtx_due(tw_timer_t* t, void* arg, uint64_t now){
+    obs_rtx_t* r = (obs_rtx_t*)arg;
+    if (!obs_pending(&g_obs, &r->to, r->mid)){ pool_put(&r->W->rtx, r); return; }  /* ya hubo ACK (o se pisó) */
+    if (r->tries == OBS_MAX_RETRANSMIT){                                  /* RFC 7641 §4.5: baja */
+        obs_ack(&g_obs, &r->to, r->mid, 1);
+        pool_put(&r->W->rtx, r);
+        return;
+    }
+    if (sendto(r->W->fd, r->pkt, r->len, 0, (const struct sockaddr*)&r->to, sizeof(r->to)) > 0)
+        mx_add(&r->W->mx, M_NOTIFY, 1);
+    r->tries++;
+    r->timeout_ms *= 2u;
+    tw_add(&r->W->tw, t, now, r->timeout_ms, obs_rtx_due, r);
+}
+
+/* Guarda una CON recién enviada para reenviarla; con el pool agotado queda sin reenvíos */
+static void obs_rtx_arm(worker_t* W, const obs_target_t* tg, const uint8_t* pkt, size_t len, uint64_t now){
+    obs_rtx_t* r = (obs_rtx_t*)pool_get(&W->rtx);
+    if (!r) return;
+    r->W = W; r->to = tg->to; r->mid = tg->mid;
+    r->len = (uint16_t)len; memcpy(r->pkt, pkt, len);
+    r->timeout_ms = OBS_ACK_TIMEOUT_MS + (uint32_t)(random() % (OBS_ACK_TIMEOUT_MS / 2u));
+    tw_add(&W->tw, &r->t, now, r->timeout_ms, obs_rtx_due, r);
+}
+
+/* Envía la lectura actual de key a todos sus suscriptores: las notificaciones se
+ * arman en buf (RX_BATCH a la vez) y salen con un sendmmsg por tanda */
+static void obs_fanout(worker_t* W, const char* key, uint8_t (*buf)[BUF_SZ]){
+    obs_target_t* tg = W->tg;
+    struct iovec iov[RX_BATCH];
+    struct mmsghdr mm[RX_BATCH];
+    uint8_t val[LAST_MAX];
+    uint32_t seq;
+    long L = last_or_store(key, val, sizeof(val));
+    if (L < 0) return;
+    int nt = obs_targets(&g_obs, key, tg, (int)g_obs.n, &seq);
+    for (int base = 0; base < nt; base += RX_BATCH){
+        int k = 0;
+        for (int i = base; i < nt && k < RX_BATCH; i++){
+            copt_t ob = copt_uint(OPT_OBSERVE, seq);
+            size_t hdr = build_resp(buf[k], BUF_SZ, COAP_NON, tg[i].tkl, tg[i].token, tg[i].mid,
+                                    COAP_205_CONTENT, CF_TEXT_PLAIN, &ob, 1, NULL);
+            if (hdr == 0 || hdr + 1u >= BUF_SZ) continue;
+            if (tg[i].con) buf[k][0] = (uint8_t)((buf[k][0] & 0xCF) | (COAP_CON<<4));
+            size_t plen = put_bytes(buf[k] + hdr + 1u, BUF_SZ - hdr - 1u, val, (size_t)L);
+            iov[k].iov_base = buf[k]; iov[k].iov_len = finish_resp(buf[k], hdr, plen);
+            if (tg[i].con) obs_rtx_arm(W, &tg[i], buf[k], iov[k].iov_len, now_ms());
+            memset(&mm[k].msg_hdr, 0, sizeof(mm[k].msg_hdr));
+            mm[k].msg_hdr.msg_iov = &iov[k]; mm[k].msg_hdr.msg_iovlen = 1;
+            mm[k].msg_hdr.msg_name = &tg[i].to; mm[k].msg_hdr.msg_namelen = sizeof(tg[i].to);
+            k++;
+        }
+        for (int off = 0; off < k; ){
+            uint64_t t0 = mx_now_ns();
+            int sent = sendmmsg(W->fd, mm + off, (unsigned)(k - off), 0);
+            mx_rec(&W->mx, H_SEND, mx_now_ns() - t0);
+            if (sent <= 0) break;
+            for (int j = off; j < off + sent; j++) mx_add(&W->mx, M_BYTES_OUT, mm[j].msg_len);
+            off += sent;
+            mx_add(&W->mx, M_NOTIFY, (unsigned long)sent);
+        }
+    }
+}
+
+/* Petición con opción OSCORE: si verifica deja en req el mensaje interno
+ * (armado en plain) y devuelve 1; si no, deja en out la respuesta (4.01 con
+ * Echo protegido, o el error sin proteger de §8.2) y devuelve 0 */
+static int oscore_open(worker_t* W, coap_req_t* req, const uint8_t* in, uint8_t* plain, osc_req_t* orq,
+                       uint8_t* out, size_t* outlen){
+    size_t pn = 0;
+    int rc = g_osc.n ? osc_unprotect(&g_osc, W->cx, in, req, plain, BUF_SZ, &pn, orq) : COAP_401_UNAUTH;
+    if (rc == OSC_OK && coap_parse(plain, pn, &g_rt, req) == 0){
+        req->observe = -1;                  /* sin Observe sobre OSCORE: GET simple */
+        mx_add(&W->mx, M_OSCORE, 1);
+        return 1;
+    }
+    mx_add(&W->mx, M_OSC_REJ, 1);
+    if (rc == OSC_ECHO){
+        size_t k = osc_challenge(req, orq, out, BUF_SZ);
+        *outlen = k ? osc_protect(&g_osc, W->cx, orq, out, k, BUF_SZ) : 0;
+    } else *outlen = reply_plain(req, out, BUF_SZ, rc == OSC_OK ? COAP_400_BADREQ : (uint8_t)rc, NULL, 0);
+    return 0;
+}
+
+/* Dispositivo que escribe una petición sin OSCORE, para su token bucket: el
+ * {id} de la ruta o, en /sensor, el "id" del cuerpo (se parsea sólo el primer
+ * registro). -1 = anónimo (dispositivo 0) o cuerpo que no se entiende: sólo
+ * cuenta el límite del endpoint. Un bloque intermedio de Block1 no se mira. */
+static int req_write_device(const coap_req_t* req, uint32_t* dev){
+    srec_t r;
+    if (req_device(req, dev) != 0) return -1;
+    if (req->nparams > 0) return 0;
+    if (req_readings(req, 0, &r, 1) < 1 || r.device == 0) return -1;
+    *dev = r.device;
+    return 0;
+}
+
+/* Control de admisión de una petición ya abierta (req es el mensaje interno si
+ * vino por OSCORE, y ctx su contexto). Con la cola del escritor sobre la marca
+ * baja se descartan las escrituras NON y sobre la alta también las CON; luego
+ * el token bucket del endpoint y el del dispositivo: el kid de OSCORE o, en
+ * las escrituras, el de req_write_device (las lecturas de /device/{id} las
+ * hacen otros y no gastan las fichas del sensor). Devuelve 1 si se atiende;
+ * si no, una CON recibe 5.03 con Max-Age = segundos hasta poder reintentar y
+ * una NON se descarta sin respuesta. */
+static int admit(worker_t* W, const coap_req_t* req, const struct sockaddr_in* cli,
+                 const osc_ctx_t* ctx, int shed, uint8_t* out, size_t* outlen){
+    uint32_t wait_s = 0, now = (uint32_t)now_ms(), dev;
+    int write = req->code == COAP_POST || req->code == COAP_PUT;
+    if (write && shed >= (req->type == COAP_CON ? 2 : 1)){
+        wait_s = SHED_RETRY_S;
+        mx_add(&W->mx, M_SHED, 1);
+    } else if ((g_rl_ep.rate && rl_take(&W->rl, rl_key_ep(cli), &g_rl_ep, now, &wait_s) != 0) ||
+               (g_rl_dev.rate && ctx && rl_take(&W->rl, rl_key(RL_KID, (uint32_t)(ctx - g_osc.c)), &g_rl_dev, now, &wait_s) != 0) ||
+               (g_rl_dev.rate && !ctx && write && req_write_device(req, &dev) == 0 &&
+                rl_take(&W->rl, rl_key(RL_DEV, dev), &g_rl_dev, now, &wait_s) != 0)){
+        mx_add(&W->mx, M_RATE_LIM, 1);
+    } else return 1;
+    if (req->type == COAP_CON){
+        copt_t ma = copt_uint(OPT_MAX_AGE, wait_s);
+        *outlen = reply_plain(req, out, BUF_SZ, COAP_503_UNAVAIL, &ma, 1);
+    }
+    return 0;
+}
+
+/* --- proxy hacia el dueño (modo clúster) --- */
+/* GET/DELETE de un dispositivo de otro nodo: se reenvía en NON al puerto CoAP
+ * de su dueño y la respuesta vuelve al cliente cuando llega (px_input). Se
+ * enrutan las rutas con dispositivo (/device/{id}[...], /sensor/{id}/stats) y
+ * las de /sensor (dispositivo 0, o el de ?device=); /metrics y .well-known se
+ * contestan aquí. GET con Observe=0 suma al cliente a la observación de la
+ * clave (una por worker hacia el dueño); Observe=1 lo quita y sólo se la pasa
+ * al dueño si era el último. Devuelve 1 si quedó reenviada, 0 si se atiende
+ * aquí, -1 si la tabla está llena (el llamador contesta 5.03). out es scratch. */
+static int px_forward(worker_t* W, const cl_ring_t* r, const coap_req_t* req, const struct sockaddr_in* cli,
+                      const osc_req_t* orq, uint32_t now_s, uint8_t* out){
+    const rt_node_t* nd = req->node >= 0 ? &g_rt.n[req->node] : NULL;
+    uint32_t dev; int64_t qd;
+    if ((req->code != COAP_GET && req->code != COAP_DELETE) || !nd || !(nd->obs || req->nparams > 0) ||
+        !nd->fn[req->code] || req_device(req, &dev) != 0) return 0;      /* el handler contesta el error */
+    if (req_query_i64(req, "device", &qd) > 0 && qd >= 0 && qd <= (int64_t)UINT32_MAX) dev = (uint32_t)qd;
+    uint32_t o = cl_owner(r, dev);
+    if ((int32_t)o == r->self) return 0;
+    cl_px_t* e = NULL;
+    int32_t obs = req->observe;
+    if (req->code == COAP_GET && nd->obs && req->observe >= 0 && req->nquery == 0 && req->block2 < 0){
+        char key[RT_PATH_MAX];
+        req_key(req, key, sizeof(key));
+        uint32_t kt = cl_px_key_tok(key);
+        if (req->observe == 0) e = cl_px_sub(&W->px, cli, kt, now_s);   /* llena: GET simple */
+        else if (req->observe == 1){
+            int others = 0;
+            for (uint32_t i = 0; i <= W->px.mask; i++){
+                cl_px_t* s = &W->px.e[i];
+                if (s->state != PX_SUB || s->ptok != kt) continue;
+                if (s->cli.sin_port == cli->sin_port && s->cli.sin_addr.s_addr == cli->sin_addr.s_addr) s->state = PX_FREE;
+                else others = 1;
+            }
+            if (others) obs = -1;          /* la observación hacia el dueño sigue para los demás */
+        }
+        if (!e && req->observe == 0) obs = -1;
+    }
+    if (!e && !(e = cl_px_new(&W->px, now_s))) return -1;
+    e->cli = *cli; e->ctype = req->type; e->cmid = req->mid;
+    e->tkl = req->tkl; memcpy(e->token, req->token, req->tkl);
+    e->answered = 0;
+    e->sec = orq != NULL;
+    if (orq) e->orq = *orq;
+    size_t n = cl_fwd_req(out, BUF_SZ, req, COAP_NON, W->px_mid++, e->ptok, obs, &g_cl_key);
+    if (n == 0 || sendto(W->pfd, out, n, 0, (const struct sockaddr*)&r->node[o].coap, sizeof(r->node[o].coap)) < 0){
+        e->state = PX_FREE;
+        return -1;
+    }
+    mx_add(&W->mx, M_PROXY, 1);
+    return 1;
+}
+
+/* Respuesta (o notificación) m del dueño hacia el cliente de e: su token, y su
+ * MID si es la primera (piggyback en el ACK si pidió en CON); las siguientes
+ * salen en NON con MID propio. La primera a una CON queda en la caché de dedup. */
+static void px_relay(worker_t* W, dedup_t* dd, cl_px_t* e, const uint8_t* m, size_t n, uint32_t now_s, uint8_t* out){
+    int first = !e->answered;
+    uint8_t type = first && e->ctype == COAP_CON ? COAP_ACK : COAP_NON;
+    uint16_t mid = first ? e->cmid : W->px_mid++;
+    size_t len = 4u + e->tkl + (n - 8u);
+    if (len > BUF_SZ) return;
+    out[0] = (uint8_t)((COAP_VER<<6) | (type<<4) | e->tkl);
+    out[1] = m[1];
+    out[2] = (uint8_t)(mid>>8); out[3] = (uint8_t)(mid & 0xFF);
+    memcpy(out + 4, e->token, e->tkl);
+    memcpy(out + 4 + e->tkl, m + 8, n - 8u);
+    if (e->sec && (len = osc_protect(&g_osc, W->cx, &e->orq, out, len, BUF_SZ)) == 0) return;
+    if (sendto(W->fd, out, len, 0, (const struct sockaddr*)&e->cli, sizeof(e->cli)) > 0){
+        mx_add(&W->mx, first ? M_TX : M_NOTIFY, 1);
+        mx_add(&W->mx, M_BYTES_OUT, len);
+    }
+    if (first && e->ctype == COAP_CON) dd_store(dd, &e->cli, e->cmid, now_s, out, len);
+    if (!first) e->rmid = mid;
+    e->answered = 1;
+}
+
+/* Lo que llega por el socket del proxy: respuestas a peticiones reenviadas y
+ * notificaciones de las observaciones agregadas. Una CON del dueño se confirma
+ * con ACK; una notificación sin suscriptores se contesta con RST para que el
+ * dueño dé de baja la observación (RFC 7641 §3.6). */
+static void px_input(worker_t* W, dedup_t* dd, uint8_t* in, uint8_t* out){
+    uint32_t now_s = (uint32_t)(now_ms() / 1000u);
+    for (;;){
+        struct sockaddr_in from; socklen_t fl = sizeof(from);
+        ssize_t n = recvfrom(W->pfd, in, BUF_SZ, MSG_DONTWAIT, (struct sockaddr*)&from, &fl);
+        if (n < 0) return;
+        coap_req_t rs;
+        if (n < 8 || (in[0] & 0x0F) != 4u || in[1] == 0 || coap_parse(in, (size_t)n, NULL, &rs) != 0) continue;
+        uint32_t tok = (uint32_t)in[4]<<24 | (uint32_t)in[5]<<16 | (uint32_t)in[6]<<8 | in[7];
+        int more = rs.observe >= 0 && in[1] >> 5 == 2, any = 0;
+        if (tok & CL_PX_OBS){
+            for (uint32_t i = 0; W->px.e && i <= W->px.mask; i++){
+                cl_px_t* e = &W->px.e[i];
+                if (e->state != PX_SUB || e->ptok != tok) continue;
+                any = 1;
+                px_relay(W, dd, e, in, (size_t)n, now_s, out);
+                if (!more) e->state = PX_FREE;   /* la observación terminó (o nunca empezó) */
+            }
+        } else {
+            cl_px_t* e = cl_px_find(&W->px, tok);
+            if (e){ any = 1; px_relay(W, dd, e, in, (size_t)n, now_s, out); e->state = PX_FREE; }
+        }
+        if (rs.type == COAP_CON || (rs.type == COAP_NON && !any && (tok & CL_PX_OBS))){
+            uint8_t a[4] = { (uint8_t)((COAP_VER<<6) | ((any ? COAP_ACK : COAP_RST)<<4)), 0, in[2], in[3] };
+            (void)!sendto(W->pfd, a, sizeof(a), 0, (const struct sockaddr*)&from, fl);
+        }
+    }
+}
+
+/* RST del cliente a una notificación reenviada: deja de ser suscriptor */
+static void px_rst(worker_t* W, const struct sockaddr_in* cli, uint16_t mid){
+    for (uint32_t i = 0; W->px.e && i <= W->px.mask; i++){
+        cl_px_t* e = &W->px.e[i];
+        if (e->state == PX_SUB && e->answered && e->rmid == mid && e->cli.sin_port == cli->sin_port &&
+            e->cli.sin_addr.s_addr == cli->sin_addr.s_addr) e->state = PX_FREE;
+    }
+}
+
+static void worker_sweep(tw_timer_t* t, void* arg, uint64_t now){
+    worker_t* W = (worker_t*)arg;
+    blk_expire(&W->blk, (uint32_t)(now / 1000u));
+    tw_add(&W->tw, t, now, BLK_SWEEP_MS, worker_sweep, W);
+}
+
+/* --- instantánea (arranque en caliente; ver snapshot.h) --- */
+static sn_t       g_snap;           /* la cargada al arrancar, mapeada hasta que los workers toman su dedup */
+static atomic_int g_snap_refs;
+static uint32_t   g_snap_age_s;     /* antigüedad de g_snap al cargarla */
+static sn_buf_t   g_snap_buf;       /* se reutiliza entre instantáneas (sólo el hilo principal) */
+
+static void snap_path(const char* dir, char* out, size_t cap){ snprintf(out, cap, "%s/state.snap", dir); }
+
+/* Periódica (clean = 0, con todo en marcha) o final (con workers y escritor
+ * parados y el almacenamiento ya vaciado); 0 o -1 */
+static int snap_write(int clean){
+    char path[320];
+    sn_buf_t* b = &g_snap_buf;
+    snap_path(g_st.dir, path, sizeof(path));
+    sn_begin(b, clean ? SN_CLEAN : 0u, (uint32_t)g_nworkers, wall_ms());
+    st_snap_save(&g_st, b);
+    last_snap_save(b);
+    obs_snap_save(&g_obs, b);
+    if (clean){
+        uint32_t now_s = (uint32_t)(now_ms() / 1000u);
+        ru_snap_save(&g_ru, b);
+        osc_snap_save(&g_osc, b);
+        sn_section(b, SN_DEDUP, sizeof(dd_snap_t));
+        for (int i = 0; i < g_nworkers; i++)
+            if (g_workers[i].dd.slots) dd_snap_save(&g_workers[i].dd, b, (uint32_t)i, now_s);
+    }
+    int rc = sn_commit(b, path);
+    if (rc != 0) perror("snapshot");
+    return rc;
+}
+
+/* Cada worker, al arrancar: su dedup (de una salida limpia) y suelta la instantánea */
+static void snap_worker_load(worker_t* W){
+    uint64_t n;
+    const dd_snap_t* x = (g_snap.flags & SN_CLEAN) ? (const dd_snap_t*)sn_find(&g_snap, SN_DEDUP, sizeof(dd_snap_t), &n) : NULL;
+    if (x) dd_snap_load(&W->dd, x, n, g_snap.nworkers == (uint32_t)g_nworkers ? W->id : -1,
+                        g_snap_age_s, (uint32_t)(now_ms() / 1000u));
+    if (atomic_fetch_sub(&g_snap_refs, 1) == 1) sn_close(&g_snap);
+}
+
+/* Bucle de un worker: epoll sobre su socket y g_stop_fd, con timeout hasta el
+ * próximo timer de su rueda. Por despertar, hasta RX_ROUNDS recvmmsg de
+ * RX_BATCH datagramas; cada lote se procesa completo y sus respuestas salen con
+ * un solo sendmmsg. Los CON ya vistos se contestan desde la caché de dedup sin
+ * pasar por handle_packet (también los OSCORE: la respuesta guardada ya va
+ * cifrada y el reenvío no choca con la ventana anti-replay). */
+static void* worker_main(void* arg){
+    worker_t* W = (worker_t*)arg;
+    int fd = W->fd;
+    uint8_t inbuf[RX_BATCH][BUF_SZ], outbuf[RX_BATCH][BUF_SZ], plain[BUF_SZ];
+    struct sockaddr_in cli[RX_BATCH];
+    struct iovec iin[RX_BATCH], iout[RX_BATCH];
+    struct mmsghdr rx[RX_BATCH], tx[RX_BATCH];
+    char changed[RX_BATCH][RT_PATH_MAX];
+    dedup_t* dd = &W->dd;
+    /* la arena la reserva (y la toca) el propio hilo: páginas en su nodo NUMA */
+    if (arena_init(&W->arena, worker_arena_bytes(&g_pool)) != 0 ||
+        dd_init(dd, &W->arena, g_pool.dedup_slots) != 0 ||
+        rl_init(&W->rl, &W->arena, g_pool.rate_slots) != 0 ||
+        blk_init(&W->blk, &W->arena, g_pool.blk_sessions, (uint32_t)W->id << 24) != 0 ||
+        pool_init(&W->rtx, &W->arena, sizeof(obs_rtx_t), g_pool.obs_rtx) != 0 ||
+        cl_px_init(&W->px, &W->arena, W->pfd >= 0 ? g_pool.proxy_slots : 0u) != 0 ||
+        !(W->tg = (obs_target_t*)arena_alloc(&W->arena, (size_t)g_pool.obs_slots * sizeof(obs_target_t)))){
+        perror("worker arena"); arena_free(&W->arena); g_stop = 1; return NULL;
+    }
+    if (!(W->cx = EVP_CIPHER_CTX_new())){ perror("worker cipher"); arena_free(&W->arena); g_stop = 1; return NULL; }
+    snap_worker_load(W);
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+    if (ep < 0 || epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) != 0 ||
+        (ev.data.fd = g_stop_fd, epoll_ctl(ep, EPOLL_CTL_ADD, g_stop_fd, &ev)) != 0 ||
+        (W->pfd >= 0 && (ev.data.fd = W->pfd, epoll_ctl(ep, EPOLL_CTL_ADD, W->pfd, &ev)) != 0) ||
+        (W->id == 0 && g_cl_mbx_fd >= 0 && (ev.data.fd = g_cl_mbx_fd, epoll_ctl(ep, EPOLL_CTL_ADD, g_cl_mbx_fd, &ev)) != 0)){
+        perror("worker epoll"); g_stop = 1;
+        if (ep >= 0) close(ep);
+        EVP_CIPHER_CTX_free(W->cx);
+        arena_free(&W->arena);
+        return NULL;
+    }
+    tw_init(&W->tw, now_ms(), TW_TICK_MS);
+    tw_add(&W->tw, &W->sweep, now_ms(), BLK_SWEEP_MS, worker_sweep, W);
+
+    memset(rx, 0, sizeof(rx));
+    for (int i = 0; i < RX_BATCH; i++){
+        iin[i].iov_base = inbuf[i]; iin[i].iov_len = BUF_SZ;
+        rx[i].msg_hdr.msg_iov = &iin[i]; rx[i].msg_hdr.msg_iovlen = 1;
+        rx[i].msg_hdr.msg_name = &cli[i];
+    }
+
+    while (!g_stop){
+        struct epoll_event evs[4];
+        int ne = epoll_wait(ep, evs, 4, tw_timeout_ms(&W->tw, now_ms())), rx_ready = 0;
+        tw_advance(&W->tw, now_ms());
+        for (int k = 0; k < ne; k++){
+            if (evs[k].data.fd == fd) rx_ready = 1;
+            else if (evs[k].data.fd == W->pfd) px_input(W, dd, inbuf[0], outbuf[0]);
+            else if (evs[k].data.fd == g_cl_mbx_fd){
+                /* registros de otro nodo ya guardados: notificar aquí a sus observadores */
+                char key[CL_KEY_MAX]; uint64_t v;
+                if (read(g_cl_mbx_fd, &v, sizeof(v)) < 0){ /* EAGAIN: ya leído */ }
+                while (cl_mbx_pop(&g_cl_mbx, key)) obs_fanout(W, key, outbuf);
+            }
+        }
+        const cl_ring_t* ring = W->pfd >= 0 ? cl_ring() : NULL;
+        for (int round = 0; rx_ready && round < RX_ROUNDS && !g_stop; round++){
+            for (int i = 0; i < RX_BATCH; i++) rx[i].msg_hdr.msg_namelen = sizeof(cli[i]);
+            int got = recvmmsg(fd, rx, RX_BATCH, MSG_DONTWAIT, NULL);
+            if (got <= 0) break;
+            mx_add(&W->mx, M_RX, (unsigned long)got);
+            mx_add(&W->mx, M_BATCHES, 1);
+
+            uint32_t now_s = (uint32_t)(now_ms() / 1000u);
+            int nout = 0, nchg = 0;
+            /* nivel de descarte para todo el lote: 0 nada, 1 escrituras NON, 2 también CON */
+            size_t depth = g_shed_non ? lq_depth(&g_lq) : 0;
+            int shed = !g_shed_non ? 0 : depth >= g_shed_con ? 2 : depth >= g_shed_non ? 1 : 0;
+            for (int i = 0; i < got; i++){
+                const uint8_t* in = inbuf[i];
+                size_t n = rx[i].msg_len, outlen = 0;
+                int con = n >= 4u && ((in[0]>>4) & 0x03) == COAP_CON;
+                uint16_t mid = con ? (uint16_t)((in[2]<<8) | in[3]) : 0;
+                mx_add(&W->mx, M_BYTES_IN, n);
+                if (con && (outlen = dd_lookup(dd, &cli[i], mid, now_s, outbuf[nout], BUF_SZ)) > 0){
+                    mx_add(&W->mx, M_DUPS, 1);
+                } else {
+                    coap_req_t req;
+                    uint64_t t0 = mx_now_ns();
+                    int bad = coap_parse(in, n, &g_rt, &req) != 0;
+                    uint64_t t1 = mx_now_ns();
+                    mx_rec(&W->mx, H_PARSE, t1 - t0);
+                    if (bad){ mx_add(&W->mx, M_PARSE_ERR, 1); continue; }
+                    /* sec: petición OSCORE verificada (req es el mensaje interno, en plain);
+                     * peer: viene del proxy de otro nodo, que ya la admitió */
+                    int sec = 0, serve = 1, peer = ring ? cl_from_peer(ring, &g_cl_key, &req, &cli[i]) : 0;
+                    osc_req_t orq;
+                    changed[nchg][0] = '\0';
+                    if (peer < 0){
+                        /* opción de salto que no verifica: nadie de afuera se salta los límites */
+                        if (req.code != 0) outlen = reply_plain(&req, outbuf[nout], BUF_SZ, COAP_402_BADOPT, NULL, 0);
+                        serve = peer = 0;
+                    }
+                    else if (req.opt[CO_OSCORE].off && req.code != 0)
+                        serve = sec = oscore_open(W, &req, in, plain, &orq, outbuf[nout], &outlen);
+                    else if (g_osc_require && req.code != 0 && !peer){
+                        outlen = reply_plain(&req, outbuf[nout], BUF_SZ, COAP_401_UNAUTH, NULL, 0);
+                        serve = 0;
+                    }
+                    if (serve && req.code != 0 && !peer) serve = admit(W, &req, &cli[i], sec ? orq.c : NULL, shed, outbuf[nout], &outlen);
+                    if (serve && ring && !peer){
+                        if (req.code == 0 && req.type == COAP_RST) px_rst(W, &cli[i], req.mid);
+                        int fw = req.code != 0 ? px_forward(W, ring, &req, &cli[i], sec ? &orq : NULL, now_s, outbuf[nout]) : 0;
+                        if (fw < 0){
+                            copt_t ma = copt_uint(OPT_MAX_AGE, SHED_RETRY_S);
+                            outlen = reply_plain(&req, outbuf[nout], BUF_SZ, COAP_503_UNAVAIL, &ma, 1);
+                        }
+                        serve = fw == 0;
+                    }
+                    if (serve) outlen = handle_packet(&W->blk, &cli[i], now_s, &req, sec ? plain : in, outbuf[nout], BUF_SZ, changed[nchg]);
+                    mx_rec(&W->mx, H_HANDLE, mx_now_ns() - t1);
+                    if (outlen >= 2u && outbuf[nout][1] >> 5 == 4) mx_add(&W->mx, M_4XX, 1);
+                    if (outlen >= 2u && outbuf[nout][1] >> 5 == 5) mx_add(&W->mx, M_5XX, 1);
+                    if (sec && outlen > 0) outlen = osc_protect(&g_osc, W->cx, &orq, outbuf[nout], outlen, BUF_SZ);
+                    if (con && outlen > 0) dd_store(dd, &cli[i], mid, now_s, outbuf[nout], outlen);
+                    /* una notificación por recurso y lote, aunque llegaran varios POST */
+                    if (changed[nchg][0]){
+                        int seen = 0;
+                        for (int j = 0; j < nchg && !seen; j++) seen = strcmp(changed[j], changed[nchg]) == 0;
+                        if (!seen) nchg++;
+                    }
+                }
+                if (outlen == 0) continue;
+                iout[nout].iov_base = outbuf[nout]; iout[nout].iov_len = outlen;
+                memset(&tx[nout].msg_hdr, 0, sizeof(tx[nout].msg_hdr));
+                tx[nout].msg_hdr.msg_iov = &iout[nout]; tx[nout].msg_hdr.msg_iovlen = 1;
+                tx[nout].msg_hdr.msg_name = &cli[i];
+                tx[nout].msg_hdr.msg_namelen = rx[i].msg_hdr.msg_namelen;
+                nout++;
+            }
+            for (int off = 0; off < nout; ){
+                uint64_t t0 = mx_now_ns();
+                int sent = sendmmsg(fd, tx + off, (unsigned)(nout - off), 0);
+                mx_rec(&W->mx, H_SEND, mx_now_ns() - t0);
+                if (sent <= 0) break;
+                for (int j = off; j < off + sent; j++) mx_add(&W->mx, M_BYTES_OUT, tx[j].msg_len);
+                off += sent;
+                mx_add(&W->mx, M_TX, (unsigned long)sent);
+            }
+            /* outbuf ya se envió: se reutiliza para armar las notificaciones */
+            for (int j = 0; j < nchg; j++) obs_fanout(W, changed[j], outbuf);
+        }
+    }
+    close(ep);
+    EVP_CIPHER_CTX_free(W->cx);
+    return NULL;   /* la arena la libera main tras el join (y tras leer sus pools) */
+}
+
+static void print_stats(const worker_t* ws, int n){
+    for (int i = 0; i < n; i++){
+        const mx_t* m = &ws[i].mx;
+        unsigned long rx = mx_get(m, M_RX), b = mx_get(m, M_BATCHES);
+        printf("worker %d: rx=%lu tx=%lu dups=%lu notifies=%lu parse_err=%lu batches=%lu avg_batch=%.2f\n",
+               i, rx, mx_get(m, M_TX), mx_get(m, M_DUPS), mx_get(m, M_NOTIFY), mx_get(m, M_PARSE_ERR),
+               b, b ? (double)rx / (double)b : 0.0);
+    }
+    fflush(stdout);
+}
+
+/* --- métricas por HTTP (para el scrape de Prometheus) --- */
+static int open_listen(uint16_t port, const char* what){
+    int fd = sn_take(g_ho_fds, g_ho_n, SOCK_STREAM, port);
+    if (fd >= 0) return fd;
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0){ perror(what); return -1; }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in a; memset(&a,0,sizeof(a));
+    a.sin_family = AF_INET; a.sin_addr.s_addr = htonl(INADDR_ANY); a.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&a, sizeof(a)) != 0 || listen(fd, 16) != 0){
+        perror(what); close(fd); return -1;
+    }
+    return fd;
+}
+
+/* Una conexión por despertar, desde el hilo principal: a cualquier GET se le
+ * contesta el texto de Prometheus (HTTP/1.0, se cierra al terminar) */
+static void serve_metrics_http(int lfd){
+    static char body[BLK_REPR_MAX];
+    char rq[1024], hdr[192];
+    int c = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+    if (c < 0) return;
+    struct timeval tv = { 0, 200000 };
+    setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    ssize_t r = recv(c, rq, sizeof(rq) - 1u, 0);
+    if (r > 0){
+        int get = r >= 4 && memcmp(rq, "GET ", 4) == 0;
+        size_t n = get ? metrics_render(1, body, sizeof(body)) : 0;
+        if (n >= sizeof(body)) n = sizeof(body) - 1u;
+        int h = snprintf(hdr, sizeof(hdr), "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                         "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                         get ? "200 OK" : "405 Method Not Allowed", n);
+        if (send(c, hdr, (size_t)h, MSG_NOSIGNAL) == h && n) (void)!send(c, body, n, MSG_NOSIGNAL);
+    }
+    close(c);
+}
+
+/* SIGHUP en modo clúster: el hilo principal relee COAP_CLUSTER */
+static int g_hup_fd = -1;
+static void on_hup(int s){
+    (void)s;
+    uint64_t one = 1;
+    if (write(g_hup_fd, &one, sizeof(one)) < 0){ /* nada que hacer en la señal */ }
+}
+
+/* Publica el anillo nuevo; el viejo queda colgado de él hasta salir (ver cluster.h).
+ * Los puertos propios (CoAP y enlace) son los del arranque: cambiarlos pide reiniciar. */
+static void cluster_reload(const char* path, const char* self){
+    cl_ring_t* old = cl_ring();
+    cl_ring_t* r = cl_load(path, self, old->gen + 1u);
+    if (!r){ fprintf(stderr, "cluster: %s no cambió el anillo\n", path); return; }
+    r->retired = old;
+    atomic_store_explicit(&g_ring, r, memory_order_release);
+    wr_kick();
+}
+
+/* --- main --- */
+int main(int argc, char** argv){
+    int nworkers = 1;
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "--workers") == 0 && i+1 < argc) nworkers = atoi(argv[++i]);
+        else { fprintf(stderr, "uso: %s [--workers N]\n", argv[0]); return 2; }
+    }
+    if (nworkers < 1) nworkers = 1;
+    if (nworkers > MAX_WORKERS) nworkers = MAX_WORKERS;
+
+    g_stop_fd = eventfd(0, EFD_CLOEXEC);
+    g_wr_fd   = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (g_stop_fd < 0 || g_wr_fd < 0){ perror("eventfd"); return 1; }
+    srandom((unsigned)wall_ms());
+    g_start_ms = now_ms();
+    uint64_t t_exec = mx_now_ns();
+    signal(SIGINT, on_sig);
+    signal(SIGTERM, on_sig);
+
+    const char* DATA = datafile_path();
+    const char* DIRP = datadir_path();
+    g_text_export = (int)env_uint("COAP_TEXT_EXPORT", 0);
+    for (unsigned bmax = env_uint("COAP_BLOCK_MAX", 1024); g_blk_szx > 0 && BLK_SIZE(g_blk_szx) > bmax; ) g_blk_szx--;
+    /* traspaso: si hay un proceso en marcha, tomar sus sockets y esperar su instantánea final */
+    char hopath[320];
+    const char* hoenv = getenv("COAP_HANDOVER");
+    if (hoenv) snprintf(hopath, sizeof(hopath), "%s", hoenv);
+    else snprintf(hopath, sizeof(hopath), "%s/handover.sock", DIRP);
+    uint64_t t_ho = mx_now_ns();
+    int took = hopath[0] && (g_ho_n = sn_takeover(hopath, g_ho_fds, SN_FDS_MAX, SNAP_WAIT_MS)) >= 0;
+    if (took) printf("handover: %d sockets del proceso anterior en %.1f ms\n", g_ho_n, (double)(mx_now_ns() - t_ho) / 1e6);
+    if (g_ho_n < 0) g_ho_n = 0;
+    t_ho = mx_now_ns();
+    const char* cpath = getenv("COAP_CLUSTER");
+    const char* cself = getenv("COAP_CLUSTER_SELF");
+    if (cpath && *cpath){
+        cl_ring_t* r = cl_load(cpath, cself ? cself : "", 1u);
+        if (!r) return 1;
+        if (r->self < 0){
+            fprintf(stderr, "cluster: COAP_CLUSTER_SELF=\"%s\" no está en %s\n", cself ? cself : "", cpath);
+            cl_free(r); return 1;
+        }
+        const char* ck = getenv("COAP_CLUSTER_KEY");
+        int kl = ck && *ck ? osc_hex(ck, g_cl_key.k, sizeof(g_cl_key.k)) : -1;
+        if (kl < (int)CL_SECRET_MIN){
+            fprintf(stderr, "cluster: COAP_CLUSTER_KEY debe ser de %u a %u bytes en hex\n", CL_SECRET_MIN, CL_SECRET_MAX);
+            cl_free(r); return 1;
+        }
+        g_cl_key.len = (size_t)kl;
+        const cl_node_t* me = &r->node[r->self];
+        g_port = ntohs(me->coap.sin_port);
+        g_cl_flush_ms = env_uint("COAP_CLUSTER_FLUSH_MS", 5);
+        if (g_cl_flush_ms == 0) g_cl_flush_ms = 1;
+        g_cl_lfd = open_listen(ntohs(me->link.sin_port), "cluster listen");
+        g_cl_mbx_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        g_hup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (g_cl_lfd < 0 || g_cl_mbx_fd < 0 || g_hup_fd < 0){ cl_free(r); return 1; }
+        atomic_store(&g_ring, r);
+        signal(SIGHUP, on_hup);
+        printf("cluster: nodo %s de %u (%u puntos), enlace en :%u, vaciado cada %u ms\n", me->name,
+               r->nnodes, r->npoints, ntohs(me->link.sin_port), g_cl_flush_ms);
+    }
+    printf("CoAP min server on 0.0.0.0:%u (workers=%d)\n", g_port, nworkers);
+    printf("datadir=%s\n", DIRP);
+    if (g_text_export) printf("datafile=%s (export)\n", DATA);
+    fflush(stdout);
+
+    register_routes(&g_rt);
+    g_osc_require = (int)env_uint("COAP_OSCORE_REQUIRE", 0);
+    const char* okeys = getenv("COAP_OSCORE_KEYS");
+    if (okeys && *okeys){
+        const char* sh = getenv("COAP_OSCORE_SID");
+        uint8_t sid[OSC_ID_MAX];
+        int sl = osc_hex(sh && *sh ? sh : "-", sid, sizeof(sid));
+        if (sl < 0 || osc_load(&g_osc, okeys, sid, (size_t)sl) < 0){
+            fprintf(stderr, "oscore: no se pudieron cargar los contextos de %s\n", okeys); return 1;
+        }
+        char spath[320];
+        snprintf(spath, sizeof(spath), "%s/oscore.ssn", DIRP);
+        if ((mkdir(DIRP, 0755) != 0 && errno != EEXIST) || osc_ssn_open(&g_osc, spath) != 0){
+            perror(spath); return 1;
+        }
+        printf("oscore: %u contextos%s\n", g_osc.n, g_osc_require ? " (sólo peticiones protegidas)" : "");
+    } else if (g_osc_require) printf("oscore: sin contextos, toda petición recibe 4.01\n");
+    pool_cfg_load(&g_pool, DEDUP_SLOTS, RL_SLOTS, BLK_SESSIONS, OBS_RTX_SLOTS, CL_PX_SLOTS, OBS_SLOTS);
+    if (!cl_ring()) g_pool.proxy_slots = 0;
+    rl_limit_load(&g_rl_ep, "COAP_RATE_PPS", "COAP_RATE_BURST");
+    rl_limit_load(&g_rl_dev, "COAP_DEV_RATE_PPS", "COAP_DEV_RATE_BURST");
+    g_shed_non = env_uint("COAP_SHED_HWM", LQ_CAP / 2u);
+    if (g_shed_non >= LQ_CAP) g_shed_non = 0;
+    g_shed_con = g_shed_non + (LQ_CAP - g_shed_non) * 3u / 4u;
+    if (g_rl_ep.rate || g_rl_dev.rate)
+        printf("límite: %.3g/s (ráfaga %u) por endpoint, %.3g/s (ráfaga %u) por dispositivo; 0 = sin límite\n",
+               g_rl_ep.rate / 1e3, g_rl_ep.burst, g_rl_dev.rate / 1e3, g_rl_dev.burst);
+    if (g_shed_non) printf("descarte: escrituras NON con la cola en %zu, CON (5.03) en %zu de %u\n",
+                           g_shed_non, g_shed_con, LQ_CAP);
+    if (arena_init(&g_obs_arena, obs_need(g_pool.obs_slots)) != 0 ||
+        obs_init(&g_obs, &g_obs_arena, g_pool.obs_slots, env_uint("COAP_OBS_CON", 0),
+                 (uint16_t)(wall_ms() & 0xFFFF)) != 0){
+        perror("observe"); return 1;
+    }
+    size_t wbytes = worker_arena_bytes(&g_pool);
+    printf("memoria: %zu KiB/worker (dedup=%u rate=%u blk=%u rtx=%u proxy=%u) + %zu KiB observe (%u) = %zu KiB\n",
+           wbytes >> 10, g_pool.dedup_slots, g_pool.rate_slots, g_pool.blk_sessions, g_pool.obs_rtx, g_pool.proxy_slots,
+           g_obs_arena.cap >> 10, g_pool.obs_slots, ((size_t)nworkers * wbytes + g_obs_arena.cap) >> 10);
+    fflush(stdout);
+
+    /* instantánea: catálogo, última lectura y observadores siempre; agregados,
+     * ventanas OSCORE y dedup sólo si es de una salida limpia */
+    char spath[320];
+    uint64_t nknown = 0, nrup = 0, nobs = 0, nosc = 0;
+    snap_path(DIRP, spath, sizeof(spath));
+    int warm = sn_open(&g_snap, spath) == 0, clean = warm && (g_snap.flags & SN_CLEAN);
+    const st_known_t* known = warm ? (const st_known_t*)sn_find(&g_snap, SN_CATALOG, sizeof(st_known_t), &nknown) : NULL;
+    const ru_snap_t* rup = clean ? (const ru_snap_t*)sn_find(&g_snap, SN_ROLLUP, sizeof(ru_snap_t), &nrup) : NULL;
+    if (warm){
+        int64_t age = wall_ms() - g_snap.wall_ms;
+        g_snap_age_s = age > 0 ? (uint32_t)(age / 1000) : 0u;
+        uint64_t nh;
+        const obs_snap_t* oh = (const obs_snap_t*)sn_find(&g_snap, SN_OBS_HDR, sizeof(obs_snap_t), &nh);
+        const obs_entry_t* oe = (const obs_entry_t*)sn_find(&g_snap, SN_OBS, sizeof(obs_entry_t), &nobs);
+        obs_snap_load(&g_obs, nh ? oh : NULL, oe, nobs);
+        const osc_snap_t* ow = clean ? (const osc_snap_t*)sn_find(&g_snap, SN_OSCORE, sizeof(osc_snap_t), &nosc) : NULL;
+        nosc = ow ? osc_snap_load(&g_osc, ow, nosc) : 0u;
+        last_snap_load(&g_snap);
+    }
+    store_t* st = &g_st;
+    if (st_open(st, DIRP, (uint64_t)env_uint("COAP_SEG_MAX_KB", 4096)*1024u,
+                env_uint("COAP_SEG_FLUSH_MS", 1000), (int)env_uint("COAP_FSYNC", 0), known, nknown) != 0){
+        perror("datadir"); return 1;
+    }
+    seed_from_store(st);
+    if (ru_open(&g_ru, DIRP, env_uint("COAP_ROLLUP_FLUSH_MS", 10000), rup, nrup) != 0){
+        perror("rollup"); return 1;
+    }
+    if (warm){
+        uint32_t nscan = 0;
+        for (uint32_t i = 0; i < ST_MAX_DEVICES; i++) nscan += st->devs[i].used && st->devs[i].scanned;
+        printf("snapshot: %s de hace %u s; %lu segmentos conocidos, %u/%u dispositivos releídos, "
+               "%lu observadores, %lu ventanas oscore%s\n", clean ? "limpia" : "periódica", g_snap_age_s,
+               (unsigned long)nknown, nscan, st->ndevs, (unsigned long)nobs, (unsigned long)nosc,
+               rup ? "" : ", agregados de los .rollup");
+    }
+
+    static bwriter_t wr;
+    persist_t ps = { st, &g_ru, NULL };
+    if (g_text_export){
+        last_seed(DATA, "sensor");
+        bw_init(&wr, DATA, env_uint("COAP_FLUSH_MS", 50), (int)env_uint("COAP_FSYNC", 0));
+        if (wr.fd < 0) perror("open datafile");
+        ps.text = &wr;
+    }
+    lq_init(&g_lq);
+
+    worker_t* workers = g_workers;
+    for (int i = 0; i < nworkers; i++){
+        workers[i].id = i;
+        workers[i].fd = open_udp(g_port, nworkers > 1);
+        if (workers[i].fd < 0 && i > 0 && g_ho_n > 0){
+            /* heredados sin SO_REUSEPORT (el anterior tenía un worker): seguir con los que hay */
+            fprintf(stderr, "handover: sigo con %d workers\n", i);
+            nworkers = i;
+            break;
+        }
+        workers[i].pfd = cl_ring() ? open_udp(0, 0) : -1;   /* puerto efímero, hacia los dueños */
+        if (workers[i].fd < 0 || (cl_ring() && workers[i].pfd < 0)){
+            for (; i >= 0; i--){ close(workers[i].fd); if (workers[i].pfd >= 0) close(workers[i].pfd); }
+            return 1;
+        }
+    }
+
+    g_nworkers = nworkers;
+    if (warm) atomic_store(&g_snap_refs, nworkers);
+
+    pthread_t wth;
+    pthread_create(&wth, NULL, writer_main, &ps);
+    for (int i = 0; i < nworkers; i++)
+        pthread_create(&workers[i].th, NULL, worker_main, &workers[i]);
+
+    unsigned stats_s = env_uint("COAP_STATS_S", 0);
+    uint64_t next_stats = now_ms() + stats_s*1000u;
+    unsigned snap_ms = env_uint("COAP_SNAPSHOT_MS", 10000);
+    uint64_t next_snap = now_ms() + snap_ms;
+    unsigned mport = env_uint("COAP_METRICS_PORT", 0);
+    int hfd = mport ? open_listen((uint16_t)mport, "metrics") : -1;
+    if (hfd >= 0){ printf("metrics: http://0.0.0.0:%u/metrics\n", mport); fflush(stdout); }
+    for (int i = 0; i < g_ho_n; i++) if (g_ho_fds[i] >= 0) close(g_ho_fds[i]);   /* heredados que ya no se usan */
+    int hlfd = hopath[0] ? sn_listen(hopath) : -1, hconn = -1;
+    if (hopath[0] && hlfd < 0) perror("handover");
+    if (took) printf("listo en %.1f ms (%.1f ms tras el traspaso)\n", (double)(mx_now_ns() - t_exec) / 1e6,
+                     (double)(mx_now_ns() - t_ho) / 1e6);
+    else printf("listo en %.1f ms\n", (double)(mx_now_ns() - t_exec) / 1e6);
+    fflush(stdout);
+    int mep = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event mev[4] = { { .events = EPOLLIN, .data.fd = g_stop_fd }, { .events = EPOLLIN, .data.fd = hfd },
+                                  { .events = EPOLLIN, .data.fd = g_hup_fd }, { .events = EPOLLIN, .data.fd = hlfd } };
+    if (mep >= 0){
+        epoll_ctl(mep, EPOLL_CTL_ADD, g_stop_fd, &mev[0]);
+        if (hfd >= 0) epoll_ctl(mep, EPOLL_CTL_ADD, hfd, &mev[1]);
+        if (g_hup_fd >= 0) epoll_ctl(mep, EPOLL_CTL_ADD, g_hup_fd, &mev[2]);
+        if (hlfd >= 0) epoll_ctl(mep, EPOLL_CTL_ADD, hlfd, &mev[3]);
+    }
+    while (!g_stop){
+        uint64_t now = now_ms();
+        int to = stats_s ? (int)(next_stats > now ? next_stats - now : 0) : -1;
+        if (snap_ms){
+            int ts = (int)(next_snap > now ? next_snap - now : 0);
+            if (to < 0 || ts < to) to = ts;
+        }
+        int ne = mep < 0 ? -1 : epoll_wait(mep, mev, 4, to);
+        if (ne < 0){ struct timespec ts = { 0, 200000000L }; nanosleep(&ts, NULL); }
+        for (int i = 0; i < ne; i++){
+            if (mev[i].data.fd == hfd) serve_metrics_http(hfd);
+            else if (mev[i].data.fd == g_hup_fd){
+                uint64_t v;
+                if (read(g_hup_fd, &v, sizeof(v)) > 0) cluster_reload(cpath, cself ? cself : "");
+            } else if (mev[i].data.fd == hlfd && hconn < 0){
+                /* un sucesor pide los sockets: se los pasamos y paramos como con SIGTERM */
+                int fds[SN_FDS_MAX], n = 0;
+                for (int k = 0; k < nworkers; k++) fds[n++] = workers[k].fd;
+                if (hfd >= 0) fds[n++] = hfd;
+                if (g_cl_lfd >= 0) fds[n++] = g_cl_lfd;
+                if ((hconn = sn_handover(hlfd, fds, n)) >= 0){
+                    printf("handover: %d sockets al sucesor, parando\n", n);
+                    on_sig(SIGTERM);
+                }
+            }
+        }
+        if (stats_s && now_ms() >= next_stats){ print_stats(workers, nworkers); next_stats += stats_s*1000u; }
+        if (snap_ms && !g_stop && now_ms() >= next_snap){ snap_write(0); next_snap = now_ms() + snap_ms; }
+    }
+    if (mep >= 0) close(mep);
+    if (hfd >= 0) close(hfd);
+
+    uint64_t t_stop = mx_now_ns();
+    for (int i = 0; i < nworkers; i++){
+        pthread_join(workers[i].th, NULL);
+        close(workers[i].fd);
+        if (workers[i].pfd >= 0) close(workers[i].pfd);
+    }
+    atomic_store(&g_wr_stop, 1);
+    atomic_store(&g_wr_idle, 1);
+    wr_kick();
+    pthread_join(wth, NULL);
+    int snap_rc = snap_write(1);
+    st_close(st);
+    ru_close(&g_ru);
+    if (hlfd >= 0){ close(hlfd); sn_release(hconn, hopath); }
+    printf("snapshot: %s en %.1f ms desde la parada\n", snap_rc == 0 ? "final escrita" : "final fallida",
+           (double)(mx_now_ns() - t_stop) / 1e6);
+    sn_close(&g_snap);
+    print_stats(workers, nworkers);
+    for (int i = 0; i < nworkers; i++){
+        const pool_t* p = &workers[i].rtx;
+        printf("worker %d: arena %zu/%zu KiB, rtx peak=%u/%u fails=%lu\n", i,
+               workers[i].arena.used >> 10, workers[i].arena.cap >> 10, p->peak, p->count, p->fails);
+        arena_free(&workers[i].arena);
+    }
+    printf("store: %lu records, %lu writes, %lu rotations, %lu compactions\n",
+           st->recs, st->writes, st->rotations, st->compactions);
+    if (g_text_export) printf("writer: %lu lines in %lu batches\n", wr.lines, wr.batches);
+    arena_free(&g_obs_arena);
+    osc_free(&g_osc);
+    sn_buf_free(&g_snap_buf);
+    if (cl_ring()){
+        close(g_cl_lfd); close(g_cl_mbx_fd); close(g_hup_fd);
+        cl_free(cl_ring());
+    }
+    puts("bye");
+    return 0;
+}
@@ -0,0 +1,282 @@
+// snapshot.h — Instantánea del estado en memoria y traspaso de sockets
+// Para arrancar en caliente sin releer la historia: un archivo binario
+//   <dir>/state.snap   cabecera de 32 bytes + secciones (tmp + rename)
+// con una sección por módulo: cabecera {tag, tamaño de elemento, cantidad} y
+// un arreglo de structs tal cual (alineado a 8), que cada módulo escribe y lee
+// con sus *_snap_save/*_snap_load. Se carga con mmap y se lee en el sitio; una
+// sección cuyo tamaño de elemento no coincide (otra versión) se ignora y ese
+// estado arranca en frío. SN_CLEAN marca la que se escribe al salir con todo
+// ya quieto: sólo ésa trae lo que no puede estar viejo (dedup, ventanas
+// anti-replay). Al cargarla se borra la marca en el archivo, así una caída
+// posterior no vuelve a usar un estado que ya avanzó.
+// Traspaso: el proceso nuevo se conecta al socket unix del viejo, recibe sus
+// sockets (SCM_RIGHTS) y espera un byte que el viejo manda tras parar y
+// escribir la instantánea final. Los datagramas que llegan mientras tanto
+// esperan en los mismos sockets: no se pierde ninguno ni se cierra el puerto.
+#pragma once
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define SN_MAGIC    0x504E5343u   /* "CSNP" */
+#define SN_VERSION  1u
+#define SN_CLEAN    1u            /* escrita al salir, con workers y escritor parados */
+#define SN_FDS_MAX  80            /* sockets por traspaso (workers + escuchas) */
+
+#define SN_TAG(a, b, c, d)  ((uint32_t)(a) | (uint32_t)(b) << 8 | (uint32_t)(c) << 16 | (uint32_t)(d) << 24)
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version, flags;
+    uint32_t nsec, nworkers;
+    int64_t  wall_ms;             /* reloj de pared al escribirla */
+    uint64_t size;                /* bytes del archivo */
+} sn_hdr_t;
+
+typedef struct {
+    uint32_t tag, elem;
+    uint64_t count;
+} sn_sec_t;
+
+/* --- escritura --- */
+typedef struct {
+    uint8_t* p;
+    size_t   len, cap;
+    size_t   sec;                 /* offset de la sección abierta; 0 = ninguna */
+    int      err;
+} sn_buf_t;
+
+static inline size_t sn_pad(size_t n){ return (n + 7u) & ~(size_t)7u; }
+
+/* n bytes a cero al final del buffer; NULL (y err) si no hay memoria */
+static inline void* sn_grow(sn_buf_t* b, size_t n){
+    if (b->err) return NULL;
+    if (b->len + n > b->cap){
+        size_t nc = b->cap ? b->cap : 64u * 1024u;
+        while (nc < b->len + n) nc *= 2u;
+        uint8_t* np = (uint8_t*)realloc(b->p, nc);
+        if (!np){ b->err = 1; return NULL; }
+        b->p = np; b->cap = nc;
+    }
+    void* r = b->p + b->len;
+    memset(r, 0, n);
+    b->len += n;
+    return r;
+}
+
+static inline void sn_end_sec(sn_buf_t* b){
+    if (!b->sec || b->err) return;
+    size_t pad = sn_pad(b->len) - b->len;
+    if (pad) sn_grow(b, pad);
+    b->sec = 0;
+}
+
+/* Empieza de cero (el buffer se reutiliza entre instantáneas) */
+static inline void sn_begin(sn_buf_t* b, uint16_t flags, uint32_t nworkers, int64_t wall_ms){
+    b->len = 0; b->sec = 0; b->err = 0;
+    sn_hdr_t* h = (sn_hdr_t*)sn_grow(b, sizeof(sn_hdr_t));
+    if (!h) return;
+    h->magic = SN_MAGIC; h->version = SN_VERSION; h->flags = flags;
+    h->nworkers = nworkers; h->wall_ms = wall_ms;
+}
+
+/* Abre una sección de elementos de elem bytes (cierra la anterior) */
+static inline void sn_section(sn_buf_t* b, uint32_t tag, uint32_t elem){
+    sn_end_sec(b);
+    size_t at = b->len;
+    sn_sec_t* s = (sn_sec_t*)sn_grow(b, sizeof(sn_sec_t));
+    if (!s) return;
+    s->tag = tag; s->elem = elem;
+    ((sn_hdr_t*)b->p)->nsec++;
+    b->sec = at;
+}
+
+/* Un elemento más (a cero) en la sección abierta */
+static inline void* sn_item(sn_buf_t* b){
+    if (!b->sec || b->err) return NULL;
+    uint32_t elem = ((const sn_sec_t*)(b->p + b->sec))->elem;
+    void* r = sn_grow(b, elem);
+    if (r) ((sn_sec_t*)(b->p + b->sec))->count++;   /* sn_grow puede mover p */
+    return r;
+}
+
+/* Escribe path (tmp + fdatasync + rename); 0 o -1 */
+static inline int sn_commit(sn_buf_t* b, const char* path){
+    char tmp[336];
+    sn_end_sec(b);
+    if (b->err || b->len < sizeof(sn_hdr_t)) return -1;
+    ((sn_hdr_t*)b->p)->size = b->len;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    int ok = write(fd, b->p, b->len) == (ssize_t)b->len && fdatasync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp, path) != 0){ unlink(tmp); return -1; }
+    return 0;
+}
+
+static inline void sn_buf_free(sn_buf_t* b){ free(b->p); memset(b, 0, sizeof(*b)); }
+
+/* --- lectura --- */
+typedef struct {
+    const uint8_t* p;             /* mmap de sólo lectura; NULL = sin instantánea */
+    size_t   size;
+    uint16_t flags;               /* como estaba en el archivo al abrirlo */
+    uint32_t nworkers;
+    int64_t  wall_ms;
+} sn_t;
+
+/* Mapea y valida path; 0, o -1 si no hay o no sirve (se arranca en frío).
+ * Una instantánea SN_CLEAN deja de serlo en el disco en cuanto se abre. */
+static inline int sn_open(sn_t* s, const char* path){
+    memset(s, 0, sizeof(*s));
+    int fd = open(path, O_RDWR|O_CLOEXEC);
+    if (fd < 0) return -1;
+    sn_hdr_t h; struct stat sb;
+    if (fstat(fd, &sb) != 0 || pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) || h.magic != SN_MAGIC ||
+        h.version != SN_VERSION || h.size != (uint64_t)sb.st_size){ close(fd); return -1; }
+    void* p = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED){ close(fd); return -1; }
+    size_t off = sizeof(sn_hdr_t);
+    for (uint32_t i = 0; i < h.nsec; i++){   /* todas las secciones dentro del archivo */
+        const sn_sec_t* x = (const sn_sec_t*)((const uint8_t*)p + off);
+        if (off + sizeof(sn_sec_t) > (size_t)sb.st_size || (x->elem && x->count > ((size_t)sb.st_size - off) / x->elem)){
+            munmap(p, (size_t)sb.st_size); close(fd); return -1;
+        }
+        off += sn_pad(sizeof(sn_sec_t) + (size_t)(x->count * x->elem));
+    }
+    if (h.flags & SN_CLEAN){
+        uint16_t f = (uint16_t)(h.flags & ~SN_CLEAN);
+        if (pwrite(fd, &f, sizeof(f), offsetof(sn_hdr_t, flags)) != (ssize_t)sizeof(f) || fdatasync(fd) != 0)
+            h.flags = f;              /* no se pudo desmarcar: se usa como periódica */
+    }
+    close(fd);
+    s->p = (const uint8_t*)p; s->size = (size_t)sb.st_size;
+    s->flags = h.flags; s->nworkers = h.nworkers; s->wall_ms = h.wall_ms;
+    return 0;
+}
+
+/* Elementos de la sección tag (y su cantidad), o NULL si no está o es de otro tamaño */
+static inline const void* sn_find(const sn_t* s, uint32_t tag, uint32_t elem, uint64_t* count){
+    *count = 0;
+    if (!s->p) return NULL;
+    const sn_hdr_t* h = (const sn_hdr_t*)s->p;
+    size_t off = sizeof(sn_hdr_t);
+    for (uint32_t i = 0; i < h->nsec; i++){
+        const sn_sec_t* x = (const sn_sec_t*)(s->p + off);
+        if (x->tag == tag){
+            if (x->elem != elem) return NULL;
+            *count = x->count;
+            return x + 1;
+        }
+        off += sn_pad(sizeof(sn_sec_t) + (size_t)(x->count * x->elem));
+    }
+    return NULL;
+}
+
+static inline void sn_close(sn_t* s){
+    if (s->p) munmap((void*)s->p, s->size);
+    s->p = NULL;
+}
+
+/* --- traspaso de sockets --- */
+static inline int sn_unix_addr(const char* path, struct sockaddr_un* a){
+    memset(a, 0, sizeof(*a));
+    a->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(a->sun_path)) return -1;
+    memcpy(a->sun_path, path, strlen(path));
+    return 0;
+}
+
+/* Escucha del proceso en marcha (reemplaza un socket viejo en path) */
+static inline int sn_listen(const char* path){
+    struct sockaddr_un a;
+    if (sn_unix_addr(path, &a) != 0) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&a, sizeof(a)) != 0 || listen(fd, 1) != 0){ close(fd); return -1; }
+    return fd;
+}
+
+/* Proceso viejo: acepta al sucesor y le pasa fds; devuelve la conexión
+ * (para sn_release tras la instantánea final) o -1 */
+static inline int sn_handover(int lfd, const int* fds, int n){
+    int c = n >= 1 && n <= SN_FDS_MAX ? accept4(lfd, NULL, NULL, SOCK_CLOEXEC) : -1;
+    if (c < 0) return -1;
+    char cbuf[CMSG_SPACE(sizeof(int) * SN_FDS_MAX)];
+    memset(cbuf, 0, sizeof(cbuf));
+    uint8_t one = 1;
+    struct iovec iov = { &one, 1 };
+    struct msghdr m = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf,
+                        .msg_controllen = CMSG_SPACE(sizeof(int) * (size_t)n) };
+    struct cmsghdr* cm = CMSG_FIRSTHDR(&m);
+    cm->cmsg_level = SOL_SOCKET; cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int) * (size_t)n);
+    memcpy(CMSG_DATA(cm), fds, sizeof(int) * (size_t)n);
+    if (sendmsg(c, &m, MSG_NOSIGNAL) != 1){ close(c); return -1; }
+    return c;
+}
+
+/* Proceso viejo, al final: ya no escucha en path y el sucesor puede seguir */
+static inline void sn_release(int c, const char* path){
+    uint8_t done = 1;
+    unlink(path);
+    if (c >= 0){ (void)!send(c, &done, 1, MSG_NOSIGNAL); close(c); }
+}
+
+/* Proceso nuevo: pide los sockets al que escucha en path y espera a que
+ * termine (hasta wait_ms). Devuelve cuántos fds recibió, o -1 si no hay nadie */
+static inline int sn_takeover(const char* path, int* fds, int cap, int wait_ms){
+    struct sockaddr_un a;
+    if (sn_unix_addr(path, &a) != 0) return -1;
+    int c = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (c < 0) return -1;
+    if (connect(c, (struct sockaddr*)&a, sizeof(a)) != 0){ close(c); return -1; }
+    char cbuf[CMSG_SPACE(sizeof(int) * SN_FDS_MAX)];
+    uint8_t b;
+    struct iovec iov = { &b, 1 };
+    struct msghdr m = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+    struct pollfd pf = { c, POLLIN, 0 };
+    int n = 0;
+    if (poll(&pf, 1, wait_ms) == 1 && recvmsg(c, &m, MSG_CMSG_CLOEXEC) == 1){
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&m); cm; cm = CMSG_NXTHDR(&m, cm)){
+            if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+            int k = (int)((cm->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            for (int i = 0; i < k; i++){
+                int fd; memcpy(&fd, CMSG_DATA(cm) + (size_t)i * sizeof(int), sizeof(int));
+                if (n < cap) fds[n++] = fd; else close(fd);
+            }
+        }
+        if (poll(&pf, 1, wait_ms) != 1 || recv(c, &b, 1, 0) != 1)
+            fprintf(stderr, "handover: el proceso anterior no confirmó en %d ms\n", wait_ms);
+    }
+    close(c);
+    return n;
+}
+
+/* Saca de fds el primer socket de tipo type ligado a port; -1 si no hay */
+static inline int sn_take(int* fds, int n, int type, uint16_t port){
+    for (int i = 0; i < n; i++){
+        struct sockaddr_in a; socklen_t al = sizeof(a);
+        int t = 0; socklen_t tl = sizeof(t);
+        if (fds[i] < 0 || getsockopt(fds[i], SOL_SOCKET, SO_TYPE, &t, &tl) != 0 || t != type ||
+            getsockname(fds[i], (struct sockaddr*)&a, &al) != 0 || a.sin_family != AF_INET ||
+            ntohs(a.sin_port) != port) continue;
+        int fd = fds[i];
+        fds[i] = -1;
+        return fd;
+    }
+    return -1;
+}
@@ -0,0 +1,706 @@
+// storage.h — Almacenamiento de series de tiempo por dispositivo
+// Cada dispositivo escribe registros srec_t en segmentos append-only
+//   <dir>/d<device>-<seq>.seg   cabecera de 16 bytes + registros de 24 bytes
+//   <dir>/d<device>-<seq>.idx   índice disperso: (ts_ms, nº de registro) cada ST_IDX_EVERY
+// Dentro de un dispositivo los timestamps no decrecen (se fijan al último si el
+// reloj retrocede), así que cada segmento está ordenado por tiempo.
+// Un segmento se cierra al llegar a seg_max bytes o al terminar la ejecución;
+// los cerrados son inmutables. Cada ejecución abre uno nuevo, y la compactación
+// une segmentos cerrados contiguos mientras quepan en seg_max.
+// Sólo el hilo escritor escribe; los workers consultan con st_query(), que mapea
+// los segmentos con mmap. El catálogo (dispositivos, segmentos y nrec) se
+// modifica bajo st->lock en escritura; nrec sólo crece tras escribir los datos.
+// En modo clúster un dispositivo puede llegar de otro nodo ya con historia: cada
+// segmento traspasado entra cerrado (st_import_*) con un seq nuevo pero en su
+// lugar por tiempo, así que el catálogo se ordena por first_ts y no por seq; el
+// activo es siempre el último. Si el traspaso se solapa en el tiempo con lo que
+// ya había, una consulta ve ese tramo fuera de orden, no incompleto.
+// Al arrancar hay que validar cada segmento (cabecera y último crc). Con el
+// catálogo de una instantánea (snapshot.h) basta un fstatat: un segmento con
+// el mismo inodo, mtime y tamaño que cuando se guardó se toma tal cual, y sólo
+// se leen los que cambiaron desde entonces (la cola: el activo y los nuevos).
+#pragma once
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "reading.h"
+#include "snapshot.h"
+
+#define ST_MAGIC        0x47455343u   /* "CSEG" */
+#define ST_VERSION      1u
+#define ST_HDR_SZ       16u
+#define ST_IDX_EVERY    64u
+#define ST_BUF_RECS     64u           /* registros pendientes por dispositivo */
+#define ST_MAX_DEVICES  4096u         /* potencia de 2 */
+#define ST_OPEN_MAX     256u          /* dispositivos con descriptores abiertos */
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version, rec_size;
+    uint32_t device, reserved;
+} seg_hdr_t;
+
+typedef struct { int64_t ts_ms; uint64_t rec; } sidx_t;
+
+typedef struct {
+    uint32_t seq, nrec;
+    int64_t  first_ts, last_ts;
+} sseg_t;
+
+typedef struct {
+    uint32_t device;
+    uint8_t  used, active, dirty;       /* active = último segmento abierto para append */
+    uint8_t  scanned;                   /* algún segmento se leyó al abrir (no venía del catálogo previo) */
+    int      fd, ifd;
+    sseg_t*  segs;                      /* catálogo ordenado por seq */
+    uint32_t nsegs, capsegs;
+    int64_t  last_ts;
+    uint64_t first_pend_ms, last_use_ms;
+    uint32_t npend;
+    srec_t   pend[ST_BUF_RECS];
+} sdev_t;
+
+typedef struct {
+    char      dir[256];
+    pthread_rwlock_t lock;              /* catálogo: escritor vs. consultas */
+    sdev_t*   devs;                     /* hash de direccionamiento abierto por device */
+    uint32_t* dirty;                    /* índices de devs con registros pendientes */
+    uint32_t  ndevs, ndirty, nopen;
+    uint64_t  seg_max;
+    unsigned  flush_ms;
+    int       fsync_mode;
+    unsigned long recs, writes, rotations, compactions;
+    unsigned long bytes;                /* registros escritos a segmentos, en bytes */
+} store_t;
+
+/* Segmento tal como lo vio una ejecución anterior (sección de la instantánea),
+ * ordenados por (device, seq) */
+typedef struct {
+    uint32_t device, seq, nrec, reserved;
+    int64_t  first_ts, last_ts;
+    int64_t  mtime_ns;
+    uint64_t ino;
+} st_known_t;
+
+#define SN_CATALOG  SN_TAG('S','E','G','S')
+
+static inline void st_path(const store_t* st, uint32_t dev, uint32_t seq, const char* ext, char* out, size_t cap){
+    snprintf(out, cap, "%s/d%u-%06u.%s", st->dir, dev, seq, ext);
+}
+
+static inline uint64_t st_seg_bytes(const sseg_t* s){ return ST_HDR_SZ + (uint64_t)s->nrec * sizeof(srec_t); }
+
+static inline sdev_t* st_dev(store_t* st, uint32_t device, int create){
+    uint32_t h = device * 2654435761u;
+    for (uint32_t i = 0; i < ST_MAX_DEVICES; i++){
+        sdev_t* d = &st->devs[(h + i) & (ST_MAX_DEVICES-1)];
+        if (d->used && d->device == device) return d;
+        if (!d->used){
+            if (!create || st->ndevs + 1u >= ST_MAX_DEVICES) return NULL;
+            pthread_rwlock_wrlock(&st->lock);
+            memset(d, 0, offsetof(sdev_t, pend));
+            d->fd = d->ifd = -1; d->device = device; d->used = 1;
+            st->ndevs++;
+            pthread_rwlock_unlock(&st->lock);
+            return d;
+        }
+    }
+    return NULL;
+}
+
+/* Inserta s en la posición at del catálogo */
+static inline int st_seg_insert(store_t* st, sdev_t* d, uint32_t at, const sseg_t* s){
+    int rc = 0;
+    pthread_rwlock_wrlock(&st->lock);
+    if (d->nsegs == d->capsegs){
+        uint32_t nc = d->capsegs ? d->capsegs*2u : 8u;
+        sseg_t* ns = (sseg_t*)realloc(d->segs, nc * sizeof(sseg_t));
+        if (ns){ d->segs = ns; d->capsegs = nc; }
+        else rc = -1;
+    }
+    if (rc == 0){
+        memmove(&d->segs[at+1u], &d->segs[at], (d->nsegs - at) * sizeof(sseg_t));
+        d->segs[at] = *s;
+        d->nsegs++;
+    }
+    pthread_rwlock_unlock(&st->lock);
+    return rc;
+}
+
+static inline int st_seg_push(store_t* st, sdev_t* d, const sseg_t* s){ return st_seg_insert(st, d, d->nsegs, s); }
+
+static inline void st_close_fds(store_t* st, sdev_t* d){
+    if (d->fd >= 0){ close(d->fd); st->nopen--; }
+    if (d->ifd >= 0) close(d->ifd);
+    d->fd = d->ifd = -1;
+}
+
+/* Mantiene acotados los descriptores abiertos cerrando el de uso más antiguo */
+static inline void st_evict_fd(store_t* st){
+    sdev_t* old = NULL;
+    for (uint32_t i = 0; i < ST_MAX_DEVICES; i++){
+        sdev_t* d = &st->devs[i];
+        if (d->used && d->fd >= 0 && (!old || d->last_use_ms < old->last_use_ms)) old = d;
+    }
+    if (old) st_close_fds(st, old);
+}
+
+/* Lee un segmento cerrado al arrancar: valida cabecera y descarta una cola cortada */
+static inline int st_scan_seg(store_t* st, uint32_t dev, uint32_t seq, sseg_t* out){
+    char path[320];
+    st_path(st, dev, seq, "seg", path, sizeof(path));
+    int fd = open(path, O_RDWR|O_CLOEXEC);
+    if (fd < 0) return -1;
+    seg_hdr_t h; struct stat sb;
+    if (pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) || h.magic != ST_MAGIC ||
+        h.rec_size != sizeof(srec_t) || fstat(fd, &sb) != 0){ close(fd); return -1; }
+    uint64_t n = ((uint64_t)sb.st_size - ST_HDR_SZ) / sizeof(srec_t);
+    srec_t r;
+    while (n > 0){   /* el último registro válido (crc) marca el final real */
+        if (pread(fd, &r, sizeof(r), (off_t)(ST_HDR_SZ + (n-1u)*sizeof(srec_t))) == (ssize_t)sizeof(r) &&
+            r.crc == srec_crc(&r)) break;
+        n--;
+    }
+    if ((uint64_t)sb.st_size != ST_HDR_SZ + n*sizeof(srec_t))
+        if (ftruncate(fd, (off_t)(ST_HDR_SZ + n*sizeof(srec_t))) != 0) perror("ftruncate seg");
+    out->seq = seq; out->nrec = (uint32_t)n;
+    out->first_ts = out->last_ts = 0;
+    if (n > 0){
+        if (pread(fd, &r, sizeof(r), ST_HDR_SZ) == (ssize_t)sizeof(r)) out->first_ts = r.ts_ms;
+        if (pread(fd, &r, sizeof(r), (off_t)(ST_HDR_SZ + (n-1u)*sizeof(srec_t))) == (ssize_t)sizeof(r)) out->last_ts = r.ts_ms;
+    }
+    close(fd);
+    return 0;
+}
+
+/* Orden del catálogo: por tiempo (los vacíos al final), a igualdad por seq */
+static inline int st_seg_cmp(const void* a, const void* b){
+    const sseg_t* x = (const sseg_t*)a; const sseg_t* y = (const sseg_t*)b;
+    if ((x->nrec == 0) != (y->nrec == 0)) return x->nrec == 0 ? 1 : -1;
+    if (x->first_ts != y->first_ts) return x->first_ts < y->first_ts ? -1 : 1;
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+static inline uint32_t st_next_seq(const sdev_t* d){
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < d->nsegs; i++) if (d->segs[i].seq >= n) n = d->segs[i].seq + 1u;
+    return n;
+}
+
+/* Escribe idx para los registros [first, first+n) de un segmento que empiezan en base */
+static inline void st_write_idx(int ifd, const srec_t* r, uint32_t n, uint64_t first){
+    sidx_t ix[ST_BUF_RECS/ST_IDX_EVERY + 1u];
+    uint32_t k = 0;
+    for (uint32_t i = 0; i < n; i++){
+        uint64_t rec = first + i;
+        if (rec % ST_IDX_EVERY == 0){
+            ix[k].ts_ms = r[i].ts_ms; ix[k].rec = rec;
+            if (++k == sizeof(ix)/sizeof(ix[0])){
+                if (write(ifd, ix, k*sizeof(sidx_t)) < 0) perror("write idx");
+                k = 0;
+            }
+        }
+    }
+    if (k && write(ifd, ix, k*sizeof(sidx_t)) < 0) perror("write idx");
+}
+
+/* Une segmentos cerrados contiguos [i, j) en uno nuevo con el seq de i */
+static inline int st_merge(store_t* st, sdev_t* d, uint32_t i, uint32_t j){
+    char tmp[320], itmp[320], path[320];
+    snprintf(tmp,  sizeof(tmp),  "%s/d%u-%06u.seg.tmp", st->dir, d->device, d->segs[i].seq);
+    snprintf(itmp, sizeof(itmp), "%s/d%u-%06u.idx.tmp", st->dir, d->device, d->segs[i].seq);
+    int fd  = open(tmp,  O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    int ifd = open(itmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if (fd < 0 || ifd < 0){ if (fd >= 0) close(fd); if (ifd >= 0) close(ifd); return -1; }
+    seg_hdr_t h = { ST_MAGIC, ST_VERSION, (uint16_t)sizeof(srec_t), d->device, 0 };
+    int ok = write(fd, &h, sizeof(h)) == (ssize_t)sizeof(h);
+    sseg_t m = d->segs[i]; m.nrec = 0;
+    srec_t buf[ST_BUF_RECS];
+    for (uint32_t s = i; ok && s < j; s++){
+        st_path(st, d->device, d->segs[s].seq, "seg", path, sizeof(path));
+        int in = open(path, O_RDONLY|O_CLOEXEC);
+        if (in < 0){ ok = 0; break; }
+        uint32_t left = d->segs[s].nrec;
+        off_t off = ST_HDR_SZ;
+        while (ok && left > 0){
+            uint32_t k = left < ST_BUF_RECS ? left : ST_BUF_RECS;
+            if (pread(in, buf, k*sizeof(srec_t), off) != (ssize_t)(k*sizeof(srec_t))){ ok = 0; break; }
+            if (write(fd, buf, k*sizeof(srec_t)) != (ssize_t)(k*sizeof(srec_t))){ ok = 0; break; }
+            st_write_idx(ifd, buf, k, m.nrec);
+            m.nrec += k; left -= k; off += (off_t)(k*sizeof(srec_t));
+        }
+        close(in);
+    }
+    if (ok) ok = fsync(fd) == 0;
+    close(fd); close(ifd);
+    if (!ok){ unlink(tmp); unlink(itmp); return -1; }
+    m.last_ts = d->segs[j-1u].last_ts;
+
+    pthread_rwlock_wrlock(&st->lock);   /* ninguna consulta ve el cambio a medias */
+    st_path(st, d->device, m.seq, "seg", path, sizeof(path));
+    if (rename(tmp, path) != 0){ pthread_rwlock_unlock(&st->lock); unlink(tmp); unlink(itmp); return -1; }
+    st_path(st, d->device, m.seq, "idx", path, sizeof(path));
+    if (rename(itmp, path) != 0) unlink(itmp);
+    for (uint32_t s = i + 1u; s < j; s++){
+        st_path(st, d->device, d->segs[s].seq, "seg", path, sizeof(path)); unlink(path);
+        st_path(st, d->device, d->segs[s].seq, "idx", path, sizeof(path)); unlink(path);
+    }
+    d->segs[i] = m;
+    memmove(&d->segs[i+1u], &d->segs[j], (d->nsegs - j) * sizeof(sseg_t));
+    d->nsegs -= (j - i - 1u);
+    pthread_rwlock_unlock(&st->lock);
+    st->compactions++;
+    return 0;
+}
+
+/* Compacta por tamaño: cada racha de cerrados cuya suma quepa en seg_max se une */
+static inline void st_compact_dev(store_t* st, sdev_t* d){
+    uint32_t sealed = d->nsegs - (d->active ? 1u : 0u);
+    for (uint32_t i = 0; i + 1u < sealed; ){
+        uint64_t sum = st_seg_bytes(&d->segs[i]);
+        uint32_t j = i + 1u;
+        while (j < sealed && sum + st_seg_bytes(&d->segs[j]) - ST_HDR_SZ <= st->seg_max){
+            sum += st_seg_bytes(&d->segs[j]) - ST_HDR_SZ; j++;
+        }
+        if (j - i >= 2u && st_merge(st, d, i, j) == 0) sealed -= (j - i - 1u);
+        i++;
+    }
+}
+
+static inline const st_known_t* st_known_find(const st_known_t* k, uint64_t n, uint32_t dev, uint32_t seq){
+    uint64_t lo = 0, hi = n;
+    while (lo < hi){
+        uint64_t m = (lo + hi) / 2u;
+        if (k[m].device < dev || (k[m].device == dev && k[m].seq < seq)) lo = m + 1u; else hi = m;
+    }
+    return lo < n && k[lo].device == dev && k[lo].seq == seq ? &k[lo] : NULL;
+}
+
+static inline int64_t st_mtime_ns(const struct stat* sb){ return (int64_t)sb->st_mtim.tv_sec * 1000000000 + sb->st_mtim.tv_nsec; }
+
+/* known (puede ser NULL): catálogo previo; esos segmentos no se leen si no
+ * cambiaron, y no se compacta al abrir (lo hará la próxima rotación) para no
+ * copiar segmentos antes de atender */
+static inline int st_open(store_t* st, const char* dir, uint64_t seg_max, unsigned flush_ms, int fsync_mode,
+                          const st_known_t* known, uint64_t nknown){
+    memset(st, 0, sizeof(*st));
+    pthread_rwlock_init(&st->lock, NULL);
+    snprintf(st->dir, sizeof(st->dir), "%s", dir);
+    st->seg_max = seg_max < 64u*1024u ? 64u*1024u : seg_max;
+    st->flush_ms = flush_ms;
+    st->fsync_mode = fsync_mode;
+    st->devs  = (sdev_t*)calloc(ST_MAX_DEVICES, sizeof(sdev_t));
+    st->dirty = (uint32_t*)calloc(ST_MAX_DEVICES, sizeof(uint32_t));
+    if (!st->devs || !st->dirty) return -1;
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) return -1;
+
+    DIR* dp = opendir(dir);
+    if (!dp) return -1;
+    struct dirent* de;
+    while ((de = readdir(dp))){
+        unsigned dev, seq; char ext[8];
+        if (sscanf(de->d_name, "d%u-%u.%7s", &dev, &seq, ext) != 3 || strcmp(ext, "seg") != 0) continue;
+        sseg_t s;
+        struct stat sb;
+        sdev_t* d = st_dev(st, dev, 1);
+        if (!d) continue;
+        const st_known_t* k = known ? st_known_find(known, nknown, dev, seq) : NULL;
+        if (k && fstatat(dirfd(dp), de->d_name, &sb, 0) == 0 && (uint64_t)sb.st_ino == k->ino &&
+            st_mtime_ns(&sb) == k->mtime_ns && (uint64_t)sb.st_size == ST_HDR_SZ + (uint64_t)k->nrec * sizeof(srec_t)){
+            s.seq = seq; s.nrec = k->nrec; s.first_ts = k->first_ts; s.last_ts = k->last_ts;
+        } else if (st_scan_seg(st, dev, seq, &s) == 0) d->scanned = 1;
+        else continue;
+        st_seg_push(st, d, &s);
+    }
+    closedir(dp);
+
+    for (uint32_t i = 0; i < ST_MAX_DEVICES; i++){
+        sdev_t* d = &st->devs[i];
+        if (!d->used || d->nsegs == 0) continue;
+        qsort(d->segs, d->nsegs, sizeof(sseg_t), st_seg_cmp);
+        if (!known) st_compact_dev(st, d);
+        for (uint32_t s = d->nsegs; s-- > 0; )
+            if (d->segs[s].nrec){ d->last_ts = d->segs[s].last_ts; break; }
+    }
+    return 0;
+}
+
+/* Abre (o reabre tras un desalojo) el segmento activo del dispositivo */
+static inline int st_open_active(store_t* st, sdev_t* d){
+    char path[320];
+    if (d->fd >= 0) return 0;
+    if (st->nopen >= ST_OPEN_MAX) st_evict_fd(st);
+    if (!d->active){
+        sseg_t s = { st_next_seq(d), 0, 0, 0 };
+        st_path(st, d->device, s.seq, "seg", path, sizeof(path));
+        d->fd = open(path, O_WRONLY|O_APPEND|O_CREAT|O_EXCL|O_CLOEXEC, 0644);
+        if (d->fd < 0) return -1;
+        seg_hdr_t h = { ST_MAGIC, ST_VERSION, (uint16_t)sizeof(srec_t), d->device, 0 };
+        if (write(d->fd, &h, sizeof(h)) != (ssize_t)sizeof(h) || st_seg_push(st, d, &s) != 0){
+            close(d->fd); d->fd = -1; unlink(path); return -1;
+        }
+        d->active = 1;
+    } else {
+        st_path(st, d->device, d->segs[d->nsegs-1u].seq, "seg", path, sizeof(path));
+        d->fd = open(path, O_WRONLY|O_APPEND|O_CLOEXEC);
+        if (d->fd < 0) return -1;
+    }
+    st->nopen++;
+    st_path(st, d->device, d->segs[d->nsegs-1u].seq, "idx", path, sizeof(path));
+    d->ifd = open(path, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0644);
+    return 0;
+}
+
+/* Escribe los pendientes de un dispositivo (un write(), salvo escrituras cortas)
+ * y rota si llegó a seg_max. Si falla, el segmento vuelve a su último registro
+ * entero y los pendientes quedan para el próximo intento; si ni eso se puede,
+ * se cierra con la cola cortada (st_scan_seg la descarta al arrancar). */
+static inline int st_flush_dev(store_t* st, sdev_t* d, uint64_t now){
+    if (d->npend == 0) return 0;
+    if (st_open_active(st, d) != 0) return -1;
+    sseg_t* s = &d->segs[d->nsegs-1u];
+    size_t bytes = d->npend * sizeof(srec_t), done = 0;
+    while (done < bytes){
+        ssize_t w = write(d->fd, (const uint8_t*)d->pend + done, bytes - done);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) break;
+        done += (size_t)w;
+    }
+    if (done < bytes){
+        if (done > 0 && ftruncate(d->fd, (off_t)st_seg_bytes(s)) != 0){
+            perror("ftruncate seg");
+            st_close_fds(st, d); d->active = 0; st->rotations++;
+        }
+        return -1;
+    }
+    if (d->ifd >= 0) st_write_idx(d->ifd, d->pend, d->npend, s->nrec);
+    if (st->fsync_mode) fdatasync(d->fd);
+    pthread_rwlock_wrlock(&st->lock);
+    if (s->nrec == 0) s->first_ts = d->pend[0].ts_ms;
+    s->nrec += d->npend;
+    s->last_ts = d->pend[d->npend-1u].ts_ms;
+    pthread_rwlock_unlock(&st->lock);
+    d->npend = 0;
+    d->last_use_ms = now;
+    st->writes++;
+    st->bytes += bytes;
+    if (st_seg_bytes(s) >= st->seg_max){
+        st_close_fds(st, d);
+        d->active = 0;
+        st->rotations++;
+        st_compact_dev(st, d);
+    }
+    return 0;
+}
+
+/* Encola registros ya decodificados; el timestamp nunca retrocede por dispositivo.
+ * Devuelve cuántos entraron: los de un dispositivo nuevo con la tabla llena, o
+ * con el búfer lleno y el disco fallando, se descartan */
+static inline size_t st_append(store_t* st, const srec_t* recs, size_t n, uint64_t now){
+    size_t ok = 0;
+    for (size_t i = 0; i < n; i++){
+        sdev_t* d = st_dev(st, recs[i].device, 1);
+        if (!d) continue;
+        if (d->npend == ST_BUF_RECS && st_flush_dev(st, d, now) != 0) continue;
+        srec_t* r = &d->pend[d->npend++];
+        *r = recs[i];
+        if (r->ts_ms < d->last_ts) r->ts_ms = d->last_ts;
+        d->last_ts = r->ts_ms;
+        r->crc = srec_crc(r);
+        st->recs++; ok++;
+        if (!d->dirty){
+            d->dirty = 1; d->first_pend_ms = now;
+            st->dirty[st->ndirty++] = (uint32_t)(d - st->devs);
+        }
+    }
+    return ok;
+}
+
+/* Cierra el segmento activo (vaciando antes los pendientes): lo que tenía pasa
+ * a ser un segmento cerrado más, el próximo append abre uno nuevo */
+static inline int st_seal(store_t* st, sdev_t* d, uint64_t now){
+    if (st_flush_dev(st, d, now) != 0) return -1;      /* si estaba en dirty, st_poll lo quita */
+    if (d->active){ st_close_fds(st, d); d->active = 0; st->rotations++; }
+    return 0;
+}
+
+/* Lee hasta n registros del segmento cerrado i desde el registro off; sólo el escritor */
+static inline long st_read_seg(const store_t* st, const sdev_t* d, uint32_t i, uint32_t off, srec_t* out, uint32_t n){
+    char path[320];
+    if (i >= d->nsegs || off >= d->segs[i].nrec) return 0;
+    if (n > d->segs[i].nrec - off) n = d->segs[i].nrec - off;
+    st_path(st, d->device, d->segs[i].seq, "seg", path, sizeof(path));
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t r = pread(fd, out, (size_t)n * sizeof(srec_t), (off_t)(ST_HDR_SZ + (uint64_t)off * sizeof(srec_t)));
+    close(fd);
+    return r == (ssize_t)((size_t)n * sizeof(srec_t)) ? (long)n : -1;
+}
+
+/* Borra el segmento cerrado seq (ya traspasado a su nuevo dueño) */
+static inline int st_drop_seg(store_t* st, sdev_t* d, uint32_t seq){
+    char path[320];
+    int rc = -1;
+    pthread_rwlock_wrlock(&st->lock);
+    for (uint32_t i = 0; i < d->nsegs; i++){
+        if (d->segs[i].seq != seq || (d->active && i + 1u == d->nsegs)) continue;
+        st_path(st, d->device, seq, "seg", path, sizeof(path)); unlink(path);
+        st_path(st, d->device, seq, "idx", path, sizeof(path)); unlink(path);
+        memmove(&d->segs[i], &d->segs[i+1u], (d->nsegs - i - 1u) * sizeof(sseg_t));
+        d->nsegs--;
+        rc = 0;
+        break;
+    }
+    pthread_rwlock_unlock(&st->lock);
+    return rc;
+}
+
+/* --- importación de segmentos (traspaso entre nodos del clúster) --- */
+typedef struct {
+    int      fd, ifd;
+    uint32_t device, tag;
+    sseg_t   seg;
+    char     tmp[320], itmp[320];
+} st_import_t;
+
+/* Abre un segmento temporal para device; tag distingue importaciones simultáneas */
+static inline int st_import_begin(store_t* st, st_import_t* im, uint32_t device, uint32_t tag){
+    memset(im, 0, sizeof(*im));
+    im->device = device; im->tag = tag;
+    snprintf(im->tmp,  sizeof(im->tmp),  "%s/d%u-imp%u.seg.tmp", st->dir, device, tag);
+    snprintf(im->itmp, sizeof(im->itmp), "%s/d%u-imp%u.idx.tmp", st->dir, device, tag);
+    im->fd  = open(im->tmp,  O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    im->ifd = open(im->itmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    seg_hdr_t h = { ST_MAGIC, ST_VERSION, (uint16_t)sizeof(srec_t), device, 0 };
+    if (im->fd < 0 || im->ifd < 0 || write(im->fd, &h, sizeof(h)) != (ssize_t)sizeof(h)){
+        if (im->fd >= 0) close(im->fd);
+        if (im->ifd >= 0) close(im->ifd);
+        unlink(im->tmp); unlink(im->itmp);
+        im->fd = im->ifd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/* Agrega registros (en orden de tiempo, tal como salen del segmento de origen) */
+static inline int st_import_add(st_import_t* im, srec_t* recs, uint32_t n){
+    if (im->fd < 0) return -1;
+    for (uint32_t i = 0; i < n; i++){
+        if (im->seg.nrec + i > 0 && recs[i].ts_ms < im->seg.last_ts) recs[i].ts_ms = im->seg.last_ts;
+        im->seg.last_ts = recs[i].ts_ms;
+        recs[i].crc = srec_crc(&recs[i]);
+    }
+    if (n && im->seg.nrec == 0) im->seg.first_ts = recs[0].ts_ms;
+    size_t bytes = (size_t)n * sizeof(srec_t);
+    if (write(im->fd, recs, bytes) != (ssize_t)bytes) return -1;
+    st_write_idx(im->ifd, recs, n, im->seg.nrec);
+    im->seg.nrec += n;
+    return 0;
+}
+
+static inline void st_import_abort(st_import_t* im){
+    if (im->fd >= 0){ close(im->fd); close(im->ifd); unlink(im->tmp); unlink(im->itmp); }
+    im->fd = im->ifd = -1;
+}
+
+/* Cierra la importación: fsync, renombra con el próximo seq y la inserta en el
+ * catálogo en su lugar por tiempo (nunca detrás del activo). Sólo el escritor
+ * modifica el catálogo, así que puede recorrerlo sin lock. */
+static inline int st_import_commit(store_t* st, st_import_t* im){
+    char path[320];
+    if (im->fd < 0) return -1;
+    sdev_t* d = im->seg.nrec ? st_dev(st, im->device, 1) : NULL;
+    int ok = d && fsync(im->fd) == 0;
+    close(im->fd); close(im->ifd); im->fd = im->ifd = -1;
+    if (ok){
+        im->seg.seq = st_next_seq(d);
+        st_path(st, d->device, im->seg.seq, "seg", path, sizeof(path));
+        ok = rename(im->tmp, path) == 0;
+    }
+    if (!ok){ unlink(im->tmp); unlink(im->itmp); return im->seg.nrec ? -1 : 0; }
+    st_path(st, d->device, im->seg.seq, "idx", path, sizeof(path));
+    if (rename(im->itmp, path) != 0) unlink(im->itmp);
+    uint32_t lim = d->active ? d->nsegs - 1u : d->nsegs, at = 0;
+    while (at < lim && d->segs[at].nrec && d->segs[at].first_ts <= im->seg.first_ts) at++;
+    if (st_seg_insert(st, d, at, &im->seg) != 0) return -1;
+    st_compact_dev(st, d);
+    return 0;
+}
+
+/* Vacía los dispositivos cuyo primer pendiente superó flush_ms (o todos si force) */
+static inline void st_poll(store_t* st, uint64_t now, int force){
+    for (uint32_t k = 0; k < st->ndirty; ){
+        sdev_t* d = &st->devs[st->dirty[k]];
+        if (!force && now - d->first_pend_ms < st->flush_ms){ k++; continue; }
+        if (st_flush_dev(st, d, now) != 0){ d->first_pend_ms = now; k++; continue; }   /* sigue pendiente: otro intento en flush_ms */
+        d->dirty = 0;
+        st->dirty[k] = st->dirty[--st->ndirty];
+    }
+}
+
+/* ms hasta el próximo vaciado de st_poll(); -1 = nada pendiente */
+static inline int64_t st_due_ms(const store_t* st, uint64_t now){
+    int64_t due = -1;
+    for (uint32_t k = 0; k < st->ndirty; k++){
+        uint64_t at = st->devs[st->dirty[k]].first_pend_ms + st->flush_ms;
+        int64_t d = at > now ? (int64_t)(at - now) : 0;
+        if (due < 0 || d < due) due = d;
+    }
+    return due;
+}
+
+/* Última lectura guardada para sembrar la caché al arrancar */
+static inline int st_last(store_t* st, const sdev_t* d, srec_t* out){
+    char path[320];
+    for (uint32_t s = d->nsegs; s-- > 0; ){
+        if (d->segs[s].nrec == 0) continue;
+        st_path(st, d->device, d->segs[s].seq, "seg", path, sizeof(path));
+        int fd = open(path, O_RDONLY|O_CLOEXEC);
+        if (fd < 0) return -1;
+        ssize_t n = pread(fd, out, sizeof(*out), (off_t)(ST_HDR_SZ + (d->segs[s].nrec-1u)*sizeof(srec_t)));
+        close(fd);
+        return n == (ssize_t)sizeof(*out) ? 0 : -1;
+    }
+    return -1;
+}
+
+/* ¿Entra device? Ya conocido, o queda lugar en la tabla. Desde cualquier hilo:
+ * ndevs sólo crece, así que un "sí" puede quedar viejo por los que estén en vuelo */
+static inline int st_has_room(store_t* st, uint32_t device){
+    pthread_rwlock_rdlock(&st->lock);
+    int ok = st_dev(st, device, 0) != NULL || st->ndevs + 1u < ST_MAX_DEVICES;
+    pthread_rwlock_unlock(&st->lock);
+    return ok;
+}
+
+/* st_last() de device desde cualquier hilo (bajo el lock, como st_query); lo
+ * que aún está pendiente en el escritor no se ve */
+static inline int st_query_last(store_t* st, uint32_t device, srec_t* out){
+    pthread_rwlock_rdlock(&st->lock);
+    const sdev_t* d = st_dev(st, device, 0);
+    int rc = d ? st_last(st, d, out) : -1;
+    pthread_rwlock_unlock(&st->lock);
+    return rc;
+}
+
+static inline int st_known_cmp(const void* a, const void* b){
+    const st_known_t* x = (const st_known_t*)a; const st_known_t* y = (const st_known_t*)b;
+    if (x->device != y->device) return x->device < y->device ? -1 : 1;
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+/* Catálogo a la instantánea (desde cualquier hilo). Se copia bajo el lock y se
+ * hace stat después: si el segmento crece entremedio, su tamaño o mtime ya no
+ * coinciden al cargar y se vuelve a leer, nunca se toma de menos. */
+static inline void st_snap_save(store_t* st, sn_buf_t* b){
+    sn_section(b, SN_CATALOG, sizeof(st_known_t));
+    size_t first = b->len;
+    pthread_rwlock_rdlock(&st->lock);
+    for (uint32_t i = 0; i < ST_MAX_DEVICES && st->devs; i++){
+        const sdev_t* d = &st->devs[i];
+        for (uint32_t j = 0; d->used && j < d->nsegs; j++){
+            st_known_t* k = (st_known_t*)sn_item(b);
+            if (!k) break;
+            k->device = d->device; k->seq = d->segs[j].seq; k->nrec = d->segs[j].nrec;
+            k->first_ts = d->segs[j].first_ts; k->last_ts = d->segs[j].last_ts;
+        }
+    }
+    pthread_rwlock_unlock(&st->lock);
+    if (b->err) return;
+    st_known_t* k = (st_known_t*)(b->p + first);
+    size_t n = (b->len - first) / sizeof(st_known_t);
+    for (size_t i = 0; i < n; i++){
+        char path[320]; struct stat sb;
+        st_path(st, k[i].device, k[i].seq, "seg", path, sizeof(path));
+        if (stat(path, &sb) == 0){ k[i].ino = (uint64_t)sb.st_ino; k[i].mtime_ns = st_mtime_ns(&sb); }
+    }
+    qsort(k, n, sizeof(st_known_t), st_known_cmp);
+}
+
+static inline void st_close(store_t* st){
+    st_poll(st, 0, 1);
+    for (uint32_t i = 0; i < ST_MAX_DEVICES && st->devs; i++){
+        sdev_t* d = &st->devs[i];
+        if (!d->used) continue;
+        st_close_fds(st, d);
+        free(d->segs);
+    }
+    free(st->devs); free(st->dirty);
+    st->devs = NULL; st->dirty = NULL;
+    pthread_rwlock_destroy(&st->lock);
+}
+
+/* --- consultas (desde los workers) --- */
+/* Callback por registro; r apunta al page cache (mmap), no a una copia.
+ * Devuelve 0 para seguir, distinto de 0 para cortar la consulta. */
+typedef int (*st_emit_fn)(void* ctx, const srec_t* r);
+
+/* Primer registro con ts >= from: búsqueda binaria en el índice disperso y
+ * luego, dentro del tramo de ST_IDX_EVERY registros, sobre los registros. */
+static inline uint64_t st_lower_bound(const srec_t* r, uint64_t n, const sidx_t* ix, uint64_t nix, int64_t from){
+    uint64_t lo = 0, hi = n;
+    if (nix > 0){
+        uint64_t a = 0, b = nix;            /* última entrada con ts < from */
+        while (a < b){ uint64_t m = (a+b)/2u; if (ix[m].ts_ms < from) a = m+1u; else b = m; }
+        if (a > 0 && ix[a-1u].rec < n) lo = ix[a-1u].rec;
+        if (a < nix && ix[a].rec <= n) hi = ix[a].rec;
+    }
+    while (lo < hi){ uint64_t m = (lo+hi)/2u; if (r[m].ts_ms < from) lo = m+1u; else hi = m; }
+    return lo;
+}
+
+/* Recorre los registros de device con from <= ts <= to, en orden, hasta limit.
+ * Devuelve cuántos se emitieron o -1 si el dispositivo no existe. */
+static inline long st_query(store_t* st, uint32_t device, int64_t from, int64_t to, uint64_t skip,
+                            uint64_t limit, st_emit_fn emit, void* ctx){
+    long out = 0;
+    int stop = 0;
+    pthread_rwlock_rdlock(&st->lock);
+    sdev_t* d = st_dev(st, device, 0);
+    if (!d){ pthread_rwlock_unlock(&st->lock); return -1; }
+    for (uint32_t s = 0; s < d->nsegs && !stop && (uint64_t)out < limit; s++){
+        const sseg_t* sg = &d->segs[s];
+        if (sg->nrec == 0 || sg->last_ts < from || sg->first_ts > to) continue;
+        char path[320];
+        size_t rlen = ST_HDR_SZ + (size_t)sg->nrec * sizeof(srec_t);
+        st_path(st, d->device, sg->seq, "seg", path, sizeof(path));
+        int fd = open(path, O_RDONLY|O_CLOEXEC);
+        if (fd < 0) continue;
+        void* map = mmap(NULL, rlen, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) continue;
+        const srec_t* r = (const srec_t*)(const void*)((const uint8_t*)map + ST_HDR_SZ);
+
+        const sidx_t* ix = NULL; size_t ilen = 0; void* imap = MAP_FAILED;
+        struct stat sb;
+        st_path(st, d->device, sg->seq, "idx", path, sizeof(path));
+        if ((fd = open(path, O_RDONLY|O_CLOEXEC)) >= 0){
+            if (fstat(fd, &sb) == 0 && sb.st_size >= (off_t)sizeof(sidx_t)){
+                ilen = (size_t)sb.st_size - (size_t)sb.st_size % sizeof(sidx_t);
+                imap = mmap(NULL, ilen, PROT_READ, MAP_SHARED, fd, 0);
+                if (imap != MAP_FAILED) ix = (const sidx_t*)imap;
+            }
+            close(fd);
+        }
+
+        for (uint64_t i = st_lower_bound(r, sg->nrec, ix, ix ? ilen/sizeof(sidx_t) : 0, from);
+             i < sg->nrec && r[i].ts_ms <= to && (uint64_t)out < limit; i++){
+            if (skip){ skip--; continue; }
+            if (emit(ctx, &r[i])){ stop = 1; break; }
+            out++;
+        }
+        if (imap != MAP_FAILED) munmap(imap, ilen);
+        munmap(map, rlen);
+    }
+    pthread_rwlock_unlock(&st->lock);
+    return out;
+}
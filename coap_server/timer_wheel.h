@@ -0,0 +1,134 @@
+// timer_wheel.h — Rueda de timers jerárquica (un hilo, sin locks)
+// Nivel 0: TW_L0_SLOTS ranuras de un tick; niveles 1..3: TW_LN_SLOTS ranuras de
+// 256, 256*64 y 256*64*64 ticks. Con tick de 10 ms cubre ~46 h; plazos más
+// largos se recortan al último nivel. Un timer vive en la lista de la ranura de
+// su vencimiento; al dar la vuelta el nivel 0 se reparte (cascade) la ranura
+// siguiente del nivel 1 hacia abajo, así alta, baja y disparo son O(1).
+// Los timers son intrusivos (tw_timer_t dentro de la estructura del dueño) y
+// sólo los toca el hilo dueño de la rueda; un callback puede re-armarse.
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define TW_L0_BITS   8
+#define TW_LN_BITS   6
+#define TW_L0_SLOTS  (1u << TW_L0_BITS)
+#define TW_LN_SLOTS  (1u << TW_LN_BITS)
+#define TW_LEVELS    4
+
+typedef struct tw_timer tw_timer_t;
+typedef void (*tw_fn)(tw_timer_t* t, void* arg, uint64_t now_ms);
+
+struct tw_timer {
+    tw_timer_t *next, *prev;     /* prev = NULL: no armado */
+    uint64_t    expires;         /* en ticks */
+    tw_fn       fn;
+    void*       arg;
+};
+
+typedef struct {
+    tw_timer_t  l0[TW_L0_SLOTS];             /* cabezas de lista (centinelas) */
+    tw_timer_t  ln[TW_LEVELS - 1][TW_LN_SLOTS];
+    uint64_t    tick;                        /* próximo tick a procesar */
+    uint64_t    origin_ms;
+    unsigned    tick_ms;
+    unsigned    armed;
+    uint8_t     running;                     /* dentro de tw_advance(): lo nuevo va al tick siguiente */
+} twheel_t;
+
+static inline void tw_head(tw_timer_t* h){ h->next = h->prev = h; }
+
+static inline void tw_init(twheel_t* w, uint64_t now_ms, unsigned tick_ms){
+    memset(w, 0, sizeof(*w));
+    w->tick_ms = tick_ms ? tick_ms : 1u;
+    w->origin_ms = now_ms;
+    for (unsigned i = 0; i < TW_L0_SLOTS; i++) tw_head(&w->l0[i]);
+    for (unsigned l = 0; l < TW_LEVELS - 1; l++)
+        for (unsigned i = 0; i < TW_LN_SLOTS; i++) tw_head(&w->ln[l][i]);
+}
+
+static inline void tw_link(twheel_t* w, tw_timer_t* t){
+    uint64_t d = t->expires > w->tick ? t->expires - w->tick : 0;
+    tw_timer_t* h;
+    if (d < TW_L0_SLOTS) h = &w->l0[(w->tick + d) & (TW_L0_SLOTS-1)];
+    else {
+        unsigned l = 0, shift = TW_L0_BITS;
+        while (l < TW_LEVELS - 2 && d >= ((uint64_t)1 << (shift + TW_LN_BITS))){ l++; shift += TW_LN_BITS; }
+        if (d >= ((uint64_t)1 << (shift + TW_LN_BITS)))   /* fuera de rango: al último nivel */
+            t->expires = w->tick + ((uint64_t)1 << (shift + TW_LN_BITS)) - 1u;
+        h = &w->ln[l][(t->expires >> shift) & (TW_LN_SLOTS-1)];
+    }
+    t->next = h; t->prev = h->prev;
+    h->prev->next = t; h->prev = t;
+}
+
+static inline void tw_cancel(twheel_t* w, tw_timer_t* t){
+    if (!t->prev) return;
+    t->prev->next = t->next; t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+    w->armed--;
+}
+
+static inline int tw_armed(const tw_timer_t* t){ return t->prev != NULL; }
+
+/* Arma (o re-arma) t para dentro de delay_ms */
+static inline void tw_add(twheel_t* w, tw_timer_t* t, uint64_t now_ms, uint64_t delay_ms, tw_fn fn, void* arg){
+    tw_cancel(w, t);
+    uint64_t at = now_ms + delay_ms - (now_ms < w->origin_ms ? now_ms : w->origin_ms);
+    t->expires = (at + w->tick_ms - 1u) / w->tick_ms;            /* nunca antes de tiempo */
+    if (t->expires < w->tick + w->running) t->expires = w->tick + w->running;
+    t->fn = fn; t->arg = arg;
+    tw_link(w, t);
+    w->armed++;
+}
+
+/* Baja un nivel la ranura que toca en este tick */
+static inline void tw_cascade(twheel_t* w, unsigned l, unsigned shift){
+    tw_timer_t* h = &w->ln[l][(w->tick >> shift) & (TW_LN_SLOTS-1)];
+    tw_timer_t* t = h->next;
+    tw_head(h);
+    while (t != h){
+        tw_timer_t* nx = t->next;
+        tw_link(w, t);
+        t = nx;
+    }
+}
+
+/* Dispara todo lo vencido hasta now_ms */
+static inline void tw_advance(twheel_t* w, uint64_t now_ms){
+    uint64_t target = now_ms < w->origin_ms ? 0 : (now_ms - w->origin_ms) / w->tick_ms;
+    while (w->tick <= target){
+        unsigned idx = (unsigned)(w->tick & (TW_L0_SLOTS-1));
+        if (idx == 0){
+            unsigned shift = TW_L0_BITS;
+            for (unsigned l = 0; l < TW_LEVELS - 1; l++, shift += TW_LN_BITS){
+                tw_cascade(w, l, shift);
+                if (((w->tick >> shift) & (TW_LN_SLOTS-1)) != 0) break;
+            }
+        }
+        tw_timer_t* h = &w->l0[idx];
+        w->running = 1;
+        while (h->next != h){
+            tw_timer_t* t = h->next;
+            tw_cancel(w, t);
+            t->fn(t, t->arg, now_ms);                  /* puede re-armarse */
+        }
+        w->running = 0;
+        w->tick++;
+        if (w->armed == 0){ w->tick = target + 1u; break; }   /* nada pendiente: saltar */
+    }
+}
+
+/* ms hasta el próximo tick con trabajo (para el timeout de epoll_wait);
+ * -1 = nada armado. Mira el nivel 0; si está vacío espera a la próxima vuelta. */
+static inline int tw_timeout_ms(const twheel_t* w, uint64_t now_ms){
+    if (w->armed == 0) return -1;
+    uint64_t n = 0;
+    for (; n < TW_L0_SLOTS; n++){
+        const tw_timer_t* h = &w->l0[(w->tick + n) & (TW_L0_SLOTS-1)];
+        if (h->next != h || ((w->tick + n) & (TW_L0_SLOTS-1)) == 0) break;   /* 0: hay cascade */
+    }
+    uint64_t at = w->origin_ms + (w->tick + n) * w->tick_ms;
+    return at <= now_ms ? 0 : (int)(at - now_ms);
+}
@@ -1,46 +1,342 @@
 #pragma once
 #include <Arduino.h>
+#include <math.h>
+#include <mbedtls/ccm.h>
+#include <mbedtls/md.h>
 
 namespace coapmin {
   enum Type { CON=0, NON=1, ACK=2, RST=3 };
 
-  inline size_t buildPost(uint8_t* out, const char* path1, const char* path2,
-                          const char* json, uint16_t msgId) {
-    uint8_t* p = out;
+  const uint16_t OPT_OSCORE = 9, OPT_URI_PATH = 11, OPT_CONTENT_FORMAT = 12, OPT_MAX_AGE = 14,
+                 OPT_BLOCK1 = 27, OPT_ECHO = 252;
+  const uint8_t  CF_JSON = 50, CF_CBOR = 60, CF_SENML_CBOR = 112;
 
-    // Header: ver=1, type=CON, TKL=2, code=POST(0x02)
-    *p++ = (1 << 6) | (CON << 4) | 2;
-    *p++ = 0x02;
-    *p++ = uint8_t(msgId >> 8);
-    *p++ = uint8_t(msgId & 0xFF);
+  // CBOR mínimo (RFC 8949): sólo lo que usa SenML. ok queda en false si no cupo.
+  struct Cbor {
+    uint8_t* p; uint8_t* end; bool ok = true;
+    Cbor(uint8_t* out, size_t cap) : p(out), end(out + cap) {}
+
+    void head(uint8_t major, uint32_t v) {
+      uint8_t n = v < 24 ? 0 : v < 0x100 ? 1 : v < 0x10000 ? 2 : 4;
+      if (!ok || size_t(end - p) < size_t(1 + n)) { ok = false; return; }
+      *p++ = uint8_t(major << 5) | (n == 0 ? uint8_t(v) : n == 1 ? 24 : n == 2 ? 25 : 26);
+      for (int i = n - 1; i >= 0; i--) *p++ = uint8_t(v >> (8 * i));
+    }
+    void arr(uint32_t n) { head(4, n); }
+    void map(uint32_t n) { head(5, n); }
+    void i(int32_t v) { if (v >= 0) head(0, uint32_t(v)); else head(1, uint32_t(-1 - v)); }
+    void str(const char* s) {
+      size_t n = strlen(s);
+      head(3, n);
+      if (!ok || size_t(end - p) < n) { ok = false; return; }
+      memcpy(p, s, n); p += n;
+    }
+    // float32; los enteros exactos salen como entero (más cortos). El rango se
+    // mira antes del cast: int32_t(v) con NAN o |v| grande es indefinido.
+    void f(float v) {
+      if (v > -1e6f && v < 1e6f && v == float(int32_t(v))) { i(int32_t(v)); return; }
+      uint32_t u; memcpy(&u, &v, 4);
+      if (!ok || end - p < 5) { ok = false; return; }
+      *p++ = 0xFA;
+      for (int k = 3; k >= 0; k--) *p++ = uint8_t(u >> (8 * k));
+    }
+  };
+
+  // Etiquetas SenML (RFC 8428 §6)
+  enum SenmlKey { SENML_BN = -2, SENML_BT = -3, SENML_BU = -4, SENML_N = 0, SENML_V = 2, SENML_T = 6 };
+
+  // Nibble de delta/largo con extensión de 1 o 2 bytes (RFC 7252 §3.1)
+  inline uint8_t* putExt(uint8_t* ext, uint16_t v, uint8_t& nib) {
+    if (v < 13)  { nib = uint8_t(v); return ext; }
+    if (v < 269) { nib = 13; *ext++ = uint8_t(v - 13); return ext; }
+    nib = 14; v -= 269;
+    *ext++ = uint8_t(v >> 8); *ext++ = uint8_t(v & 0xFF);
+    return ext;
+  }
+
+  inline uint8_t* putOpt(uint8_t* p, uint16_t& last, uint16_t number,
+                         const uint8_t* val, uint16_t len) {
+    uint8_t ext[4], dn, ln;
+    uint8_t* e = putExt(ext, number - last, dn);
+    e = putExt(e, len, ln);
+    *p++ = uint8_t((dn << 4) | ln);
+    memcpy(p, ext, e - ext); p += e - ext;
+    memcpy(p, val, len); p += len;
+    last = number;
+    return p;
+  }
 
-    // Token = msgId
+  // Block1/Block2 (RFC 7959): valor NUM<<4 | M<<3 | SZX, bloque = 16 << SZX bytes
+  inline uint32_t blockValue(uint32_t num, bool more, uint8_t szx) {
+    return (num << 4) | (more ? 0x08 : 0) | (szx & 0x07);
+  }
+
+  // Lote de lecturas: anillo de N valores con su millis(). toJson() arma un solo
+  // cuerpo {"t":[[age,v],...],"unit":"C"} con age = ms antes del envío; el
+  // servidor lo desarma en un registro por lectura. Si el anillo se llena sin
+  // poder enviar, se pisa la lectura más vieja. Las lecturas no finitas (NAN de
+  // un sensor sin dato) ocupan su secuencia pero no viajan en el cuerpo.
+  template <size_t N>
+  struct Batch {
+    float    v[N];
+    uint32_t at[N];
+    size_t   head = 0, count = 0;
+    uint32_t first = 0;               // número de secuencia de la lectura v[head]
+
+    void push(float value, uint32_t nowMs) {
+      size_t i = (head + count) % N;
+      v[i] = value; at[i] = nowMs;
+      if (count < N) count++; else { head = (head + 1) % N; first++; }
+    }
+    uint32_t end() const { return first + count; }   // secuencia de la próxima lectura
+    bool full() const { return count == N; }
+    size_t size() const { return count; }
+    void clear() { first += count; head = count = 0; }
+    // Quita las k lecturas más viejas (las ya enviadas)
+    void drop(size_t k) {
+      if (k > count) k = count;
+      head = (head + k) % N; count -= k; first += k;
+    }
+    // Quita todas las lecturas con secuencia < seq
+    void dropUntil(uint32_t seq) { if (int32_t(seq - first) > 0) drop(seq - first); }
+
+    // Tramo [from, from + k) que sigue guardado (las pisadas se saltan);
+    // devuelve la posición de la primera en el anillo y cuántas hay
+    size_t span(uint32_t from, size_t k, size_t& cnt) const {
+      if (int32_t(from - first) < 0) { uint32_t lost = first - from; k = lost < k ? k - lost : 0; from = first; }
+      size_t off = from - first;
+      cnt = off < count ? (k < count - off ? k : count - off) : 0;
+      return (head + off) % N;
+    }
+
+    // k = máximo de lecturas a incluir, a partir de la secuencia from
+    // (por defecto, las más viejas)
+    size_t toJson(char* out, size_t cap, char key, const char* unit, uint32_t nowMs,
+                  size_t k = N, uint32_t from = UINT32_MAX) const {
+      size_t cnt, h0 = span(from == UINT32_MAX ? first : from, k, cnt);
+      int w = snprintf(out, cap, "{\"%c\":[", key);
+      size_t pos = w > 0 ? size_t(w) : 0;
+      for (size_t j = 0, o = 0; j < cnt && pos < cap; j++) {
+        size_t i = (h0 + j) % N;
+        if (!isfinite(v[i])) continue;
+        w = snprintf(out + pos, cap - pos, "%s[%lu,%.2f]", o++ ? "," : "",
+                     (unsigned long)(nowMs - at[i]), v[i]);
+        if (w < 0) return 0;
+        pos += size_t(w);
+      }
+      if (pos < cap) { w = snprintf(out + pos, cap - pos, "],\"unit\":\"%s\"}", unit); pos += w > 0 ? size_t(w) : 0; }
+      return pos < cap ? pos : 0;   // 0 = no cupo en out
+    }
+
+    // El mismo lote en SenML+CBOR (Content-Format 112): el primer registro
+    // lleva bn (nombre del recurso) y bu; t es relativo al envío, en segundos.
+    size_t toSenml(uint8_t* out, size_t cap, const char* name, const char* unit, uint32_t nowMs,
+                   size_t k = N, uint32_t from = UINT32_MAX) const {
+      size_t cnt, h0 = span(from == UINT32_MAX ? first : from, k, cnt);
+      Cbor c(out, cap);
+      size_t nv = 0;
+      for (size_t j = 0; j < cnt; j++) nv += isfinite(v[(h0 + j) % N]) ? 1 : 0;
+      c.arr(nv);
+      for (size_t j = 0, o = 0; j < cnt; j++) {
+        size_t i = (h0 + j) % N;
+        if (!isfinite(v[i])) continue;
+        uint32_t age = nowMs - at[i];
+        c.map((o == 0 ? 2 : 0) + 1 + (age ? 1 : 0));
+        if (o++ == 0) { c.i(SENML_BN); c.str(name); c.i(SENML_BU); c.str(unit); }
+        c.i(SENML_V); c.f(v[i]);
+        if (age) { c.i(SENML_T); c.f(-float(age) / 1000.0f); }
+      }
+      return c.ok ? size_t(c.p - out) : 0;
+    }
+  };
+
+  // Cabecera CON + token; sin token explícito se usa el msgId (2 bytes)
+  inline uint8_t* putHeader(uint8_t* p, uint8_t code, uint16_t msgId, const uint8_t* tok, uint8_t tkl) {
+    uint8_t mt[2] = { uint8_t(msgId >> 8), uint8_t(msgId & 0xFF) };
+    if (!tok) { tok = mt; tkl = 2; }
+    if (tkl > 8) tkl = 8;
+    *p++ = (1 << 6) | (CON << 4) | tkl;
+    *p++ = code;
     *p++ = uint8_t(msgId >> 8);
     *p++ = uint8_t(msgId & 0xFF);
+    memcpy(p, tok, tkl);
+    return p + tkl;
+  }
+
+  // POST de un cuerpo cualquiera con su Content-Format
+  inline size_t buildPostBody(uint8_t* out, const char* path1, const char* path2,
+                              const uint8_t* body, size_t bodyLen, uint8_t cf, uint16_t msgId,
+                              const uint8_t* tok = nullptr, uint8_t tkl = 0) {
+    uint8_t* p = out;
+
+    // Header: ver=1, type=CON, code=POST(0.02), token
+    p = putHeader(p, 0x02, msgId, tok, tkl);
 
-    // Opciones (delta/len < 13)
     uint16_t last = 0;
-    auto addOpt = [&](uint16_t number, const uint8_t* val, uint8_t len) {
-      uint16_t delta = number - last;
-      *p++ = uint8_t((delta << 4) | (len & 0x0F));
-      memcpy(p, val, len); p += len;
-      last = number;
+    auto addOpt = [&](uint16_t number, const uint8_t* val, uint16_t len) {
+      p = putOpt(p, last, number, val, len);
     };
 
-    if (path1 && *path1) addOpt(11, (const uint8_t*)path1, strlen(path1)); // Uri-Path
-    if (path2 && *path2) addOpt(11, (const uint8_t*)path2, strlen(path2)); // Uri-Path
+    if (path1 && *path1) addOpt(OPT_URI_PATH, (const uint8_t*)path1, strlen(path1)); // Uri-Path
+    if (path2 && *path2) addOpt(OPT_URI_PATH, (const uint8_t*)path2, strlen(path2)); // Uri-Path
 
-    uint8_t cf = 50; 
-    addOpt(12, &cf, 1);
+    addOpt(OPT_CONTENT_FORMAT, &cf, 1);
 
-    // Payload marker + JSON
+    // Payload marker + cuerpo
     *p++ = 0xFF;
-    size_t jlen = strlen(json);
-    memcpy(p, json, jlen); p += jlen;
+    memcpy(p, body, bodyLen); p += bodyLen;
 
     return (size_t)(p - out);
   }
 
+  inline size_t buildPost(uint8_t* out, const char* path1, const char* path2,
+                          const char* json, uint16_t msgId) {
+    return buildPostBody(out, path1, path2, (const uint8_t*)json, strlen(json), CF_JSON, msgId);
+  }
+
+  // POST del bloque num (Block1) de body: sube un lote grande por partes de
+  // 16 << szx bytes. El servidor responde 2.31 Continue a los intermedios con
+  // su Block1 (parseBlock1): el siguiente es num + 1 con el SZX devuelto.
+  inline size_t buildPostBlock(uint8_t* out, const char* path1, const char* path2,
+                               const uint8_t* body, size_t bodyLen,
+                               uint32_t num, uint8_t szx, uint16_t msgId,
+                               uint8_t cf = CF_JSON, const uint8_t* tok = nullptr, uint8_t tkl = 0) {
+    uint8_t* p = out;
+    size_t bs = size_t(16) << szx, off = size_t(num) * bs;
+    if (off > bodyLen) return 0;
+    size_t n = (bodyLen - off) < bs ? (bodyLen - off) : bs;
+    bool more = off + n < bodyLen;
+
+    p = putHeader(p, 0x02, msgId, tok, tkl);
+
+    uint16_t last = 0;
+    if (path1 && *path1) p = putOpt(p, last, OPT_URI_PATH, (const uint8_t*)path1, strlen(path1));
+    if (path2 && *path2) p = putOpt(p, last, OPT_URI_PATH, (const uint8_t*)path2, strlen(path2));
+    p = putOpt(p, last, OPT_CONTENT_FORMAT, &cf, 1);
+    uint32_t bv = blockValue(num, more, szx);
+    uint8_t b[3]; uint16_t bl = bv > 0xFFFF ? 3 : (bv > 0xFF ? 2 : (bv ? 1 : 0));
+    for (uint16_t i = 0; i < bl; i++) b[i] = uint8_t(bv >> (8 * (bl - 1 - i)));
+    p = putOpt(p, last, OPT_BLOCK1, b, bl);
+
+    *p++ = 0xFF;
+    memcpy(p, body + off, n); p += n;
+    return (size_t)(p - out);
+  }
+
+  // --- Plantillas de mensaje resueltas al compilar ---
+  // Cabecera CON + token (TKL bytes) + Uri-Path (PATH, segmentos separados por
+  // '/') + Content-Format + 0xFF se arman una sola vez como constexpr; al
+  // enviar sólo se copia el prefijo y se parchean MID y token. El cuerpo se
+  // escribe directo en body(out), sin copia. PATH debe ser un arreglo
+  // constexpr con enlace estático, p.ej. constexpr char kPath[] = "sensor";
+  constexpr uint8_t cxMin(uint16_t v) { return v < 13 ? uint8_t(v) : v < 269 ? 13 : 14; }
+  constexpr size_t  cxExt(uint16_t v) { return v < 13 ? 0 : v < 269 ? 1 : 2; }
+  constexpr size_t  cxUint(uint16_t v) { return v == 0 ? 0 : v < 0x100 ? 1 : 2; }
+  static_assert(cxMin(12) == 12 && cxMin(13) == 13 && cxExt(268) == 1 && cxExt(269) == 2,
+                "extensiones de delta/largo (RFC 7252 §3.1)");
+
+  constexpr size_t cxPrefixLen(const char* path, uint16_t cf, uint8_t tkl) {
+    size_t n = 4 + tkl, seg = 0;
+    uint16_t last = 0;
+    for (const char* s = path; ; s++) {
+      if (*s && *s != '/') { seg++; continue; }
+      if (seg) { n += 1 + cxExt(OPT_URI_PATH - last) + cxExt(uint16_t(seg)) + seg; last = OPT_URI_PATH; }
+      seg = 0;
+      if (!*s) break;
+    }
+    return n + 1 + cxExt(OPT_CONTENT_FORMAT - last) + cxUint(cf) + 1;
+  }
+
+  template <size_t L> struct Prefix { uint8_t b[L]; };
+
+  constexpr void cxExtPut(uint8_t* b, size_t& i, uint16_t v) {
+    if (v >= 269) { b[i++] = uint8_t((v - 269) >> 8); b[i++] = uint8_t((v - 269) & 0xFF); }
+    else if (v >= 13) b[i++] = uint8_t(v - 13);
+  }
+  constexpr void cxPut(uint8_t* b, size_t& i, uint16_t delta, uint16_t len) {
+    b[i++] = uint8_t((cxMin(delta) << 4) | cxMin(len));
+    cxExtPut(b, i, delta);
+    cxExtPut(b, i, len);
+  }
+
+  template <size_t L>
+  constexpr Prefix<L> cxPrefix(uint8_t code, const char* path, uint16_t cf, uint8_t tkl) {
+    Prefix<L> p{};
+    size_t i = 0;
+    p.b[i++] = uint8_t((1 << 6) | (CON << 4) | tkl);
+    p.b[i++] = code;
+    i += 2 + tkl;                                   // MID y token: se parchean al enviar
+    uint16_t last = 0;
+    const char* seg = path;
+    for (const char* s = path; ; s++) {
+      if (*s && *s != '/') continue;
+      if (s > seg) {
+        cxPut(p.b, i, OPT_URI_PATH - last, uint16_t(s - seg));
+        for (const char* c = seg; c < s; c++) p.b[i++] = uint8_t(*c);
+        last = OPT_URI_PATH;
+      }
+      seg = s + 1;
+      if (!*s) break;
+    }
+    cxPut(p.b, i, OPT_CONTENT_FORMAT - last, uint16_t(cxUint(cf)));
+    if (cf > 0xFF) p.b[i++] = uint8_t(cf >> 8);
+    if (cf) p.b[i++] = uint8_t(cf & 0xFF);
+    p.b[i++] = 0xFF;
+    return p;
+  }
+
+  template <const char* PATH, uint16_t CF, uint8_t TKL = 4, uint8_t CODE = 0x02>
+  struct MsgTemplate {
+    static constexpr size_t LEN = cxPrefixLen(PATH, CF, TKL);
+    static constexpr Prefix<LEN> prefix = cxPrefix<LEN>(CODE, PATH, CF, TKL);
+
+    static uint8_t* body(uint8_t* out) { return out + LEN; }
+    // Completa el mensaje cuyo cuerpo (len bytes) ya está en body(out)
+    static size_t stamp(uint8_t* out, uint16_t msgId, const uint8_t* tok, size_t len) {
+      memcpy(out, prefix.b, LEN);
+      out[2] = uint8_t(msgId >> 8); out[3] = uint8_t(msgId & 0xFF);
+      memcpy(out + 4, tok, TKL);
+      return len ? LEN + len : LEN - 1;             // sin cuerpo no va el 0xFF
+    }
+  };
+  template <const char* PATH, uint16_t CF, uint8_t TKL, uint8_t CODE>
+  constexpr Prefix<MsgTemplate<PATH, CF, TKL, CODE>::LEN> MsgTemplate<PATH, CF, TKL, CODE>::prefix;
+
+  // Busca la opción num en un mensaje y la lee como entero (hasta 4 bytes);
+  // false si no viene o el mensaje está mal formado
+  inline bool findUintOpt(const uint8_t* b, size_t n, uint16_t num, uint32_t& v) {
+    if (n < 4) return false;
+    size_t i = 4 + (b[0] & 0x0F);
+    uint16_t last = 0;
+    while (i < n && b[i] != 0xFF) {
+      uint8_t h = b[i++];
+      uint16_t d = h >> 4, l = h & 0x0F;
+      if (d == 15 || l == 15) return false;
+      if (d == 13) { if (i >= n) return false; d = 13 + b[i++]; }
+      else if (d == 14) { if (i + 1 >= n) return false; d = 269 + ((b[i] << 8) | b[i+1]); i += 2; }
+      if (l == 13) { if (i >= n) return false; l = 13 + b[i++]; }
+      else if (l == 14) { if (i + 1 >= n) return false; l = 269 + ((b[i] << 8) | b[i+1]); i += 2; }
+      if (i + l > n) return false;
+      last += d;
+      if (last > num) return false;
+      if (last == num && l <= 4) {
+        v = 0;
+        for (uint16_t k = 0; k < l; k++) v = (v << 8) | b[i + k];
+        return true;
+      }
+      i += l;
+    }
+    return false;
+  }
+
+  // Busca la opción Block1 en una respuesta (2.31 / 2.04); false si no viene
+  inline bool parseBlock1(const uint8_t* b, size_t n, uint32_t& num, bool& more, uint8_t& szx) {
+    uint32_t v;
+    if (!findUintOpt(b, n, OPT_BLOCK1, v) || v > 0xFFFFFF) return false;
+    num = v >> 4; more = (v & 0x08) != 0; szx = v & 0x07;
+    return true;
+  }
+
   //Parseo de header
   inline bool parseHeader(const uint8_t* b, size_t n,
                           Type& type, uint8_t& code, uint16_t& msgId) {
@@ -51,4 +347,448 @@ namespace coapmin {
     msgId = (uint16_t(b[2]) << 8) | b[3];
     return true;
   }
+
+  // --- Intercambios confirmables (RFC 7252 §4.2, §4.8) ---
+  // Tabla de hasta SLOTS CON simultáneos (NSTART): se reenvían con backoff exponencial desde un
+  // timeout inicial sorteado en [ACK_TIMEOUT, ACK_TIMEOUT * 1.5) y a los
+  // MAX_RETRANSMIT reenvíos se dan por perdidos. La respuesta se empareja por
+  // MID (ACK/RST) y token; tras un ACK vacío se espera la respuesta separada
+  // por token, contestando con ACK si llega en CON. Nada bloquea: loop() llama
+  // a poll() y le pasa cada datagrama a onPacket().
+  // Un 5.03 con Max-Age (servidor sobre su límite o saturado) suspende los envíos
+  // nuevos hasta que pase: canSend() da false y holding() avisa para no
+  // gastar la ventana despierto; los reenvíos ya en curso siguen su curso.
+  const uint32_t ACK_TIMEOUT_MS  = 2000;
+  const uint8_t  MAX_RETRANSMIT  = 4;
+  const uint32_t RESP_TIMEOUT_MS = 10000;   // respuesta separada tras ACK vacío
+  const uint32_t MAX_AGE_DEFAULT_S = 60;    // RFC 7252 §5.10.5, si el 5.03 no trae Max-Age
+  const uint32_t BACKOFF_MAX_S     = 300;   // tope a lo que pida el servidor
+
+  typedef bool (*TxFn)(const uint8_t* pkt, size_t len);
+  // code = código CoAP de la respuesta; 0 = sin respuesta (timeout) o RST
+  typedef void (*DoneFn)(uint32_t tag, uint8_t code, const uint8_t* rsp, size_t n);
+
+  template <size_t SLOTS, size_t PKT_MAX>
+  struct Exchanges {
+    enum State : uint8_t { FREE = 0, WAIT_ACK, WAIT_RESP };
+    struct Slot {
+      State    st;
+      uint8_t  tries, tkl, token[8];
+      uint16_t mid;
+      uint32_t due, timeout, tag;
+      size_t   len;
+      uint8_t  pkt[PKT_MAX];
+    };
+    Slot     s[SLOTS];
+    TxFn     tx = nullptr;
+    DoneFn   done = nullptr;
+    uint16_t mid = 0;
+    uint32_t tok = 0;
+    uint32_t holdUntil = 0;
+    bool     hold = false;
+
+    // Semillas aleatorias: MID y token no deben repetirse entre reinicios
+    void begin(TxFn t, DoneFn d, uint16_t midSeed, uint32_t tokSeed) {
+      tx = t; done = d; mid = midSeed; tok = tokSeed; hold = false;
+      for (size_t i = 0; i < SLOTS; i++) s[i].st = FREE;
+    }
+
+    uint16_t nextMid() { return mid++; }
+    // Token de 4 bytes distinto para cada intercambio
+    uint8_t nextToken(uint8_t* out) {
+      uint32_t t = tok++;
+      for (int i = 0; i < 4; i++) out[i] = uint8_t(t >> (24 - 8 * i));
+      return 4;
+    }
+    bool holding(uint32_t now) const { return hold && int32_t(now - holdUntil) < 0; }
+    bool canSend(uint32_t now) const { return pending() < SLOTS && !holding(now); }
+
+    size_t pending() const {
+      size_t n = 0;
+      for (size_t i = 0; i < SLOTS; i++) n += s[i].st != FREE;
+      return n;
+    }
+
+    // Envía un CON ya armado (MID y token incluidos) y lo sigue hasta la
+    // respuesta; false si no hay slot libre o el paquete no cabe
+    bool send(const uint8_t* pkt, size_t len, uint32_t tag, uint32_t now) {
+      if (len < 4 || len > PKT_MAX || (pkt[0] & 0x0F) > 8) return false;
+      for (size_t i = 0; i < SLOTS; i++) {
+        Slot& e = s[i];
+        if (e.st != FREE) continue;
+        memcpy(e.pkt, pkt, len); e.len = len;
+        e.mid = (uint16_t(pkt[2]) << 8) | pkt[3];
+        e.tkl = pkt[0] & 0x0F; memcpy(e.token, pkt + 4, e.tkl);
+        e.tag = tag; e.tries = 0;
+        e.timeout = ACK_TIMEOUT_MS + uint32_t(random(ACK_TIMEOUT_MS / 2));
+        e.due = now + e.timeout;
+        e.st = WAIT_ACK;
+        tx(e.pkt, e.len);
+        return true;
+      }
+      return false;
+    }
+
+    // 5.03: nada nuevo hasta now + Max-Age; un 5.03 posterior puede alargarlo, no acortarlo
+    void backoff(const uint8_t* b, size_t n, uint32_t now) {
+      uint32_t s = MAX_AGE_DEFAULT_S;
+      findUintOpt(b, n, OPT_MAX_AGE, s);
+      if (s > BACKOFF_MAX_S) s = BACKOFF_MAX_S;
+      uint32_t until = now + s * 1000;
+      if (!holding(now) || int32_t(until - holdUntil) > 0) holdUntil = until;
+      hold = true;
+    }
+
+    void finish(Slot& e, uint8_t code, const uint8_t* rsp, size_t n) {
+      e.st = FREE;
+      if (done) done(e.tag, code, rsp, n);
+    }
+
+    // Reenvíos y vencimientos; llamar en cada vuelta de loop()
+    void poll(uint32_t now) {
+      for (size_t i = 0; i < SLOTS; i++) {
+        Slot& e = s[i];
+        if (e.st == FREE || int32_t(now - e.due) < 0) continue;
+        if (e.st == WAIT_RESP || e.tries == MAX_RETRANSMIT) { finish(e, 0, nullptr, 0); continue; }
+        e.tries++;
+        e.timeout *= 2;
+        e.due = now + e.timeout;
+        tx(e.pkt, e.len);
+      }
+    }
+
+    // Procesa un datagrama recibido; true si correspondía a un intercambio
+    bool onPacket(const uint8_t* b, size_t n, uint32_t now) {
+      Type t; uint8_t code; uint16_t m;
+      if (!parseHeader(b, n, t, code, m)) return false;
+      uint8_t tkl = b[0] & 0x0F;
+      if (tkl > 8 || n < size_t(4 + tkl)) return false;
+      for (size_t i = 0; i < SLOTS; i++) {
+        Slot& e = s[i];
+        if (e.st == FREE) continue;
+        bool byMid = (t == ACK || t == RST) && e.st == WAIT_ACK && m == e.mid;
+        bool byTok = tkl == e.tkl && memcmp(b + 4, e.token, tkl) == 0;
+        if (byMid && t == RST) { finish(e, 0, b, n); return true; }
+        if (byMid && code == 0) {            // ACK vacío: la respuesta vendrá aparte
+          e.st = WAIT_RESP; e.due = now + RESP_TIMEOUT_MS;
+          return true;
+        }
+        if (byMid ? !byTok : !(e.st == WAIT_RESP && byTok && (t == CON || t == NON))) continue;
+        if (t == CON) {                      // respuesta separada confirmable
+          uint8_t ack[4] = { uint8_t((1 << 6) | (ACK << 4)), 0, b[2], b[3] };
+          tx(ack, sizeof(ack));
+        }
+        if (code == 0xA3) backoff(b, n, now);   // 5.03 Service Unavailable
+        finish(e, code, b, n);
+        return true;
+      }
+      return false;
+    }
+  };
+
+  // Banda muerta con latido: una lectura pasa si se aleja más de band de la
+  // última que pasó, si cambia entre válida y NAN, o si pasaron heartbeatMs
+  // desde la última (el servidor sabe así que el nodo sigue vivo). POD, para
+  // poder guardarla con RTC_DATA_ATTR junto al RtcLog.
+  struct Deadband {
+    float    last;
+    uint32_t lastAt;
+    bool     primed;
+
+    bool pass(float v, uint32_t nowMs, float band, uint32_t heartbeatMs) {
+      bool changed = !primed || isnan(v) != isnan(last) || (!isnan(v) && fabsf(v - last) > band);
+      if (!changed && nowMs - lastAt < heartbeatMs) return false;
+      last = v; lastAt = nowMs; primed = true;
+      return true;
+    }
+  };
+
+  // Lecturas que sobreviven al deep sleep (declarar con RTC_DATA_ATTR).
+  // Es POD a propósito: con constructor o inicializadores se volvería a poner
+  // a cero en cada despertar. magic distingue el arranque en frío; clockMs es
+  // un reloj propio porque millis() vuelve a 0 tras cada sueño.
+  template <size_t N>
+  struct RtcLog {
+    uint32_t magic, wakes, clockMs;
+    uint16_t n;
+    float    v[N];
+    uint32_t at[N];          // en clockMs
+
+    bool cold(uint32_t m) {
+      if (magic == m) return false;
+      magic = m; wakes = 0; clockMs = 0; n = 0;
+      return true;
+    }
+    void push(float value, uint32_t t) {
+      if (n == N) { memmove(v, v + 1, (N - 1) * sizeof(v[0])); memmove(at, at + 1, (N - 1) * sizeof(at[0])); n--; }
+      v[n] = value; at[n] = t; n++;
+    }
+    // Vuelca las lecturas al Batch, pasando clockMs a la escala de millis()
+    template <size_t M>
+    void toBatch(Batch<M>& b, uint32_t clockNow, uint32_t ms) const {
+      for (uint16_t i = 0; i < n; i++) b.push(v[i], ms - (clockNow - at[i]));
+    }
+    // Guarda lo que quedó sin confirmar en el Batch
+    template <size_t M>
+    void fromBatch(const Batch<M>& b, uint32_t clockNow, uint32_t ms) {
+      n = 0;
+      for (size_t j = 0; j < b.count; j++) {
+        size_t i = (b.head + j) % M;
+        push(b.v[i], clockNow - (ms - b.at[i]));
+      }
+    }
+  };
+
+  // Tramos de un lote repartidos entre varios intercambios en vuelo. Cada
+  // tramo son las lecturas [from, from + k) del Batch; se confirman en
+  // cualquier orden y el Batch se recorta sólo hasta el primer tramo aún sin
+  // confirmar. Un tramo fallido se reenvía antes que uno nuevo.
+  template <size_t NSTART>
+  struct Pipeline {
+    enum : uint8_t { FLYING = 1, DONE, RETRY };
+    struct Span { uint32_t from; uint16_t k; uint8_t st; uint32_t tag; };
+    Span     q[NSTART];
+    size_t   n = 0;
+    uint32_t next = 0;     // primera lectura sin tramo
+
+    // Próximo tramo a enviar: uno fallido o uno nuevo de k lecturas entre
+    // first y end (las secuencias del Batch); con partial también uno más
+    // corto con lo que haya. nullptr si no toca enviar
+    Span* take(uint32_t first, uint32_t end, uint16_t k, bool partial = false) {
+      for (size_t i = 0; i < n; i++) if (q[i].st == RETRY) { q[i].st = FLYING; return &q[i]; }
+      if (int32_t(next - first) < 0) next = first;          // se pisaron lecturas
+      if (partial && end != next && end - next < k) k = uint16_t(end - next);
+      if (n == NSTART || end == next || end - next < k) return nullptr;
+      Span& s = q[n++];
+      s.from = next; s.k = k; s.st = FLYING; s.tag = 0;
+      next += k;
+      return &s;
+    }
+
+    Span* find(uint32_t tag) {
+      for (size_t i = 0; i < n; i++) if (q[i].st == FLYING && q[i].tag == tag) return &q[i];
+      return nullptr;
+    }
+
+    size_t flying() const {
+      size_t c = 0;
+      for (size_t i = 0; i < n; i++) c += q[i].st == FLYING;
+      return c;
+    }
+
+    // Marca el resultado del tramo y devuelve la secuencia hasta la que se
+    // puede recortar el Batch (la del primer tramo pendiente)
+    uint32_t settle(Span* s, bool ok) {
+      if (s) s->st = ok ? DONE : RETRY;
+      size_t d = 0;
+      while (d < n && q[d].st == DONE) d++;
+      uint32_t upto = d ? q[d-1].from + q[d-1].k : (n ? q[0].from : next);
+      for (size_t i = d; i < n; i++) q[i - d] = q[i];
+      n -= d;
+      return upto;
+    }
+  };
+
+  // --- OSCORE (RFC 8613), lado cliente ---
+  // Protege cada petición extremo a extremo sin handshake: la clave maestra es
+  // precompartida (una por dispositivo) y las claves de sesión se derivan con
+  // HKDF-SHA256 en begin(), unos pocos HMAC al despertar. Por mensaje sólo hace
+  // falta un número de secuencia nuevo (Partial IV), que vive en OscoreState
+  // (RTC_DATA_ATTR) y se adelanta en flash cada SSN_STEP usos (Apéndice B.1.1),
+  // así un arranque en frío nunca repite un nonce. Si el servidor reinició,
+  // contesta 4.01 con Echo: se guarda y va en la siguiente petición (RFC 9175).
+  // AES-CCM-16-64-128 (alg 10) con mbedtls, que ya trae el core de ESP32.
+  const uint8_t  OSC_ALG = 10, OSC_NONCE = 13, OSC_TAG = 8, OSC_ID_MAX = 7, OSC_ECHO_MAX = 8;
+  const uint32_t SSN_STEP = 64;
+  // bytes que agrega protect(): opción OSCORE, código interno, tag y Echo
+  const size_t   OSCORE_OVERHEAD = 1 + 13 + 1 + OSC_TAG + 2 + OSC_ECHO_MAX;
+
+  // POD, para RTC_DATA_ATTR: con inicializadores se borraría en cada despertar
+  struct OscoreState {
+    uint32_t magic;
+    uint64_t ssn;             // próximo Partial IV
+    uint64_t saved;           // cota ya guardada en flash
+    uint8_t  echo[OSC_ECHO_MAX], echoLen;
+
+    // Arranque en frío: seguir desde la cota guardada en flash
+    bool cold(uint32_t m, uint64_t stored) {
+      if (magic == m) return false;
+      magic = m; ssn = saved = stored; echoLen = 0;
+      return true;
+    }
+  };
+
+  // SLOTS = peticiones en vuelo (NSTART): la respuesta se verifica con el
+  // nonce de su petición, que se busca por token
+  template <size_t SLOTS>
+  struct Oscore {
+    typedef void (*SaveFn)(uint64_t ssn);   // guarda la cota en flash (Preferences)
+    OscoreState* st = nullptr;
+    SaveFn   save = nullptr;
+    uint8_t  sid[OSC_ID_MAX], sidLen = 0, rid[OSC_ID_MAX], ridLen = 0;
+    uint8_t  civ[OSC_NONCE];
+    mbedtls_ccm_context cs, cr;
+    struct Req { uint8_t tkl, tok[8], pivLen, piv[5]; } req[SLOTS];
+    size_t   nreq = 0;
+
+    // info = [id, nil, alg, "Key"/"IV", L] (§3.2.1); L <= 32: un solo bloque
+    static bool hkdf(const uint8_t* salt, size_t saltLen, const uint8_t* secret, size_t secretLen,
+                     const uint8_t* id, uint8_t idLen, bool iv, uint8_t* out, uint8_t L) {
+      const mbedtls_md_info_t* md = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+      static const uint8_t zero[32] = {0};
+      uint8_t prk[32], t[32], info[32];
+      size_t k = 0;
+      if (mbedtls_md_hmac(md, saltLen ? salt : zero, saltLen ? saltLen : 32, secret, secretLen, prk) != 0) return false;
+      info[k++] = 0x85;
+      info[k++] = 0x40 | idLen;
+      if (idLen) { memcpy(info + k, id, idLen); k += idLen; }
+      info[k++] = 0xF6;
+      info[k++] = OSC_ALG;
+      if (iv) { info[k++] = 0x62; info[k++] = 'I'; info[k++] = 'V'; }
+      else    { info[k++] = 0x63; info[k++] = 'K'; info[k++] = 'e'; info[k++] = 'y'; }
+      info[k++] = L;
+      info[k++] = 0x01;
+      if (mbedtls_md_hmac(md, prk, sizeof(prk), info, k, t) != 0) return false;
+      memcpy(out, t, L);
+      return true;
+    }
+
+    // Sender ID propio (= kid) y del servidor; salt puede ser nullptr
+    bool begin(OscoreState& s, SaveFn sv, const uint8_t* secret, size_t secretLen,
+               const uint8_t* salt, size_t saltLen, const uint8_t* myId, uint8_t myIdLen,
+               const uint8_t* srvId, uint8_t srvIdLen) {
+      uint8_t ks[16], kr[16];
+      if (myIdLen > OSC_ID_MAX || srvIdLen > OSC_ID_MAX) return false;
+      st = &s; save = sv; nreq = 0;
+      memcpy(sid, myId, myIdLen); sidLen = myIdLen;
+      memcpy(rid, srvId, srvIdLen); ridLen = srvIdLen;
+      if (!hkdf(salt, saltLen, secret, secretLen, sid, sidLen, false, ks, 16) ||
+          !hkdf(salt, saltLen, secret, secretLen, rid, ridLen, false, kr, 16) ||
+          !hkdf(salt, saltLen, secret, secretLen, nullptr, 0, true, civ, OSC_NONCE)) return false;
+      mbedtls_ccm_init(&cs); mbedtls_ccm_init(&cr);
+      return mbedtls_ccm_setkey(&cs, MBEDTLS_CIPHER_ID_AES, ks, 128) == 0 &&
+             mbedtls_ccm_setkey(&cr, MBEDTLS_CIPHER_ID_AES, kr, 128) == 0;
+    }
+
+    // §5.2: largo del ID | ID y PIV con ceros a la izquierda, XOR Common IV
+    void nonce(const uint8_t* id, uint8_t idLen, const uint8_t* piv, uint8_t pivLen, uint8_t* n) const {
+      memset(n, 0, OSC_NONCE);
+      n[0] = idLen;
+      memcpy(n + 1 + OSC_ID_MAX - idLen, id, idLen);
+      memcpy(n + OSC_NONCE - pivLen, piv, pivLen);
+      for (uint8_t i = 0; i < OSC_NONCE; i++) n[i] ^= civ[i];
+    }
+
+    // Enc_structure ["Encrypt0", h'', [1, [alg], kid, piv, h'']] (§5.4)
+    size_t aad(uint8_t* out, const uint8_t* piv, uint8_t pivLen) const {
+      size_t a = 0;
+      out[a++] = 0x83;
+      out[a++] = 0x68; memcpy(out + a, "Encrypt0", 8); a += 8;
+      out[a++] = 0x40;
+      out[a++] = 0x40 | uint8_t(7 + sidLen + pivLen);
+      out[a++] = 0x85; out[a++] = 0x01; out[a++] = 0x81; out[a++] = OSC_ALG;
+      out[a++] = 0x40 | sidLen; memcpy(out + a, sid, sidLen); a += sidLen;
+      out[a++] = 0x40 | pivLen; memcpy(out + a, piv, pivLen); a += pivLen;
+      out[a++] = 0x40;
+      return a;
+    }
+
+    // Protege la petición in (n bytes): afuera quedan cabecera y token, POST y
+    // la opción OSCORE; código, opciones (+ Echo pendiente) y payload van
+    // cifrados. Devuelve el largo en out o 0 si no cabe.
+    size_t protect(const uint8_t* in, size_t n, uint8_t* out, size_t cap) {
+      if (!st || n < 4) return 0;
+      uint8_t tkl = in[0] & 0x0F;
+      size_t h = 4 + tkl, i = h;
+      if (tkl > 8 || n < h) return 0;
+      uint16_t last = 0;
+      while (i < n && in[i] != 0xFF) {           // fin de opciones y último número (para el Echo)
+        uint8_t b = in[i++];
+        uint16_t d = b >> 4, l = b & 0x0F;
+        if (d == 13) d = 13 + in[i++]; else if (d == 14) { d = 269 + ((in[i] << 8) | in[i+1]); i += 2; }
+        if (l == 13) l = 13 + in[i++]; else if (l == 14) { l = 269 + ((in[i] << 8) | in[i+1]); i += 2; }
+        last += d; i += l;
+      }
+      if (i > n) return 0;
+      if (st->ssn >= st->saved) { st->saved = st->ssn + SSN_STEP; if (save) save(st->saved); }
+      uint64_t seq = st->ssn++;
+      uint8_t piv[5], pl = 0, tmp[5];
+      do { tmp[pl++] = uint8_t(seq); seq >>= 8; } while (seq && pl < 5);
+      for (uint8_t k = 0; k < pl; k++) piv[k] = tmp[pl - 1 - k];
+
+      uint8_t ov[1 + 5 + OSC_ID_MAX], ol = 0;
+      ov[ol++] = 0x08 | pl;                       // k: va el kid; n: largo del PIV
+      memcpy(ov + ol, piv, pl); ol += pl;
+      memcpy(ov + ol, sid, sidLen); ol += sidLen;
+      size_t need = h + 1 + ol + 1 + 1 + (i - h) + (st->echoLen ? 2 + st->echoLen : 0) + (n - i) + OSC_TAG;
+      if (need > cap) return 0;
+      memcpy(out, in, h);
+      out[1] = 0x02;                              // POST afuera (§4.2)
+      uint8_t* p = out + h;
+      uint16_t ol0 = 0;
+      p = putOpt(p, ol0, OPT_OSCORE, ov, ol);
+      *p++ = 0xFF;
+      uint8_t* pt = p;                            // texto plano en sitio: se cifra encima
+      *p++ = in[1];
+      memcpy(p, in + h, i - h); p += i - h;
+      if (st->echoLen) p = putOpt(p, last, OPT_ECHO, st->echo, st->echoLen);
+      memcpy(p, in + i, n - i); p += n - i;
+      uint8_t nc[OSC_NONCE], ad[32];
+      nonce(sid, sidLen, piv, pl, nc);
+      size_t al = aad(ad, piv, pl), ptl = size_t(p - pt);
+      if (mbedtls_ccm_encrypt_and_tag(&cs, ptl, nc, OSC_NONCE, ad, al, pt, pt, p, OSC_TAG) != 0) return 0;
+      Req& r = req[nreq++ % SLOTS];
+      r.tkl = tkl; memcpy(r.tok, in + 4, tkl); r.pivLen = pl; memcpy(r.piv, piv, pl);
+      return size_t(p + OSC_TAG - out);
+    }
+
+    // Verifica y descifra una respuesta: en out queda el mensaje interno
+    // (cabecera y token externos, código, opciones y payload internos). Los
+    // vacíos (ACK/RST) pasan tal cual; sin OSCORE o sin petición, 0.
+    size_t unprotect(const uint8_t* in, size_t n, uint8_t* out, size_t cap) {
+      if (n < 4 || n > cap) return 0;
+      uint8_t tkl = in[0] & 0x0F;
+      size_t h = 4 + tkl, i = h;
+      if (tkl > 8 || n < h) return 0;
+      if (in[1] == 0) { memcpy(out, in, n); return n; }
+      const Req* r = nullptr;
+      for (size_t k = 0; k < SLOTS && k < nreq; k++)
+        if (req[k].tkl == tkl && memcmp(req[k].tok, in + 4, tkl) == 0) r = &req[k];
+      const uint8_t* ov = nullptr; uint16_t ol = 0, last = 0;
+      while (i < n && in[i] != 0xFF) {
+        uint8_t b = in[i++];
+        uint16_t d = b >> 4, l = b & 0x0F;
+        if (d == 13) d = 13 + in[i++]; else if (d == 14) { d = 269 + ((in[i] << 8) | in[i+1]); i += 2; }
+        if (l == 13) l = 13 + in[i++]; else if (l == 14) { l = 269 + ((in[i] << 8) | in[i+1]); i += 2; }
+        last += d;
+        if (last == OPT_OSCORE) { ov = in + i; ol = l; }
+        i += l;
+      }
+      if (!r || !ov || i >= n || n - i - 1 <= OSC_TAG) return 0;
+      uint8_t nc[OSC_NONCE], ad[32];
+      uint8_t pn = ol ? ov[0] & 0x07 : 0;
+      if (pn) nonce(rid, ridLen, ov + 1, pn, nc);   // la respuesta trae su propio PIV
+      else nonce(sid, sidLen, r->piv, r->pivLen, nc);
+      size_t al = aad(ad, r->piv, r->pivLen), ctl = n - i - 1 - OSC_TAG;
+      uint8_t* dst = out + h - 1;                 // dst[0] = código interno
+      if (mbedtls_ccm_auth_decrypt(&cr, ctl, nc, OSC_NONCE, ad, al, in + i + 1, dst, in + n - OSC_TAG, OSC_TAG) != 0) return 0;
+      uint8_t code = dst[0];
+      memcpy(out, in, h);
+      out[1] = code;
+      // Echo del servidor: repetirlo hasta el primer 2.xx
+      size_t j = h, end = h - 1 + ctl;
+      uint16_t num = 0;
+      if ((code >> 5) == 2) st->echoLen = 0;
+      while (j < end && out[j] != 0xFF) {
+        uint8_t b = out[j++];
+        uint16_t d = b >> 4, l = b & 0x0F;
+        if (d == 13) d = 13 + out[j++]; else if (d == 14) { d = 269 + ((out[j] << 8) | out[j+1]); j += 2; }
+        if (l == 13) l = 13 + out[j++]; else if (l == 14) { l = 269 + ((out[j] << 8) | out[j+1]); j += 2; }
+        num += d;
+        if (num == OPT_ECHO && code == 0x81 && l <= OSC_ECHO_MAX && j + l <= end) { memcpy(st->echo, out + j, l); st->echoLen = uint8_t(l); }
+        j += l;
+      }
+      return end;
+    }
+  };
 }
@@ -7,43 +7,101 @@
 
 // Tiempo máx de espera para el pulso ≈ 25 ms
 #define HCSR04_TIMEOUT_US 25000UL
+// Pausa tras el eco antes del siguiente disparo (rebotes del anterior)
+#define HCSR04_GAP_US     20000UL
+#define HCSR04_SAMPLES_MAX 9
 
 // Distancia = (duración_us * 0.0343) / 2 = duración_us * 0.01715
 static const float HCSR04_US_TO_CM = 0.01715f;
 
+// Medición sin bloqueo: el flanco de subida y el de bajada de ECHO se
+// registran por interrupción; hcsrPoll() avanza la ráfaga de disparos desde
+// loop() y entrega la mediana de las muestras válidas.
+static volatile uint32_t hcsrRiseUs = 0, hcsrFallUs = 0;
+static volatile uint8_t  hcsrEdge = 0;          // 0 esperando, 1 subió, 2 eco completo
+
+static struct {
+  bool     active;
+  uint8_t  want, shots, got;
+  uint32_t pingUs;
+  float    s[HCSR04_SAMPLES_MAX];               // muestras válidas, ordenadas
+} hcsrBurst;
+
+static void IRAM_ATTR hcsrEchoIsr() {
+  uint32_t t = micros();
+  if (digitalRead(HCSR04_ECHO_PIN)) { hcsrRiseUs = t; hcsrEdge = 1; }
+  else if (hcsrEdge == 1) { hcsrFallUs = t; hcsrEdge = 2; }
+}
+
 inline void hcsrBegin() {
   pinMode(HCSR04_TRIG_PIN, OUTPUT);
   pinMode(HCSR04_ECHO_PIN, INPUT);
   digitalWrite(HCSR04_TRIG_PIN, LOW);
+  attachInterrupt(digitalPinToInterrupt(HCSR04_ECHO_PIN), hcsrEchoIsr, CHANGE);
   delay(50);
 }
 
-inline float hcsrReadDistanceCm(uint8_t samples = 5) {
-  float acc = 0.0f;
-  uint8_t ok = 0;
-
-  for (uint8_t i = 0; i < samples; i++) {
-    // Disparo TRIG
-    digitalWrite(HCSR04_TRIG_PIN, LOW);
-    delayMicroseconds(2);
-    digitalWrite(HCSR04_TRIG_PIN, HIGH);
-    delayMicroseconds(10);
-    digitalWrite(HCSR04_TRIG_PIN, LOW);
-
-    // Medir el pulso HIGH en ECHO 
-    unsigned long dur = pulseIn(HCSR04_ECHO_PIN, HIGH, HCSR04_TIMEOUT_US);
-
-    if (dur > 0) {
-      float d = dur * HCSR04_US_TO_CM; 
-      if (d < 2.0f) d = 2.0f;
-      if (d > 400.0f) d = 400.0f;
-      acc += d;
-      ok++;
-    }
-
-    delay(20); // pequeña pausa entre muestras
+static void hcsrPing() {
+  hcsrEdge = 0;
+  digitalWrite(HCSR04_TRIG_PIN, LOW);
+  delayMicroseconds(2);
+  digitalWrite(HCSR04_TRIG_PIN, HIGH);
+  delayMicroseconds(10);
+  digitalWrite(HCSR04_TRIG_PIN, LOW);
+  hcsrBurst.pingUs = micros();
+  hcsrBurst.shots++;
+}
+
+// Inserción ordenada: la mediana queda lista al terminar la ráfaga
+static void hcsrInsert(float d) {
+  uint8_t i = hcsrBurst.got++;
+  while (i > 0 && hcsrBurst.s[i - 1] > d) { hcsrBurst.s[i] = hcsrBurst.s[i - 1]; i--; }
+  hcsrBurst.s[i] = d;
+}
+
+// Inicia una ráfaga de samples disparos; false si ya hay una en curso
+inline bool hcsrStart(uint8_t samples = 5) {
+  if (hcsrBurst.active) return false;
+  if (samples == 0) samples = 1;
+  if (samples > HCSR04_SAMPLES_MAX) samples = HCSR04_SAMPLES_MAX;
+  hcsrBurst.active = true;
+  hcsrBurst.want = samples;
+  hcsrBurst.shots = hcsrBurst.got = 0;
+  hcsrPing();
+  return true;
+}
+
+inline bool hcsrBusy() { return hcsrBurst.active; }
+
+// Llamar en cada vuelta de loop(). Devuelve true una vez por ráfaga, con la
+// mediana en *cm (NAN si ningún disparo tuvo eco).
+inline bool hcsrPoll(float* cm) {
+  if (!hcsrBurst.active) return false;
+  uint32_t now = micros();
+  uint8_t edge = hcsrEdge;
+  if (edge == 2) {
+    float d = (hcsrFallUs - hcsrRiseUs) * HCSR04_US_TO_CM;
+    if (d < 2.0f) d = 2.0f;
+    if (d > 400.0f) d = 400.0f;
+    hcsrInsert(d);
+    hcsrEdge = edge = 3;                        // consumido, esperando la pausa
   }
+  bool last = hcsrBurst.shots >= hcsrBurst.want;
+  if (edge == 3) { if (!last && now - hcsrFallUs < HCSR04_GAP_US) return false; }
+  else if (now - hcsrBurst.pingUs < HCSR04_TIMEOUT_US + (last ? 0 : HCSR04_GAP_US)) return false;
+  if (!last) { hcsrPing(); return false; }
+  hcsrBurst.active = false;
+  uint8_t n = hcsrBurst.got;
+  if (n == 0) *cm = NAN;
+  else *cm = (n & 1) ? hcsrBurst.s[n / 2] : 0.5f * (hcsrBurst.s[n / 2 - 1] + hcsrBurst.s[n / 2]);
+  return true;
+}
 
-  if (ok == 0) return NAN;      
-  return acc / (float)ok;    
+// Versión bloqueante (una ráfaga completa), para quien sólo mide y duerme
+inline float hcsrReadDistanceCm(uint8_t samples = 5) {
+  float d = NAN;
+  while (hcsrBusy()) hcsrPoll(&d);
+  hcsrStart(samples);
+  while (!hcsrPoll(&d)) delay(1);
+  return d;
 }
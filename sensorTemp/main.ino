@@ -1,6 +1,8 @@
 #include <Arduino.h>
 #include <WiFi.h>
 #include <WiFiUdp.h>
+#include <Preferences.h>
+#include <esp_sleep.h>
 #include "ntc_sensor.h"
 #include "coap_min.h"
 
@@ -9,71 +11,200 @@ const char* WIFI_PASS   = "";
 const char* SERVER_IP   = "100.27.228.1";   
 const uint16_t SERVER_PORT = 5683;       
 const uint32_t PERIOD_MS   = 3000;     
+const size_t   BATCH_N     = 10;           // lecturas por POST
+const size_t   NSTART      = 4;            // intercambios CON simultáneos
+const size_t   BACKLOG_N   = 240;          // lecturas retenidas sin red
+const size_t   BODY_MAX    = BATCH_N * 24 + 32;
+constexpr uint8_t PAYLOAD_CF  = coapmin::CF_SENML_CBOR;   // coapmin::CF_JSON = lote en texto
+
+// Deep sleep: dormir entre muestras (lecturas en memoria RTC) y levantar WiFi
+// sólo cada WAKES_PER_SEND despertares. La fase se sortea al arrancar en frío
+// y cada sueño dura PERIOD_MS +- JITTER_PCT %, así una flota no reconecta a la vez.
+const bool     DEEP_SLEEP      = false;
+const uint32_t WAKES_PER_SEND  = 10;
+const uint32_t JITTER_PCT      = 10;
+const uint32_t WIFI_TIMEOUT_MS = 10000;
+const uint32_t SEND_WINDOW_MS  = 8000;     // tiempo máximo despierto para vaciar la cola
+const uint32_t RTC_MAGIC       = 0xC0A5EE01;
+
+// Banda muerta: sólo se encola una lectura que se aleje más de DEADBAND
+// (°C) de la última encolada, o una cada HEARTBEAT_MS aunque no cambie.
+// Un tramo incompleto sale igual cuando su lectura más vieja tiene FLUSH_MS.
+// OSCORE (RFC 8613): cada POST va cifrado y autenticado con la clave de este
+// sensor; en el servidor, la línea "<OSCORE_ID> <OSCORE_SECRET>" (hex) de
+// COAP_OSCORE_KEYS. Sin handshake: tras el deep sleep el primer datagrama ya
+// va protegido; el número de secuencia queda en RTC y su cota en flash.
+const bool     OSCORE_ON       = false;
+const uint8_t  OSCORE_SECRET[16] = { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+                                     0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10 };
+const uint8_t  OSCORE_ID[]     = { 0x07 };    // Sender ID (kid) de este sensor
+const uint8_t* const OSCORE_SERVER_ID = nullptr;   // COAP_OSCORE_SID (vacío por defecto)
+const uint8_t  OSCORE_SERVER_ID_LEN = 0;
+const uint32_t OSC_MAGIC       = 0x05C0E001;
+
+const float    DEADBAND        = 0.2f;
+const uint32_t HEARTBEAT_MS    = 60000;
+const uint32_t FLUSH_MS        = BATCH_N * PERIOD_MS;
 
 WiFiUDP udp;
+coapmin::Batch<BACKLOG_N> batch;           // se sigue muestreando con tramos en vuelo
 
-static void connectWiFi() {
+RTC_DATA_ATTR coapmin::RtcLog<BACKLOG_N> rtc;   // sólo se usa con DEEP_SLEEP
+RTC_DATA_ATTR coapmin::Deadband band;           // sobrevive al deep sleep
+RTC_DATA_ATTR coapmin::OscoreState oscState;     // secuencia y Echo de OSCORE
+Preferences prefs;
+
+// timeoutMs = 0: esperar indefinidamente
+static bool connectWiFi(uint32_t timeoutMs = 0) {
   WiFi.mode(WIFI_STA);
   WiFi.begin(WIFI_SSID, WIFI_PASS);
+  uint32_t start = millis();
   while (WiFi.status() != WL_CONNECTED) {
+    if (timeoutMs && millis() - start >= timeoutMs) return false;
     delay(300);
   }
+  return true;
+}
+
+// Hasta NSTART intercambios CON a la vez: tras un corte de red la cola se
+// vacía en pocos RTT. Cada tramo de BATCH_N lecturas cabe en un datagrama
+// (Block1 es secuencial por recurso, así que no se usa para tramos en paralelo).
+coapmin::Exchanges<NSTART, BODY_MAX + 64 + coapmin::OSCORE_OVERHEAD> ex;
+coapmin::Pipeline<NSTART> spans;
+coapmin::Oscore<NSTART> osc;
+uint32_t lastSample = 0;
+
+static bool txUdp(const uint8_t* pkt, size_t len) {
+  IPAddress ip; ip.fromString(SERVER_IP);
+  if (udp.beginPacket(ip, SERVER_PORT) != 1) return false;
+  udp.write(pkt, len);
+  return udp.endPacket() == 1;
+}
+
+static void saveSsn(uint64_t ssn) { prefs.putULong64("ssn", ssn); }
+
+// Claves de sesión derivadas de OSCORE_SECRET; en frío la secuencia sigue
+// desde la cota guardada en flash
+static void oscoreBegin() {
+  if (!OSCORE_ON) return;
+  prefs.begin("oscore", false);
+  oscState.cold(OSC_MAGIC, prefs.getULong64("ssn", 0));
+  if (!osc.begin(oscState, saveSsn, OSCORE_SECRET, sizeof(OSCORE_SECRET), nullptr, 0,
+                 OSCORE_ID, sizeof(OSCORE_ID), OSCORE_SERVER_ID, OSCORE_SERVER_ID_LEN))
+    Serial.println("[OSCORE] no se pudo derivar el contexto");
+}
+
+// POST /sensor precodificado: por envío sólo cambian MID, token y cuerpo
+constexpr char SENSOR_PATH[] = "sensor";
+typedef coapmin::MsgTemplate<SENSOR_PATH, PAYLOAD_CF> SensorPost;
+
+// Arma el tramo (SenML+CBOR o JSON) directo en el datagrama, con MID y token nuevos, y lo envía
+static bool sendSpan(coapmin::Pipeline<NSTART>::Span* s, uint32_t now) {
+  uint8_t pkt[BODY_MAX + 64], tok[8], sec[BODY_MAX + 64 + coapmin::OSCORE_OVERHEAD];
+  uint8_t* body = SensorPost::body(pkt);
+  size_t cap = sizeof(pkt) - SensorPost::LEN;
+  size_t len = (PAYLOAD_CF == coapmin::CF_SENML_CBOR)
+    ? batch.toSenml(body, cap, "t", "Cel", now, s->k, s->from)
+    : batch.toJson((char*)body, cap, 't', "C", now, s->k, s->from);
+  uint16_t msgId = ex.nextMid();
+  ex.nextToken(tok);
+  size_t plen = len ? SensorPost::stamp(pkt, msgId, tok, len) : 0;
+  s->tag = msgId;
+  const uint8_t* out = pkt;
+  if (OSCORE_ON && plen) { plen = osc.protect(pkt, plen, sec, sizeof(sec)); out = sec; }
+  bool ok = plen > 0 && ex.send(out, plen, msgId, now);
+  Serial.print("[CoAP] POST "); Serial.print(ok ? "OK " : "FALLO ");
+  Serial.print("/sensor desde="); Serial.print(s->from);
+  Serial.print(" bytes="); Serial.print(len);
+  Serial.print(" en vuelo="); Serial.println(ex.pending());
+  return ok;
+}
+
+// Fin de un intercambio: 2.04 confirma el tramo; un 4.xx no mejora
+// reenviando y también se descarta; timeout y 5.xx se reintentan, igual que
+// el 4.01 con Echo de OSCORE (servidor recién arrancado: el Echo va en el reenvío).
+// Tras un 5.03 el reintento espera el Max-Age (lo lleva ex, ver canSend).
+static void onDone(uint32_t tag, uint8_t code, const uint8_t*, size_t) {
+  Serial.print("[CoAP] RX code=0x"); Serial.print(code, HEX);
+  Serial.print(" msgId="); Serial.println(tag);
+  if (code == 0) Serial.println("[CoAP] Sin ACK (timeout)");
+  bool echo = OSCORE_ON && code == 0x81 && oscState.echoLen;
+  bool ok = !echo && (code == 0x44 || (code >> 5) == 4);
+  batch.dropUntil(spans.settle(spans.find(tag), ok));
+}
+
+// Respuestas, reenvíos y nuevos tramos hasta NSTART en vuelo, sin bloquear.
+// partial: enviar también un último tramo con menos de BATCH_N lecturas.
+static void service(uint32_t now, bool partial) {
+  while (udp.parsePacket() > 0) {
+    uint8_t rx[256], in[256];
+    int n = udp.read(rx, sizeof(rx));
+    if (n <= 0) continue;
+    size_t m = OSCORE_ON ? osc.unprotect(rx, size_t(n), in, sizeof(in)) : size_t(n);   // 0 = no verifica
+    if (m) ex.onPacket(OSCORE_ON ? in : rx, m, now);
+  }
+  ex.poll(now);
+  while (ex.canSend(now)) {
+    coapmin::Pipeline<NSTART>::Span* s = spans.take(batch.first, batch.end(), BATCH_N, partial);
+    if (!s) break;
+    if (!sendSpan(s, now)) { spans.settle(s, false); break; }
+  }
+}
+
+// Un despertar en modo deep sleep (no retorna): muestrear a RTC y, si toca,
+// conectar, vaciar la cola durante SEND_WINDOW_MS y devolver a RTC lo que
+// quedó sin confirmar (entrega al menos una vez). Si un 5.03 pide esperar más
+// allá de la ventana y no queda nada en vuelo, se duerme ya.
+static void sleepCycle() {
+  if (rtc.cold(RTC_MAGIC)) { rtc.wakes = esp_random() % WAKES_PER_SEND; band = coapmin::Deadband(); }
+  float v = ntcReadCelsius(12);
+  uint32_t clock = rtc.clockMs + millis();
+  if (band.pass(v, clock, DEADBAND, HEARTBEAT_MS)) rtc.push(v, clock);
+  if (++rtc.wakes % WAKES_PER_SEND == 0 && rtc.n > 0 && connectWiFi(WIFI_TIMEOUT_MS)) {
+    udp.begin(0);
+    ex.begin(txUdp, onDone, (uint16_t)esp_random(), esp_random());
+    oscoreBegin();
+    rtc.toBatch(batch, rtc.clockMs + millis(), millis());
+    uint32_t start = millis();
+    while ((batch.size() > 0 || ex.pending() > 0) && millis() - start < SEND_WINDOW_MS &&
+           !(ex.pending() == 0 && ex.holding(start + SEND_WINDOW_MS))) {
+      service(millis(), true);
+      delay(5);
+    }
+    rtc.fromBatch(batch, rtc.clockMs + millis(), millis());
+    Serial.print("[Sleep] sin confirmar="); Serial.println(rtc.n);
+  }
+  WiFi.disconnect(true);
+  WiFi.mode(WIFI_OFF);
+  uint64_t us = uint64_t(PERIOD_MS) * 10 * (100 - JITTER_PCT + esp_random() % (2 * JITTER_PCT + 1));
+  rtc.clockMs += millis() + uint32_t(us / 1000);
+  esp_sleep_enable_timer_wakeup(us);
+  esp_deep_sleep_start();
 }
 
 void setup() {
   Serial.begin(115200);
   delay(200);
   ntcBegin();
+  if (DEEP_SLEEP) sleepCycle();
   connectWiFi();
   udp.begin(0); 
+  ex.begin(txUdp, onDone, (uint16_t)esp_random(), esp_random());
+  oscoreBegin();
   Serial.print("IP local: "); Serial.println(WiFi.localIP());
 }
 
 void loop() {
-  // 1) Leer temperatura
-  float tC = ntcReadCelsius(12);
-
-  // 2) Armar JSON
-  char json[64];
-  snprintf(json, sizeof(json), "{\"t\":%.2f,\"unit\":\"C\"}", tC);
+  uint32_t now = millis();
+  size_t cnt, i = batch.span(spans.next, 1, cnt);
+  service(now, cnt > 0 && now - batch.at[i] >= FLUSH_MS);
 
-  // 3) Armar paquete CoAP POST 
-  uint8_t pkt[256];
-  uint16_t msgId = (uint16_t)millis();
-  size_t len = coapmin::buildPost(pkt, "sensor", nullptr, json, msgId);
-
-  // 4) Enviar por UDP
-  IPAddress ip; ip.fromString(SERVER_IP);
-  bool sent = false;
-  if (udp.beginPacket(ip, SERVER_PORT) == 1) {
-    udp.write(pkt, len);
-    sent = (udp.endPacket() == 1);
-  }
-  Serial.print("[CoAP] POST "); Serial.print(sent ? "OK " : "FALLO ");
-  Serial.print("/sensor payload="); Serial.println(json);
-
-  // 5) Esperar ACK (timeout 1.5s)
-  uint8_t rx[256];
-  int n = 0;
-  uint32_t start = millis();
-  while ((millis() - start) < 1500) {
-    int psize = udp.parsePacket();
-    if (psize > 0) { n = udp.read(rx, sizeof(rx)); break; }
-    delay(5);
-  }
-
-  if (n > 0) {
-    coapmin::Type t; uint8_t code; uint16_t mid;
-    if (coapmin::parseHeader(rx, n, t, code, mid)) {
-      Serial.print("[CoAP] RX type="); Serial.print((int)t);
-      Serial.print(" code=0x"); Serial.print(code, HEX);
-      Serial.print(" msgId="); Serial.println(mid);
-    } else {
-      Serial.println("[CoAP] RX no válido");
-    }
-  } else {
-    Serial.println("[CoAP] Sin ACK (timeout)");
+  // Muestrear cada PERIOD_MS aunque haya tramos esperando ACK
+  if (now - lastSample >= PERIOD_MS) {
+    lastSample = now;
+    float t = ntcReadCelsius(12);
+    if (band.pass(t, now, DEADBAND, HEARTBEAT_MS)) batch.push(t, now);
   }
 
-  delay(PERIOD_MS);
+  delay(5);
 }
@@ -5,31 +5,83 @@
 #define NTC_ADC_PIN 34
 #define ADC_SAMPLES 8
 
+// Modo continuo (ADC por DMA, core ESP32 >= 3): el driver convierte en
+// segundo plano y ntcReadCelsius() sólo recoge los promedios ya listos.
+#ifndef NTC_USE_DMA
+#if defined(ESP_ARDUINO_VERSION_MAJOR) && ESP_ARDUINO_VERSION_MAJOR >= 3
+#define NTC_USE_DMA 1
+#else
+#define NTC_USE_DMA 0
+#endif
+#endif
+#define NTC_DMA_OVERSAMPLE 64       // conversiones promediadas por trama
+#define NTC_DMA_FREQ_HZ    20000
+#define NTC_DMA_FIRST_MS   10       // espera máx. por la primera trama (una tarda 64/20 kHz = 3.2 ms)
+
 // Calibración del senosor
-static const float CAL_T1 = 0.0f;   
-static const float CAL_T2 = 80.0f;  
-static const float adcT1  = 3149.0f; 
-static const float adcT2  = 462.0f;  
+constexpr float CAL_T1 = 0.0f;
+constexpr float CAL_T2 = 80.0f;
+constexpr float adcT1  = 3149.0f;
+constexpr float adcT2  = 462.0f;
+static_assert(adcT2 - adcT1 > 1.0f || adcT2 - adcT1 < -1.0f, "calibración NTC degenerada");
+
+// Calibración en punto fijo, resuelta al compilar: temperatura en Q16.16 y
+// ADC promediado en Q8 (los bits extra vienen del sobremuestreo)
+constexpr int32_t NTC_T1_Q16    = int32_t(CAL_T1 * 65536.0f);
+constexpr int32_t NTC_T2_Q16    = int32_t(CAL_T2 * 65536.0f);
+constexpr int32_t NTC_A1_Q8     = int32_t(adcT1 * 256.0f);
+constexpr int32_t NTC_SLOPE_Q16 = int32_t((CAL_T2 - CAL_T1) / (adcT2 - adcT1) * 65536.0f
+                                          + ((CAL_T2 - CAL_T1) / (adcT2 - adcT1) < 0 ? -0.5f : 0.5f));
+
+// Suma de n lecturas crudas -> °C en Q16.16, limitado al rango calibrado
+inline int32_t ntcAdcToQ16(uint32_t acc, uint32_t n) {
+  int32_t adcQ8 = int32_t((uint64_t(acc) << 8) / n);
+  int32_t t = NTC_T1_Q16 + int32_t((int64_t(adcQ8 - NTC_A1_Q8) * NTC_SLOPE_Q16) >> 8);
+  const int32_t lo = NTC_T1_Q16 < NTC_T2_Q16 ? NTC_T1_Q16 : NTC_T2_Q16;
+  const int32_t hi = NTC_T1_Q16 < NTC_T2_Q16 ? NTC_T2_Q16 : NTC_T1_Q16;
+  return t < lo ? lo : (t > hi ? hi : t);
+}
+
+#if NTC_USE_DMA
+
+static uint32_t ntcLastAcc = 0, ntcLastN = 0;
+
+inline void ntcBegin() {
+  uint8_t pins[] = { NTC_ADC_PIN };
+  analogContinuous(pins, 1, NTC_DMA_OVERSAMPLE, NTC_DMA_FREQ_HZ, nullptr);
+  analogContinuousStart();
+}
+
+// Promedia las tramas acumuladas desde la última llamada (sin esperar); si no
+// hay ninguna nueva repite el último valor. La primera lectura tras ntcBegin()
+// (cada despertar en deep sleep) espera a que llegue una trama; NAN sólo si el
+// ADC no entrega ninguna. samples no aplica en este modo.
+inline float ntcReadCelsius(uint8_t samples = ADC_SAMPLES) {
+  (void)samples;
+  adc_continuous_data_t* res = nullptr;
+  uint32_t acc = 0, n = 0;
+  while (n < 256 && analogContinuousRead(&res, n == 0 && ntcLastN == 0 ? NTC_DMA_FIRST_MS : 0)) {
+    acc += uint32_t(res[0].avg_read_raw); n++;
+  }
+  if (n) { ntcLastAcc = acc; ntcLastN = n; }
+  if (ntcLastN == 0) return NAN;            // el ADC no dio ninguna trama
+  return ntcAdcToQ16(ntcLastAcc, ntcLastN) / 65536.0f;
+}
+
+#else
 
 inline void ntcBegin() { pinMode(NTC_ADC_PIN, INPUT); }
 
 inline float ntcReadCelsius(uint8_t samples = ADC_SAMPLES) {
   // 1) Promediar lectura de valores
+  if (samples == 0) samples = 1;
   uint32_t acc = 0;
   for (uint8_t i = 0; i < samples; i++) {
     acc += analogRead(NTC_ADC_PIN);
     delay(2);
   }
-  float adc = acc / (float)samples;
-  float spanAdc = (adcT2 - adcT1);       
-  if (fabsf(spanAdc) < 1e-6f) return NAN; // evita división por cero
-
-  float slope = (CAL_T2 - CAL_T1) / spanAdc; 
-  float t = (adc - adcT1) * slope + CAL_T1;
-
-  // 3) Limitar al rango del sensor (0 - 80) °C
-  if (t < CAL_T1) t = CAL_T1;
-  if (t > CAL_T2) t = CAL_T2;
-
-  return t;
+  // 2) Calibración lineal en punto fijo, limitada al rango (0 - 80) °C
+  return ntcAdcToQ16(acc, samples) / 65536.0f;
 }
+
+#endif